@@ -0,0 +1,226 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "low-debug.h"
+#include "low-bloom.h"
+
+/*
+ * On disk, a filter is an 8 byte magic string, the bit count, the hash
+ * count and the stamp of the file it was built from, followed by the bit
+ * array. The files only ever live in the local
+ * cache, so everything is in host byte order.
+ */
+#define BLOOM_MAGIC "LOWBLM02"
+#define BLOOM_MAGIC_SIZE 8
+#define BLOOM_SOURCE_OFFSET (BLOOM_MAGIC_SIZE + 2 * sizeof (uint32_t))
+#define BLOOM_HEADER_SIZE (BLOOM_SOURCE_OFFSET + sizeof (LowFileStamp))
+
+/* ~10 bits and 7 hashes per item gives about a 1% false positive rate */
+#define BLOOM_BITS_PER_ITEM 10
+#define BLOOM_HASHES 7
+#define BLOOM_MIN_BITS 1024
+#define BLOOM_MAX_HASHES 32
+
+LowBloom *
+low_bloom_new (unsigned int expected_items)
+{
+	LowBloom *bloom = malloc (sizeof (LowBloom));
+	uint64_t wanted = (uint64_t) expected_items * BLOOM_BITS_PER_ITEM;
+
+	bloom->nbits = BLOOM_MIN_BITS;
+	while (bloom->nbits < wanted && bloom->nbits < (1U << 31)) {
+		bloom->nbits <<= 1;
+	}
+
+	bloom->nhashes = BLOOM_HASHES;
+	bloom->bits = calloc (bloom->nbits / 8, 1);
+	memset (&bloom->source, 0, sizeof (LowFileStamp));
+	bloom->map = NULL;
+	bloom->map_size = 0;
+
+	return bloom;
+}
+
+/**
+ * Map a filter written by low_bloom_write. Returns NULL if the file is
+ * missing or doesn't look like a filter.
+ */
+LowBloom *
+low_bloom_load (const char *filename)
+{
+	LowBloom *bloom;
+	struct stat buf;
+	unsigned char *map;
+	uint32_t nbits;
+	uint32_t nhashes;
+	int fd = open (filename, O_RDONLY);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat (fd, &buf) != 0 || (size_t) buf.st_size < BLOOM_HEADER_SIZE) {
+		close (fd);
+		return NULL;
+	}
+
+	map = mmap (NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	memcpy (&nbits, map + BLOOM_MAGIC_SIZE, sizeof (uint32_t));
+	memcpy (&nhashes, map + BLOOM_MAGIC_SIZE + sizeof (uint32_t),
+		sizeof (uint32_t));
+
+	if (memcmp (map, BLOOM_MAGIC, BLOOM_MAGIC_SIZE) ||
+	    nbits < BLOOM_MIN_BITS || (nbits & (nbits - 1)) != 0 ||
+	    nhashes == 0 || nhashes > BLOOM_MAX_HASHES ||
+	    (size_t) buf.st_size != BLOOM_HEADER_SIZE + nbits / 8) {
+		low_debug ("Ignoring malformed filter %s", filename);
+		munmap (map, buf.st_size);
+		return NULL;
+	}
+
+	bloom = malloc (sizeof (LowBloom));
+	bloom->nbits = nbits;
+	bloom->nhashes = nhashes;
+	bloom->bits = map + BLOOM_HEADER_SIZE;
+	memcpy (&bloom->source, map + BLOOM_SOURCE_OFFSET,
+		sizeof (LowFileStamp));
+	bloom->map = map;
+	bloom->map_size = buf.st_size;
+
+	return bloom;
+}
+
+void
+low_bloom_free (LowBloom *bloom)
+{
+	if (bloom == NULL) {
+		return;
+	}
+
+	if (bloom->map != NULL) {
+		munmap (bloom->map, bloom->map_size);
+	} else {
+		free (bloom->bits);
+	}
+
+	free (bloom);
+}
+
+/*
+ * 64 bit FNV-1a, split in two and combined as h1 + i * h2 to get as many
+ * bit positions as we need out of a single pass over the key.
+ */
+static uint64_t
+low_bloom_hash (const char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *key != '\0'; key++) {
+		hash ^= (unsigned char) *key;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+void
+low_bloom_add (LowBloom *bloom, const char *key)
+{
+	uint64_t hash = low_bloom_hash (key);
+	uint32_t h1 = (uint32_t) hash;
+	uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+	uint32_t i;
+
+	for (i = 0; i < bloom->nhashes; i++) {
+		uint32_t bit = (h1 + i * h2) & (bloom->nbits - 1);
+		bloom->bits[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+bool
+low_bloom_might_contain (const LowBloom *bloom, const char *key)
+{
+	uint64_t hash = low_bloom_hash (key);
+	uint32_t h1 = (uint32_t) hash;
+	uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+	uint32_t i;
+
+	for (i = 0; i < bloom->nhashes; i++) {
+		uint32_t bit = (h1 + i * h2) & (bloom->nbits - 1);
+		if (!(bloom->bits[bit / 8] & (1 << (bit % 8)))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Write the filter out to filename, replacing it atomically.
+ */
+bool
+low_bloom_write (const LowBloom *bloom, const char *filename)
+{
+	char *tmp_file = malloc (strlen (filename) + 5);
+	FILE *file;
+	bool ok;
+
+	sprintf (tmp_file, "%s.tmp", filename);
+
+	file = fopen (tmp_file, "w");
+	if (file == NULL) {
+		free (tmp_file);
+		return false;
+	}
+
+	ok = fwrite (BLOOM_MAGIC, BLOOM_MAGIC_SIZE, 1, file) == 1 &&
+	     fwrite (&bloom->nbits, sizeof (uint32_t), 1, file) == 1 &&
+	     fwrite (&bloom->nhashes, sizeof (uint32_t), 1, file) == 1 &&
+	     fwrite (&bloom->source, sizeof (LowFileStamp), 1, file) == 1 &&
+	     fwrite (bloom->bits, bloom->nbits / 8, 1, file) == 1;
+
+	if (fclose (file) != 0) {
+		ok = false;
+	}
+
+	if (ok) {
+		ok = rename (tmp_file, filename) == 0;
+	} else {
+		unlink (tmp_file);
+	}
+
+	free (tmp_file);
+	return ok;
+}
+
+/* vim: set ts=8 sw=8 noet: */
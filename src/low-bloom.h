@@ -0,0 +1,57 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#ifndef _LOW_BLOOM_H_
+#define _LOW_BLOOM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "low-util.h"
+
+/**
+ * A Bloom filter over strings. It can say that a string was definitely
+ * never added, or that it might have been.
+ */
+typedef struct _LowBloom {
+	uint32_t nbits;		/**< Size of the bit array; a power of two */
+	uint32_t nhashes;	/**< Bits set per added string */
+	unsigned char *bits;
+	LowFileStamp source;	/**< The file the filter was built from */
+
+	void *map;		/**< The mmapped file, if loaded from disk */
+	size_t map_size;
+} LowBloom;
+
+LowBloom *	low_bloom_new 		(unsigned int expected_items);
+LowBloom *	low_bloom_load 		(const char *filename);
+void 		low_bloom_free 		(LowBloom *bloom);
+
+void 		low_bloom_add 		(LowBloom *bloom, const char *key);
+bool 		low_bloom_might_contain (const LowBloom *bloom,
+					 const char *key);
+
+bool 		low_bloom_write 	(const LowBloom *bloom,
+					 const char *filename);
+
+#endif /* _LOW_BLOOM_H_ */
+
+/* vim: set ts=8 sw=8 noet: */
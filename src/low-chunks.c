@@ -0,0 +1,176 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "low-chunks.h"
+#include "low-debug.h"
+
+/* Longer than any digest we know about, in hex */
+#define MAX_DIGEST_LEN 128
+
+/*
+ * A chunk index is a text file. The first line names the digest type;
+ * then there's a line per chunk, in order:
+ *
+ *   <offset> <length> <uncompressed length> <digest>
+ *
+ * Chunks have to follow one another with no gaps.
+ */
+LowChunkIndex *
+low_chunk_index_load (const char *filename)
+{
+	LowChunkIndex *index;
+	FILE *file;
+	char digest_type[32];
+	char digest[MAX_DIGEST_LEN + 1];
+	long long offset;
+	long long length;
+	long long open_length;
+	unsigned int size = 64;
+	unsigned int i;
+
+	file = fopen (filename, "r");
+	if (file == NULL) {
+		return NULL;
+	}
+
+	if (fscanf (file, "%31s", digest_type) != 1) {
+		fclose (file);
+		return NULL;
+	}
+
+	index = malloc (sizeof (LowChunkIndex));
+	index->digest_type = low_util_digest_type_from_string (digest_type);
+	index->n_chunks = 0;
+	index->chunks = malloc (sizeof (LowChunk) * size);
+	index->size = 0;
+	index->open_size = 0;
+	index->by_digest = g_hash_table_new (g_str_hash, g_str_equal);
+
+	while (fscanf (file, "%lld %lld %lld %128s", &offset, &length,
+		       &open_length, digest) == 4) {
+		LowChunk *chunk;
+
+		if (offset != index->size || length <= 0 || open_length < 0) {
+			low_debug ("bad chunk in %s at %lld", filename,
+				   offset);
+			fclose (file);
+			low_chunk_index_free (index);
+			return NULL;
+		}
+
+		if (index->n_chunks == size) {
+			size *= 2;
+			index->chunks = realloc (index->chunks,
+						 sizeof (LowChunk) * size);
+		}
+
+		chunk = &index->chunks[index->n_chunks++];
+		chunk->offset = offset;
+		chunk->length = length;
+		chunk->open_offset = index->open_size;
+		chunk->open_length = open_length;
+		chunk->digest = strdup (digest);
+
+		index->size += length;
+		index->open_size += open_length;
+	}
+
+	fclose (file);
+
+	/* The array has stopped moving, so the chunks can be pointed at */
+	for (i = 0; i < index->n_chunks; i++) {
+		LowChunk *chunk = &index->chunks[i];
+
+		g_hash_table_insert (index->by_digest, chunk->digest, chunk);
+	}
+
+	return index;
+}
+
+void
+low_chunk_index_free (LowChunkIndex *index)
+{
+	unsigned int i;
+
+	if (index == NULL) {
+		return;
+	}
+
+	for (i = 0; i < index->n_chunks; i++) {
+		free (index->chunks[i].digest);
+	}
+	free (index->chunks);
+	g_hash_table_destroy (index->by_digest);
+	free (index);
+}
+
+/**
+ * Find a chunk in index with the same contents as chunk, or NULL if
+ * there isn't one.
+ */
+LowChunk *
+low_chunk_index_lookup (LowChunkIndex *index, const LowChunk *chunk)
+{
+	LowChunk *found;
+
+	if (index == NULL) {
+		return NULL;
+	}
+
+	found = g_hash_table_lookup (index->by_digest, chunk->digest);
+	if (found == NULL || found->open_length != chunk->open_length) {
+		return NULL;
+	}
+
+	return found;
+}
+
+/**
+ * How many bytes of new_index's compressed file we'd have to fetch, with
+ * what old_index's file already gives us.
+ */
+off_t
+low_chunk_index_missing (LowChunkIndex *old_index, LowChunkIndex *new_index)
+{
+	off_t missing = 0;
+	unsigned int i;
+
+	if (old_index == NULL ||
+	    old_index->digest_type != new_index->digest_type) {
+		return new_index->size;
+	}
+
+	for (i = 0; i < new_index->n_chunks; i++) {
+		LowChunk *chunk = &new_index->chunks[i];
+
+		if (low_chunk_index_lookup (old_index, chunk) == NULL) {
+			missing += chunk->length;
+		}
+	}
+
+	return missing;
+}
+
+/* vim: set ts=8 sw=8 noet: */
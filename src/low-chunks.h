@@ -0,0 +1,68 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#ifndef _LOW_CHUNKS_H_
+#define _LOW_CHUNKS_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <glib.h>
+
+#include "low-util.h"
+
+/**
+ * One piece of a chunked repodata file. Each chunk is compressed on its
+ * own (so the whole file is still just a run of compressed streams), and
+ * can be fetched and uncompressed without any of the others.
+ */
+typedef struct _LowChunk {
+	off_t offset;		/**< Where it starts in the compressed file */
+	off_t length;
+	off_t open_offset;	/**< Where it starts once uncompressed */
+	off_t open_length;
+	char *digest;		/**< Of the chunk uncompressed */
+} LowChunk;
+
+/**
+ * The chunks a file is made of, in order. Chunk boundaries are picked by
+ * content, so an edit to one part of a file leaves the chunks around it
+ * (and their digests) alone, and only changed chunks need fetching.
+ */
+typedef struct _LowChunkIndex {
+	LowDigestType digest_type;
+	unsigned int n_chunks;
+	LowChunk *chunks;
+	off_t size;
+	off_t open_size;
+	GHashTable *by_digest;
+} LowChunkIndex;
+
+LowChunkIndex *	low_chunk_index_load 	(const char *filename);
+void 		low_chunk_index_free 	(LowChunkIndex *index);
+
+LowChunk *	low_chunk_index_lookup 	(LowChunkIndex *index,
+					 const LowChunk *chunk);
+off_t 		low_chunk_index_missing (LowChunkIndex *old_index,
+					 LowChunkIndex *new_index);
+
+#endif /* _LOW_CHUNKS_H_ */
+
+/* vim: set ts=8 sw=8 noet: */
@@ -192,6 +192,12 @@ low_config_get_bool (LowConfig *config, const char *group, const char *key)
 	return g_key_file_get_boolean (config->config, group, key, NULL);
 }
 
+int
+low_config_get_int (LowConfig *config, const char *group, const char *key)
+{
+	return g_key_file_get_integer (config->config, group, key, NULL);
+}
+
 void
 low_config_free (LowConfig *config)
 {
@@ -42,6 +42,9 @@ char *          low_config_get_string       (LowConfig *config,
 bool            low_config_get_bool      (LowConfig *config,
 					  const char *group,
 					  const char *key);
+int             low_config_get_int       (LowConfig *config,
+					  const char *group,
+					  const char *key);
 
 #endif /* _LOW_CONFIG_H_ */
 
@@ -0,0 +1,532 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bzlib.h>
+#include <zlib.h>
+
+#include "config.h"
+
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "low-debug.h"
+#include "low-decompress.h"
+
+/* Uncompressed data gets written out in chunks this big */
+#define OUT_BUF_SIZE (256 * 1024)
+
+/**
+ * How to uncompress one format. begin sets up a new stream, write feeds it
+ * more input, finish says if it ended cleanly, and end frees it.
+ */
+typedef struct _LowCodec {
+	const char *extension;
+	bool (*begin) (LowDecompressor *decompressor);
+	bool (*write) (LowDecompressor *decompressor, const void *buf,
+		       size_t len);
+	bool (*finish) (LowDecompressor *decompressor);
+	void (*end) (LowDecompressor *decompressor);
+} LowCodec;
+
+struct _LowDecompressor {
+	const LowCodec *codec;
+	int fd;
+	bool started;
+	bool finished;		/**< At the end of a compressed stream */
+	union {
+		bz_stream bz;
+		z_stream z;
+#ifdef HAVE_LZMA
+		lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+		ZSTD_DStream *zstd;
+#endif
+	} stream;
+	char *out;
+};
+
+static bool
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t written = write (fd, buf, len);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		buf += written;
+		len -= written;
+	}
+
+	return true;
+}
+
+/*
+ * Files can be several compressed streams one after another (as pbzip2
+ * writes them), so bzip2 and gzip start over each time one ends with
+ * more data behind it.
+ */
+static bool
+low_decompressor_restart (LowDecompressor *decompressor)
+{
+	decompressor->codec->end (decompressor);
+	return decompressor->codec->begin (decompressor);
+}
+
+static bool
+finish_stream (LowDecompressor *decompressor)
+{
+	return decompressor->finished;
+}
+
+/* bzip2 */
+
+static bool
+bz2_begin (LowDecompressor *decompressor)
+{
+	memset (&decompressor->stream.bz, 0, sizeof (bz_stream));
+	decompressor->finished = false;
+
+	return BZ2_bzDecompressInit (&decompressor->stream.bz, 0, 0) == BZ_OK;
+}
+
+static bool
+bz2_write (LowDecompressor *decompressor, const void *buf, size_t len)
+{
+	bz_stream *bz = &decompressor->stream.bz;
+
+	bz->next_in = (char *) buf;
+	bz->avail_in = len;
+
+	while (bz->avail_in > 0) {
+		int res;
+
+		if (decompressor->finished) {
+			char *next_in = bz->next_in;
+			unsigned int avail_in = bz->avail_in;
+
+			if (!low_decompressor_restart (decompressor)) {
+				return false;
+			}
+			bz->next_in = next_in;
+			bz->avail_in = avail_in;
+		}
+
+		bz->next_out = decompressor->out;
+		bz->avail_out = OUT_BUF_SIZE;
+
+		res = BZ2_bzDecompress (bz);
+		if (res != BZ_OK && res != BZ_STREAM_END) {
+			low_debug ("bzip2 error %d", res);
+			return false;
+		}
+
+		if (!write_all (decompressor->fd, decompressor->out,
+				OUT_BUF_SIZE - bz->avail_out)) {
+			return false;
+		}
+
+		if (res == BZ_STREAM_END) {
+			decompressor->finished = true;
+		}
+	}
+
+	return true;
+}
+
+static void
+bz2_end (LowDecompressor *decompressor)
+{
+	BZ2_bzDecompressEnd (&decompressor->stream.bz);
+}
+
+/* gzip */
+
+static bool
+gz_begin (LowDecompressor *decompressor)
+{
+	memset (&decompressor->stream.z, 0, sizeof (z_stream));
+	decompressor->finished = false;
+
+	/* 16 tells zlib to expect a gzip header */
+	return inflateInit2 (&decompressor->stream.z, 16 + MAX_WBITS) == Z_OK;
+}
+
+static bool
+gz_write (LowDecompressor *decompressor, const void *buf, size_t len)
+{
+	z_stream *z = &decompressor->stream.z;
+
+	z->next_in = (Bytef *) buf;
+	z->avail_in = len;
+
+	while (z->avail_in > 0) {
+		int res;
+
+		if (decompressor->finished) {
+			Bytef *next_in = z->next_in;
+			uInt avail_in = z->avail_in;
+
+			if (!low_decompressor_restart (decompressor)) {
+				return false;
+			}
+			z->next_in = next_in;
+			z->avail_in = avail_in;
+		}
+
+		z->next_out = (Bytef *) decompressor->out;
+		z->avail_out = OUT_BUF_SIZE;
+
+		res = inflate (z, Z_NO_FLUSH);
+		if (res != Z_OK && res != Z_STREAM_END) {
+			low_debug ("zlib error %d", res);
+			return false;
+		}
+
+		if (!write_all (decompressor->fd, decompressor->out,
+				OUT_BUF_SIZE - z->avail_out)) {
+			return false;
+		}
+
+		if (res == Z_STREAM_END) {
+			decompressor->finished = true;
+		}
+	}
+
+	return true;
+}
+
+static void
+gz_end (LowDecompressor *decompressor)
+{
+	inflateEnd (&decompressor->stream.z);
+}
+
+#ifdef HAVE_LZMA
+
+/* xz */
+
+static bool
+xz_begin (LowDecompressor *decompressor)
+{
+	lzma_stream init = LZMA_STREAM_INIT;
+
+	decompressor->stream.xz = init;
+	decompressor->finished = false;
+
+	/* liblzma handles concatenated streams itself */
+	return lzma_stream_decoder (&decompressor->stream.xz, UINT64_MAX,
+				    LZMA_CONCATENATED) == LZMA_OK;
+}
+
+static bool
+xz_code (LowDecompressor *decompressor, lzma_action action)
+{
+	lzma_stream *xz = &decompressor->stream.xz;
+
+	do {
+		lzma_ret res;
+
+		xz->next_out = (uint8_t *) decompressor->out;
+		xz->avail_out = OUT_BUF_SIZE;
+
+		res = lzma_code (xz, action);
+		if (res != LZMA_OK && res != LZMA_STREAM_END) {
+			low_debug ("xz error %d", res);
+			return false;
+		}
+
+		if (!write_all (decompressor->fd, decompressor->out,
+				OUT_BUF_SIZE - xz->avail_out)) {
+			return false;
+		}
+
+		if (res == LZMA_STREAM_END) {
+			decompressor->finished = true;
+			break;
+		}
+	} while (xz->avail_in > 0 || xz->avail_out == 0);
+
+	return true;
+}
+
+static bool
+xz_write (LowDecompressor *decompressor, const void *buf, size_t len)
+{
+	decompressor->stream.xz.next_in = buf;
+	decompressor->stream.xz.avail_in = len;
+
+	return xz_code (decompressor, LZMA_RUN);
+}
+
+static bool
+xz_finish (LowDecompressor *decompressor)
+{
+	/* With LZMA_CONCATENATED, the end only shows once we say so */
+	decompressor->stream.xz.next_in = NULL;
+	decompressor->stream.xz.avail_in = 0;
+
+	return xz_code (decompressor, LZMA_FINISH) && decompressor->finished;
+}
+
+static void
+xz_end (LowDecompressor *decompressor)
+{
+	lzma_end (&decompressor->stream.xz);
+}
+
+#endif /* HAVE_LZMA */
+
+#ifdef HAVE_ZSTD
+
+/* zstd */
+
+static bool
+zstd_begin (LowDecompressor *decompressor)
+{
+	decompressor->stream.zstd = ZSTD_createDStream ();
+	decompressor->finished = false;
+
+	return decompressor->stream.zstd != NULL &&
+		!ZSTD_isError (ZSTD_initDStream (decompressor->stream.zstd));
+}
+
+/*
+ * zstd can hold back decompressed data when the output buffer fills, even
+ * after it has taken all of the input, so keep going until it leaves room.
+ */
+static bool
+zstd_code (LowDecompressor *decompressor, ZSTD_inBuffer *in)
+{
+	ZSTD_outBuffer out;
+
+	do {
+		size_t in_pos = in->pos;
+		size_t res;
+
+		out.dst = decompressor->out;
+		out.size = OUT_BUF_SIZE;
+		out.pos = 0;
+
+		res = ZSTD_decompressStream (decompressor->stream.zstd, &out,
+					     in);
+		if (ZSTD_isError (res)) {
+			low_debug ("zstd error: %s", ZSTD_getErrorName (res));
+			return false;
+		}
+
+		if (!write_all (decompressor->fd, decompressor->out,
+				out.pos)) {
+			return false;
+		}
+
+		/*
+		 * 0 means a frame is done, and everything is flushed. A call
+		 * that did nothing says how much of the next frame it wants.
+		 */
+		if (in->pos > in_pos || out.pos > 0) {
+			decompressor->finished = res == 0;
+		}
+	} while (in->pos < in->size || out.pos == out.size);
+
+	return true;
+}
+
+static bool
+zstd_write (LowDecompressor *decompressor, const void *buf, size_t len)
+{
+	ZSTD_inBuffer in = { buf, len, 0 };
+
+	return zstd_code (decompressor, &in);
+}
+
+static bool
+zstd_finish (LowDecompressor *decompressor)
+{
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+
+	return zstd_code (decompressor, &in) && decompressor->finished;
+}
+
+static void
+zstd_end (LowDecompressor *decompressor)
+{
+	ZSTD_freeDStream (decompressor->stream.zstd);
+}
+
+#endif /* HAVE_ZSTD */
+
+/*
+ * Everything we know how to uncompress, by file extension. Formats we
+ * recognize but were built without have no functions, so they can still
+ * be named properly.
+ */
+static const LowCodec codecs[] = {
+	{ ".bz2", bz2_begin, bz2_write, finish_stream, bz2_end },
+	{ ".gz", gz_begin, gz_write, finish_stream, gz_end },
+#ifdef HAVE_LZMA
+	{ ".xz", xz_begin, xz_write, xz_finish, xz_end },
+#else
+	{ ".xz", NULL, NULL, NULL, NULL },
+#endif
+#ifdef HAVE_ZSTD
+	{ ".zst", zstd_begin, zstd_write, zstd_finish, zstd_end },
+#else
+	{ ".zst", NULL, NULL, NULL, NULL },
+#endif
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static const LowCodec *
+low_codec_for_name (const char *name)
+{
+	size_t len = strlen (name);
+	int i;
+
+	for (i = 0; codecs[i].extension != NULL; i++) {
+		size_t ext_len = strlen (codecs[i].extension);
+
+		if (len > ext_len &&
+		    strcmp (name + len - ext_len, codecs[i].extension) == 0) {
+			return &codecs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * The name compressed_name will have once it's uncompressed.
+ */
+char *
+low_decompress_strip_extension (const char *compressed_name)
+{
+	const LowCodec *codec = low_codec_for_name (compressed_name);
+	size_t len = strlen (compressed_name);
+
+	if (codec != NULL) {
+		len -= strlen (codec->extension);
+	}
+
+	return strndup (compressed_name, len);
+}
+
+/**
+ * Returns true unless compressed_name is in a format we were built
+ * without.
+ */
+bool
+low_decompress_is_supported (const char *compressed_name)
+{
+	const LowCodec *codec = low_codec_for_name (compressed_name);
+
+	return codec == NULL || codec->begin != NULL;
+}
+
+/**
+ * Get ready to uncompress a stream in the format compressed_name's
+ * extension says it's in, into fd. Anything without a compression
+ * extension is passed through untouched. Returns NULL for formats we were
+ * built without.
+ */
+LowDecompressor *
+low_decompressor_new (const char *compressed_name, int fd)
+{
+	LowDecompressor *decompressor;
+	const LowCodec *codec = low_codec_for_name (compressed_name);
+
+	if (codec != NULL && codec->begin == NULL) {
+		low_debug ("no support for %s files", codec->extension);
+		return NULL;
+	}
+
+	decompressor = malloc (sizeof (LowDecompressor));
+	memset (decompressor, 0, sizeof (LowDecompressor));
+	decompressor->codec = codec;
+	decompressor->fd = fd;
+	decompressor->out = malloc (OUT_BUF_SIZE);
+
+	return decompressor;
+}
+
+/**
+ * Uncompress the next len bytes of the stream. Returns false if they
+ * can't be uncompressed, or written out.
+ */
+bool
+low_decompressor_write (LowDecompressor *decompressor, const void *buf,
+			size_t len)
+{
+	if (decompressor->codec == NULL) {
+		return write_all (decompressor->fd, buf, len);
+	}
+
+	if (!decompressor->started) {
+		if (!decompressor->codec->begin (decompressor)) {
+			return false;
+		}
+		decompressor->started = true;
+	}
+
+	return decompressor->codec->write (decompressor, buf, len);
+}
+
+/**
+ * Returns true if everything written so far made up whole compressed
+ * streams; false if it was cut off part way through one.
+ */
+bool
+low_decompressor_finish (LowDecompressor *decompressor)
+{
+	if (decompressor->codec == NULL) {
+		return true;
+	}
+
+	return decompressor->started &&
+		decompressor->codec->finish (decompressor);
+}
+
+void
+low_decompressor_free (LowDecompressor *decompressor)
+{
+	if (decompressor->started) {
+		decompressor->codec->end (decompressor);
+	}
+	free (decompressor->out);
+	free (decompressor);
+}
+
+/* vim: set ts=8 sw=8 noet: */
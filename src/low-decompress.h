@@ -0,0 +1,46 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _LOW_DECOMPRESS_H_
+#define _LOW_DECOMPRESS_H_
+
+/**
+ * Uncompresses a stream handed to it in pieces, writing the result out to
+ * a file descriptor as it goes.
+ */
+typedef struct _LowDecompressor LowDecompressor;
+
+LowDecompressor *low_decompressor_new    (const char *compressed_name,
+					  int fd);
+bool             low_decompressor_write  (LowDecompressor *decompressor,
+					  const void *buf, size_t len);
+bool             low_decompressor_finish (LowDecompressor *decompressor);
+void             low_decompressor_free   (LowDecompressor *decompressor);
+
+char *low_decompress_strip_extension (const char *compressed_name);
+bool  low_decompress_is_supported    (const char *compressed_name);
+
+#endif /* _LOW_DECOMPRESS_H_ */
+
+/* vim: set ts=8 sw=8 noet: */
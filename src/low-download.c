@@ -23,9 +23,11 @@
  *  02110-1301  USA
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
@@ -34,6 +36,7 @@
 
 #include "low-download.h"
 #include "low-debug.h"
+#include "low-decompress.h"
 
 static char *
 create_file_url (const char *baseurl, const char *relative_file)
@@ -56,163 +59,240 @@ create_file_url (const char *baseurl, const char *relative_file)
 	return full_url;
 }
 
-static CURL *
-init_curl (char *error, const char *basename, LowDownloadCallback callback)
+/* Idle handles kept around per host, for their open connections */
+#define MAX_IDLE_HANDLES 8
+
+static void
+low_download_session_lock (CURL *curl G_GNUC_UNUSED, curl_lock_data data,
+			   curl_lock_access access G_GNUC_UNUSED, void *userp)
 {
-	CURL *curl;
+	LowDownloadSession *session = userp;
 
-	curl = curl_easy_init ();
-	if (curl == NULL) {
-		return curl;
-	}
+	pthread_mutex_lock (&session->locks[data]);
+}
 
-	curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1);
-	curl_easy_setopt (curl, CURLOPT_ERRORBUFFER, error);
-	curl_easy_setopt (curl, CURLOPT_NOPROGRESS, 0);
-	curl_easy_setopt (curl, CURLOPT_PROGRESSFUNCTION, callback);
-	curl_easy_setopt (curl, CURLOPT_PROGRESSDATA, basename);
+static void
+low_download_session_unlock (CURL *curl G_GNUC_UNUSED, curl_lock_data data,
+			     void *userp)
+{
+	LowDownloadSession *session = userp;
 
-	return curl;
+	pthread_mutex_unlock (&session->locks[data]);
 }
 
-int
-low_download (const char *url, const char *file, const char *basename,
-	      LowDownloadCallback callback)
+/**
+ * Create a session to make downloads through. Handles, DNS lookups, TLS
+ * sessions and open connections are all kept for the life of the session.
+ */
+LowDownloadSession *
+low_download_session_new (void)
 {
-	CURL *curl;
-	char error[256];
-	FILE *fp;
-	CURLcode res;
-	long response;
+	LowDownloadSession *session = malloc (sizeof (LowDownloadSession));
+	int i;
 
-	curl = init_curl (error, basename, callback);
-	if (curl == NULL) {
-		return 1;
-	}
+	curl_global_init (CURL_GLOBAL_ALL);
 
-	fp = fopen (file, "w");
-	if (fp == NULL) {
-		fprintf (stderr, "failed to open %s for writing\n", file);
-		return -1;
-	}
-	curl_easy_setopt (curl, CURLOPT_WRITEDATA, fp);
-	curl_easy_setopt (curl, CURLOPT_URL, url);
-	res = curl_easy_perform (curl);
-	fclose (fp);
-	if (res != CURLE_OK) {
-		fprintf (stderr, "curl error: %s\n", error);
-		unlink (file);
-		return -1;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_init (&session->locks[i], NULL);
 	}
-	res = curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response);
-	if (res != CURLE_OK) {
-		fprintf (stderr, "curl error: %s\n", error);
-		unlink (file);
-		return -1;
-	}
-	if (response != 200) {
-		if (!(response == 226 && strncmp ("ftp", url, 3) == 0)) {
-			fprintf (stderr, " - failed %ld\n", response);
-			unlink (file);
-			return -1;
-		}
-	}
-	printf ("\n");
+	pthread_mutex_init (&session->handles_lock, NULL);
 
-	curl_easy_cleanup (curl);
+	session->share = curl_share_init ();
+	curl_share_setopt (session->share, CURLSHOPT_LOCKFUNC,
+			   low_download_session_lock);
+	curl_share_setopt (session->share, CURLSHOPT_UNLOCKFUNC,
+			   low_download_session_unlock);
+	curl_share_setopt (session->share, CURLSHOPT_USERDATA, session);
+	curl_share_setopt (session->share, CURLSHOPT_SHARE,
+			   CURL_LOCK_DATA_DNS);
+	curl_share_setopt (session->share, CURLSHOPT_SHARE,
+			   CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt (session->share, CURLSHOPT_SHARE,
+			   CURL_LOCK_DATA_CONNECT);
+#endif
 
-	return 0;
+	session->handles = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  free, NULL);
+	session->multi = curl_multi_init ();
+
+	session->low_speed_limit = LOW_DOWNLOAD_DEFAULT_LOW_SPEED_LIMIT;
+	session->low_speed_time = LOW_DOWNLOAD_DEFAULT_LOW_SPEED_TIME;
+
+	return session;
 }
 
-int
-low_download_from_mirror (LowMirrorList *mirrors, const char *relative_path,
-			  const char *file, const char *basename,
-			  LowDownloadCallback callback)
+/**
+ * Abandon any transfer that does less than limit bytes a second for
+ * seconds in a row, so it can be carried on from another mirror. A limit
+ * of 0 means put up with anything.
+ */
+void
+low_download_session_set_low_speed (LowDownloadSession *session, long limit,
+				    long seconds)
 {
-	CURL *curl;
-	char *url;
-	const char *baseurl;
-	char error[256];
-	FILE *fp;
-	CURLcode res;
-	long response;
+	session->low_speed_limit = limit;
+	session->low_speed_time = seconds;
+}
 
-	curl = init_curl (error, basename, callback);
-	if (curl == NULL) {
-		return 1;
+static void
+low_download_session_free_handles (gpointer key G_GNUC_UNUSED,
+				   gpointer value,
+				   gpointer user_data G_GNUC_UNUSED)
+{
+	GList *handles = value;
+	GList *cur;
+
+	for (cur = handles; cur != NULL; cur = cur->next) {
+		curl_easy_cleanup (cur->data);
 	}
+	g_list_free (handles);
+}
 
-	fp = fopen (file, "w");
-	if (fp == NULL) {
-		fprintf (stderr, "failed to open %s for writing\n", file);
-		return -1;
+void
+low_download_session_free (LowDownloadSession *session)
+{
+	int i;
+
+	g_hash_table_foreach (session->handles,
+			      low_download_session_free_handles, NULL);
+	g_hash_table_destroy (session->handles);
+
+	curl_multi_cleanup (session->multi);
+	curl_share_cleanup (session->share);
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_destroy (&session->locks[i]);
 	}
+	pthread_mutex_destroy (&session->handles_lock);
 
-	while (1) {
-		fseek (fp, 0, SEEK_SET);
+	free (session);
+}
 
-		baseurl = low_mirror_list_lookup_random_mirror (mirrors);
-		if (baseurl == NULL) {
-			return -1;
-		}
+/*
+ * The scheme and host part of url, which is what decides whether a
+ * handle's connections can be reused for it.
+ */
+static char *
+low_download_url_host (const char *url)
+{
+	const char *host = strstr (url, "://");
+	const char *end;
 
-		url = create_file_url (baseurl, relative_path);
+	host = host == NULL ? url : host + 3;
+	end = strchr (host, '/');
+	if (end == NULL) {
+		end = host + strlen (host);
+	}
 
-		curl_easy_setopt (curl, CURLOPT_WRITEDATA, fp);
-		curl_easy_setopt (curl, CURLOPT_URL, url);
+	return strndup (url, end - url);
+}
 
-		res = curl_easy_perform (curl);
-		if (res != CURLE_OK) {
-			low_debug ("curl error: %s for url %s. marking as bad",
-				   error, baseurl);
+/**
+ * Get a handle for fetching url, reusing an idle one for the same host
+ * if we have one. Give it back with low_download_session_release_handle.
+ */
+CURL *
+low_download_session_get_handle (LowDownloadSession *session,
+				 const char *url)
+{
+	char *host = low_download_url_host (url);
+	CURL *curl = NULL;
+	GList *handles;
 
-			low_mirror_list_mark_as_bad (mirrors, baseurl);
-			free (url);
-			continue;
-		}
+	pthread_mutex_lock (&session->handles_lock);
+	handles = g_hash_table_lookup (session->handles, host);
+	if (handles != NULL) {
+		curl = handles->data;
+		handles = g_list_delete_link (handles, handles);
+		g_hash_table_replace (session->handles, host, handles);
+		host = NULL;
+	}
+	pthread_mutex_unlock (&session->handles_lock);
 
-		res = curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE,
-					 &response);
-		if (res != CURLE_OK) {
-			low_debug ("curl error: %s for url %s. marking as bad",
-				   error, baseurl);
+	free (host);
 
-			low_mirror_list_mark_as_bad (mirrors, baseurl);
-			free (url);
-			continue;
+	if (curl != NULL) {
+		curl_easy_reset (curl);
+	} else {
+		curl = curl_easy_init ();
+		if (curl == NULL) {
+			return NULL;
 		}
+	}
 
-		if (response != 200 &&
-		    !(response == 226 && strncmp ("ftp", baseurl, 3) == 0)) {
-			low_debug ("error: %ld for url %s. marking as bad",
-				   response, baseurl);
+	curl_easy_setopt (curl, CURLOPT_SHARE, session->share);
 
-			low_mirror_list_mark_as_bad (mirrors, baseurl);
-			free (url);
-			continue;
-		}
+	if (session->low_speed_limit > 0) {
+		curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT,
+				  session->low_speed_limit);
+		curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME,
+				  session->low_speed_time);
+	}
 
-		free (url);
-		break;
+	return curl;
+}
+
+void
+low_download_session_release_handle (LowDownloadSession *session,
+				     const char *url, CURL *curl)
+{
+	char *host = low_download_url_host (url);
+	GList *handles;
+
+	pthread_mutex_lock (&session->handles_lock);
+	handles = g_hash_table_lookup (session->handles, host);
+	if (g_list_length (handles) < MAX_IDLE_HANDLES) {
+		handles = g_list_prepend (handles, curl);
+		g_hash_table_replace (session->handles, host, handles);
+		curl = NULL;
+		host = NULL;
 	}
+	pthread_mutex_unlock (&session->handles_lock);
 
-	printf ("\n");
+	free (host);
 
-	fclose (fp);
+	if (curl != NULL) {
+		curl_easy_cleanup (curl);
+	}
+}
 
-	curl_easy_cleanup (curl);
+static CURL *
+init_curl (LowDownloadSession *session, const char *url, char *error,
+	   const char *basename, LowDownloadCallback callback)
+{
+	CURL *curl;
 
-	return 0;
+	curl = low_download_session_get_handle (session, url);
+	if (curl == NULL) {
+		return curl;
+	}
+
+	curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt (curl, CURLOPT_ERRORBUFFER, error);
+	/* Without a callback, curl would draw its own progress meter */
+	if (callback != NULL) {
+		curl_easy_setopt (curl, CURLOPT_NOPROGRESS, 0);
+		curl_easy_setopt (curl, CURLOPT_PROGRESSFUNCTION, callback);
+		curl_easy_setopt (curl, CURLOPT_PROGRESSDATA, basename);
+	}
+	curl_easy_setopt (curl, CURLOPT_URL, url);
+
+	return curl;
 }
 
-#define BUF_SIZE 32
+/* Big enough for any digest we know about */
+#define MAX_DIGEST_SIZE 32
+
+/* Read cached files in big chunks when checking them */
+#define READ_BUF_SIZE (256 * 1024)
 
 static void
 debug_hashes (const char *expected, const unsigned char *calculated, size_t len)
 {
 	unsigned int i;
 
-	char calculated_pretty[BUF_SIZE * 2 + 1];
+	char calculated_pretty[MAX_DIGEST_SIZE * 2 + 1];
 
 	for (i = 0; i < len; i++) {
 		sprintf (calculated_pretty + i * 2, "%.2x", calculated[i]);
@@ -244,14 +324,13 @@ char_to_short (char to_convert)
 	return 0;
 }
 
-static bool
-compare_digest (const char *file, const char *expected,
-		LowDigestType digest_type)
+/*
+ * Start a running hash of digest_type. Returns NULL if it isn't a type of
+ * digest we can check.
+ */
+static HASHContext *
+low_download_hash_new (LowDigestType digest_type)
 {
-	unsigned char result[BUF_SIZE];
-	unsigned int size;
-	unsigned int i;
-	int fd;
 	HASHContext *ctx;
 
 	/*
@@ -275,27 +354,35 @@ compare_digest (const char *file, const char *expected,
 		case DIGEST_UNKNOWN:
 		case DIGEST_NONE:
 		default:
-			return false;
+			return NULL;
 	}
 
-	fd = open (file, O_RDONLY);
-
 	HASH_Begin (ctx);
 
-	while (1) {
-		unsigned char buf[BUF_SIZE];
-		int cnt = read (fd, &buf, BUF_SIZE);
+	return ctx;
+}
 
-		if (cnt == 0) {
-			break;
-		}
+/*
+ * Finish off the running hash in ctx, and see if it matches expected.
+ * ctx is still the caller's to destroy.
+ */
+static bool
+low_download_hash_matches (HASHContext *ctx, const char *expected)
+{
+	unsigned char result[MAX_DIGEST_SIZE];
+	unsigned int size;
+	unsigned int i;
 
-		HASH_Update (ctx, buf, cnt);
+	if (ctx == NULL) {
+		return false;
 	}
 
-	close (fd);
-	HASH_End (ctx, result, &size, BUF_SIZE);
-	HASH_Destroy (ctx);
+	HASH_End (ctx, result, &size, MAX_DIGEST_SIZE);
+
+	if (strlen (expected) != size * 2) {
+		debug_hashes (expected, result, size);
+		return false;
+	}
 
 	for (i = 0; i < strlen (expected); i += 2) {
 		unsigned char e = 16 * char_to_short (expected[i]) +
@@ -310,42 +397,2337 @@ compare_digest (const char *file, const char *expected,
 	return true;
 }
 
-bool
-low_download_is_missing (const char *file, const char *digest,
-			 LowDigestType digest_type, off_t size)
+/*
+ * Check a file that's already on disk against its digest. Downloads are
+ * checked as they arrive instead; this is for what's in the cache.
+ */
+static bool
+compare_digest (const char *file, const char *expected,
+		LowDigestType digest_type)
 {
-	struct stat buf;
+	HASHContext *ctx;
+	unsigned char *buf;
+	ssize_t cnt;
+	bool matches;
+	int fd;
 
-	if (stat (file, &buf) < 0 || buf.st_size != size) {
-		return true;
+	fd = open (file, O_RDONLY);
+	if (fd < 0) {
+		return false;
 	}
 
-	return !compare_digest (file, digest, digest_type);
+	ctx = low_download_hash_new (digest_type);
+	if (ctx == NULL) {
+		close (fd);
+		return false;
+	}
+
+	posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	buf = malloc (READ_BUF_SIZE);
+	while (cnt = read (fd, buf, READ_BUF_SIZE), cnt > 0) {
+		HASH_Update (ctx, buf, cnt);
+	}
+	free (buf);
+	close (fd);
+
+	matches = cnt == 0 && low_download_hash_matches (ctx, expected);
+	HASH_Destroy (ctx);
+
+	return matches;
 }
 
-int
-low_download_if_missing (LowMirrorList *mirrors, const char *relative_path,
-			 const char *file, const char *basename,
-			 const char *digest, LowDigestType digest_type,
-			 off_t size, LowDownloadCallback callback)
+/* A byte range of a file. end is inclusive. */
+typedef struct _LowDownloadRange {
+	off_t start;
+	off_t end;
+} LowDownloadRange;
+
+static LowDownloadRange *
+low_download_range_new (off_t start, off_t end)
 {
-	int res;
+	LowDownloadRange *range = malloc (sizeof (LowDownloadRange));
 
-	if (low_download_is_missing (file, digest, digest_type, size)) {
-		res = low_download_from_mirror (mirrors, relative_path, file,
-						basename, callback);
-		if (res != 0) {
-			unlink (file);
-			return res;
+	range->start = start;
+	range->end = end;
+
+	return range;
+}
+
+static void
+low_download_ranges_free (GList *ranges)
+{
+	GList *cur;
+
+	for (cur = ranges; cur != NULL; cur = cur->next) {
+		free (cur->data);
+	}
+	g_list_free (ranges);
+}
+
+/*
+ * A file that's still coming in lives at <file>.part, with <file>.part.info
+ * beside it saying what the file is meant to be and which byte ranges of
+ * it we don't have yet. That's enough to pick up where we left off, from
+ * any mirror, in this run or the next.
+ */
+static char *
+low_download_part_info_file (const char *part_file)
+{
+	return g_strdup_printf ("%s.info", part_file);
+}
+
+static void
+low_download_part_remove (const char *part_file)
+{
+	char *info_file = low_download_part_info_file (part_file);
+
+	unlink (part_file);
+	unlink (info_file);
+
+	free (info_file);
+}
+
+static bool
+low_download_part_save (const char *part_file, off_t size,
+			const char *digest, LowDigestType digest_type,
+			GList *ranges)
+{
+	char *info_file = low_download_part_info_file (part_file);
+	char *tmp_file = g_strdup_printf ("%s.tmp", info_file);
+	bool saved = false;
+	FILE *file;
+	GList *cur;
+
+	file = fopen (tmp_file, "w");
+	if (file != NULL) {
+		fprintf (file, "%lld %d %s\n", (long long) size, digest_type,
+			 digest);
+		for (cur = ranges; cur != NULL; cur = cur->next) {
+			LowDownloadRange *range = cur->data;
+
+			fprintf (file, "%lld %lld\n", (long long) range->start,
+				 (long long) range->end);
 		}
+
+		saved = fclose (file) == 0 && rename (tmp_file, info_file) == 0;
 	}
 
-	if (!compare_digest (file, digest, digest_type)) {
-		unlink (file);
-		return -1;
+	if (!saved) {
+		low_debug ("unable to save progress for %s", part_file);
+		unlink (tmp_file);
 	}
 
-	return 0;
+	free (tmp_file);
+	free (info_file);
+
+	return saved;
+}
+
+/*
+ * Read back the missing ranges of part_file, if it's the file we're
+ * after. Returns false (and clears out the old part) if it isn't, or if
+ * there's nothing to go on. An empty list of ranges means it's all here.
+ */
+static bool
+low_download_part_load (const char *part_file, off_t size,
+			const char *digest, LowDigestType digest_type,
+			GList **ranges)
+{
+	char *info_file = low_download_part_info_file (part_file);
+	long long saved_size;
+	int saved_type;
+	char saved_digest[MAX_DIGEST_SIZE * 2 + 1];
+	long long start;
+	long long end;
+	bool matches = false;
+	struct stat buf;
+	FILE *file;
+
+	*ranges = NULL;
+
+	file = fopen (info_file, "r");
+	free (info_file);
+
+	if (file == NULL) {
+		unlink (part_file);
+		return false;
+	}
+
+	if (size > 0 && stat (part_file, &buf) == 0 &&
+	    fscanf (file, "%lld %d %64s", &saved_size, &saved_type,
+		    saved_digest) == 3) {
+		matches = saved_size == size &&
+			saved_type == (int) digest_type &&
+			!strcmp (saved_digest, digest);
+	}
+
+	while (matches && fscanf (file, "%lld %lld", &start, &end) == 2) {
+		if (start < 0 || end >= size || start > end + 1) {
+			matches = false;
+			break;
+		}
+
+		if (start <= end) {
+			*ranges = g_list_append (*ranges,
+						 low_download_range_new (start,
+									 end));
+		}
+	}
+
+	fclose (file);
+
+	if (!matches) {
+		low_download_ranges_free (*ranges);
+		*ranges = NULL;
+		low_download_part_remove (part_file);
+	}
+
+	return matches;
+}
+
+/*
+ * Move a finished part file into place if it checks out against digest,
+ * or throw it away if it doesn't. hash, if given, has already seen all of
+ * the file.
+ */
+static bool
+low_download_part_complete (const char *part_file, const char *file,
+			    const char *digest, LowDigestType digest_type,
+			    HASHContext *hash)
+{
+	char *info_file;
+	bool successful;
+
+	if (hash != NULL) {
+		successful = low_download_hash_matches (hash, digest);
+	} else {
+		successful = compare_digest (part_file, digest, digest_type);
+	}
+
+	if (!successful || rename (part_file, file) != 0) {
+		low_download_part_remove (part_file);
+		return false;
+	}
+
+	info_file = low_download_part_info_file (part_file);
+	unlink (info_file);
+	free (info_file);
+
+	return true;
+}
+
+/*
+ * What the server said about a file, kept at <file>.http, so the next
+ * fetch can ask for it only if it's changed since.
+ */
+static char *
+low_download_validators_file (const char *file)
+{
+	return g_strdup_printf ("%s.http", file);
+}
+
+/**
+ * Read back the validators saved for file. Any we don't have are NULL.
+ */
+LowDownloadValidators *
+low_download_validators_load (const char *file)
+{
+	LowDownloadValidators *validators =
+		malloc (sizeof (LowDownloadValidators));
+	char *validators_file = low_download_validators_file (file);
+	char line[1024];
+	FILE *fp;
+
+	validators->etag = NULL;
+	validators->last_modified = NULL;
+
+	fp = fopen (validators_file, "r");
+	free (validators_file);
+
+	if (fp == NULL) {
+		return validators;
+	}
+
+	while (fgets (line, sizeof (line), fp) != NULL) {
+		g_strchomp (line);
+
+		if (!strncmp (line, "ETag: ", 6)) {
+			free (validators->etag);
+			validators->etag = strdup (line + 6);
+		} else if (!strncmp (line, "Last-Modified: ", 15)) {
+			free (validators->last_modified);
+			validators->last_modified = strdup (line + 15);
+		}
+	}
+	fclose (fp);
+
+	return validators;
+}
+
+/**
+ * Save validators beside file, or clear out the old ones if there aren't
+ * any.
+ */
+bool
+low_download_validators_save (LowDownloadValidators *validators,
+			      const char *file)
+{
+	char *validators_file = low_download_validators_file (file);
+	char *tmp_file;
+	bool saved = false;
+	FILE *fp;
+
+	if (validators->etag == NULL && validators->last_modified == NULL) {
+		unlink (validators_file);
+		free (validators_file);
+		return true;
+	}
+
+	tmp_file = g_strdup_printf ("%s.tmp", validators_file);
+	fp = fopen (tmp_file, "w");
+	if (fp != NULL) {
+		if (validators->etag != NULL) {
+			fprintf (fp, "ETag: %s\n", validators->etag);
+		}
+		if (validators->last_modified != NULL) {
+			fprintf (fp, "Last-Modified: %s\n",
+				 validators->last_modified);
+		}
+
+		saved = fclose (fp) == 0 &&
+			rename (tmp_file, validators_file) == 0;
+	}
+
+	if (!saved) {
+		low_debug ("unable to save validators for %s", file);
+		unlink (tmp_file);
+	}
+
+	free (tmp_file);
+	free (validators_file);
+
+	return saved;
+}
+
+void
+low_download_validators_free (LowDownloadValidators *validators)
+{
+	if (validators == NULL) {
+		return;
+	}
+
+	free (validators->etag);
+	free (validators->last_modified);
+	free (validators);
+}
+
+/*
+ * Pick the validators out of a response's headers as they come in. A
+ * redirect gets a header block of its own; only the last block counts.
+ */
+static size_t
+low_download_header (void *ptr, size_t size, size_t nmemb, void *data)
+{
+	LowDownloadValidators *seen = data;
+	size_t len = size * nmemb;
+	char *header = g_strndup (ptr, len);
+
+	g_strchomp (header);
+
+	if (!strncmp (header, "HTTP/", 5)) {
+		free (seen->etag);
+		free (seen->last_modified);
+		seen->etag = NULL;
+		seen->last_modified = NULL;
+	} else if (!g_ascii_strncasecmp (header, "ETag:", 5)) {
+		free (seen->etag);
+		seen->etag = strdup (g_strchug (header + 5));
+	} else if (!g_ascii_strncasecmp (header, "Last-Modified:", 14)) {
+		free (seen->last_modified);
+		seen->last_modified = strdup (g_strchug (header + 14));
+	}
+
+	g_free (header);
+
+	return len;
+}
+
+/*
+ * Before we write the first bytes of a transfer, make sure they're what
+ * we asked for, and not an error page, or the whole file when we only
+ * wanted a piece of it.
+ */
+static bool
+low_download_response_is_wanted (CURL *curl, const char *url, bool ranged)
+{
+	long response = 0;
+
+	if (strncmp ("http", url, 4) != 0) {
+		return true;
+	}
+
+	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response);
+
+	if (ranged) {
+		return response == 206;
+	}
+
+	return response == 200 || response == 206;
+}
+
+/*
+ * Where a transfer's bytes go: into fp from start on (or through
+ * decompressor, if there is one, instead), and through hash (if there is
+ * one) on the way. With validators, only ask for the file if it's changed
+ * since they were given, and update them from the response.
+ */
+typedef struct _LowDownloadWriter {
+	FILE *fp;
+	LowDecompressor *decompressor;
+	HASHContext *hash;
+	CURL *curl;
+	const char *url;
+	off_t start;
+	off_t offset;
+	LowDownloadValidators *validators;
+} LowDownloadWriter;
+
+static size_t
+low_download_write (void *ptr, size_t size, size_t nmemb, void *data)
+{
+	LowDownloadWriter *writer = data;
+	size_t written;
+
+	if (writer->offset == writer->start &&
+	    !low_download_response_is_wanted (writer->curl, writer->url,
+					      writer->start > 0)) {
+		return 0;
+	}
+
+	if (writer->decompressor != NULL) {
+		if (!low_decompressor_write (writer->decompressor, ptr,
+					     size * nmemb)) {
+			return 0;
+		}
+		written = size * nmemb;
+	} else {
+		written = fwrite (ptr, 1, size * nmemb, writer->fp);
+	}
+	writer->offset += written;
+
+	if (writer->hash != NULL) {
+		HASH_Update (writer->hash, ptr, written);
+	}
+
+	return written;
+}
+
+/*
+ * Let mirrors know how the transfer on curl from the mirror at baseurl
+ * went, so faster mirrors get picked next time.
+ */
+static void
+record_transfer (LowMirrorList *mirrors, const char *baseurl, CURL *curl)
+{
+	double bytes = 0;
+	double seconds = 0;
+	double ttfb = 0;
+
+	curl_easy_getinfo (curl, CURLINFO_SIZE_DOWNLOAD, &bytes);
+	curl_easy_getinfo (curl, CURLINFO_TOTAL_TIME, &seconds);
+	curl_easy_getinfo (curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+
+	low_mirror_list_record_transfer (mirrors, baseurl, bytes, seconds,
+					 ttfb);
+}
+
+/*
+ * Fetch url through writer on curl, picking up from writer->offset.
+ * Returns false, with an explanation in error, if it didn't work out.
+ */
+static bool
+low_download_perform (CURL *curl, const char *url, LowDownloadWriter *writer,
+		      char *error)
+{
+	CURLcode res;
+	long response = 0;
+	struct curl_slist *headers = NULL;
+	LowDownloadValidators seen = { NULL, NULL };
+	LowDownloadValidators *validators = writer->validators;
+
+	writer->curl = curl;
+	writer->url = url;
+	writer->start = writer->offset;
+
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, low_download_write);
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, writer);
+	if (writer->offset > 0) {
+		curl_easy_setopt (curl, CURLOPT_RESUME_FROM_LARGE,
+				  (curl_off_t) writer->offset);
+	}
+
+	if (validators != NULL) {
+		char *header;
+
+		if (validators->etag != NULL) {
+			header = g_strdup_printf ("If-None-Match: %s",
+						  validators->etag);
+			headers = curl_slist_append (headers, header);
+			free (header);
+		}
+		if (validators->last_modified != NULL) {
+			header = g_strdup_printf ("If-Modified-Since: %s",
+						  validators->last_modified);
+			headers = curl_slist_append (headers, header);
+			free (header);
+		}
+
+		curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+		curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION,
+				  low_download_header);
+		curl_easy_setopt (curl, CURLOPT_HEADERDATA, &seen);
+	}
+
+	res = curl_easy_perform (curl);
+	if (res == CURLE_OK) {
+		res = curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE,
+					 &response);
+	}
+
+	if (validators != NULL) {
+		curl_easy_setopt (curl, CURLOPT_HTTPHEADER, NULL);
+		curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, NULL);
+		curl_slist_free_all (headers);
+	}
+
+	if (res != CURLE_OK) {
+		free (seen.etag);
+		free (seen.last_modified);
+		return false;
+	}
+
+	if (response != 200 && response != 206 &&
+	    !(response == 226 && strncmp ("ftp", url, 3) == 0) &&
+	    !(response == 304 && validators != NULL)) {
+		sprintf (error, "response %ld", response);
+		free (seen.etag);
+		free (seen.last_modified);
+		return false;
+	}
+
+	if (validators != NULL) {
+		/* A 304 needn't repeat what we already know */
+		if (response != 304 || seen.etag != NULL) {
+			free (validators->etag);
+			validators->etag = seen.etag;
+		} else {
+			free (seen.etag);
+		}
+		if (response != 304 || seen.last_modified != NULL) {
+			free (validators->last_modified);
+			validators->last_modified = seen.last_modified;
+		} else {
+			free (seen.last_modified);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * True if the last transfer on curl was skipped, as the file hadn't
+ * changed.
+ */
+static bool
+low_download_not_modified (CURL *curl)
+{
+	long response = 0;
+
+	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response);
+
+	return response == 304;
+}
+
+/*
+ * Fetch url into file. With validators, the server is asked for it only
+ * if it's changed; if it hasn't, there's no file, *modified is false, and
+ * it still counts as success.
+ */
+static int
+download_url (LowDownloadSession *session, const char *url, const char *file,
+	      const char *basename, LowDownloadValidators *validators,
+	      bool *modified, LowDownloadCallback callback)
+{
+	CURL *curl;
+	char error[CURL_ERROR_SIZE];
+	LowDownloadWriter writer = { NULL, NULL, NULL, NULL, NULL, 0, 0, NULL };
+	bool ok;
+
+	writer.fp = fopen (file, "w");
+	if (writer.fp == NULL) {
+		fprintf (stderr, "failed to open %s for writing\n", file);
+		return -1;
+	}
+
+	curl = init_curl (session, url, error, basename, callback);
+	if (curl == NULL) {
+		fclose (writer.fp);
+		unlink (file);
+		return 1;
+	}
+
+	writer.validators = validators;
+	ok = low_download_perform (curl, url, &writer, error);
+	fclose (writer.fp);
+	if (modified != NULL) {
+		*modified = !ok || !low_download_not_modified (curl);
+	}
+	low_download_session_release_handle (session, url, curl);
+
+	if (!ok) {
+		fprintf (stderr, "curl error: %s\n", error);
+		unlink (file);
+		return -1;
+	}
+	if (callback != NULL) {
+		printf ("\n");
+	}
+
+	if (modified != NULL && !*modified) {
+		unlink (file);
+	}
+
+	return 0;
+}
+
+int
+low_download (LowDownloadSession *session, const char *url, const char *file,
+	      const char *basename, LowDownloadCallback callback)
+{
+	return download_url (session, url, file, basename, NULL, NULL,
+			     callback);
+}
+
+/**
+ * Fetch url into file if it's changed since validators were saved, and
+ * bring them up to date. *modified says if it was fetched.
+ */
+int
+low_download_if_modified (LowDownloadSession *session, const char *url,
+			  const char *file, const char *basename,
+			  LowDownloadValidators *validators, bool *modified,
+			  LowDownloadCallback callback)
+{
+	return download_url (session, url, file, basename, validators,
+			     modified, callback);
+}
+
+/*
+ * Set writer up to fill in part_file, carrying on from an earlier attempt
+ * if there's one to carry on from. The serial path can only append, so a
+ * part with holes in it (left by a segmented download) is started over.
+ */
+static bool
+low_download_part_open (LowDownloadWriter *writer, const char *part_file,
+			off_t size, const char *digest,
+			LowDigestType digest_type)
+{
+	GList *ranges;
+
+	if (low_download_part_load (part_file, size, digest, digest_type,
+				    &ranges)) {
+		LowDownloadRange *range = ranges != NULL ? ranges->data : NULL;
+
+		if (range == NULL) {
+			writer->offset = size;
+		} else if (ranges->next == NULL && range->end == size - 1) {
+			writer->offset = range->start;
+		}
+		low_download_ranges_free (ranges);
+
+		if (writer->offset > 0) {
+			writer->fp = fopen (part_file, "r+");
+			if (writer->fp != NULL &&
+			    fseeko (writer->fp, writer->offset, SEEK_SET) == 0) {
+				low_debug ("Resuming %s at %lld", part_file,
+					   (long long) writer->offset);
+				return true;
+			}
+
+			if (writer->fp != NULL) {
+				fclose (writer->fp);
+			}
+		}
+	}
+
+	writer->offset = 0;
+	writer->fp = fopen (part_file, "w");
+	if (writer->fp == NULL) {
+		return false;
+	}
+
+	/* Starting at the beginning, we can hash it as it comes in */
+	writer->hash = low_download_hash_new (digest_type);
+
+	return true;
+}
+
+static void
+low_download_part_save_offset (const char *part_file, off_t offset,
+			       off_t size, const char *digest,
+			       LowDigestType digest_type)
+{
+	LowDownloadRange range = { offset, size - 1 };
+	GList ranges = { &range, NULL, NULL };
+
+	low_download_part_save (part_file, size, digest, digest_type,
+				offset < size ? &ranges : NULL);
+}
+
+/*
+ * Fetch relative_path from the first mirror that works. If digest and
+ * size are given, the file comes in through a part file that survives
+ * failures, a mismatch against digest is a failure, and later mirrors
+ * (or runs) carry on from where the last one stopped. Otherwise each
+ * mirror starts from scratch, as their copies may well differ, and
+ * validators (if given) make the fetch conditional, as for download_url.
+ */
+static int
+download_from_mirror (LowDownloadSession *session, LowMirrorList *mirrors,
+		      const char *relative_path, const char *file,
+		      const char *basename, const char *digest,
+		      LowDigestType digest_type, off_t size,
+		      LowDownloadValidators *validators, bool *modified,
+		      LowDownloadCallback callback)
+{
+	CURL *curl;
+	char *url;
+	const char *baseurl = NULL;
+	char error[CURL_ERROR_SIZE];
+	LowDownloadWriter writer = { NULL, NULL, NULL, NULL, NULL, 0, 0, NULL };
+	char *part_file = NULL;
+	bool ok;
+
+	if (digest != NULL && size > 0) {
+		part_file = g_strdup_printf ("%s.part", file);
+		if (low_download_part_open (&writer, part_file, size, digest,
+					    digest_type)) {
+			low_download_part_save_offset (part_file,
+						       writer.offset, size,
+						       digest, digest_type);
+		}
+	} else {
+		writer.fp = fopen (file, "w");
+		writer.validators = validators;
+	}
+
+	if (writer.fp == NULL) {
+		fprintf (stderr, "failed to open %s for writing\n",
+			 part_file != NULL ? part_file : file);
+		free (part_file);
+		return -1;
+	}
+
+	while (part_file == NULL || writer.offset < size) {
+		if (part_file == NULL) {
+			fseek (writer.fp, 0, SEEK_SET);
+			if (ftruncate (fileno (writer.fp), 0) != 0) {
+				low_debug ("unable to truncate %s", file);
+			}
+			writer.offset = 0;
+		}
+
+		baseurl = low_mirror_list_lookup_random_mirror (mirrors);
+		if (baseurl == NULL) {
+			break;
+		}
+
+		url = create_file_url (baseurl, relative_path);
+
+		curl = init_curl (session, url, error, basename, callback);
+		if (curl == NULL) {
+			free (url);
+			break;
+		}
+
+		ok = low_download_perform (curl, url, &writer, error);
+		if (ok) {
+			record_transfer (mirrors, baseurl, curl);
+			if (modified != NULL) {
+				*modified = !low_download_not_modified (curl);
+			}
+		}
+		low_download_session_release_handle (session, url, curl);
+		free (url);
+
+		if (!ok) {
+			low_debug ("curl error: %s for url %s. marking as bad",
+				   error, baseurl);
+
+			low_mirror_list_mark_as_bad (mirrors, baseurl);
+			if (part_file != NULL) {
+				fflush (writer.fp);
+				low_download_part_save_offset (part_file,
+							       writer.offset,
+							       size, digest,
+							       digest_type);
+			}
+			continue;
+		}
+
+		if (part_file != NULL && writer.offset < size) {
+			low_debug ("short transfer from %s", baseurl);
+			low_mirror_list_mark_as_bad (mirrors, baseurl);
+			continue;
+		}
+
+		break;
+	}
+
+	if (callback != NULL) {
+		printf ("\n");
+	}
+
+	fclose (writer.fp);
+
+	if (part_file == NULL) {
+		if (baseurl == NULL) {
+			return -1;
+		}
+		if (modified != NULL && !*modified) {
+			unlink (file);
+		}
+		return 0;
+	}
+
+	/* Out of mirrors; keep what we have for next time */
+	if (writer.offset < size) {
+		low_download_part_save_offset (part_file, writer.offset, size,
+					       digest, digest_type);
+		ok = false;
+	} else {
+		ok = low_download_part_complete (part_file, file, digest,
+						 digest_type, writer.hash);
+	}
+
+	if (writer.hash != NULL) {
+		HASH_Destroy (writer.hash);
+	}
+	free (part_file);
+
+	return ok ? 0 : -1;
+}
+
+int
+low_download_from_mirror (LowDownloadSession *session,
+			  LowMirrorList *mirrors, const char *relative_path,
+			  const char *file, const char *basename,
+			  LowDownloadCallback callback)
+{
+	return download_from_mirror (session, mirrors, relative_path, file,
+				     basename, NULL, DIGEST_NONE, 0, NULL, NULL,
+				     callback);
+}
+
+/**
+ * Fetch relative_path from the first mirror that works, if it's changed
+ * since validators were saved, and bring them up to date. *modified says
+ * if it was fetched.
+ */
+int
+low_download_from_mirror_if_modified (LowDownloadSession *session,
+				      LowMirrorList *mirrors,
+				      const char *relative_path,
+				      const char *file, const char *basename,
+				      LowDownloadValidators *validators,
+				      bool *modified,
+				      LowDownloadCallback callback)
+{
+	return download_from_mirror (session, mirrors, relative_path, file,
+				     basename, NULL, DIGEST_NONE, 0,
+				     validators, modified, callback);
+}
+
+/**
+ * Fetch bytes start to end (inclusive) of relative_path into buf, from
+ * the first mirror that works.
+ */
+int
+low_download_range (LowDownloadSession *session, LowMirrorList *mirrors,
+		    const char *relative_path, off_t start, off_t end,
+		    char *buf, const char *basename)
+{
+	CURL *curl;
+	char *url;
+	const char *baseurl;
+	char error[CURL_ERROR_SIZE];
+	char byte_range[64];
+	LowDownloadWriter writer = { NULL, NULL, NULL, NULL, NULL, 0, 0, NULL };
+	size_t len = end - start + 1;
+	bool ok = false;
+
+	snprintf (byte_range, sizeof (byte_range), "%lld-%lld",
+		  (long long) start, (long long) end);
+
+	while (!ok) {
+		baseurl = low_mirror_list_lookup_random_mirror (mirrors);
+		if (baseurl == NULL) {
+			break;
+		}
+
+		url = create_file_url (baseurl, relative_path);
+
+		curl = init_curl (session, url, error, basename, NULL);
+		if (curl == NULL) {
+			free (url);
+			break;
+		}
+		curl_easy_setopt (curl, CURLOPT_RANGE, byte_range);
+
+		/* A mirror that ignores the range overflows buf, and fails */
+		writer.fp = fmemopen (buf, len, "w");
+		if (writer.fp != NULL) {
+			setvbuf (writer.fp, NULL, _IONBF, 0);
+		}
+		writer.offset = 0;
+
+		ok = writer.fp != NULL &&
+			low_download_perform (curl, url, &writer, error);
+		if (writer.fp != NULL) {
+			fclose (writer.fp);
+		}
+
+		if (ok && writer.offset != (off_t) len) {
+			sprintf (error, "short range");
+			ok = false;
+		}
+
+		if (ok) {
+			record_transfer (mirrors, baseurl, curl);
+		}
+		low_download_session_release_handle (session, url, curl);
+		free (url);
+
+		if (!ok) {
+			low_debug ("curl error: %s for url %s (bytes %s). "
+				   "marking as bad", error, baseurl,
+				   byte_range);
+			low_mirror_list_mark_as_bad (mirrors, baseurl);
+		}
+	}
+
+	return ok ? 0 : -1;
+}
+
+/*
+ * Fetch relative_path from the first mirror that works, uncompressing it
+ * into file as it comes in. The compressed bytes are checked against
+ * digest on the way, and file only shows up once they've matched.
+ */
+int
+low_download_uncompressed (LowDownloadSession *session,
+			   LowMirrorList *mirrors, const char *relative_path,
+			   const char *file, const char *basename,
+			   const char *digest, LowDigestType digest_type,
+			   LowDownloadCallback callback)
+{
+	CURL *curl;
+	char *url;
+	const char *baseurl;
+	char error[CURL_ERROR_SIZE];
+	LowDownloadWriter writer = { NULL, NULL, NULL, NULL, NULL, 0, 0, NULL };
+	char *tmp_file;
+	bool ok = false;
+	int fd;
+
+	if (!low_decompress_is_supported (relative_path)) {
+		fprintf (stderr, "%s: unsupported compression for %s\n",
+			 basename, relative_path);
+		return -1;
+	}
+
+	tmp_file = g_strdup_printf ("%s.tmp", file);
+	fd = open (tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf (stderr, "failed to open %s for writing\n", tmp_file);
+		free (tmp_file);
+		return -1;
+	}
+
+	while (!ok) {
+		baseurl = low_mirror_list_lookup_random_mirror (mirrors);
+		if (baseurl == NULL) {
+			break;
+		}
+
+		/* A half-uncompressed stream can't be picked up again */
+		if (ftruncate (fd, 0) != 0 || lseek (fd, 0, SEEK_SET) != 0) {
+			low_debug ("unable to truncate %s", tmp_file);
+			break;
+		}
+
+		url = create_file_url (baseurl, relative_path);
+
+		curl = init_curl (session, url, error, basename, callback);
+		if (curl == NULL) {
+			free (url);
+			break;
+		}
+
+		writer.offset = 0;
+		writer.decompressor = low_decompressor_new (relative_path, fd);
+		writer.hash = low_download_hash_new (digest_type);
+
+		ok = low_download_perform (curl, url, &writer, error);
+		if (ok) {
+			record_transfer (mirrors, baseurl, curl);
+
+			if (!low_decompressor_finish (writer.decompressor)) {
+				sprintf (error, "truncated file");
+				ok = false;
+			} else if (writer.hash != NULL &&
+				   !low_download_hash_matches (writer.hash,
+							      digest)) {
+				sprintf (error, "digest mismatch");
+				ok = false;
+			}
+		}
+		low_download_session_release_handle (session, url, curl);
+		free (url);
+
+		low_decompressor_free (writer.decompressor);
+		if (writer.hash != NULL) {
+			HASH_Destroy (writer.hash);
+		}
+
+		if (!ok) {
+			low_debug ("curl error: %s for url %s. marking as bad",
+				   error, baseurl);
+			low_mirror_list_mark_as_bad (mirrors, baseurl);
+		}
+	}
+
+	if (callback != NULL) {
+		printf ("\n");
+	}
+
+	if (close (fd) != 0) {
+		ok = false;
+	}
+
+	if (ok && rename (tmp_file, file) != 0) {
+		fprintf (stderr, "failed to rename %s\n", tmp_file);
+		ok = false;
+	}
+
+	if (!ok) {
+		unlink (tmp_file);
+	}
+	free (tmp_file);
+
+	return ok ? 0 : -1;
+}
+
+/* Fetch changed chunks in runs of up to this much */
+#define MAX_CHUNK_RUN_SIZE (4 * 1024 * 1024)
+
+/*
+ * True if the len bytes at buf match digest.
+ */
+static bool
+low_download_buf_matches (const char *buf, size_t len, const char *digest,
+			  LowDigestType digest_type)
+{
+	HASHContext *ctx = low_download_hash_new (digest_type);
+	bool matches;
+
+	if (ctx == NULL) {
+		return false;
+	}
+
+	HASH_Update (ctx, (const unsigned char *) buf, len);
+	matches = low_download_hash_matches (ctx, digest);
+	HASH_Destroy (ctx);
+
+	return matches;
+}
+
+/*
+ * Copy chunk out of old_fd, where old_chunk has the same contents, into
+ * fd, checking it on the way.
+ */
+static bool
+low_download_chunk_copy (int fd, int old_fd, LowChunk *old_chunk,
+			 LowChunk *chunk, LowDigestType digest_type)
+{
+	char *buf = malloc (chunk->open_length);
+	bool ok;
+
+	ok = pread (old_fd, buf, chunk->open_length,
+		    old_chunk->open_offset) == chunk->open_length &&
+		low_download_buf_matches (buf, chunk->open_length,
+					  chunk->digest, digest_type) &&
+		write (fd, buf, chunk->open_length) == chunk->open_length;
+
+	free (buf);
+
+	return ok;
+}
+
+/*
+ * Uncompress chunk, which was fetched into buf, onto the end of fd, and
+ * read it back to check it.
+ */
+static bool
+low_download_chunk_write (int fd, const char *relative_path,
+			  const char *buf, LowChunk *chunk,
+			  LowDigestType digest_type)
+{
+	LowDecompressor *decompressor;
+	char *check;
+	bool ok;
+
+	decompressor = low_decompressor_new (relative_path, fd);
+	if (decompressor == NULL) {
+		return false;
+	}
+
+	ok = low_decompressor_write (decompressor, buf, chunk->length) &&
+		low_decompressor_finish (decompressor);
+	low_decompressor_free (decompressor);
+
+	if (!ok || lseek (fd, 0, SEEK_CUR) !=
+	    chunk->open_offset + chunk->open_length) {
+		return false;
+	}
+
+	check = malloc (chunk->open_length);
+	ok = pread (fd, check, chunk->open_length, chunk->open_offset) ==
+		chunk->open_length &&
+		low_download_buf_matches (check, chunk->open_length,
+					  chunk->digest, digest_type);
+	free (check);
+
+	return ok;
+}
+
+/**
+ * Bring file up to date with new_index, the chunk index of relative_path,
+ * fetching only the chunks that old_file (laid out as old_index says)
+ * doesn't already have. Every chunk is checked against its digest, and
+ * file only shows up once they all match.
+ */
+int
+low_download_chunked (LowDownloadSession *session, LowMirrorList *mirrors,
+		      const char *relative_path, const char *file,
+		      const char *basename, LowChunkIndex *new_index,
+		      const char *old_file, LowChunkIndex *old_index)
+{
+	char *tmp_file = g_strdup_printf ("%s.tmp", file);
+	LowDigestType digest_type = new_index->digest_type;
+	bool ok = true;
+	unsigned int i = 0;
+	off_t fetched = 0;
+	int old_fd;
+	int fd;
+
+	if (old_index->digest_type != digest_type) {
+		free (tmp_file);
+		return -1;
+	}
+
+	old_fd = open (old_file, O_RDONLY);
+	fd = open (tmp_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (old_fd < 0 || fd < 0) {
+		fprintf (stderr, "failed to open %s for writing\n", tmp_file);
+		if (old_fd >= 0) {
+			close (old_fd);
+		}
+		if (fd >= 0) {
+			close (fd);
+		}
+		free (tmp_file);
+		return -1;
+	}
+
+	while (ok && i < new_index->n_chunks) {
+		LowChunk *chunk = &new_index->chunks[i];
+		LowChunk *old_chunk = low_chunk_index_lookup (old_index, chunk);
+		unsigned int end = i + 1;
+		off_t run_size = chunk->length;
+		char *buf;
+
+		if (old_chunk != NULL) {
+			if (low_download_chunk_copy (fd, old_fd, old_chunk,
+						     chunk, digest_type)) {
+				i++;
+				continue;
+			}
+
+			/*
+			 * Our copy isn't what its index says. Fetch it like a
+			 * changed chunk, over anything the copy wrote.
+			 */
+			low_debug ("%s: chunk %u is damaged, fetching it",
+				   old_file, i);
+			if (lseek (fd, chunk->open_offset, SEEK_SET) !=
+			    chunk->open_offset) {
+				ok = false;
+				break;
+			}
+		}
+
+		/* Changed chunks next to each other come in one request */
+		while (end < new_index->n_chunks &&
+		       low_chunk_index_lookup (old_index,
+					       &new_index->chunks[end]) ==
+		       NULL &&
+		       run_size + new_index->chunks[end].length <=
+		       MAX_CHUNK_RUN_SIZE) {
+			run_size += new_index->chunks[end].length;
+			end++;
+		}
+
+		buf = malloc (run_size);
+		ok = low_download_range (session, mirrors, relative_path,
+					 chunk->offset,
+					 chunk->offset + run_size - 1, buf,
+					 basename) == 0;
+		fetched += run_size;
+
+		for (; ok && i < end; i++) {
+			LowChunk *fetched_chunk = &new_index->chunks[i];
+
+			ok = low_download_chunk_write (fd, relative_path,
+						       buf + fetched_chunk->offset -
+						       chunk->offset,
+						       fetched_chunk,
+						       digest_type);
+		}
+		free (buf);
+	}
+
+	close (old_fd);
+	if (close (fd) != 0) {
+		ok = false;
+	}
+
+	if (ok && rename (tmp_file, file) != 0) {
+		fprintf (stderr, "failed to rename %s\n", tmp_file);
+		ok = false;
+	}
+
+	if (ok) {
+		low_debug ("%s: fetched %lld of %lld bytes", relative_path,
+			   (long long) fetched, (long long) new_index->size);
+	} else {
+		low_debug ("%s: unable to update by chunk", relative_path);
+		unlink (tmp_file);
+	}
+	free (tmp_file);
+
+	return ok ? 0 : -1;
+}
+
+bool
+low_download_is_missing (const char *file, const char *digest,
+			 LowDigestType digest_type, off_t size)
+{
+	struct stat buf;
+
+	if (stat (file, &buf) < 0 || buf.st_size != size) {
+		return true;
+	}
+
+	return !compare_digest (file, digest, digest_type);
+}
+
+/*
+ * A file we know to be good gets <file>.verified beside it, saying which
+ * digests it was checked against, and which file on disk it was (by size,
+ * mtime and inode), so it needn't be read through again while it's
+ * untouched.
+ */
+static char *
+low_download_verified_file (const char *file)
+{
+	return g_strdup_printf ("%s.verified", file);
+}
+
+/**
+ * Remember that file, as it is now, matches checksum (the digest it was
+ * downloaded with) and open_checksum (the digest of it uncompressed).
+ * Either can be NULL.
+ */
+bool
+low_download_record_verified (const char *file, const char *checksum,
+			      const char *open_checksum)
+{
+	char *verified_file = low_download_verified_file (file);
+	char *tmp_file = g_strdup_printf ("%s.tmp", verified_file);
+	bool saved = false;
+	struct stat buf;
+	FILE *fp;
+
+	if (stat (file, &buf) == 0 && (fp = fopen (tmp_file, "w")) != NULL) {
+		fprintf (fp, "%lld %lld %llu %s %s\n",
+			 (long long) buf.st_size, (long long) buf.st_mtime,
+			 (unsigned long long) buf.st_ino,
+			 checksum != NULL ? checksum : "-",
+			 open_checksum != NULL ? open_checksum : "-");
+
+		saved = fclose (fp) == 0 &&
+			rename (tmp_file, verified_file) == 0;
+	}
+
+	if (!saved) {
+		low_debug ("unable to record %s as verified", file);
+		unlink (tmp_file);
+	}
+
+	free (tmp_file);
+	free (verified_file);
+
+	return saved;
+}
+
+/**
+ * True if file was recorded as verified against the same digests, and
+ * hasn't changed since.
+ */
+bool
+low_download_is_verified (const char *file, const char *checksum,
+			  const char *open_checksum)
+{
+	char *verified_file = low_download_verified_file (file);
+	char saved_checksum[MAX_DIGEST_SIZE * 2 + 1];
+	char saved_open_checksum[MAX_DIGEST_SIZE * 2 + 1];
+	long long size;
+	long long mtime;
+	unsigned long long inode;
+	bool verified = false;
+	struct stat buf;
+	FILE *fp;
+
+	fp = fopen (verified_file, "r");
+	free (verified_file);
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	if (stat (file, &buf) == 0 &&
+	    fscanf (fp, "%lld %lld %llu %64s %64s", &size, &mtime, &inode,
+		    saved_checksum, saved_open_checksum) == 5) {
+		verified = size == (long long) buf.st_size &&
+			mtime == (long long) buf.st_mtime &&
+			inode == (unsigned long long) buf.st_ino &&
+			!strcmp (saved_checksum,
+				 checksum != NULL ? checksum : "-") &&
+			!strcmp (saved_open_checksum,
+				 open_checksum != NULL ? open_checksum : "-");
+	}
+
+	fclose (fp);
+
+	return verified;
+}
+
+int
+low_download_if_missing (LowDownloadSession *session, LowMirrorList *mirrors,
+			 const char *relative_path, const char *file,
+			 const char *basename,
+			 const char *digest, LowDigestType digest_type,
+			 off_t size, LowDownloadCallback callback)
+{
+	int res;
+
+	if (!low_download_is_missing (file, digest, digest_type, size)) {
+		return 0;
+	}
+
+	/* The download is checked as it comes in; no need to read it back */
+	res = download_from_mirror (session, mirrors, relative_path, file,
+				    basename, digest, digest_type, size, NULL,
+				    NULL, callback);
+	if (res != 0) {
+		unlink (file);
+	}
+
+	return res;
+}
+
+/* Segments smaller than this aren't worth a connection of their own */
+#define MIN_SEGMENT_SIZE (4 * 1024 * 1024)
+
+/* Seconds between noting down how far along running downloads are */
+#define SAVE_PROGRESS_INTERVAL 5
+
+/*
+ * Hedge a transfer once it's been waiting for data longer than this
+ * percentile of what we've seen so far, if we've seen enough to tell.
+ */
+#define HEDGE_PERCENTILE 95
+#define HEDGE_MIN_SAMPLES 8
+
+static double
+now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * One file in a download queue. It stays on the queue's pending list for
+ * as long as it has ranges that nobody is fetching yet.
+ */
+typedef struct _LowDownloadItem {
+	LowMirrorList *mirrors;
+	char *relative_path;
+	char *file;
+	char *part_file;
+	char *basename;
+	char *digest;
+	LowDigestType digest_type;
+	off_t size;
+	LowDownloadDoneFunc done;
+	void *data;
+
+	int fd;			/**< -1 until we start on it */
+	HASHContext *hash;	/**< Running hash, if it's fetched in order */
+	GList *ranges;		/**< LowDownloadRanges still to be fetched */
+	unsigned int transfers;	/**< Transfers running for it now */
+	off_t received;
+	bool checked;		/**< Looked for in the cache already */
+	bool failed;
+} LowDownloadItem;
+
+/*
+ * A range of an item being fetched from a mirror. It holds a curl handle
+ * and one of the mirror's connections while it runs.
+ */
+typedef struct _LowDownloadTransfer {
+	LowDownloadQueue *queue;
+	LowDownloadItem *item;
+	LowDownloadRange range;
+	off_t offset;		/**< Where the next byte we get goes */
+	bool ranged;		/**< Asked for less than the whole file */
+	CURL *curl;
+	LowMirror *mirror;
+	char *url;
+	char error[CURL_ERROR_SIZE];
+
+	double started;
+	bool receiving;		/**< Data has started coming in */
+
+	/* Hedging; see low_download_queue_hedge */
+	struct _LowDownloadTransfer *twin;	/**< Racing us for the range */
+	bool hedge;		/**< Started to race a slow transfer */
+	bool cancelled;		/**< Lost the race */
+} LowDownloadTransfer;
+
+/**
+ * Create an empty queue that runs at most max_connections downloads at
+ * once, and at most max_mirror_connections from any one mirror (0 for no
+ * limit per mirror). Connections are made through session.
+ */
+LowDownloadQueue *
+low_download_queue_new (LowDownloadSession *session,
+			unsigned int max_connections,
+			unsigned int max_mirror_connections)
+{
+	LowDownloadQueue *queue = malloc (sizeof (LowDownloadQueue));
+
+	queue->session = session;
+
+	/* We'd never get anywhere with no connections */
+	queue->max_connections = max_connections > 0 ? max_connections : 1;
+	queue->max_mirror_connections = max_mirror_connections;
+	queue->segment_min_size = 0;
+	queue->max_segments = 1;
+	queue->hedged = false;
+	queue->ttfbs = g_array_new (FALSE, FALSE, sizeof (double));
+	queue->max_inflight = 0;
+	queue->inflight = 0;
+	queue->pending = NULL;
+	queue->active = NULL;
+	queue->files_total = 0;
+	queue->files_done = 0;
+	queue->dltotal = 0;
+	queue->dldone = 0;
+	queue->fetched = 0;
+	queue->elapsed = 0;
+	queue->poll = NULL;
+	queue->poll_data = NULL;
+
+	return queue;
+}
+
+/**
+ * Fetch files of at least min_size bytes in up to max_segments pieces at
+ * once, spread over the available mirrors. A min_size of 0 turns this
+ * off. Only affects files added after the call.
+ */
+void
+low_download_queue_set_segmented (LowDownloadQueue *queue, off_t min_size,
+				  unsigned int max_segments)
+{
+	queue->segment_min_size = min_size;
+	queue->max_segments = max_segments > 0 ? max_segments : 1;
+}
+
+/**
+ * When a transfer takes longer than almost all the others to get going,
+ * race it against the next best mirror, and keep whichever answers first.
+ */
+void
+low_download_queue_set_hedged (LowDownloadQueue *queue, bool hedged)
+{
+	queue->hedged = hedged;
+}
+
+/**
+ * Don't start on a file if the ones already started would add up to more
+ * than max_inflight bytes with it, unless nothing else is going. A value
+ * of 0 means no limit.
+ */
+void
+low_download_queue_set_max_inflight (LowDownloadQueue *queue,
+				     off_t max_inflight)
+{
+	queue->max_inflight = max_inflight;
+}
+
+/**
+ * Have poll called with data each time around the queue's main loop, from
+ * the thread running it. It's free to add more to the queue.
+ */
+void
+low_download_queue_set_poll (LowDownloadQueue *queue,
+			     LowDownloadQueuePollFunc poll, void *data)
+{
+	queue->poll = poll;
+	queue->poll_data = data;
+}
+
+static void
+low_download_item_free (LowDownloadItem *item)
+{
+	if (item->fd >= 0) {
+		close (item->fd);
+	}
+
+	if (item->hash != NULL) {
+		HASH_Destroy (item->hash);
+	}
+
+	low_download_ranges_free (item->ranges);
+
+	free (item->relative_path);
+	free (item->file);
+	free (item->part_file);
+	free (item->basename);
+	free (item->digest);
+	free (item);
+}
+
+void
+low_download_queue_free (LowDownloadQueue *queue)
+{
+	GList *cur;
+
+	for (cur = queue->pending; cur != NULL; cur = cur->next) {
+		low_download_item_free (cur->data);
+	}
+	g_list_free (queue->pending);
+
+	g_array_free (queue->ttfbs, TRUE);
+	free (queue);
+}
+
+static gint
+compare_items_by_size (gconstpointer a, gconstpointer b)
+{
+	const LowDownloadItem *item_a = a;
+	const LowDownloadItem *item_b = b;
+
+	return item_a->size < item_b->size ? 1 : item_a->size > item_b->size ?
+		-1 : 0;
+}
+
+/*
+ * Split item up into the ranges we'll fetch it in: one for the whole
+ * thing, unless it's big enough to be worth segmenting.
+ */
+static void
+low_download_item_split (LowDownloadQueue *queue, LowDownloadItem *item)
+{
+	off_t segments = 1;
+	off_t segment_size;
+	off_t start;
+
+	if (queue->segment_min_size > 0 &&
+	    item->size >= queue->segment_min_size) {
+		segments = MIN (queue->max_segments,
+				item->size / MIN_SEGMENT_SIZE);
+		segments = MAX (segments, 1);
+	}
+
+	/* Without a size, all we can do is ask for everything */
+	if (item->size <= 0) {
+		item->ranges = g_list_append (item->ranges,
+					      low_download_range_new (0, -1));
+		return;
+	}
+
+	segment_size = (item->size + segments - 1) / segments;
+	for (start = 0; start < item->size; start += segment_size) {
+		off_t end = MIN (start + segment_size, item->size) - 1;
+
+		item->ranges = g_list_append (item->ranges,
+					      low_download_range_new (start,
+								      end));
+	}
+}
+
+/**
+ * Queue up file to be fetched from one of mirrors. Nothing is downloaded
+ * until low_download_queue_run. Once the file is in place and matches
+ * digest (or can't be), done is called with data.
+ */
+void
+low_download_queue_add (LowDownloadQueue *queue, LowMirrorList *mirrors,
+			const char *relative_path, const char *file,
+			const char *basename, const char *digest,
+			LowDigestType digest_type, off_t size,
+			LowDownloadDoneFunc done, void *data)
+{
+	LowDownloadItem *item = malloc (sizeof (LowDownloadItem));
+
+	item->mirrors = mirrors;
+	item->relative_path = strdup (relative_path);
+	item->file = strdup (file);
+	item->part_file = g_strdup_printf ("%s.part", file);
+	item->basename = strdup (basename);
+	item->digest = strdup (digest);
+	item->digest_type = digest_type;
+	item->size = size;
+	item->done = done;
+	item->data = data;
+
+	item->fd = -1;
+	item->hash = NULL;
+	item->ranges = NULL;
+	item->transfers = 0;
+	item->received = 0;
+	item->checked = false;
+	item->failed = false;
+
+	low_download_item_split (queue, item);
+
+	/* The biggest files are the long poles, so get them going first */
+	queue->pending = g_list_insert_sorted (queue->pending, item,
+					       compare_items_by_size);
+	queue->files_total++;
+	queue->dltotal += size;
+}
+
+/*
+ * Write down which ranges of item we still need, so it can be picked up
+ * again if this run doesn't get it all. Running transfers still need
+ * everything past where they've got to.
+ */
+static void
+low_download_item_save_progress (LowDownloadQueue *queue,
+				 LowDownloadItem *item)
+{
+	GList *ranges = NULL;
+	GList *cur;
+
+	if (item->fd < 0 || item->size <= 0) {
+		return;
+	}
+
+	for (cur = item->ranges; cur != NULL; cur = cur->next) {
+		LowDownloadRange *range = cur->data;
+
+		ranges = g_list_prepend (ranges,
+					 low_download_range_new (range->start,
+								 range->end));
+	}
+
+	for (cur = queue->active; cur != NULL; cur = cur->next) {
+		LowDownloadTransfer *transfer = cur->data;
+
+		/* Don't count a range twice while it's being raced for */
+		if (transfer->item == item && !transfer->cancelled &&
+		    !(transfer->hedge && transfer->twin != NULL)) {
+			ranges = g_list_prepend (ranges,
+						 low_download_range_new
+						 (transfer->offset,
+						  transfer->range.end));
+		}
+	}
+
+	low_download_part_save (item->part_file, item->size, item->digest,
+				item->digest_type, ranges);
+	low_download_ranges_free (ranges);
+}
+
+/*
+ * Get item's part file ready to be written to, carrying on from an
+ * earlier run if it left one behind. Segments arrive out of order, so
+ * there's no hashing as we go for them; the space for the whole file is
+ * set aside up front instead.
+ */
+static bool
+low_download_item_open (LowDownloadQueue *queue, LowDownloadItem *item)
+{
+	GList *ranges;
+	GList *cur;
+
+	if (item->size > 0 &&
+	    low_download_part_load (item->part_file, item->size,
+				    item->digest, item->digest_type,
+				    &ranges)) {
+		item->fd = open (item->part_file, O_WRONLY);
+		if (item->fd >= 0) {
+			queue->inflight += item->size;
+			low_download_ranges_free (item->ranges);
+			item->ranges = ranges;
+
+			item->received = item->size;
+			for (cur = ranges; cur != NULL; cur = cur->next) {
+				LowDownloadRange *range = cur->data;
+
+				item->received -= range->end - range->start + 1;
+			}
+			queue->dldone += item->received;
+
+			low_debug ("Resuming %s with %lld bytes already here",
+				   item->file, (long long) item->received);
+			return true;
+		}
+
+		low_download_ranges_free (ranges);
+	}
+
+	item->fd = open (item->part_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (item->fd < 0) {
+		fprintf (stderr, "failed to open %s for writing\n",
+			 item->part_file);
+		return false;
+	}
+
+	queue->inflight += item->size;
+
+	if (item->ranges != NULL && item->ranges->next != NULL) {
+		if (posix_fallocate (item->fd, 0, item->size) != 0) {
+			low_debug ("unable to preallocate %s", item->file);
+		}
+	} else {
+		item->hash = low_download_hash_new (item->digest_type);
+	}
+
+	low_download_item_save_progress (queue, item);
+
+	return true;
+}
+
+/*
+ * Check over a file that nobody is working on anymore, and let whoever
+ * queued it know how it went. A file that we ran out of mirrors for is
+ * left as a part, to be finished off next time.
+ */
+static bool
+low_download_queue_finish (LowDownloadQueue *queue, LowDownloadItem *item)
+{
+	bool successful = !item->failed;
+
+	if (item->fd >= 0) {
+		queue->inflight -= item->size;
+	}
+
+	if (item->fd >= 0 && item->failed) {
+		low_download_item_save_progress (queue, item);
+		close (item->fd);
+		item->fd = -1;
+	} else if (item->fd >= 0) {
+		close (item->fd);
+		item->fd = -1;
+
+		successful = low_download_part_complete (item->part_file,
+							 item->file,
+							 item->digest,
+							 item->digest_type,
+							 item->hash);
+	}
+
+	queue->files_done++;
+	if (item->size > item->received) {
+		queue->dldone += item->size - item->received;
+	}
+
+	if (item->done != NULL) {
+		item->done (item->data, successful);
+	}
+
+	low_download_item_free (item);
+
+	return successful;
+}
+
+static size_t
+low_download_transfer_write (void *ptr, size_t size, size_t nmemb,
+			     void *data)
+{
+	LowDownloadTransfer *transfer = data;
+	LowDownloadItem *item = transfer->item;
+	size_t len = size * nmemb;
+	size_t written = 0;
+
+	if (transfer->cancelled) {
+		return 0;
+	}
+
+	if (!transfer->receiving) {
+		double ttfb = now () - transfer->started;
+
+		if (!low_download_response_is_wanted (transfer->curl,
+						      transfer->url,
+						      transfer->ranged)) {
+			low_debug ("unexpected response for %s from %s",
+				   item->basename, transfer->mirror->url);
+			return 0;
+		}
+
+		transfer->receiving = true;
+		g_array_append_val (transfer->queue->ttfbs, ttfb);
+
+		/* We won; the other one can't be removed from in here */
+		if (transfer->twin != NULL) {
+			low_debug ("%s beat %s for %s", transfer->mirror->url,
+				   transfer->twin->mirror->url,
+				   item->basename);
+			transfer->twin->cancelled = true;
+			transfer->twin->twin = NULL;
+			transfer->twin = NULL;
+		}
+	}
+
+	if (transfer->range.end >= 0 &&
+	    transfer->offset + (off_t) len > transfer->range.end + 1) {
+		low_debug ("too much data for %s from %s", item->basename,
+			   transfer->mirror->url);
+		return 0;
+	}
+
+	while (written < len) {
+		ssize_t res = pwrite (item->fd, (char *) ptr + written,
+				      len - written,
+				      transfer->offset + written);
+		if (res < 0) {
+			return 0;
+		}
+		written += res;
+	}
+
+	if (item->hash != NULL) {
+		HASH_Update (item->hash, ptr, len);
+	}
+
+	transfer->offset += len;
+	item->received += len;
+	transfer->queue->dldone += len;
+	transfer->queue->fetched += len;
+
+	return len;
+}
+
+/*
+ * Start fetching range of item from mirror. Returns NULL if we couldn't
+ * even get going.
+ */
+static LowDownloadTransfer *
+low_download_transfer_start (LowDownloadQueue *queue, LowDownloadItem *item,
+			     LowDownloadRange *range, LowMirror *mirror)
+{
+	LowDownloadTransfer *transfer = malloc (sizeof (LowDownloadTransfer));
+
+	transfer->queue = queue;
+	transfer->item = item;
+	transfer->range = *range;
+	transfer->offset = range->start;
+	transfer->mirror = mirror;
+	transfer->url = create_file_url (mirror->url, item->relative_path);
+	transfer->error[0] = '\0';
+	transfer->started = now ();
+	transfer->receiving = false;
+	transfer->twin = NULL;
+	transfer->hedge = false;
+	transfer->cancelled = false;
+
+	transfer->curl = low_download_session_get_handle (queue->session,
+							  transfer->url);
+	if (transfer->curl == NULL) {
+		free (transfer->url);
+		free (transfer);
+		return NULL;
+	}
+
+	mirror->connections++;
+	item->transfers++;
+
+	curl_easy_setopt (transfer->curl, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt (transfer->curl, CURLOPT_ERRORBUFFER,
+			  transfer->error);
+	curl_easy_setopt (transfer->curl, CURLOPT_PRIVATE, transfer);
+	curl_easy_setopt (transfer->curl, CURLOPT_WRITEFUNCTION,
+			  low_download_transfer_write);
+	curl_easy_setopt (transfer->curl, CURLOPT_WRITEDATA, transfer);
+	curl_easy_setopt (transfer->curl, CURLOPT_URL, transfer->url);
+
+	transfer->ranged = range->start > 0 ||
+		(range->end >= 0 && range->end < item->size - 1);
+
+	if (transfer->ranged) {
+		char byte_range[64];
+
+		/* Without a known end, ask for everything from start on */
+		if (range->end < 0) {
+			snprintf (byte_range, sizeof (byte_range), "%lld-",
+				  (long long) range->start);
+		} else {
+			snprintf (byte_range, sizeof (byte_range), "%lld-%lld",
+				  (long long) range->start,
+				  (long long) range->end);
+		}
+		curl_easy_setopt (transfer->curl, CURLOPT_RANGE, byte_range);
+
+		low_debug ("Fetching %s (bytes %s)", transfer->url,
+			   byte_range);
+	} else {
+		low_debug ("Fetching %s", transfer->url);
+	}
+
+	curl_multi_add_handle (queue->session->multi, transfer->curl);
+	queue->active = g_list_prepend (queue->active, transfer);
+
+	return transfer;
+}
+
+/*
+ * Start as many pending ranges as the connection limits allow. Files
+ * that are already here, or have no good mirrors left, are finished off
+ * straight away.
+ */
+static unsigned int
+low_download_queue_start_pending (LowDownloadQueue *queue)
+{
+	GList *cur = queue->pending;
+	unsigned int failed = 0;
+
+	while (cur != NULL &&
+	       g_list_length (queue->active) < queue->max_connections) {
+		LowDownloadItem *item = cur->data;
+		GList *next = cur->next;
+		LowDownloadRange *range;
+		LowMirror *mirror;
+
+		/*
+		 * Checking the cache reads the whole file through, so only
+		 * do it once, not each time we pass over a held off item.
+		 */
+		if (!item->checked) {
+			item->checked = true;
+			if (!low_download_is_missing (item->file,
+						      item->digest,
+						      item->digest_type,
+						      item->size)) {
+				queue->pending =
+					g_list_delete_link (queue->pending,
+							    cur);
+				low_download_queue_finish (queue, item);
+				cur = next;
+				continue;
+			}
+		}
+
+		if (item->fd < 0 && item->received == 0) {
+			/* Hold off until there's room for it */
+			if (queue->max_inflight > 0 && queue->inflight > 0 &&
+			    queue->inflight + item->size >
+			    queue->max_inflight) {
+				cur = next;
+				continue;
+			}
+
+			if (!low_download_item_open (queue, item)) {
+				item->failed = true;
+			} else if (item->ranges == NULL) {
+				/* An earlier run got all of it */
+				queue->pending =
+					g_list_delete_link (queue->pending,
+							    cur);
+				if (!low_download_queue_finish (queue, item)) {
+					failed++;
+				}
+				cur = next;
+				continue;
+			}
+		}
+
+		if (!item->failed &&
+		    low_mirror_list_lookup_random_mirror (item->mirrors) ==
+		    NULL) {
+			item->failed = true;
+		}
+
+		/* Once its last transfer is done, it'll be finished off */
+		if (item->failed) {
+			queue->pending = g_list_delete_link (queue->pending,
+							     cur);
+			if (item->transfers == 0 &&
+			    !low_download_queue_finish (queue, item)) {
+				failed++;
+			}
+			cur = next;
+			continue;
+		}
+
+		/* Every good mirror for this one is busy. Try the next. */
+		mirror = low_mirror_list_lookup_available_mirror
+			(item->mirrors, queue->max_mirror_connections, NULL);
+		if (mirror == NULL) {
+			cur = next;
+			continue;
+		}
+
+		range = item->ranges->data;
+		item->ranges = g_list_delete_link (item->ranges, item->ranges);
+
+		if (low_download_transfer_start (queue, item, range,
+						 mirror) != NULL) {
+			free (range);
+		} else {
+			item->ranges = g_list_prepend (item->ranges, range);
+			item->failed = true;
+		}
+
+		/* Stick with it while it has ranges to hand out */
+		if (item->ranges == NULL) {
+			queue->pending = g_list_delete_link (queue->pending,
+							     cur);
+			if (item->failed && item->transfers == 0 &&
+			    !low_download_queue_finish (queue, item)) {
+				failed++;
+			}
+			cur = next;
+		}
+	}
+
+	return failed;
+}
+
+/*
+ * Deal with a finished transfer. If the mirror let us down, it's marked
+ * as bad, and whatever of the range we didn't get goes back on the queue
+ * for another mirror. Once nothing more is running or pending for the
+ * file, it's checked against its digest. Returns false if the file
+ * failed for good.
+ */
+static bool
+low_download_queue_complete (LowDownloadQueue *queue,
+			     LowDownloadTransfer *transfer, CURLcode res)
+{
+	LowDownloadItem *item = transfer->item;
+	long response = 0;
+	bool ok;
+
+	curl_multi_remove_handle (queue->session->multi, transfer->curl);
+	queue->active = g_list_remove (queue->active, transfer);
+	transfer->mirror->connections--;
+	item->transfers--;
+
+	/* Its twin got there first, and has the range covered */
+	if (transfer->cancelled) {
+		low_download_session_release_handle (queue->session,
+						     transfer->url,
+						     transfer->curl);
+		free (transfer->url);
+		free (transfer);
+
+		goto out;
+	}
+
+	if (res == CURLE_OK) {
+		res = curl_easy_getinfo (transfer->curl,
+					 CURLINFO_RESPONSE_CODE, &response);
+	}
+
+	ok = res == CURLE_OK &&
+		(response == 200 || response == 206 ||
+		 (response == 226 && strncmp ("ftp", transfer->url, 3) == 0));
+
+	if (ok && transfer->range.end >= 0 &&
+	    transfer->offset <= transfer->range.end) {
+		sprintf (transfer->error, "short transfer");
+		ok = false;
+	}
+
+	if (ok) {
+		record_transfer (item->mirrors, transfer->mirror->url,
+				 transfer->curl);
+	}
+
+	if (ok && transfer->twin != NULL) {
+		transfer->twin->cancelled = true;
+		transfer->twin->twin = NULL;
+	}
+	low_download_session_release_handle (queue->session, transfer->url,
+					     transfer->curl);
+
+	if (!ok) {
+		if (res != CURLE_OK || response == 0 ||
+		    response == 200 || response == 206) {
+			low_debug ("curl error: %s for url %s. marking as bad",
+				   transfer->error, transfer->mirror->url);
+		} else {
+			low_debug ("error: %ld for url %s. marking as bad",
+				   response, transfer->mirror->url);
+		}
+
+		low_mirror_list_mark_as_bad (item->mirrors,
+					     transfer->mirror->url);
+
+		if (transfer->twin != NULL) {
+			/* The twin still has the range covered */
+			transfer->twin->twin = NULL;
+		} else {
+			/*
+			 * Keep what we got, and ask someone else for the
+			 * rest
+			 */
+			if (!item->failed && item->ranges == NULL) {
+				queue->pending =
+					g_list_prepend (queue->pending, item);
+			}
+			item->ranges =
+				g_list_prepend (item->ranges,
+						low_download_range_new
+						(transfer->offset,
+						 transfer->range.end));
+		}
+	}
+
+	free (transfer->url);
+	free (transfer);
+
+out:
+	if (item->transfers > 0 || (!item->failed && item->ranges != NULL)) {
+		low_download_item_save_progress (queue, item);
+		return true;
+	}
+
+	return low_download_queue_finish (queue, item);
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+low_download_queue_ttfb_percentile (LowDownloadQueue *queue,
+				    unsigned int percentile)
+{
+	double *sorted = malloc (sizeof (double) * queue->ttfbs->len);
+	double value;
+
+	memcpy (sorted, queue->ttfbs->data,
+		sizeof (double) * queue->ttfbs->len);
+	qsort (sorted, queue->ttfbs->len, sizeof (double), compare_doubles);
+
+	value = sorted[(queue->ttfbs->len - 1) * percentile / 100];
+	free (sorted);
+
+	return value;
+}
+
+/*
+ * Race a second mirror against any transfer that's taking longer than
+ * most to send anything. Whichever sends data first carries on, and the
+ * other is cancelled.
+ */
+static void
+low_download_queue_hedge (LowDownloadQueue *queue)
+{
+	double threshold;
+	double when;
+	GList *cur;
+
+	if (!queue->hedged || queue->ttfbs->len < HEDGE_MIN_SAMPLES) {
+		return;
+	}
+
+	threshold = low_download_queue_ttfb_percentile (queue,
+							HEDGE_PERCENTILE);
+	when = now ();
+
+	for (cur = queue->active;
+	     cur != NULL &&
+	     g_list_length (queue->active) < queue->max_connections;
+	     cur = cur->next) {
+		LowDownloadTransfer *transfer = cur->data;
+		LowDownloadTransfer *twin;
+		LowDownloadRange range;
+		LowMirror *mirror;
+
+		if (transfer->receiving || transfer->cancelled ||
+		    transfer->twin != NULL ||
+		    when - transfer->started < threshold) {
+			continue;
+		}
+
+		mirror = low_mirror_list_lookup_available_mirror
+			(transfer->item->mirrors,
+			 queue->max_mirror_connections, transfer->mirror);
+		if (mirror == NULL) {
+			continue;
+		}
+
+		range.start = transfer->offset;
+		range.end = transfer->range.end;
+
+		twin = low_download_transfer_start (queue, transfer->item,
+						    &range, mirror);
+		if (twin == NULL) {
+			continue;
+		}
+
+		low_debug ("%s is slow to start; racing %s against it",
+			   transfer->mirror->url, mirror->url);
+
+		twin->hedge = true;
+		twin->twin = transfer;
+		transfer->twin = twin;
+	}
+}
+
+/*
+ * Clear out transfers that lost a race. They can't be removed from inside
+ * the write callback where they find out.
+ */
+static unsigned int
+low_download_queue_reap (LowDownloadQueue *queue)
+{
+	unsigned int failed = 0;
+	GList *cur = queue->active;
+
+	while (cur != NULL) {
+		LowDownloadTransfer *transfer = cur->data;
+
+		cur = cur->next;
+		if (transfer->cancelled &&
+		    !low_download_queue_complete (queue, transfer,
+						  CURLE_OK)) {
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+static void
+low_download_queue_report (LowDownloadQueue *queue,
+			   LowDownloadQueueCallback callback)
+{
+	if (callback == NULL) {
+		return;
+	}
+
+	callback (queue->files_done, queue->files_total, queue->dldone,
+		  queue->dltotal);
+}
+
+/**
+ * Download everything in the queue, up to the queue's connection limits
+ * at a time. callback is given the progress of the queue as a whole.
+ *
+ * Returns the number of files that couldn't be downloaded.
+ */
+int
+low_download_queue_run (LowDownloadQueue *queue,
+			LowDownloadQueueCallback callback)
+{
+	CURLM *multi = queue->session->multi;
+	time_t last_saved = time (NULL);
+	double started = now ();
+	int failed = 0;
+
+	failed += low_download_queue_start_pending (queue);
+
+	while (queue->active != NULL) {
+		CURLMsg *msg;
+		int running;
+		int msgs_left;
+
+		curl_multi_perform (multi, &running);
+
+		while ((msg = curl_multi_info_read (multi, &msgs_left))) {
+			LowDownloadTransfer *transfer;
+
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE,
+					   (char **) &transfer);
+			if (!low_download_queue_complete (queue, transfer,
+							  msg->data.result)) {
+				failed++;
+			}
+		}
+
+		failed += low_download_queue_reap (queue);
+
+		if (queue->poll != NULL) {
+			queue->poll (queue, queue->poll_data);
+		}
+
+		failed += low_download_queue_start_pending (queue);
+		low_download_queue_hedge (queue);
+		low_download_queue_report (queue, callback);
+
+		/* So an interrupted run doesn't lose much */
+		if (time (NULL) - last_saved >= SAVE_PROGRESS_INTERVAL) {
+			GList *cur;
+
+			for (cur = queue->active; cur != NULL; cur = cur->next) {
+				LowDownloadTransfer *transfer = cur->data;
+
+				low_download_item_save_progress
+					(queue, transfer->item);
+			}
+			last_saved = time (NULL);
+		}
+
+		if (queue->active != NULL) {
+			curl_multi_wait (multi, NULL, 0, 1000, NULL);
+		}
+	}
+
+	queue->elapsed += now () - started;
+
+	return failed;
 }
 
 /* vim: set ts=8 sw=8 noet: */
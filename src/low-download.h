@@ -20,33 +20,126 @@
  *  02110-1301  USA
  */
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <curl/curl.h>
 
+#include "low-chunks.h"
 #include "low-mirror-list.h"
 #include "low-util.h"
 
 #ifndef _LOW_DOWNLOAD_H_
 #define _LOW_DOWNLOAD_H_
 
+/**
+ * What a server told us about our copy of a file (its ETag and
+ * Last-Modified headers), so we can ask for it again only if it's
+ * changed.
+ */
+typedef struct _LowDownloadValidators {
+	char *etag;
+	char *last_modified;
+} LowDownloadValidators;
+
+LowDownloadValidators * low_download_validators_load (const char *file);
+bool     low_download_validators_save (LowDownloadValidators *validators,
+				       const char *file);
+void     low_download_validators_free (LowDownloadValidators *validators);
+
 typedef int (*LowDownloadCallback) (void *clientp, double dltotal,
 				    double dlnow, double ultotal,
 				    double ulnow);
 
-int      low_download 		     (const char *url,
+/**
+ * Shared state for a run of downloads: idle curl handles per host (and
+ * the keep-alive connections they hold), plus the DNS and TLS session
+ * caches.
+ */
+typedef struct _LowDownloadSession {
+	CURLSH *share;
+	CURLM *multi;
+	GHashTable *handles;	/**< Idle handles, keyed by scheme://host */
+	pthread_mutex_t handles_lock;
+	pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+	long low_speed_limit;	/**< Bytes per second; 0 for no limit */
+	long low_speed_time;
+} LowDownloadSession;
+
+LowDownloadSession * low_download_session_new (void);
+void     low_download_session_free   (LowDownloadSession *session);
+void     low_download_session_set_low_speed (LowDownloadSession *session,
+					     long limit, long seconds);
+
+CURL *   low_download_session_get_handle     (LowDownloadSession *session,
+					      const char *url);
+void     low_download_session_release_handle (LowDownloadSession *session,
+					      const char *url, CURL *curl);
+
+int      low_download 		     (LowDownloadSession *session,
+				      const char *url,
+				      const char *file,
+				      const char *basename,
+				      LowDownloadCallback callback);
+
+int      low_download_from_mirror    (LowDownloadSession *session,
+				      LowMirrorList *mirrors,
+				      const char *relative_path,
+				      const char *file,
+				      const char *basename,
+				      LowDownloadCallback callback);
+
+int      low_download_if_modified    (LowDownloadSession *session,
+				      const char *url,
 				      const char *file,
 				      const char *basename,
+				      LowDownloadValidators *validators,
+				      bool *modified,
 				      LowDownloadCallback callback);
 
-int      low_download_from_mirror    (LowMirrorList *mirrors,
+int      low_download_from_mirror_if_modified (LowDownloadSession *session,
+					       LowMirrorList *mirrors,
+					       const char *relative_path,
+					       const char *file,
+					       const char *basename,
+					       LowDownloadValidators *validators,
+					       bool *modified,
+					       LowDownloadCallback callback);
+
+int      low_download_range          (LowDownloadSession *session,
+				      LowMirrorList *mirrors,
+				      const char *relative_path,
+				      off_t start, off_t end, char *buf,
+				      const char *basename);
+
+int      low_download_uncompressed   (LowDownloadSession *session,
+				      LowMirrorList *mirrors,
 				      const char *relative_path,
 				      const char *file,
 				      const char *basename,
+				      const char *digest,
+				      LowDigestType digest_type,
 				      LowDownloadCallback callback);
 
+int      low_download_chunked        (LowDownloadSession *session,
+				      LowMirrorList *mirrors,
+				      const char *relative_path,
+				      const char *file,
+				      const char *basename,
+				      LowChunkIndex *new_index,
+				      const char *old_file,
+				      LowChunkIndex *old_index);
+
 bool low_download_is_missing (const char *file, const char *digest,
 			      LowDigestType digest_type, off_t size);
 
-int      low_download_if_missing     (LowMirrorList *mirrors,
+bool low_download_record_verified (const char *file, const char *checksum,
+				   const char *open_checksum);
+bool low_download_is_verified     (const char *file, const char *checksum,
+				   const char *open_checksum);
+
+int      low_download_if_missing     (LowDownloadSession *session,
+				      LowMirrorList *mirrors,
 				      const char *relative_path,
 				      const char *file,
 				      const char *basename,
@@ -55,6 +148,80 @@ int      low_download_if_missing     (LowMirrorList *mirrors,
 				      off_t size,
 				      LowDownloadCallback callback);
 
+#define LOW_DOWNLOAD_DEFAULT_MAX_CONNECTIONS 5
+#define LOW_DOWNLOAD_DEFAULT_MAX_MIRROR_CONNECTIONS 3
+
+#define LOW_DOWNLOAD_DEFAULT_MAX_SEGMENTS 4
+
+/* The same as yum: give up on anything under 1000 bytes/sec for 30 secs */
+#define LOW_DOWNLOAD_DEFAULT_LOW_SPEED_LIMIT 1000
+#define LOW_DOWNLOAD_DEFAULT_LOW_SPEED_TIME 30
+
+typedef struct _LowDownloadQueue LowDownloadQueue;
+
+typedef void (*LowDownloadDoneFunc) (void *data, bool successful);
+typedef void (*LowDownloadQueuePollFunc) (LowDownloadQueue *queue,
+					  void *data);
+typedef void (*LowDownloadQueueCallback) (unsigned int files_done,
+					  unsigned int files_total,
+					  double dlnow, double dltotal);
+
+/**
+ * A set of files to fetch at the same time, with limits on connections
+ * in total and to any single mirror.
+ */
+struct _LowDownloadQueue {
+	LowDownloadSession *session;
+	unsigned int max_connections;
+	unsigned int max_mirror_connections;
+	off_t segment_min_size;	/**< Segment files this big; 0 for never */
+	unsigned int max_segments;
+	bool hedged;
+	GArray *ttfbs;		/**< Times to first byte seen this run */
+	off_t max_inflight;	/**< Bytes of files started at once; 0 for any */
+	off_t inflight;
+	GList *pending;		/**< Largest first */
+	GList *active;
+	unsigned int files_total;
+	unsigned int files_done;
+	double dltotal;
+	double dldone;		/**< Bytes fetched, or found already here */
+	double fetched;		/**< Bytes that came over the network */
+	double elapsed;		/**< Seconds spent running */
+	LowDownloadQueuePollFunc poll;
+	void *poll_data;
+};
+
+LowDownloadQueue * low_download_queue_new   (LowDownloadSession *session,
+					     unsigned int max_connections,
+					     unsigned int max_mirror_connections);
+void     low_download_queue_free     (LowDownloadQueue *queue);
+
+void     low_download_queue_set_segmented (LowDownloadQueue *queue,
+					   off_t min_size,
+					   unsigned int max_segments);
+void     low_download_queue_set_hedged (LowDownloadQueue *queue,
+					bool hedged);
+void     low_download_queue_set_max_inflight (LowDownloadQueue *queue,
+					      off_t max_inflight);
+void     low_download_queue_set_poll (LowDownloadQueue *queue,
+				      LowDownloadQueuePollFunc poll,
+				      void *data);
+
+void     low_download_queue_add      (LowDownloadQueue *queue,
+				      LowMirrorList *mirrors,
+				      const char *relative_path,
+				      const char *file,
+				      const char *basename,
+				      const char *digest,
+				      LowDigestType digest_type,
+				      off_t size,
+				      LowDownloadDoneFunc done,
+				      void *data);
+
+int      low_download_queue_run      (LowDownloadQueue *queue,
+				      LowDownloadQueueCallback callback);
+
 #endif /* _LOW_DOWNLOAD_H_ */
 
 /* vim: set ts=8 sw=8 noet: */
@@ -81,6 +81,12 @@ low_metalink_end_element (void *data, const char *name G_GNUC_UNUSED)
 		mirror->url = strndup (ctx->buf, ctx->str_len - 19);
 		mirror->weight = ctx->weight;
 		mirror->is_bad = false;
+		mirror->connections = 0;
+		mirror->has_stats = false;
+		mirror->throughput = 0;
+		mirror->ttfb = 0;
+		mirror->failures = 0;
+		mirror->updated = 0;
 		ctx->mirrors = g_list_append (ctx->mirrors, mirror);
 
 		ctx->str_len = 0;
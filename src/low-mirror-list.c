@@ -22,14 +22,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "low-debug.h"
 #include "low-mirror-list.h"
 #include "low-metalink-parser.h"
 
+/* How quickly old measurements give way to new ones */
+#define STATS_NEW_SAMPLE_WEIGHT 0.3
+
+/* Failures count half as much after this long */
+#define STATS_FAILURE_HALF_LIFE (60 * 60 * 24 * 7)
+
+/* Stats older than this are too stale to trust */
+#define STATS_MAX_AGE (60 * 60 * 24 * 30)
+
+/* The size of file we score mirrors by; about a typical package */
+#define STATS_TYPICAL_FILE_SIZE (512.0 * 1024)
+
 LowMirrorList *
 low_mirror_list_new (void)
 {
 	LowMirrorList *mirrors = malloc (sizeof (LowMirrorList));
 	mirrors->mirrors = NULL;
+	mirrors->stats_file = NULL;
+	mirrors->stats_dirty = false;
+	pthread_mutex_init (&mirrors->lock, NULL);
 
 	return mirrors;
 }
@@ -49,6 +66,8 @@ low_mirror_list_free (LowMirrorList *mirrors)
 	g_list_foreach (mirrors->mirrors, free_g_list_node, NULL);
 	g_list_free (mirrors->mirrors);
 
+	free (mirrors->stats_file);
+	pthread_mutex_destroy (&mirrors->lock);
 	free (mirrors);
 }
 
@@ -61,6 +80,12 @@ low_mirror_list_new_from_baseurl (const char *baseurl)
 	mirror->url = strdup (baseurl);
 	mirror->weight = 100;
 	mirror->is_bad = false;
+	mirror->connections = 0;
+	mirror->has_stats = false;
+	mirror->throughput = 0;
+	mirror->ttfb = 0;
+	mirror->failures = 0;
+	mirror->updated = 0;
 	mirrors->mirrors = g_list_append (mirrors->mirrors, mirror);
 
 	return mirrors;
@@ -101,6 +126,12 @@ low_mirror_list_new_from_txt_file (const char *mirrorlist_txt)
 			/* txt mirrors are unweighted */
 			mirror->weight = 100;
 			mirror->is_bad = false;
+			mirror->connections = 0;
+			mirror->has_stats = false;
+			mirror->throughput = 0;
+			mirror->ttfb = 0;
+			mirror->failures = 0;
+			mirror->updated = 0;
 			mirrors->mirrors =
 				g_list_append (mirrors->mirrors, mirror);
 		}
@@ -122,69 +153,116 @@ low_mirror_list_new_from_metalink (const char *mirrorlist_txt)
 	return mirrors;
 }
 
-/* Generate a random integer between 0 and upper bound, including 0 */
-static int
-random_int (int upper)
+static bool
+is_available (LowMirror *mirror, unsigned int max_connections,
+	      LowMirror *exclude)
 {
-	/* Not the most random thing in the world but do we care? */
-	unsigned int iseed;
+	return !mirror->is_bad && mirror != exclude &&
+		(max_connections == 0 ||
+		 mirror->connections < max_connections);
+}
 
-	if (upper == 1) {
-		return 0;
+/*
+ * Roughly how long mirror should take to serve us a typical file. Mirrors
+ * we've never measured are assumed to be as good as unknown_time.
+ */
+static double
+expected_time (LowMirror *mirror, double unknown_time)
+{
+	if (!mirror->has_stats || mirror->throughput <= 0) {
+		return unknown_time;
 	}
 
-	iseed = (unsigned int) time (NULL);
-	srand (iseed);
+	return mirror->ttfb + STATS_TYPICAL_FILE_SIZE / mirror->throughput;
+}
 
-	return rand () % upper;
+/*
+ * Higher is better. The mirror's own weight counts for as much as its
+ * speed, and every recent failure halves its chances again.
+ */
+static double
+mirror_score (LowMirror *mirror, double unknown_time)
+{
+	return mirror->weight /
+		(expected_time (mirror, unknown_time) * (1 + mirror->failures));
 }
 
-const char *
-low_mirror_list_lookup_random_mirror (LowMirrorList *mirrors)
+/*
+ * Pick the best scoring good mirror other than exclude, ignoring any that
+ * already have max_connections downloads running (0 for no limit). Ties,
+ * like mirrors we know nothing about, are broken at random.
+ */
+static LowMirror *
+lookup_random_mirror (LowMirrorList *mirrors, unsigned int max_connections,
+		      LowMirror *exclude)
 {
-	int weight = 0;
-	int number_at_current_weight = 0;
-	int count = 0;
+	double known_time = 0;
+	int known = 0;
+	double unknown_time;
+	double best_score = 0;
+	int number_at_best_score = 0;
 	int choice;
-	LowMirror *mirror = NULL;
+	LowMirror *mirror;
 	GList *cur;
 
+	/* Unmeasured mirrors are given the average time, so they get tried */
 	for (cur = mirrors->mirrors; cur != NULL; cur = cur->next) {
 		mirror = (LowMirror *) cur->data;
 
-		if (mirror->is_bad) {
+		if (mirror->has_stats && mirror->throughput > 0) {
+			known_time += expected_time (mirror, 0);
+			known++;
+		}
+	}
+	unknown_time = known > 0 ? known_time / known : 1;
+
+	for (cur = mirrors->mirrors; cur != NULL; cur = cur->next) {
+		double score;
+
+		mirror = (LowMirror *) cur->data;
+		if (!is_available (mirror, max_connections, exclude)) {
 			continue;
 		}
 
-		if (mirror->weight > weight) {
-			weight = mirror->weight;
-			number_at_current_weight = 1;
-		} else if (mirror->weight == weight) {
-			number_at_current_weight++;
+		score = mirror_score (mirror, unknown_time);
+		if (number_at_best_score == 0 || score > best_score) {
+			best_score = score;
+			number_at_best_score = 1;
+		} else if (score == best_score) {
+			number_at_best_score++;
 		}
 	}
 
-	if (number_at_current_weight == 0) {
+	if (number_at_best_score == 0) {
 		return NULL;
 	}
 
-	choice = random_int (number_at_current_weight);
+	choice = g_random_int_range (0, number_at_best_score);
 	for (cur = mirrors->mirrors; cur != NULL; cur = cur->next) {
 		mirror = (LowMirror *) cur->data;
 
-		if (mirror->is_bad) {
+		if (!is_available (mirror, max_connections, exclude) ||
+		    mirror_score (mirror, unknown_time) != best_score) {
 			continue;
 		}
 
-		if (mirror->weight == weight) {
-			if (count == choice) {
-				break;
-			} else {
-				count++;
-			}
+		if (choice-- == 0) {
+			return mirror;
 		}
 	}
 
+	return NULL;
+}
+
+const char *
+low_mirror_list_lookup_random_mirror (LowMirrorList *mirrors)
+{
+	LowMirror *mirror;
+
+	pthread_mutex_lock (&mirrors->lock);
+	mirror = lookup_random_mirror (mirrors, 0, NULL);
+	pthread_mutex_unlock (&mirrors->lock);
+
 	if (mirror == NULL) {
 		return NULL;
 	}
@@ -192,19 +270,208 @@ low_mirror_list_lookup_random_mirror (LowMirrorList *mirrors)
 	return mirror->url;
 }
 
+/**
+ * Like low_mirror_list_lookup_random_mirror, but skip exclude (if given)
+ * and mirrors that are already serving max_connections downloads. Returns
+ * NULL if there's nothing left.
+ */
+LowMirror *
+low_mirror_list_lookup_available_mirror (LowMirrorList *mirrors,
+					 unsigned int max_connections,
+					 LowMirror *exclude)
+{
+	LowMirror *mirror;
+
+	pthread_mutex_lock (&mirrors->lock);
+	mirror = lookup_random_mirror (mirrors, max_connections, exclude);
+	pthread_mutex_unlock (&mirrors->lock);
+
+	return mirror;
+}
+
+static LowMirror *
+lookup_mirror (LowMirrorList *mirrors, const char *url)
+{
+	GList *cur;
+
+	for (cur = mirrors->mirrors; cur != NULL; cur = cur->next) {
+		LowMirror *mirror = (LowMirror *) cur->data;
+
+		if (!strcmp (mirror->url, url)) {
+			return mirror;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Stop using the mirror at url for the rest of this run, and remember the
+ * failure for the next few.
+ */
 void
 low_mirror_list_mark_as_bad (LowMirrorList *mirrors, const char *url)
 {
+	LowMirror *mirror = lookup_mirror (mirrors, url);
+
+	if (mirror == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock (&mirrors->lock);
+	mirror->is_bad = true;
+	mirror->failures += 1;
+	mirror->updated = time (NULL);
+	mirrors->stats_dirty = true;
+	pthread_mutex_unlock (&mirrors->lock);
+}
+
+/**
+ * Record a good transfer of bytes from the mirror at url, which took
+ * seconds in all and ttfb seconds to get started.
+ */
+void
+low_mirror_list_record_transfer (LowMirrorList *mirrors, const char *url,
+				 double bytes, double seconds, double ttfb)
+{
+	LowMirror *mirror = lookup_mirror (mirrors, url);
+	double throughput;
+
+	/* Too small to say anything about how fast the mirror is */
+	if (mirror == NULL || seconds <= ttfb || bytes <= 0) {
+		return;
+	}
+
+	throughput = bytes / (seconds - ttfb);
+
+	pthread_mutex_lock (&mirrors->lock);
+	if (mirror->has_stats) {
+		mirror->throughput +=
+			STATS_NEW_SAMPLE_WEIGHT * (throughput -
+						   mirror->throughput);
+		mirror->ttfb += STATS_NEW_SAMPLE_WEIGHT * (ttfb - mirror->ttfb);
+	} else {
+		mirror->has_stats = true;
+		mirror->throughput = throughput;
+		mirror->ttfb = ttfb;
+	}
+
+	/* It's working again; forgive it a little */
+	mirror->failures /= 2;
+	mirror->updated = time (NULL);
+	mirrors->stats_dirty = true;
+	pthread_mutex_unlock (&mirrors->lock);
+}
+
+/**
+ * Read back stats saved by an earlier run from stats_file, and save to it
+ * from now on. Failures fade with age, and anything too old is ignored.
+ */
+void
+low_mirror_list_load_stats (LowMirrorList *mirrors, const char *stats_file)
+{
+	time_t now = time (NULL);
+	char *line = NULL;
+	size_t length = 0;
+	FILE *file;
+
+	free (mirrors->stats_file);
+	mirrors->stats_file = strdup (stats_file);
+
+	file = fopen (stats_file, "r");
+	if (file == NULL) {
+		return;
+	}
+
+	while (getline (&line, &length, file) != -1) {
+		char **fields = g_strsplit (g_strchomp (line), " ", 0);
+		LowMirror *mirror;
+		time_t age;
+
+		if (g_strv_length (fields) != 5 ||
+		    (mirror = lookup_mirror (mirrors, fields[0])) == NULL) {
+			g_strfreev (fields);
+			continue;
+		}
+
+		mirror->updated = strtol (fields[4], NULL, 10);
+		age = now - mirror->updated;
+		if (age < 0 || age > STATS_MAX_AGE) {
+			g_strfreev (fields);
+			continue;
+		}
+
+		mirror->throughput = g_ascii_strtod (fields[1], NULL);
+		mirror->ttfb = g_ascii_strtod (fields[2], NULL);
+		mirror->failures = g_ascii_strtod (fields[3], NULL);
+		mirror->has_stats = mirror->throughput > 0;
+
+		for (; age >= STATS_FAILURE_HALF_LIFE;
+		     age -= STATS_FAILURE_HALF_LIFE) {
+			mirror->failures /= 2;
+		}
+
+		g_strfreev (fields);
+	}
+
+	free (line);
+	fclose (file);
+}
+
+/**
+ * Write out the stats for the next run, if anything changed.
+ */
+bool
+low_mirror_list_save_stats (LowMirrorList *mirrors)
+{
+	char buf[3][G_ASCII_DTOSTR_BUF_SIZE];
+	char *tmp_file;
+	FILE *file;
 	GList *cur;
-	LowMirror *mirror;
+
+	if (mirrors->stats_file == NULL || !mirrors->stats_dirty) {
+		return true;
+	}
+
+	tmp_file = g_strdup_printf ("%s.tmp", mirrors->stats_file);
+	file = fopen (tmp_file, "w");
+	if (file == NULL) {
+		low_debug ("Unable to save mirror stats to %s",
+			   mirrors->stats_file);
+		free (tmp_file);
+		return false;
+	}
 
 	for (cur = mirrors->mirrors; cur != NULL; cur = cur->next) {
-		mirror = (LowMirror *) cur->data;
-		if (!strcmp (mirror->url, url)) {
-			mirror->is_bad = true;
-			break;
+		LowMirror *mirror = (LowMirror *) cur->data;
+
+		if (!mirror->has_stats && mirror->failures == 0) {
+			continue;
 		}
+
+		fprintf (file, "%s %s %s %s %ld\n", mirror->url,
+			 g_ascii_dtostr (buf[0], sizeof (buf[0]),
+					 mirror->has_stats ?
+					 mirror->throughput : 0),
+			 g_ascii_dtostr (buf[1], sizeof (buf[1]),
+					 mirror->has_stats ? mirror->ttfb : 0),
+			 g_ascii_dtostr (buf[2], sizeof (buf[2]),
+					 mirror->failures),
+			 (long) mirror->updated);
+	}
+
+	if (fclose (file) != 0 || rename (tmp_file, mirrors->stats_file) != 0) {
+		low_debug ("Unable to save mirror stats to %s",
+			   mirrors->stats_file);
+		unlink (tmp_file);
+		free (tmp_file);
+		return false;
 	}
+
+	free (tmp_file);
+	mirrors->stats_dirty = false;
+
+	return true;
 }
 
 /* vim: set ts=8 sw=8 noet: */
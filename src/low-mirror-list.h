@@ -19,7 +19,9 @@
  *  02110-1301  USA
  */
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
 #include <glib.h>
 
 #ifndef _LOW_MIRROR_LIST_H_
@@ -29,10 +31,21 @@ typedef struct _LowMirror {
 	char *url;
 	int weight;
 	bool is_bad;
+	unsigned int connections;	/**< Downloads running from it now */
+
+	/* Measured over this and earlier runs; see low_mirror_list_load_stats */
+	bool has_stats;
+	double throughput;		/**< Bytes per second */
+	double ttfb;			/**< Seconds until the first byte */
+	double failures;		/**< Recent failures, decaying over time */
+	time_t updated;
 } LowMirror;
 
 typedef struct _LowMirrorList {
 	GList *mirrors;
+	char *stats_file;	/**< Where stats get saved, if anywhere */
+	bool stats_dirty;
+	pthread_mutex_t lock;	/**< For lookups and updates from threads */
 } LowMirrorList;
 
 LowMirrorList *low_mirror_list_new (void);
@@ -42,8 +55,18 @@ LowMirrorList *low_mirror_list_new_from_metalink (const char *metalink);
 void low_mirror_list_free (LowMirrorList *mirrors);
 
 const char *low_mirror_list_lookup_random_mirror (LowMirrorList *mirrors);
+LowMirror *low_mirror_list_lookup_available_mirror (LowMirrorList *mirrors,
+						    unsigned int max_connections,
+						    LowMirror *exclude);
 void low_mirror_list_mark_as_bad (LowMirrorList *mirrors, const char *url);
 
+void low_mirror_list_record_transfer (LowMirrorList *mirrors, const char *url,
+				      double bytes, double seconds,
+				      double ttfb);
+void low_mirror_list_load_stats (LowMirrorList *mirrors,
+				 const char *stats_file);
+bool low_mirror_list_save_stats (LowMirrorList *mirrors);
+
 #endif /* _LOW_MIRROR_LIST_H_ */
 
 /* vim: set ts=8 sw=8 noet: */
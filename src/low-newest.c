@@ -0,0 +1,181 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "low-debug.h"
+#include "low-newest.h"
+
+/*
+ * On disk, a view is an 8 byte magic string, the repo set signature, the
+ * key count and the stamp of the db the keys are from, followed by the
+ * sorted keys. Like the Bloom filters, the
+ * files only ever live in the local cache, so it's all host byte order.
+ */
+#define NEWEST_MAGIC "LOWNEW02"
+#define NEWEST_MAGIC_SIZE 8
+#define NEWEST_SOURCE_OFFSET (NEWEST_MAGIC_SIZE + 2 * sizeof (uint32_t))
+#define NEWEST_HEADER_SIZE (NEWEST_SOURCE_OFFSET + sizeof (LowFileStamp))
+
+/**
+ * Map a view written by low_newest_write. Returns NULL if the file is
+ * missing or doesn't look like a view.
+ */
+LowNewest *
+low_newest_load (const char *filename)
+{
+	LowNewest *newest;
+	struct stat buf;
+	unsigned char *map;
+	uint32_t signature;
+	uint32_t count;
+	int fd = open (filename, O_RDONLY);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat (fd, &buf) != 0 ||
+	    (size_t) buf.st_size < NEWEST_HEADER_SIZE) {
+		close (fd);
+		return NULL;
+	}
+
+	map = mmap (NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	memcpy (&signature, map + NEWEST_MAGIC_SIZE, sizeof (uint32_t));
+	memcpy (&count, map + NEWEST_MAGIC_SIZE + sizeof (uint32_t),
+		sizeof (uint32_t));
+
+	if (memcmp (map, NEWEST_MAGIC, NEWEST_MAGIC_SIZE) ||
+	    (size_t) buf.st_size !=
+	    NEWEST_HEADER_SIZE + count * sizeof (uint32_t)) {
+		low_debug ("Ignoring malformed view %s", filename);
+		munmap (map, buf.st_size);
+		return NULL;
+	}
+
+	newest = malloc (sizeof (LowNewest));
+	newest->signature = signature;
+	newest->count = count;
+	memcpy (&newest->source, map + NEWEST_SOURCE_OFFSET,
+		sizeof (LowFileStamp));
+	newest->keys = (const uint32_t *) (map + NEWEST_HEADER_SIZE);
+	newest->map = map;
+	newest->map_size = buf.st_size;
+
+	return newest;
+}
+
+void
+low_newest_free (LowNewest *newest)
+{
+	if (newest == NULL) {
+		return;
+	}
+
+	munmap (newest->map, newest->map_size);
+	free (newest);
+}
+
+bool
+low_newest_contains (const LowNewest *newest, uint32_t key)
+{
+	uint32_t low = 0;
+	uint32_t high = newest->count;
+
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (newest->keys[mid] == key) {
+			return true;
+		} else if (newest->keys[mid] < key) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return false;
+}
+
+static int
+low_newest_key_cmp (const void *a, const void *b)
+{
+	uint32_t key_a = *(const uint32_t *) a;
+	uint32_t key_b = *(const uint32_t *) b;
+
+	return (key_a > key_b) - (key_a < key_b);
+}
+
+/**
+ * Sort keys and write them out to filename, replacing it atomically.
+ * source is the stamp of the db they were read from.
+ */
+bool
+low_newest_write (const char *filename, uint32_t set_signature,
+		  const LowFileStamp *source, uint32_t *keys, uint32_t count)
+{
+	char *tmp_file = malloc (strlen (filename) + 5);
+	FILE *file;
+	bool ok;
+
+	qsort (keys, count, sizeof (uint32_t), low_newest_key_cmp);
+
+	sprintf (tmp_file, "%s.tmp", filename);
+
+	file = fopen (tmp_file, "w");
+	if (file == NULL) {
+		free (tmp_file);
+		return false;
+	}
+
+	ok = fwrite (NEWEST_MAGIC, NEWEST_MAGIC_SIZE, 1, file) == 1 &&
+	     fwrite (&set_signature, sizeof (uint32_t), 1, file) == 1 &&
+	     fwrite (&count, sizeof (uint32_t), 1, file) == 1 &&
+	     fwrite (source, sizeof (LowFileStamp), 1, file) == 1 &&
+	     (count == 0 ||
+	      fwrite (keys, sizeof (uint32_t), count, file) == count);
+
+	if (fclose (file) != 0) {
+		ok = false;
+	}
+
+	if (ok) {
+		ok = rename (tmp_file, filename) == 0;
+	} else {
+		unlink (tmp_file);
+	}
+
+	free (tmp_file);
+	return ok;
+}
+
+/* vim: set ts=8 sw=8 noet: */
@@ -0,0 +1,58 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#ifndef _LOW_NEWEST_H_
+#define _LOW_NEWEST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "low-util.h"
+
+/**
+ * The keys of the packages in one repo that are the newest of their name
+ * and arch across a whole repo set. The keys are sorted, so lookups are a
+ * binary search.
+ */
+typedef struct _LowNewest {
+	uint32_t signature;	/**< Identifies the repo set it was built for */
+	uint32_t count;
+	LowFileStamp source;	/**< The db the keys are from */
+	const uint32_t *keys;
+
+	void *map;		/**< The mmapped file */
+	size_t map_size;
+} LowNewest;
+
+LowNewest *	low_newest_load 	(const char *filename);
+void 		low_newest_free 	(LowNewest *newest);
+
+bool 		low_newest_contains 	(const LowNewest *newest,
+					 uint32_t key);
+
+bool 		low_newest_write 	(const char *filename,
+					 uint32_t set_signature,
+					 const LowFileStamp *source,
+					 uint32_t *keys, uint32_t count);
+
+#endif /* _LOW_NEWEST_H_ */
+
+/* vim: set ts=8 sw=8 noet: */
@@ -127,6 +127,16 @@ low_package_get_files (LowPackage *pkg)
 	return pkg->get_files (pkg);
 }
 
+/**
+ * Does pkg own file? Unlike low_package_get_files, this doesn't need the
+ * whole file list, which a repo might have to fetch.
+ */
+bool
+low_package_has_file (LowPackage *pkg, const char *file)
+{
+	return pkg->has_file (pkg, file);
+}
+
 LowPackageIter *
 low_package_iter_next (LowPackageIter *iter)
 {
@@ -64,6 +64,7 @@ typedef LowPackageDetails *	(*LowPackageGetDetails)	(LowPackage *);
 
 typedef LowPackageDependency **	(*LowPackageGetDependency)	(LowPackage *);
 typedef char **	(*LowPackageGetFiles) 		(LowPackage *);
+typedef bool	(*LowPackageHasFile) 		(LowPackage *, const char *);
 
 /**
  * A struct representing an RPM package.
@@ -99,6 +100,7 @@ struct _LowPackage {
 	LowPackageGetDependency get_obsoletes;
 
 	LowPackageGetFiles get_files;
+	LowPackageHasFile has_file; /**< Without listing every file */
 };
 
 typedef struct _LowPackageIter LowPackageIter;
@@ -125,6 +127,8 @@ LowPackageDependency **	low_package_get_conflicts 	(LowPackage *pkg);
 LowPackageDependency **	low_package_get_obsoletes	(LowPackage *pkg);
 
 char **			low_package_get_files 		(LowPackage *pkg);
+bool			low_package_has_file 		(LowPackage *pkg,
+							 const char *file);
 
 LowPackageIter *low_package_iter_next (LowPackageIter *iter);
 void low_package_iter_free (LowPackageIter *iter);
@@ -54,6 +54,7 @@ LowPackageDependency **low_rpmdb_package_get_conflicts (LowPackage *pkg);
 LowPackageDependency **low_rpmdb_package_get_obsoletes (LowPackage *pkg);
 
 char **low_rpmdb_package_get_files (LowPackage *pkg);
+bool low_rpmdb_package_has_file (LowPackage *pkg, const char *file);
 
 LowRepo *
 low_repo_rpmdb_initialize (void)
@@ -63,6 +64,9 @@ low_repo_rpmdb_initialize (void)
 	repo->super.id = strdup ("installed");
 	repo->super.name = strdup ("Installed Packages");
 	repo->super.enabled = true;
+	repo->super.priority = LOW_REPO_DEFAULT_PRIORITY;
+	repo->super.cost = LOW_REPO_DEFAULT_COST;
+	repo->super.metadata_expire = LOW_REPO_DEFAULT_METADATA_EXPIRE;
 
 	rpmReadConfigFiles (NULL, NULL);
 	if (rpmdbOpen ("", &repo->db, O_RDONLY, 0644) != 0) {
@@ -231,6 +235,7 @@ low_package_rpmdb_new_from_header (Header header, LowRepo *repo)
 	pkg->get_obsoletes = low_rpmdb_package_get_obsoletes;
 
 	pkg->get_files = low_rpmdb_package_get_files;
+	pkg->has_file = low_rpmdb_package_has_file;
 
 	rpmtdFreeData (id);
 	rpmtdFreeData (name);
@@ -669,6 +674,23 @@ low_rpmdb_package_get_files (LowPackage *pkg)
 	return files;
 }
 
+/* The header has every file anyway, so just look through them */
+bool
+low_rpmdb_package_has_file (LowPackage *pkg, const char *file)
+{
+	char **files = low_rpmdb_package_get_files (pkg);
+	bool found = false;
+	int i;
+
+	for (i = 0; files[i] != NULL && !found; i++) {
+		found = !strcmp (files[i], file);
+	}
+
+	g_strfreev (files);
+
+	return found;
+}
+
 /* XXX hack */
 rpmdb
 low_repo_rpmdb_get_db (LowRepo *repo)
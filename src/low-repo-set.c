@@ -20,18 +20,67 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "low-debug.h"
 #include "low-repo-sqlite.h"
 #include "low-repo-set.h"
+#include "low-util.h"
+
+LowRepoSet *
+low_repo_set_new (void)
+{
+	LowRepoSet *repo_set = malloc (sizeof (LowRepoSet));
+
+	repo_set->repos = g_ptr_array_new ();
+	repo_set->search_pool = NULL;
+	repo_set->search_mode = SEARCH_ALL_REPOS;
+
+	return repo_set;
+}
+
+static gint
+low_repo_set_compare_repos (gconstpointer a, gconstpointer b)
+{
+	const LowRepo *repo_a = *(LowRepo * const *) a;
+	const LowRepo *repo_b = *(LowRepo * const *) b;
+
+	if (repo_a->priority != repo_b->priority) {
+		return repo_a->priority - repo_b->priority;
+	}
+
+	if (repo_a->cost != repo_b->cost) {
+		return repo_a->cost - repo_b->cost;
+	}
+
+	return strcmp (repo_a->id, repo_b->id);
+}
+
+/**
+ * Add a repo to the set. Repos are always searched in order of priority,
+ * then cost, then id.
+ */
+void
+low_repo_set_add (LowRepoSet *repo_set, LowRepo *repo)
+{
+	g_ptr_array_add (repo_set->repos, repo);
+	g_ptr_array_sort (repo_set->repos, low_repo_set_compare_repos);
+}
 
 LowRepoSet *
 low_repo_set_initialize_from_config (LowConfig *config, bool bind_dbs)
 {
 	unsigned int i;
 	char **repo_names;
-	LowRepoSet *repo_set = malloc (sizeof (LowRepoSet));
+	char *value;
+	int metadata_expire;
+	LowRepoSet *repo_set = low_repo_set_new ();
 
-	repo_set->repos = g_hash_table_new (NULL, NULL);
+	/* Repos without their own metadata_expire use the main one */
+	value = low_config_get_string (config, "main", "metadata_expire");
+	metadata_expire =
+		low_util_parse_duration (value,
+					 LOW_REPO_DEFAULT_METADATA_EXPIRE);
+	free (value);
 
 	repo_names = low_config_get_repo_names (config);
 	for (i = 0; i < g_strv_length (repo_names); i++) {
@@ -45,6 +94,11 @@ low_repo_set_initialize_from_config (LowConfig *config, bool bind_dbs)
 							   "mirrorlist");
 		bool enabled = low_config_get_bool (config, repo_names[i],
 						    "enabled");
+		int priority = low_config_get_int (config, repo_names[i],
+						   "priority");
+		int cost = low_config_get_int (config, repo_names[i], "cost");
+		char *expire = low_config_get_string (config, repo_names[i],
+						      "metadata_expire");
 		LowRepo *repo = low_repo_sqlite_initialize (id, name, baseurl,
 							    mirror_list,
 							    enabled,
@@ -56,78 +110,279 @@ low_repo_set_initialize_from_config (LowConfig *config, bool bind_dbs)
 
 		/* failed to initialize (probably missing sqlite file) */
 		if (repo == NULL) {
+			free (expire);
 			low_repo_set_free (repo_set);
 			repo_set = NULL;
 			break;
 		}
 
-		g_hash_table_insert (repo_set->repos, id, repo);
+		if (priority > 0) {
+			repo->priority = priority;
+		}
+		if (cost > 0) {
+			repo->cost = cost;
+		}
+		repo->metadata_expire = low_util_parse_duration (expire,
+								 metadata_expire);
+		free (expire);
+
+		low_repo_set_add (repo_set, repo);
 	}
 	g_strfreev (repo_names);
 
+	if (repo_set != NULL) {
+		int threads = low_config_get_int (config, "main",
+						  "search_threads");
+
+		if (threads > 0) {
+			low_repo_set_set_search_threads (repo_set, threads);
+		}
+	}
+
 	return repo_set;
 }
 
-static void
-low_repo_set_free_repo (gpointer key G_GNUC_UNUSED, gpointer value,
-			gpointer user_data G_GNUC_UNUSED)
+static void low_repo_set_search_worker (gpointer data, gpointer user_data);
+
+/**
+ * Run each enabled repo's search on its own worker thread, up to
+ * threads at a time. A value of 0 goes back to searching serially.
+ */
+void
+low_repo_set_set_search_threads (LowRepoSet *repo_set, unsigned int threads)
 {
-	LowRepo *repo = (LowRepo *) value;
+	if (repo_set->search_pool != NULL) {
+		g_thread_pool_free (repo_set->search_pool, FALSE, TRUE);
+		repo_set->search_pool = NULL;
+	}
+
+	if (threads == 0) {
+		return;
+	}
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+	if (!g_thread_supported ()) {
+		g_thread_init (NULL);
+	}
+#endif
 
-	low_repo_sqlite_shutdown (repo);
+	repo_set->search_pool = g_thread_pool_new (low_repo_set_search_worker,
+						   NULL, threads, FALSE, NULL);
 }
 
+/**
+ * With SEARCH_FIRST_MATCH, name, provides and file searches stop as soon
+ * as a repo has answered, skipping any repos of worse priority. Repos of
+ * the same priority are still all searched.
+ */
 void
-low_repo_set_free (LowRepoSet *repo_set)
+low_repo_set_set_search_mode (LowRepoSet *repo_set, LowRepoSetSearchMode mode)
 {
-	g_hash_table_foreach (repo_set->repos, low_repo_set_free_repo, NULL);
-	g_hash_table_unref (repo_set->repos);
-	free (repo_set);
+	repo_set->search_mode = mode;
 }
 
-typedef struct _LowRepoSetForEachData {
-	LowRepoSetFilter filter;
-	LowRepoSetFunc func;
-} LowRepoSetForEachData;
+/*
+ * Identifies the enabled repos and their priorities, which is everything
+ * that goes into deciding what's newest.
+ */
+static uint32_t
+low_repo_set_signature (LowRepoSet *repo_set)
+{
+	GString *repos = g_string_new ("");
+	uint32_t set_signature;
+	unsigned int i;
 
-static void
-low_repo_set_inner_for_each (gpointer key G_GNUC_UNUSED, gpointer value,
-			     gpointer data)
+	for (i = 0; i < repo_set->repos->len; i++) {
+		LowRepo *repo = g_ptr_array_index (repo_set->repos, i);
+
+		if (repo->enabled) {
+			g_string_append_printf (repos, "%s:%d\n", repo->id,
+						repo->priority);
+		}
+	}
+
+	set_signature = g_str_hash (repos->str);
+	g_string_free (repos, TRUE);
+
+	return set_signature;
+}
+
+/**
+ * Save a view of the newest version of each package across all enabled
+ * repos, for low_repo_set_set_newest_only. Call after a refresh.
+ */
+void
+low_repo_set_build_newest (LowRepoSet *repo_set)
 {
-	LowRepo *repo = (LowRepo *) value;
-	LowRepoSetForEachData *for_each_data = (LowRepoSetForEachData *) data;
+	GPtrArray *enabled = g_ptr_array_new ();
+	unsigned int i;
 
-	if (for_each_data->filter == ALL ||
-	    (for_each_data->filter == ENABLED && repo->enabled) ||
-	    (for_each_data->filter == DISABLED && !repo->enabled)) {
-		for_each_data->func (repo);
+	for (i = 0; i < repo_set->repos->len; i++) {
+		LowRepo *repo = g_ptr_array_index (repo_set->repos, i);
+
+		if (repo->enabled) {
+			g_ptr_array_add (enabled, repo);
+		}
 	}
+
+	low_repo_sqlite_build_newest ((LowRepo **) enabled->pdata,
+				      enabled->len,
+				      low_repo_set_signature (repo_set));
+	g_ptr_array_free (enabled, TRUE);
+}
+
+/**
+ * Only see the newest version of each package in name, provides and file
+ * searches. Provides and file searches still fall back to every version
+ * in a repo when its newest packages don't match.
+ *
+ * The view is all or nothing: if any enabled repo has no current view
+ * for this exact set of repos, every version is searched, and this
+ * returns false.
+ */
+bool
+low_repo_set_set_newest_only (LowRepoSet *repo_set, bool newest_only)
+{
+	uint32_t set_signature = low_repo_set_signature (repo_set);
+	unsigned int i;
+
+	for (i = 0; newest_only && i < repo_set->repos->len; i++) {
+		LowRepo *repo = g_ptr_array_index (repo_set->repos, i);
+
+		if (repo->enabled &&
+		    !low_repo_sqlite_load_newest (repo, set_signature)) {
+			low_debug ("No current newest view for '%s'", repo->id);
+			newest_only = false;
+		}
+	}
+
+	if (!newest_only) {
+		for (i = 0; i < repo_set->repos->len; i++) {
+			low_repo_sqlite_unload_newest
+				(g_ptr_array_index (repo_set->repos, i));
+		}
+	}
+
+	return newest_only;
+}
+
+void
+low_repo_set_free (LowRepoSet *repo_set)
+{
+	unsigned int i;
+
+	low_repo_set_set_search_threads (repo_set, 0);
+
+	for (i = 0; i < repo_set->repos->len; i++) {
+		low_repo_sqlite_shutdown (g_ptr_array_index (repo_set->repos,
+							     i));
+	}
+	g_ptr_array_free (repo_set->repos, TRUE);
+	free (repo_set);
 }
 
 void
 low_repo_set_for_each (LowRepoSet *repo_set, LowRepoSetFilter filter,
 		       LowRepoSetFunc func)
 {
-	LowRepoSetForEachData for_each_data;
-	for_each_data.filter = filter;
-	for_each_data.func = func;
+	unsigned int i;
+
+	for (i = 0; i < repo_set->repos->len; i++) {
+		LowRepo *repo = g_ptr_array_index (repo_set->repos, i);
+
+		if (filter == ALL || (filter == ENABLED && repo->enabled) ||
+		    (filter == DISABLED && !repo->enabled)) {
+			func (repo);
+		}
+	}
+}
+
+/*
+ * The end of the run of repos to search together, starting at start.
+ * When stopping at the first match, that's every repo with the same
+ * priority; otherwise it's all of them.
+ */
+static unsigned int
+low_repo_set_tier_end (GPtrArray *repos, unsigned int start, bool first_match)
+{
+	LowRepo *first = g_ptr_array_index (repos, start);
+	unsigned int end = start + 1;
+
+	if (!first_match) {
+		return repos->len;
+	}
 
-	g_hash_table_foreach (repo_set->repos, low_repo_set_inner_for_each,
-			      &for_each_data);
+	while (end < repos->len &&
+	       ((LowRepo *) g_ptr_array_index (repos, end))->priority ==
+	       first->priority) {
+		end++;
+	}
+
+	return end;
 }
 
 typedef LowPackageIter *(*LowRepoSetIterSearchFunc) (LowRepo *repo,
 						     const void *search_data);
+typedef bool (*LowRepoSetIterSkipFunc) (LowRepo *repo,
+					const void *search_data);
 
 typedef struct _LowRepoSetPackageIter {
 	LowPackageIter super;
-	GHashTableIter *repo_iter;
+	GPtrArray *repos;
+	unsigned int next_repo;		/**< Index of the next repo to search */
 	LowPackageIter *current_repo_iter;
 	LowRepo *current_repo;
 	const char *search_data;
 	LowRepoSetIterSearchFunc search_func;
+	LowRepoSetIterSkipFunc skip_func;
+	bool first_match;
+	bool found;			/**< Only tracked for first_match */
+	int found_priority;
 } LowRepoSetPackageIter;
 
+/*
+ * Disabled repos are never searched, and skip_func can rule out a repo
+ * without running its search at all (say, from its Bloom filters).
+ */
+static bool
+low_repo_set_skip_repo (LowRepo *repo, LowRepoSetIterSkipFunc skip_func,
+			const void *search_data)
+{
+	if (!repo->enabled) {
+		return true;
+	}
+
+	if (skip_func != NULL && skip_func (repo, search_data)) {
+		low_debug ("Skipping repo '%s'", repo->id);
+		return true;
+	}
+
+	return false;
+}
+
+static LowRepo *
+low_repo_set_package_iter_next_repo (LowRepoSetPackageIter *iter_set)
+{
+	while (iter_set->next_repo < iter_set->repos->len) {
+		LowRepo *repo = g_ptr_array_index (iter_set->repos,
+						   iter_set->next_repo++);
+
+		/* Repos are sorted, so every one after this is worse too */
+		if (iter_set->found &&
+		    repo->priority > iter_set->found_priority) {
+			low_debug ("Stopping search at repo '%s'", repo->id);
+			return NULL;
+		}
+
+		if (!low_repo_set_skip_repo (repo, iter_set->skip_func,
+					     iter_set->search_data)) {
+			return repo;
+		}
+	}
+
+	return NULL;
+}
+
 static LowPackageIter *
 low_repo_set_package_iter_next (LowPackageIter *iter)
 {
@@ -137,7 +392,6 @@ low_repo_set_package_iter_next (LowPackageIter *iter)
 
 	/* XXX When we have no repos. this is ugly. */
 	if (current_repo == NULL) {
-		free (iter_set->repo_iter);
 		free (iter);
 		return NULL;
 	}
@@ -145,14 +399,9 @@ low_repo_set_package_iter_next (LowPackageIter *iter)
 	current_repo_iter = low_package_iter_next (current_repo_iter);
 
 	/* This should cover repos that return 0 packages from the iter */
-	while (current_repo_iter == NULL && current_repo != NULL) {
-		do {
-			current_repo = NULL;
-			g_hash_table_iter_next (iter_set->repo_iter, NULL,
-						(gpointer) &current_repo);
-		} while (current_repo != NULL && !current_repo->enabled);
+	while (current_repo_iter == NULL) {
+		current_repo = low_repo_set_package_iter_next_repo (iter_set);
 		if (current_repo == NULL) {
-			current_repo_iter = NULL;
 			break;
 		}
 
@@ -165,7 +414,6 @@ low_repo_set_package_iter_next (LowPackageIter *iter)
 	}
 
 	if (current_repo_iter == NULL) {
-		free (iter_set->repo_iter);
 		free (iter);
 		return NULL;
 	}
@@ -173,6 +421,11 @@ low_repo_set_package_iter_next (LowPackageIter *iter)
 	iter_set->current_repo = current_repo;
 	iter_set->current_repo_iter = current_repo_iter;
 
+	if (iter_set->first_match) {
+		iter_set->found = true;
+		iter_set->found_priority = current_repo->priority;
+	}
+
 	iter->pkg = iter_set->current_repo_iter->pkg;
 
 	return iter;
@@ -184,32 +437,216 @@ low_repo_set_package_iter_free (LowPackageIter *iter)
 	LowRepoSetPackageIter *iter_set = (LowRepoSetPackageIter *) iter;
 
 	low_package_iter_free (iter_set->current_repo_iter);
-	free (iter_set->repo_iter);
+	free (iter);
+}
+
+/**
+ * Iterate over a list of already found packages, in list order.
+ */
+typedef struct _LowRepoSetListIter {
+	LowPackageIter super;
+	GList *pkgs;
+} LowRepoSetListIter;
+
+static LowPackageIter *
+low_repo_set_list_iter_next (LowPackageIter *iter)
+{
+	LowRepoSetListIter *iter_list = (LowRepoSetListIter *) iter;
+
+	if (iter_list->pkgs == NULL) {
+		free (iter);
+		return NULL;
+	}
+
+	iter->pkg = iter_list->pkgs->data;
+	iter_list->pkgs = g_list_delete_link (iter_list->pkgs,
+					      iter_list->pkgs);
+
+	return iter;
+}
+
+static void
+low_repo_set_list_iter_free (LowPackageIter *iter)
+{
+	LowRepoSetListIter *iter_list = (LowRepoSetListIter *) iter;
+	GList *cur;
+
+	for (cur = iter_list->pkgs; cur != NULL; cur = cur->next) {
+		low_package_unref (cur->data);
+	}
+	g_list_free (iter_list->pkgs);
 	free (iter);
 }
 
+static LowPackageIter *
+low_repo_set_list_iter_new (GList *pkgs)
+{
+	LowRepoSetListIter *iter = malloc (sizeof (LowRepoSetListIter));
+	iter->super.repo = NULL;
+	iter->super.next_func = low_repo_set_list_iter_next;
+	iter->super.free_func = low_repo_set_list_iter_free;
+	iter->super.pkg = NULL;
+	iter->pkgs = pkgs;
+
+	return (LowPackageIter *) iter;
+}
+
+typedef struct _LowRepoSetSearchJob {
+	LowRepo *repo;
+	LowRepoSetIterSearchFunc search_func;
+	const void *search_data;
+	GList *pkgs;
+
+	/* For batched searches, instead of the above */
+	LowPackageDependency **deps;
+	unsigned int count;
+	GList **batch_pkgs;
+
+	GAsyncQueue *done;
+} LowRepoSetSearchJob;
+
+static void
+low_repo_set_search_worker (gpointer data, gpointer user_data G_GNUC_UNUSED)
+{
+	LowRepoSetSearchJob *job = (LowRepoSetSearchJob *) data;
+	LowPackageIter *iter;
+
+	low_debug ("Searching repo '%s'", job->repo->id);
+
+	if (job->deps != NULL) {
+		job->batch_pkgs =
+			low_repo_sqlite_search_provides_batch (job->repo,
+							       job->deps,
+							       job->count);
+		g_async_queue_push (job->done, job);
+		return;
+	}
+
+	iter = job->search_func (job->repo, job->search_data);
+	while (iter = low_package_iter_next (iter), iter != NULL) {
+		job->pkgs = g_list_prepend (job->pkgs, iter->pkg);
+	}
+	job->pkgs = g_list_reverse (job->pkgs);
+
+	g_async_queue_push (job->done, job);
+}
+
+/*
+ * Search the enabled repos in [start, end) at once on the repo set's
+ * thread pool. Every search runs to completion before any package is
+ * handed out, so the caller never touches a repo at the same time as a
+ * worker does. Results are merged in repo order.
+ */
+static GList *
+low_repo_set_search_concurrent (LowRepoSet *repo_set, unsigned int start,
+				unsigned int end,
+				LowRepoSetIterSearchFunc search_func,
+				LowRepoSetIterSkipFunc skip_func,
+				const void *search_data)
+{
+	GAsyncQueue *done = g_async_queue_new ();
+	GList *jobs = NULL;
+	GList *cur;
+	GList *pkgs = NULL;
+	unsigned int pending = 0;
+	unsigned int i;
+
+	for (i = start; i < end; i++) {
+		LowRepo *repo = g_ptr_array_index (repo_set->repos, i);
+		LowRepoSetSearchJob *job;
+
+		if (low_repo_set_skip_repo (repo, skip_func, search_data)) {
+			continue;
+		}
+
+		job = malloc (sizeof (LowRepoSetSearchJob));
+		job->repo = repo;
+		job->search_func = search_func;
+		job->search_data = search_data;
+		job->pkgs = NULL;
+		job->deps = NULL;
+		job->done = done;
+
+		jobs = g_list_prepend (jobs, job);
+		g_thread_pool_push (repo_set->search_pool, job, NULL);
+		pending++;
+	}
+
+	while (pending > 0) {
+		g_async_queue_pop (done);
+		pending--;
+	}
+	g_async_queue_unref (done);
+
+	jobs = g_list_reverse (jobs);
+	for (cur = jobs; cur != NULL; cur = cur->next) {
+		LowRepoSetSearchJob *job = (LowRepoSetSearchJob *) cur->data;
+
+		pkgs = g_list_concat (pkgs, job->pkgs);
+		free (job);
+	}
+	g_list_free (jobs);
+
+	return pkgs;
+}
+
+static LowPackageIter *
+low_repo_set_package_iter_new_concurrent (LowRepoSet *repo_set,
+					  LowRepoSetIterSearchFunc search_func,
+					  LowRepoSetIterSkipFunc skip_func,
+					  const void *search_data,
+					  bool first_match)
+{
+	GList *pkgs = NULL;
+	unsigned int start;
+	unsigned int end;
+
+	for (start = 0; start < repo_set->repos->len && pkgs == NULL;
+	     start = end) {
+		end = low_repo_set_tier_end (repo_set->repos, start,
+					     first_match);
+		pkgs = low_repo_set_search_concurrent (repo_set, start, end,
+						       search_func, skip_func,
+						       search_data);
+	}
+
+	return low_repo_set_list_iter_new (pkgs);
+}
+
 static LowPackageIter *
 low_repo_set_package_iter_new (LowRepoSet *repo_set,
 			       LowRepoSetIterSearchFunc search_func,
-			       const void *search_data)
+			       LowRepoSetIterSkipFunc skip_func,
+			       const void *search_data, bool first_match)
 {
-	LowRepoSetPackageIter *iter = malloc (sizeof (LowRepoSetPackageIter));
+	LowRepoSetPackageIter *iter;
+
+	if (repo_set->search_pool != NULL) {
+		return low_repo_set_package_iter_new_concurrent (repo_set,
+								 search_func,
+								 skip_func,
+								 search_data,
+								 first_match);
+	}
+
+	iter = malloc (sizeof (LowRepoSetPackageIter));
 	iter->super.next_func = low_repo_set_package_iter_next;
 	iter->super.free_func = low_repo_set_package_iter_free;
 	iter->super.pkg = NULL;
-	iter->repo_iter = malloc (sizeof (GHashTableIter));
-	g_hash_table_iter_init (iter->repo_iter, repo_set->repos);
-
-	do {
-		iter->current_repo = NULL;
-		g_hash_table_iter_next (iter->repo_iter, NULL,
-					(gpointer) &(iter->current_repo));
-	} while (iter->current_repo != NULL && !iter->current_repo->enabled);
+	iter->repos = repo_set->repos;
+	iter->next_repo = 0;
+	iter->current_repo_iter = NULL;
 
 	iter->search_func = search_func;
 	iter->search_data = search_data;
+	iter->skip_func = skip_func;
+	iter->first_match = first_match;
+	iter->found = false;
+	iter->found_priority = 0;
 
-	/* XXX For an empty hashtable. kind of ugly. */
+	iter->current_repo = low_repo_set_package_iter_next_repo (iter);
+
+	/* XXX For an empty repo set. kind of ugly. */
 	if (iter->current_repo != NULL) {
 		low_debug ("On repo '%s'", iter->current_repo->id);
 		iter->current_repo_iter =
@@ -219,6 +656,12 @@ low_repo_set_package_iter_new (LowRepoSet *repo_set,
 	return (LowPackageIter *) iter;
 }
 
+static bool
+low_repo_set_first_match (LowRepoSet *repo_set)
+{
+	return repo_set->search_mode == SEARCH_FIRST_MATCH;
+}
+
 LowPackageIter *
 low_repo_set_list_all (LowRepoSet *repo_set)
 {
@@ -228,7 +671,8 @@ low_repo_set_list_all (LowRepoSet *repo_set)
 	 */
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
-					      low_repo_sqlite_list_all, NULL);
+					      low_repo_sqlite_list_all,
+					      NULL, NULL, false);
 }
 
 LowPackageIter *
@@ -237,7 +681,25 @@ low_repo_set_list_by_name (LowRepoSet *repo_set, const char *name)
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
 					      low_repo_sqlite_list_by_name,
-					      name);
+					      NULL, name,
+					      low_repo_set_first_match
+					      (repo_set));
+}
+
+static bool
+low_repo_set_cannot_provide (LowRepo *repo, const void *search_data)
+{
+	const LowPackageDependency *provides =
+		(const LowPackageDependency *) search_data;
+
+	return !low_repo_sqlite_might_provide (repo, provides->name);
+}
+
+static bool
+low_repo_set_cannot_contain_file (LowRepo *repo, const void *search_data)
+{
+	return !low_repo_sqlite_might_contain_file (repo,
+						    (const char *) search_data);
 }
 
 LowPackageIter *
@@ -247,7 +709,145 @@ low_repo_set_search_provides (LowRepoSet *repo_set,
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
 					      low_repo_sqlite_search_provides,
-					      provides);
+					      low_repo_set_cannot_provide,
+					      provides,
+					      low_repo_set_first_match
+					      (repo_set));
+}
+
+/*
+ * Run a batched provides search over the enabled repos in [start, end),
+ * on the thread pool if we have one. Returns one list of results per
+ * repo, in repo order.
+ */
+static GList *
+low_repo_set_run_batch (LowRepoSet *repo_set, unsigned int start,
+			unsigned int end, LowPackageDependency **provides,
+			unsigned int count)
+{
+	GAsyncQueue *done = NULL;
+	GList *jobs = NULL;
+	unsigned int pending = 0;
+	unsigned int i;
+
+	if (repo_set->search_pool != NULL) {
+		done = g_async_queue_new ();
+	}
+
+	for (i = start; i < end; i++) {
+		LowRepo *repo = g_ptr_array_index (repo_set->repos, i);
+		LowRepoSetSearchJob *job;
+
+		if (!repo->enabled) {
+			continue;
+		}
+
+		job = malloc (sizeof (LowRepoSetSearchJob));
+		job->repo = repo;
+		job->deps = provides;
+		job->count = count;
+		job->batch_pkgs = NULL;
+		job->done = done;
+
+		jobs = g_list_prepend (jobs, job);
+
+		if (done != NULL) {
+			g_thread_pool_push (repo_set->search_pool, job, NULL);
+			pending++;
+		} else {
+			low_debug ("On repo '%s'", repo->id);
+			job->batch_pkgs =
+				low_repo_sqlite_search_provides_batch (repo,
+								       provides,
+								       count);
+		}
+	}
+
+	if (done != NULL) {
+		while (pending > 0) {
+			g_async_queue_pop (done);
+			pending--;
+		}
+		g_async_queue_unref (done);
+	}
+
+	return g_list_reverse (jobs);
+}
+
+/**
+ * Search for packages providing each of count dependencies, all at once.
+ * Each repo answers the whole batch with a single query. In first match
+ * mode, dependencies answered by one priority level aren't asked of the
+ * next.
+ *
+ * Returns an array of count iterators; iterator i walks the packages
+ * that provide provides[i]. Consume or free each of them, then free the
+ * array itself.
+ */
+LowPackageIter **
+low_repo_set_search_provides_batch (LowRepoSet *repo_set,
+				    LowPackageDependency **provides,
+				    unsigned int count)
+{
+	LowPackageIter **iters = malloc (sizeof (LowPackageIter *) * count);
+	GList **grouped = malloc (sizeof (GList *) * count);
+	LowPackageDependency **pending =
+		malloc (sizeof (LowPackageDependency *) * count);
+	unsigned int *pending_index = malloc (sizeof (unsigned int) * count);
+	bool first_match = low_repo_set_first_match (repo_set);
+	unsigned int start;
+	unsigned int end;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		grouped[i] = NULL;
+	}
+
+	for (start = 0; start < repo_set->repos->len; start = end) {
+		GList *jobs;
+		GList *cur;
+		unsigned int num_pending = 0;
+
+		for (i = 0; i < count; i++) {
+			if (grouped[i] == NULL) {
+				pending_index[num_pending] = i;
+				pending[num_pending++] = provides[i];
+			}
+		}
+
+		if (num_pending == 0) {
+			break;
+		}
+
+		end = low_repo_set_tier_end (repo_set->repos, start,
+					     first_match);
+		jobs = low_repo_set_run_batch (repo_set, start, end, pending,
+					       num_pending);
+		for (cur = jobs; cur != NULL; cur = cur->next) {
+			LowRepoSetSearchJob *job =
+				(LowRepoSetSearchJob *) cur->data;
+
+			for (i = 0; i < num_pending; i++) {
+				unsigned int j = pending_index[i];
+
+				grouped[j] = g_list_concat (grouped[j],
+							    job->batch_pkgs[i]);
+			}
+
+			free (job->batch_pkgs);
+			free (job);
+		}
+		g_list_free (jobs);
+	}
+	free (pending_index);
+	free (pending);
+
+	for (i = 0; i < count; i++) {
+		iters[i] = low_repo_set_list_iter_new (grouped[i]);
+	}
+	free (grouped);
+
+	return iters;
 }
 
 LowPackageIter *
@@ -257,7 +857,7 @@ low_repo_set_search_requires (LowRepoSet *repo_set,
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
 					      low_repo_sqlite_search_requires,
-					      requires);
+					      NULL, requires, false);
 }
 
 LowPackageIter *
@@ -267,7 +867,7 @@ low_repo_set_search_conflicts (LowRepoSet *repo_set,
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
 					      low_repo_sqlite_search_conflicts,
-					      conflicts);
+					      NULL, conflicts, false);
 }
 
 LowPackageIter *
@@ -277,7 +877,7 @@ low_repo_set_search_obsoletes (LowRepoSet *repo_set,
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
 					      low_repo_sqlite_search_obsoletes,
-					      obsoletes);
+					      NULL, obsoletes, false);
 }
 
 LowPackageIter *
@@ -286,7 +886,10 @@ low_repo_set_search_files (LowRepoSet *repo_set, const char *file)
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
 					      low_repo_sqlite_search_files,
-					      file);
+					      low_repo_set_cannot_contain_file,
+					      file,
+					      low_repo_set_first_match
+					      (repo_set));
 }
 
 LowPackageIter *
@@ -295,7 +898,7 @@ low_repo_set_search_details (LowRepoSet *repo_set, const char *querystr)
 	return low_repo_set_package_iter_new (repo_set,
 					      (LowRepoSetIterSearchFunc)
 					      low_repo_sqlite_search_details,
-					      querystr);
+					      NULL, querystr, false);
 }
 
 /* vim: set ts=8 sw=8 noet: */
@@ -30,9 +30,16 @@
 /**
  * A set of multiple repositories.
  */
+typedef enum {
+	SEARCH_ALL_REPOS,
+	SEARCH_FIRST_MATCH
+} LowRepoSetSearchMode;
+
 typedef struct _LowRepoSet {
 	LowRepo super;
-	GHashTable *repos;
+	GPtrArray *repos; /**< Sorted by priority, then cost, then id */
+	GThreadPool *search_pool; /**< Runs per-repo searches, if not NULL */
+	LowRepoSetSearchMode search_mode;
 } LowRepoSet;
 
 typedef enum {
@@ -43,8 +50,18 @@ typedef enum {
 
 typedef void (*LowRepoSetFunc) (LowRepo *repo);
 
+LowRepoSet *    low_repo_set_new 			(void);
 LowRepoSet *    low_repo_set_initialize_from_config 	(LowConfig *config,
 							 bool bind_dbs);
+void            low_repo_set_add 			(LowRepoSet *repo_set,
+							 LowRepo *repo);
+void            low_repo_set_set_search_threads 	(LowRepoSet *repo_set,
+							 unsigned int threads);
+void            low_repo_set_set_search_mode 		(LowRepoSet *repo_set,
+							 LowRepoSetSearchMode mode);
+void            low_repo_set_build_newest 		(LowRepoSet *repo_set);
+bool            low_repo_set_set_newest_only 		(LowRepoSet *repo_set,
+							 bool newest_only);
 void            low_repo_set_free                      	(LowRepoSet *repo_set);
 
 void            low_repo_set_for_each                  	(LowRepoSet *repo_set,
@@ -57,6 +74,9 @@ LowPackageIter * low_repo_set_list_by_name 		(LowRepoSet *repo_set,
 
 LowPackageIter * low_repo_set_search_provides      	(LowRepoSet *repo_set,
 							 const LowPackageDependency *provides);
+LowPackageIter ** low_repo_set_search_provides_batch	(LowRepoSet *repo_set,
+							 LowPackageDependency **provides,
+							 unsigned int count);
 LowPackageIter * low_repo_set_search_requires      	(LowRepoSet *repo_set,
 							 const LowPackageDependency *requires);
 LowPackageIter * low_repo_set_search_conflicts 		(LowRepoSet *repo_set,
@@ -23,24 +23,41 @@
 #include <stdio.h>
 #include <string.h>
 #include <sqlite3.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "low-bloom.h"
 #include "low-debug.h"
+#include "low-decompress.h"
+#include "low-newest.h"
 #include "low-repo-sqlite.h"
 #include "low-repomd-parser.h"
+#include "low-sqlite-importer.h"
+#include "low-util.h"
 
-#define SELECT_FIELDS_FROM "SELECT p.pkgKey, p.name, p.arch, p.version, " \
-			   "p.release, p.epoch, p.size_package, " \
-			   "p.location_href, p.pkgId, p.checksum_type FROM "
+#define SELECT_FIELDS "p.pkgKey, p.name, p.arch, p.version, " \
+		      "p.release, p.epoch, p.size_package, " \
+		      "p.location_href, p.pkgId, p.checksum_type"
+#define SELECT_FIELDS_COUNT 10
+
+#define SELECT_FIELDS_FROM "SELECT " SELECT_FIELDS " FROM "
 
 typedef struct _LowRepoSqlite {
 	LowRepo super;
-	LowMirrorList *mirrors;
+	pthread_mutex_t mirrors_lock;
+	LowMirrorList *mirrors;	/**< Built on first use */
 	LowDelta *delta;
 	sqlite3 *primary_db;
-	sqlite3 *filelists_db;
+	pthread_mutex_t filelists_lock;
+	bool filelists_tried;	/**< Set once we've gone looking for them */
+	bool filelists_attached;
 	GHashTable *table;
 	GHashTable *obsoletes;
+	LowBloom *provides_bloom;
+	LowBloom *files_bloom;
+	LowNewest *newest;	/**< Set when searching the newest only view */
 } LowRepoSqlite;
 
 /* XXX clean these up */
@@ -53,6 +70,9 @@ typedef struct _LowPackageIterSqlite {
 	LowPackageIterFilterFn func;
 	gpointer filter_data;
 	LowPackageIterFilterDataFree filter_data_free_func;
+	const LowNewest *newest;	/**< Skip rows not in this view */
+	bool newest_fallback;	/**< Rescan without the view on no match */
+	bool matched;
 } LowPackageIterSqlite;
 
 LowPackageDetails *low_sqlite_package_get_details (LowPackage *pkg);
@@ -63,6 +83,7 @@ LowPackageDependency **low_sqlite_package_get_conflicts (LowPackage *pkg);
 LowPackageDependency **low_sqlite_package_get_obsoletes (LowPackage *pkg);
 
 char **low_sqlite_package_get_files (LowPackage *pkg);
+bool low_sqlite_package_has_file (LowPackage *pkg, const char *file);
 
 static void
 low_repo_sqlite_open_db (const char *db_file, sqlite3 **db)
@@ -141,7 +162,10 @@ low_repo_sqlite_filename_match (sqlite3_context *ctx, int argc G_GNUC_UNUSED,
 typedef void (*sqlFunc) (sqlite3_context *, int, sqlite3_value **);
 typedef void (*sqlFinal) (sqlite3_context *);
 
+/* Tests point this at a cache of their own */
+#ifndef LOCAL_CACHE
 #define LOCAL_CACHE "/var/cache/yum"
+#endif
 
 static char *
 xstrdup (const char *in)
@@ -153,6 +177,100 @@ xstrdup (const char *in)
 	return strdup (in);
 }
 
+/*
+ * The uncompressed copy of a db listed in repomd.xml, in the local cache.
+ */
+static char *
+low_repo_sqlite_local_db (const char *id, const char *location)
+{
+	const char *name = strrchr (location, '/');
+	char *uncompressed_name;
+	char *local_db;
+
+	name = name == NULL ? location : name + 1;
+	uncompressed_name = low_decompress_strip_extension (name);
+	local_db = g_strdup_printf (LOCAL_CACHE "/%s/%s", id,
+				    uncompressed_name);
+	free (uncompressed_name);
+
+	return local_db;
+}
+
+/*
+ * The primary db for a repo, in the local cache. A repo that only has XML
+ * gets the one low_repoxml_parse imported it into.
+ */
+static char *
+low_repo_sqlite_repomd_primary_db (const char *id, LowRepomd *repomd)
+{
+	if (repomd->primary_db != NULL) {
+		return low_repo_sqlite_local_db (id,
+						 repomd->primary_db->location);
+	} else if (repomd->primary_xml != NULL) {
+		return g_strdup_printf (LOCAL_CACHE "/%s/"
+					LOW_SQLITE_IMPORTER_PRIMARY, id);
+	}
+
+	return NULL;
+}
+
+static char *
+low_repo_sqlite_repomd_filelists_db (const char *id, LowRepomd *repomd)
+{
+	if (repomd->filelists_db != NULL) {
+		return low_repo_sqlite_local_db (id,
+						 repomd->filelists_db->location);
+	} else if (repomd->primary_db == NULL &&
+		   repomd->filelists_xml != NULL) {
+		return g_strdup_printf (LOCAL_CACHE "/%s/"
+					LOW_SQLITE_IMPORTER_FILELISTS, id);
+	}
+
+	return NULL;
+}
+
+static char *
+low_repo_sqlite_filter_file (const char *id, const char *name)
+{
+	return g_strdup_printf (LOCAL_CACHE "/%s/%s.bloom", id, name);
+}
+
+/*
+ * A filter is only any good if it was built from the db that's there now.
+ */
+static LowBloom *
+low_repo_sqlite_load_current_filter (const char *filter_file,
+				     const char *db_file)
+{
+	LowBloom *bloom = low_bloom_load (filter_file);
+	LowFileStamp db_stamp;
+
+	if (bloom != NULL &&
+	    (!low_util_file_stamp (db_file, &db_stamp) ||
+	     !low_util_file_stamp_equal (&bloom->source, &db_stamp))) {
+		low_bloom_free (bloom);
+		bloom = NULL;
+	}
+
+	return bloom;
+}
+
+static LowBloom *
+low_repo_sqlite_load_filter (const char *id, const char *name,
+			     const char *db_file)
+{
+	char *filter_file = low_repo_sqlite_filter_file (id, name);
+	LowBloom *bloom =
+		low_repo_sqlite_load_current_filter (filter_file, db_file);
+
+	if (bloom == NULL) {
+		low_debug ("No current %s filter for %s", name, id);
+	}
+
+	free (filter_file);
+	return bloom;
+}
+
 LowRepo *
 low_repo_sqlite_initialize (const char *id, const char *name,
 			    const char *baseurl, const char *mirror_list,
@@ -169,33 +287,21 @@ low_repo_sqlite_initialize (const char *id, const char *name,
 
 	/* Will need a way to flick this on later */
 	/* XXX return some error when repomd is null */
-	if (enabled && bind_dbs && repomd != NULL) {
-		/* XXX don't assume .bz2 */
-		char tmp;
-		char *primary_db;
-		char *filelists_db;
-
-		tmp = repomd->primary_db[strlen (repomd->primary_db) - 4];
-		repomd->primary_db[strlen (repomd->primary_db) - 4] = '\0';
-		/* XXX don't assume 'repodata/' */
-		primary_db = g_strdup_printf (LOCAL_CACHE "/%s/%s", id,
-					      repomd->primary_db + 9);
-		repomd->primary_db[strlen (repomd->primary_db) - 4] = tmp;
-
-		tmp = repomd->filelists_db[strlen (repomd->filelists_db) - 4];
-		repomd->filelists_db[strlen (repomd->filelists_db) - 4] = '\0';
-		filelists_db = g_strdup_printf (LOCAL_CACHE "/%s/%s", id,
-						repomd->filelists_db + 9);
-		repomd->filelists_db[strlen (repomd->filelists_db) - 4] = tmp;
+	if (enabled && bind_dbs && repomd != NULL &&
+	    (repomd->primary_db != NULL || repomd->primary_xml != NULL)) {
+		char *primary_db = low_repo_sqlite_repomd_primary_db (id,
+								      repomd);
+		char *filelists_db =
+			low_repo_sqlite_repomd_filelists_db (id, repomd);
 
 		low_debug ("Opening %s - %s\n", id, primary_db);
-		low_debug ("Opening %s - %s\n", id, filelists_db);
 
-		if (access (primary_db, R_OK) || access (filelists_db, R_OK)) {
+		/* filelists are attached when they're first needed */
+		if (access (primary_db, R_OK)) {
 			printf ("Can't open db files for repo '%s'! (try running 'yum makecache')\n", id);
 
-			free (filelists_db);
 			free (primary_db);
+			free (filelists_db);
 			low_repomd_free (repomd);
 			free (repo);
 
@@ -203,7 +309,6 @@ low_repo_sqlite_initialize (const char *id, const char *name,
 		}
 
 		low_repo_sqlite_open_db (primary_db, &repo->primary_db);
-		attach_db (repo->primary_db, filelists_db);
 		sqlite3_create_function (repo->primary_db, "regexp", 2,
 					 SQLITE_ANY, NULL,
 					 low_repo_sqlite_regexp,
@@ -214,18 +319,23 @@ low_repo_sqlite_initialize (const char *id, const char *name,
 					 low_repo_sqlite_filename_match,
 					 (sqlFunc) NULL, (sqlFinal) NULL);
 
+		repo->provides_bloom =
+			low_repo_sqlite_load_filter (id, "provides",
+						     primary_db);
+		if (filelists_db != NULL) {
+			/* Only there once filelists have been fetched */
+			repo->files_bloom =
+				low_repo_sqlite_load_filter (id, "files",
+							     filelists_db);
+		} else {
+			repo->files_bloom = NULL;
+		}
 
 		/* XXX do this lazily */
 		if (repomd->delta_xml != NULL) {
-			char *delta_xml;
-
-			tmp = repomd->delta_xml[strlen (repomd->delta_xml) - 3];
-			repomd->delta_xml[strlen (repomd->delta_xml) - 3] =
-				'\0';
-			delta_xml = g_strdup_printf (LOCAL_CACHE "/%s/%s", id,
-						     repomd->delta_xml + 9);
-			repomd->delta_xml[strlen (repomd->delta_xml) - 3] =
-				tmp;
+			char *delta_xml =
+				low_repo_sqlite_local_db (id,
+							  repomd->delta_xml->location);
 
 			repo->delta = low_delta_parse (delta_xml);
 			free (delta_xml);
@@ -237,12 +347,20 @@ low_repo_sqlite_initialize (const char *id, const char *name,
 		free (filelists_db);
 	} else {
 		repo->primary_db = NULL;
-		repo->filelists_db = NULL;
 		repo->delta = NULL;
+		repo->provides_bloom = NULL;
+		repo->files_bloom = NULL;
 	}
 
+	pthread_mutex_init (&repo->filelists_lock, NULL);
+	repo->filelists_tried = false;
+	repo->filelists_attached = false;
+
+	repo->newest = NULL;
+
 	repo->table = NULL;
 	repo->obsoletes = NULL;
+	pthread_mutex_init (&repo->mirrors_lock, NULL);
 	repo->mirrors = NULL;
 
 	repo->super.id = strdup (id);
@@ -250,6 +368,9 @@ low_repo_sqlite_initialize (const char *id, const char *name,
 	repo->super.baseurl = xstrdup (baseurl);
 	repo->super.mirror_list = xstrdup (mirror_list);
 	repo->super.enabled = enabled;
+	repo->super.priority = LOW_REPO_DEFAULT_PRIORITY;
+	repo->super.cost = LOW_REPO_DEFAULT_COST;
+	repo->super.metadata_expire = LOW_REPO_DEFAULT_METADATA_EXPIRE;
 
 	low_repomd_free (repomd);
 
@@ -266,18 +387,27 @@ low_repo_sqlite_shutdown (LowRepo *repo)
 	free (repo->mirror_list);
 
 	if (repo_sqlite->mirrors) {
+		low_mirror_list_save_stats (repo_sqlite->mirrors);
 		low_mirror_list_free (repo_sqlite->mirrors);
 	}
+	pthread_mutex_destroy (&repo_sqlite->mirrors_lock);
 
 	if (repo_sqlite->primary_db) {
-		detach_db (repo_sqlite->primary_db);
+		if (repo_sqlite->filelists_attached) {
+			detach_db (repo_sqlite->primary_db);
+		}
 		sqlite3_close (repo_sqlite->primary_db);
 	}
+	pthread_mutex_destroy (&repo_sqlite->filelists_lock);
 
 	if (repo_sqlite->delta) {
 		low_delta_free (repo_sqlite->delta);
 	}
 
+	low_bloom_free (repo_sqlite->provides_bloom);
+	low_bloom_free (repo_sqlite->files_bloom);
+	low_newest_free (repo_sqlite->newest);
+
 	if (repo_sqlite->table) {
 		g_hash_table_destroy (repo_sqlite->table);
 	}
@@ -357,6 +487,7 @@ low_package_sqlite_new_from_row (sqlite3_stmt *pp_stmt, LowRepo *repo)
 	pkg->obsoletes = NULL;
 
 	pkg->get_files = low_sqlite_package_get_files;
+	pkg->has_file = low_sqlite_package_has_file;
 
 	return pkg;
 }
@@ -375,12 +506,44 @@ low_sqlite_package_iter_free (LowPackageIter *iter)
 	free (iter_sqlite);
 }
 
+/*
+ * Step to the next row in the newest only view, if there is one. If the
+ * view had nothing at all for us, start over with every version.
+ */
+static bool
+low_sqlite_package_iter_step (LowPackageIterSqlite *iter_sqlite)
+{
+	/* A search with nothing to look in */
+	if (iter_sqlite->pp_stmt == NULL) {
+		return false;
+	}
+
+	while (sqlite3_step (iter_sqlite->pp_stmt) == SQLITE_ROW) {
+		if (iter_sqlite->newest == NULL ||
+		    low_newest_contains (iter_sqlite->newest,
+					 sqlite3_column_int
+					 (iter_sqlite->pp_stmt, 0))) {
+			return true;
+		}
+	}
+
+	if (iter_sqlite->newest != NULL && iter_sqlite->newest_fallback &&
+	    !iter_sqlite->matched) {
+		low_debug ("No match in newest view, searching all versions");
+		iter_sqlite->newest = NULL;
+		sqlite3_reset (iter_sqlite->pp_stmt);
+		return low_sqlite_package_iter_step (iter_sqlite);
+	}
+
+	return false;
+}
+
 static LowPackageIter *
 low_sqlite_package_iter_next (LowPackageIter *iter)
 {
 	LowPackageIterSqlite *iter_sqlite = (LowPackageIterSqlite *) iter;
 
-	if (sqlite3_step (iter_sqlite->pp_stmt) == SQLITE_DONE) {
+	if (!low_sqlite_package_iter_step (iter_sqlite)) {
 		low_sqlite_package_iter_free (iter);
 		return NULL;
 	}
@@ -394,6 +557,8 @@ low_sqlite_package_iter_next (LowPackageIter *iter)
 			return low_package_iter_next (iter);
 		}
 	}
+
+	iter_sqlite->matched = true;
 	return iter;
 }
 
@@ -411,6 +576,10 @@ low_package_iter_sqlite_new (LowRepo *repo)
 	iter->filter_data_free_func = NULL;
 	iter->filter_data = NULL;
 
+	iter->newest = NULL;
+	iter->newest_fallback = false;
+	iter->matched = false;
+
 	return iter;
 }
 
@@ -422,6 +591,8 @@ low_repo_sqlite_list_all (LowRepo *repo)
 	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
 	LowPackageIterSqlite *iter = low_package_iter_sqlite_new (repo);
 
+	iter->newest = repo_sqlite->newest;
+
 	sqlite3_prepare (repo_sqlite->primary_db, stmt, -1, &iter->pp_stmt,
 			 NULL);
 	return (LowPackageIter *) iter;
@@ -436,6 +607,8 @@ low_repo_sqlite_list_by_name (LowRepo *repo, const char *name)
 	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
 	LowPackageIterSqlite *iter = low_package_iter_sqlite_new (repo);
 
+	iter->newest = repo_sqlite->newest;
+
 	sqlite3_prepare (repo_sqlite->primary_db, stmt, -1, &iter->pp_stmt,
 			 NULL);
 	sqlite3_bind_text (iter->pp_stmt, 1, name, -1, SQLITE_STATIC);
@@ -490,6 +663,10 @@ low_package_iter_sqlite_new_with_filter (LowRepo *repo)
 	iter->filter_data_free_func = dep_filter_data_free_fn;
 	iter->filter_data = (gpointer) data;
 
+	iter->newest = NULL;
+	iter->newest_fallback = false;
+	iter->matched = false;
+
 	return iter;
 }
 
@@ -510,12 +687,162 @@ low_repo_sqlite_search_provides (LowRepo *repo,
 						provides->evr);
 	data->dep_func = low_package_get_provides;
 
+	/* A versioned dependency may need something older than the newest */
+	iter->newest = repo_sqlite->newest;
+	iter->newest_fallback = true;
+
 	sqlite3_prepare (repo_sqlite->primary_db, stmt, -1, &iter->pp_stmt,
 			 NULL);
 	sqlite3_bind_text (iter->pp_stmt, 1, provides->name, -1, SQLITE_STATIC);
 	return (LowPackageIter *) iter;
 }
 
+static void
+low_repo_sqlite_exec (sqlite3 *db, const char *stmt)
+{
+	if (sqlite3_exec (db, stmt, NULL, NULL, NULL) != SQLITE_OK) {
+		low_debug ("Error running '%s': %s", stmt, sqlite3_errmsg (db));
+	}
+}
+
+/*
+ * Run the batch query over whatever is in batch_provides, adding each
+ * matching package to the list for its dependency.
+ */
+static void
+low_repo_sqlite_collect_batch (LowRepo *repo, LowPackageDependency **provides,
+			       GList **found, const LowNewest *newest)
+{
+	/*
+	 * The temp table has no statistics, so spell out the join order:
+	 * left to itself, sqlite would rather scan a whole table.
+	 */
+	const char *stmt = "SELECT " SELECT_FIELDS ", b.idx "
+			   "FROM batch_provides b CROSS JOIN provides pr "
+			   "CROSS JOIN packages p "
+			   "WHERE pr.name = b.name AND pr.pkgKey = p.pkgKey "
+			   "ORDER BY b.idx";
+
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+	sqlite3_stmt *pp_stmt;
+
+	sqlite3_prepare (repo_sqlite->primary_db, stmt, -1, &pp_stmt, NULL);
+	while (sqlite3_step (pp_stmt) == SQLITE_ROW) {
+		LowPackage *pkg;
+		DepFilterData filter_data;
+		unsigned int i;
+
+		if (newest != NULL &&
+		    !low_newest_contains (newest,
+					  sqlite3_column_int (pp_stmt, 0))) {
+			continue;
+		}
+
+		pkg = low_package_sqlite_new_from_row (pp_stmt, repo);
+		i = sqlite3_column_int (pp_stmt, SELECT_FIELDS_COUNT);
+
+		filter_data.dep = provides[i];
+		filter_data.dep_func = low_package_get_provides;
+
+		if (low_repo_sqlite_search_dep_filter_fn (pkg, &filter_data)) {
+			found[i] = g_list_prepend (found[i], pkg);
+		} else {
+			low_package_unref (pkg);
+		}
+	}
+	sqlite3_finalize (pp_stmt);
+}
+
+/**
+ * Search for packages providing any of count dependencies at once.
+ * The names go into a temporary table, so there is a single query no
+ * matter how many dependencies there are.
+ *
+ * Returns an array of count lists; entry i holds the packages providing
+ * provides[i]. Free the array (and any lists you don't consume).
+ */
+GList **
+low_repo_sqlite_search_provides_batch (LowRepo *repo,
+				       LowPackageDependency **provides,
+				       unsigned int count)
+{
+	const char *insert_stmt = "INSERT INTO batch_provides VALUES (?, ?)";
+	const char *delete_stmt = "DELETE FROM batch_provides WHERE idx = ?";
+
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+	GList **found = malloc (sizeof (GList *) * count);
+	sqlite3_stmt *pp_stmt;
+	unsigned int i;
+	unsigned int searched = 0;
+
+	for (i = 0; i < count; i++) {
+		found[i] = NULL;
+	}
+
+	low_repo_sqlite_exec (repo_sqlite->primary_db,
+			      "CREATE TEMP TABLE IF NOT EXISTS batch_provides "
+			      "(idx INTEGER, name TEXT)");
+	low_repo_sqlite_exec (repo_sqlite->primary_db, "BEGIN");
+	low_repo_sqlite_exec (repo_sqlite->primary_db,
+			      "DELETE FROM batch_provides");
+
+	sqlite3_prepare (repo_sqlite->primary_db, insert_stmt, -1, &pp_stmt,
+			 NULL);
+	for (i = 0; i < count; i++) {
+		if (!low_repo_sqlite_might_provide (repo, provides[i]->name)) {
+			continue;
+		}
+
+		sqlite3_bind_int (pp_stmt, 1, i);
+		sqlite3_bind_text (pp_stmt, 2, provides[i]->name, -1,
+				   SQLITE_STATIC);
+		sqlite3_step (pp_stmt);
+		sqlite3_reset (pp_stmt);
+		searched++;
+	}
+	sqlite3_finalize (pp_stmt);
+
+	low_repo_sqlite_exec (repo_sqlite->primary_db, "COMMIT");
+
+	if (searched == 0) {
+		return found;
+	}
+
+	low_repo_sqlite_collect_batch (repo, provides, found,
+				       repo_sqlite->newest);
+
+	/*
+	 * Like a single provides search, anything with no match in the
+	 * newest only view gets another go against every version.
+	 */
+	if (repo_sqlite->newest != NULL) {
+		low_repo_sqlite_exec (repo_sqlite->primary_db, "BEGIN");
+		sqlite3_prepare (repo_sqlite->primary_db, delete_stmt, -1,
+				 &pp_stmt, NULL);
+		for (i = 0; i < count; i++) {
+			if (found[i] != NULL) {
+				sqlite3_bind_int (pp_stmt, 1, i);
+				sqlite3_step (pp_stmt);
+				sqlite3_reset (pp_stmt);
+				searched--;
+			}
+		}
+		sqlite3_finalize (pp_stmt);
+		low_repo_sqlite_exec (repo_sqlite->primary_db, "COMMIT");
+
+		if (searched > 0) {
+			low_repo_sqlite_collect_batch (repo, provides, found,
+						       NULL);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		found[i] = g_list_reverse (found[i]);
+	}
+
+	return found;
+}
+
 LowPackageIter *
 low_repo_sqlite_search_requires (LowRepo *repo,
 				 const LowPackageDependency *requires)
@@ -692,6 +1019,93 @@ low_repo_sqlite_search_obsoletes (LowRepo *repo,
 	return (LowPackageIter *) iter;
 }
 
+static LowRepoSqliteFetchFunc fetch_filelists = NULL;
+
+/**
+ * Set how a repo gets its filelists db when it's first needed. Without
+ * one, only a filelists db that's already in the cache is used.
+ */
+void
+low_repo_sqlite_set_filelists_fetch (LowRepoSqliteFetchFunc func)
+{
+	fetch_filelists = func;
+}
+
+/*
+ * Attach the filelists db, fetching it first if we have to. Repos only
+ * try once, so a repo whose filelists can't be had just has no files
+ * past what primary lists.
+ */
+static bool
+low_repo_sqlite_attach_filelists (LowRepoSqlite *repo_sqlite)
+{
+	LowRepo *repo = (LowRepo *) repo_sqlite;
+	char *repomd_file;
+	LowRepomd *repomd;
+	char *filelists_db;
+	bool attached;
+
+	pthread_mutex_lock (&repo_sqlite->filelists_lock);
+
+	if (!repo_sqlite->filelists_tried) {
+		repo_sqlite->filelists_tried = true;
+
+		repomd_file = g_strdup_printf (LOCAL_CACHE "/%s/repomd.xml",
+					       repo->id);
+		repomd = low_repomd_parse (repomd_file);
+		free (repomd_file);
+
+		filelists_db = repomd != NULL ?
+			low_repo_sqlite_repomd_filelists_db (repo->id,
+							     repomd) : NULL;
+
+		/*
+		 * Imported filelists come in with primary, so there's
+		 * nothing to fetch for them.
+		 */
+		if (filelists_db != NULL) {
+			bool have_filelists;
+
+			if (fetch_filelists != NULL &&
+			    repomd->filelists_db != NULL) {
+				have_filelists =
+					fetch_filelists (repo,
+							 repomd->filelists_db,
+							 repomd->filelists_db_chunks);
+			} else {
+				have_filelists =
+					access (filelists_db, R_OK) == 0;
+			}
+
+			if (have_filelists) {
+				low_debug ("Attaching %s - %s", repo->id,
+					   filelists_db);
+				attach_db (repo_sqlite->primary_db,
+					   filelists_db);
+				repo_sqlite->filelists_attached = true;
+			}
+			free (filelists_db);
+		}
+		low_repomd_free (repomd);
+	}
+
+	attached = repo_sqlite->filelists_attached;
+	pthread_mutex_unlock (&repo_sqlite->filelists_lock);
+
+	return attached;
+}
+
+/*
+ * Createrepo puts these files in primary.xml, so they're in primary's files
+ * table, and filelists are never needed to find them.
+ */
+static bool
+low_repo_sqlite_is_primary_file (const char *file)
+{
+	return strstr (file, "bin/") || g_str_has_prefix (file, "/etc/") ||
+		!strcmp (file, "/usr/lib/sendmail");
+}
+
 static LowPackageIter *
 low_repo_sqlite_search_primary_files (LowRepo *repo, const char *file)
 {
@@ -718,16 +1132,21 @@ low_repo_sqlite_search_filelists_files (LowRepo *repo, const char *file)
 			   "AND filename_match (f.filenames, :file)";
 
 	char *slash = rindex (file, '/');
-	char *filename = strdup ((char *) (slash + 1));
-	char *dirname = strndup (file, slash - file);
 
 	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
 	LowPackageIterSqlite *iter = low_package_iter_sqlite_new (repo);
 
+	/* Without filelists there's no statement, so no packages */
+	iter->pp_stmt = NULL;
+	if (!low_repo_sqlite_attach_filelists (repo_sqlite)) {
+		return (LowPackageIter *) iter;
+	}
+
 	sqlite3_prepare (repo_sqlite->primary_db, stmt, -1, &iter->pp_stmt,
 			 NULL);
-	sqlite3_bind_text (iter->pp_stmt, 1, dirname, -1, free);
-	sqlite3_bind_text (iter->pp_stmt, 2, filename, -1, free);
+	sqlite3_bind_text (iter->pp_stmt, 1, strndup (file, slash - file), -1,
+			   free);
+	sqlite3_bind_text (iter->pp_stmt, 2, strdup (slash + 1), -1, free);
 
 	return (LowPackageIter *) iter;
 }
@@ -735,13 +1154,572 @@ low_repo_sqlite_search_filelists_files (LowRepo *repo, const char *file)
 LowPackageIter *
 low_repo_sqlite_search_files (LowRepo *repo, const char *file)
 {
-	/* Createrepo puts these files in primary.xml */
-	if (strstr (file, "bin/") || g_str_has_prefix (file, "/etc/")
-	    || !strcmp (file, "/usr/lib/sendmail")) {
-		return low_repo_sqlite_search_primary_files (repo, file);
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+	LowPackageIterSqlite *iter;
+
+	if (low_repo_sqlite_is_primary_file (file)) {
+		iter = (LowPackageIterSqlite *)
+			low_repo_sqlite_search_primary_files (repo, file);
 	} else {
-		return low_repo_sqlite_search_filelists_files (repo, file);
+		iter = (LowPackageIterSqlite *)
+			low_repo_sqlite_search_filelists_files (repo, file);
 	}
+
+	iter->newest = repo_sqlite->newest;
+	iter->newest_fallback = true;
+
+	return (LowPackageIter *) iter;
+}
+
+/**
+ * Returns false if the repo definitely has no provide with this name.
+ */
+bool
+low_repo_sqlite_might_provide (LowRepo *repo, const char *name)
+{
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+
+	if (repo_sqlite->provides_bloom == NULL) {
+		return true;
+	}
+
+	return low_bloom_might_contain (repo_sqlite->provides_bloom, name);
+}
+
+/**
+ * Returns false if the repo definitely has no package owning this file.
+ */
+bool
+low_repo_sqlite_might_contain_file (LowRepo *repo, const char *file)
+{
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+
+	if (repo_sqlite->files_bloom == NULL) {
+		return true;
+	}
+
+	return low_bloom_might_contain (repo_sqlite->files_bloom, file);
+}
+
+static int
+low_repo_sqlite_count (sqlite3 *db, const char *stmt)
+{
+	sqlite3_stmt *pp_stmt;
+	int count = 0;
+
+	sqlite3_prepare (db, stmt, -1, &pp_stmt, NULL);
+	if (sqlite3_step (pp_stmt) == SQLITE_ROW) {
+		count = sqlite3_column_int (pp_stmt, 0);
+	}
+	sqlite3_finalize (pp_stmt);
+
+	return count;
+}
+
+static LowBloom *
+low_repo_sqlite_build_provides_filter (sqlite3 *db)
+{
+	const char *stmt = "SELECT DISTINCT name FROM provides";
+	sqlite3_stmt *pp_stmt;
+	LowBloom *bloom =
+		low_bloom_new (low_repo_sqlite_count (db, "SELECT count(*) "
+							  "FROM provides"));
+
+	sqlite3_prepare (db, stmt, -1, &pp_stmt, NULL);
+	while (sqlite3_step (pp_stmt) == SQLITE_ROW) {
+		low_bloom_add (bloom,
+			       (const char *) sqlite3_column_text (pp_stmt, 0));
+	}
+	sqlite3_finalize (pp_stmt);
+
+	return bloom;
+}
+
+static LowBloom *
+low_repo_sqlite_build_files_filter (sqlite3 *db)
+{
+	const char *stmt = "SELECT dirname, filenames FROM filelist";
+	sqlite3_stmt *pp_stmt;
+	LowBloom *bloom;
+
+	/* one more name than there are slashes in each filenames entry */
+	bloom = low_bloom_new (low_repo_sqlite_count (db,
+		"SELECT sum(length(filenames) - "
+		"length(replace(filenames, '/', '')) + 1) FROM filelist"));
+
+	sqlite3_prepare (db, stmt, -1, &pp_stmt, NULL);
+	while (sqlite3_step (pp_stmt) == SQLITE_ROW) {
+		int i;
+		const char *dir =
+			(const char *) sqlite3_column_text (pp_stmt, 0);
+		char **names =
+			g_strsplit ((const char *)
+				    sqlite3_column_text (pp_stmt, 1), "/", -1);
+
+		for (i = 0; names[i] != NULL; i++) {
+			char *file = g_strdup_printf ("%s/%s", dir, names[i]);
+			low_bloom_add (bloom, file);
+			free (file);
+		}
+
+		g_strfreev (names);
+	}
+	sqlite3_finalize (pp_stmt);
+
+	return bloom;
+}
+
+static void
+low_repo_sqlite_build_filter (const char *id, const char *name,
+			      const char *db_file,
+			      LowBloom *(*build_func) (sqlite3 *))
+{
+	sqlite3 *db = NULL;
+	char *filter_file = low_repo_sqlite_filter_file (id, name);
+	LowBloom *bloom =
+		low_repo_sqlite_load_current_filter (filter_file, db_file);
+	LowFileStamp db_stamp;
+
+	/*
+	 * Stamp the db before reading it. If it's replaced while we read,
+	 * the filter won't match the new one, and gets built again.
+	 */
+	if (bloom == NULL && low_util_file_stamp (db_file, &db_stamp) &&
+	    sqlite3_open_v2 (db_file, &db, SQLITE_OPEN_READONLY, NULL) ==
+	    SQLITE_OK) {
+		low_debug ("Building %s filter for %s", name, id);
+		bloom = build_func (db);
+		bloom->source = db_stamp;
+
+		if (!low_bloom_write (bloom, filter_file)) {
+			low_debug ("Unable to write %s", filter_file);
+		}
+	}
+	sqlite3_close (db);
+	low_bloom_free (bloom);
+
+	free (filter_file);
+}
+
+/*
+ * createrepo's indexes are only on the column each query filters on, so
+ * every match costs a trip to the table as well. These carry the rest of
+ * what our queries read, so sqlite can answer them from the index alone.
+ * Statements for tables a db doesn't have simply fail.
+ */
+static const char *low_repo_sqlite_indexes[] = {
+	/*
+	 * The package fields of SELECT_FIELDS, by name. By key, the table
+	 * is already the index, as pkgKey is its rowid.
+	 */
+	"CREATE INDEX IF NOT EXISTS low_packages_name ON packages "
+	"(name, pkgKey, arch, version, release, epoch, size_package, "
+	"location_href, pkgId, checksum_type)",
+
+	/* The low_repo_sqlite_search_* lookups */
+	"CREATE INDEX IF NOT EXISTS low_provides_name ON provides "
+	"(name, pkgKey, flags, epoch, version, release)",
+	"CREATE INDEX IF NOT EXISTS low_requires_name ON requires "
+	"(name, pkgKey)",
+	"CREATE INDEX IF NOT EXISTS low_conflicts_name ON conflicts "
+	"(name, pkgKey)",
+	"CREATE INDEX IF NOT EXISTS low_obsoletes_name ON obsoletes "
+	"(name, pkgKey)",
+	"CREATE INDEX IF NOT EXISTS low_files_name ON files (name, pkgKey)",
+
+	/* A package's own dependencies, as DEP_QUERY reads them */
+	"CREATE INDEX IF NOT EXISTS low_provides_key ON provides "
+	"(pkgKey, name, flags, epoch, version, release)",
+	"CREATE INDEX IF NOT EXISTS low_requires_key ON requires "
+	"(pkgKey, name, flags, epoch, version, release)",
+	"CREATE INDEX IF NOT EXISTS low_conflicts_key ON conflicts "
+	"(pkgKey, name, flags, epoch, version, release)",
+	"CREATE INDEX IF NOT EXISTS low_obsoletes_key ON obsoletes "
+	"(pkgKey, name, flags, epoch, version, release)",
+	NULL
+};
+
+#define COUNT_LOW_INDEXES \
+	"SELECT count(*) FROM sqlite_master " \
+	"WHERE type = 'index' AND name GLOB 'low_*'"
+
+/*
+ * How many of our indexes db has the tables for, whether it has the
+ * indexes yet or not.
+ */
+static int
+low_repo_sqlite_count_wanted_indexes (sqlite3 *db)
+{
+	sqlite3_stmt *pp_stmt;
+	int wanted = 0;
+	int i;
+
+	for (i = 0; low_repo_sqlite_indexes[i] != NULL; i++) {
+		if (sqlite3_prepare_v2 (db, low_repo_sqlite_indexes[i], -1,
+					&pp_stmt, NULL) == SQLITE_OK) {
+			wanted++;
+		}
+		sqlite3_finalize (pp_stmt);
+	}
+
+	return wanted;
+}
+
+static bool
+low_repo_sqlite_copy_file (const char *from, const char *to)
+{
+	char *tmp_file = g_strdup_printf ("%s.tmp", to);
+	char buf[32 * 1024];
+	ssize_t len = 0;
+	bool ok;
+	int in_fd;
+	int out_fd;
+
+	in_fd = open (from, O_RDONLY);
+	out_fd = open (tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ok = in_fd >= 0 && out_fd >= 0;
+
+	while (ok && (len = read (in_fd, buf, sizeof (buf))) > 0) {
+		ok = write (out_fd, buf, len) == len;
+	}
+	ok = ok && len == 0;
+
+	if (in_fd >= 0) {
+		close (in_fd);
+	}
+	if (out_fd >= 0 && close (out_fd) != 0) {
+		ok = false;
+	}
+
+	if (ok && rename (tmp_file, to) != 0) {
+		ok = false;
+	}
+
+	if (!ok) {
+		unlink (tmp_file);
+	}
+	free (tmp_file);
+
+	return ok;
+}
+
+/**
+ * Add our covering indexes to one of a repo's dbs in the cache, and
+ * ANALYZE it so the query planner knows to use them. A db that has
+ * them already is left alone. Returns true if db_file was changed.
+ *
+ * Indexing rewrites the first page, with the header and schema on it, so
+ * the file no longer matches its chunk index. If unindexed_file isn't
+ * NULL, db_file is copied there, as it was, before it changes.
+ */
+bool
+low_repo_sqlite_add_indexes (const char *db_file, const char *unindexed_file)
+{
+	sqlite3 *db;
+	int before;
+	int after;
+	int i;
+
+	if (sqlite3_open_v2 (db_file, &db, SQLITE_OPEN_READWRITE, NULL) !=
+	    SQLITE_OK) {
+		sqlite3_close (db);
+		return false;
+	}
+
+	before = low_repo_sqlite_count (db, COUNT_LOW_INDEXES);
+	if (low_repo_sqlite_count_wanted_indexes (db) <= before) {
+		sqlite3_close (db);
+		return false;
+	}
+
+	if (unindexed_file != NULL &&
+	    !low_repo_sqlite_copy_file (db_file, unindexed_file)) {
+		low_debug ("Unable to copy %s to %s", db_file, unindexed_file);
+	}
+
+	sqlite3_exec (db, "BEGIN", NULL, NULL, NULL);
+	for (i = 0; low_repo_sqlite_indexes[i] != NULL; i++) {
+		sqlite3_exec (db, low_repo_sqlite_indexes[i], NULL, NULL,
+			      NULL);
+	}
+
+	after = low_repo_sqlite_count (db, COUNT_LOW_INDEXES);
+	if (after > before) {
+		low_debug ("Indexed %s", db_file);
+		sqlite3_exec (db, "ANALYZE", NULL, NULL, NULL);
+	}
+
+	if (sqlite3_exec (db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		low_debug ("Unable to index %s: %s", db_file,
+			   sqlite3_errmsg (db));
+		sqlite3_exec (db, "ROLLBACK", NULL, NULL, NULL);
+		after = before;
+	}
+	sqlite3_close (db);
+
+	return after > before;
+}
+
+/**
+ * Build the provides and files Bloom filters for a refreshed repo, if they
+ * are missing or weren't built from the repo's dbs as they are now. They're
+ * stored alongside the dbs in the cache, and let a LowRepoSet skip this
+ * repo without a query.
+ */
+void
+low_repo_sqlite_build_filters (LowRepo *repo)
+{
+	char *repomd_file;
+	LowRepomd *repomd;
+	char *primary_db;
+	char *filelists_db;
+
+	repomd_file = g_strdup_printf (LOCAL_CACHE "/%s/repomd.xml",
+				       repo->id);
+	repomd = low_repomd_parse (repomd_file);
+	free (repomd_file);
+
+	if (repomd == NULL) {
+		return;
+	}
+
+	primary_db = low_repo_sqlite_repomd_primary_db (repo->id, repomd);
+	filelists_db = low_repo_sqlite_repomd_filelists_db (repo->id, repomd);
+	if (primary_db == NULL || filelists_db == NULL) {
+		free (primary_db);
+		free (filelists_db);
+		low_repomd_free (repomd);
+		return;
+	}
+
+	low_repo_sqlite_build_filter (repo->id, "provides", primary_db,
+				      low_repo_sqlite_build_provides_filter);
+	low_repo_sqlite_build_filter (repo->id, "files", filelists_db,
+				      low_repo_sqlite_build_files_filter);
+
+	free (primary_db);
+	free (filelists_db);
+	low_repomd_free (repomd);
+}
+
+static char *
+low_repo_sqlite_newest_file (const char *id)
+{
+	return g_strdup_printf (LOCAL_CACHE "/%s/newest.keys", id);
+}
+
+static char *
+low_repo_sqlite_primary_db_file (LowRepo *repo)
+{
+	char *repomd_file;
+	LowRepomd *repomd;
+	char *primary_db = NULL;
+
+	repomd_file = g_strdup_printf (LOCAL_CACHE "/%s/repomd.xml",
+				       repo->id);
+	repomd = low_repomd_parse (repomd_file);
+	free (repomd_file);
+
+	if (repomd != NULL) {
+		primary_db = low_repo_sqlite_repomd_primary_db (repo->id,
+								repomd);
+	}
+
+	low_repomd_free (repomd);
+	return primary_db;
+}
+
+typedef struct _LowRepoSqliteCandidate {
+	LowRepo *repo;
+	uint32_t key;
+	char *evr;
+} LowRepoSqliteCandidate;
+
+static void
+low_repo_sqlite_candidate_free (gpointer data)
+{
+	LowRepoSqliteCandidate *candidate = (LowRepoSqliteCandidate *) data;
+
+	free (candidate->evr);
+	free (candidate);
+}
+
+/*
+ * Offer every package in repo up as the newest of its name and arch. Repos
+ * come in priority order, so anything already there from a better repo
+ * stays put regardless of version.
+ */
+static bool
+low_repo_sqlite_collect_newest (LowRepo *repo, GHashTable *best,
+				LowFileStamp *db_stamp)
+{
+	const char *stmt = "SELECT pkgKey, name, arch, epoch, version, "
+			   "release FROM packages";
+	char *db_file = low_repo_sqlite_primary_db_file (repo);
+	sqlite3 *db = NULL;
+	sqlite3_stmt *pp_stmt;
+
+	/* Stamped first, so a db replaced as we read won't match the view */
+	if (db_file == NULL || !low_util_file_stamp (db_file, db_stamp) ||
+	    sqlite3_open_v2 (db_file, &db, SQLITE_OPEN_READONLY, NULL) !=
+	    SQLITE_OK) {
+		sqlite3_close (db);
+		free (db_file);
+		return false;
+	}
+
+	sqlite3_prepare (db, stmt, -1, &pp_stmt, NULL);
+	while (sqlite3_step (pp_stmt) == SQLITE_ROW) {
+		const char *epoch =
+			(const char *) sqlite3_column_text (pp_stmt, 3);
+		char *name_arch =
+			g_strdup_printf ("%s.%s",
+					 sqlite3_column_text (pp_stmt, 1),
+					 sqlite3_column_text (pp_stmt, 2));
+		char *evr = g_strdup_printf ("%s:%s-%s", epoch ? epoch : "0",
+					     sqlite3_column_text (pp_stmt, 4),
+					     sqlite3_column_text (pp_stmt, 5));
+		LowRepoSqliteCandidate *candidate =
+			g_hash_table_lookup (best, name_arch);
+
+		if (candidate == NULL) {
+			candidate = malloc (sizeof (LowRepoSqliteCandidate));
+			g_hash_table_insert (best, name_arch, candidate);
+		} else if (candidate->repo->priority == repo->priority &&
+			   low_util_evr_cmp (evr, candidate->evr) > 0) {
+			free (name_arch);
+			free (candidate->evr);
+		} else {
+			free (name_arch);
+			free (evr);
+			continue;
+		}
+
+		candidate->repo = repo;
+		candidate->key = sqlite3_column_int (pp_stmt, 0);
+		candidate->evr = evr;
+	}
+	sqlite3_finalize (pp_stmt);
+	sqlite3_close (db);
+
+	free (db_file);
+	return true;
+}
+
+/**
+ * Work out the newest version of each name and arch across count repos,
+ * and save each repo's share of that view in its cache directory, tagged
+ * with set_signature. The repos must be in search order. Nothing is
+ * written unless every repo could be read.
+ */
+void
+low_repo_sqlite_build_newest (LowRepo **repos, unsigned int count,
+			      uint32_t set_signature)
+{
+	GHashTable *best = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  free,
+						  low_repo_sqlite_candidate_free);
+	LowFileStamp *db_stamps = malloc (sizeof (LowFileStamp) * count);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (!low_repo_sqlite_collect_newest (repos[i], best,
+						     &db_stamps[i])) {
+			low_debug ("Can't read %s, not building newest view",
+				   repos[i]->id);
+			g_hash_table_destroy (best);
+			free (db_stamps);
+			return;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		GHashTableIter iter;
+		LowRepoSqliteCandidate *candidate;
+		GArray *keys = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+		char *newest_file = low_repo_sqlite_newest_file (repos[i]->id);
+
+		g_hash_table_iter_init (&iter, best);
+		while (g_hash_table_iter_next (&iter, NULL,
+					       (gpointer) &candidate)) {
+			if (candidate->repo == repos[i]) {
+				g_array_append_val (keys, candidate->key);
+			}
+		}
+
+		if (!low_newest_write (newest_file, set_signature,
+				       &db_stamps[i],
+				       (uint32_t *) keys->data, keys->len)) {
+			low_debug ("Unable to write %s", newest_file);
+		}
+
+		free (newest_file);
+		g_array_free (keys, TRUE);
+	}
+
+	g_hash_table_destroy (best);
+	free (db_stamps);
+}
+
+/**
+ * Limit name, provides and file searches to the newest only view saved by
+ * low_repo_sqlite_build_newest. Returns false, and leaves the repo alone,
+ * if there is no view for set_signature or it wasn't built from the repo's
+ * db as it is now.
+ */
+bool
+low_repo_sqlite_load_newest (LowRepo *repo, uint32_t set_signature)
+{
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+	LowNewest *newest = NULL;
+	LowFileStamp db_stamp;
+	char *db_file;
+	char *newest_file;
+
+	if (repo_sqlite->primary_db == NULL) {
+		return false;
+	}
+
+	db_file = low_repo_sqlite_primary_db_file (repo);
+	newest_file = low_repo_sqlite_newest_file (repo->id);
+
+	if (db_file != NULL && low_util_file_stamp (db_file, &db_stamp)) {
+		newest = low_newest_load (newest_file);
+	}
+
+	if (newest != NULL &&
+	    !low_util_file_stamp_equal (&newest->source, &db_stamp)) {
+		low_debug ("Newest view for %s is out of date", repo->id);
+		low_newest_free (newest);
+		newest = NULL;
+	}
+
+	if (newest != NULL && newest->signature != set_signature) {
+		low_debug ("Newest view for %s is for other repos", repo->id);
+		low_newest_free (newest);
+		newest = NULL;
+	}
+
+	free (newest_file);
+	free (db_file);
+
+	if (newest == NULL) {
+		return false;
+	}
+
+	low_newest_free (repo_sqlite->newest);
+	repo_sqlite->newest = newest;
+
+	return true;
+}
+
+void
+low_repo_sqlite_unload_newest (LowRepo *repo)
+{
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+
+	low_newest_free (repo_sqlite->newest);
+	repo_sqlite->newest = NULL;
 }
 
 /**
@@ -834,19 +1812,37 @@ build_mirror_list (LowRepo *repo)
 		free (mirrors_file);
 	}
 
+	if (all_mirrors != NULL) {
+		char *stats_file =
+			g_strdup_printf ("/var/cache/yum/%s/mirrorstats",
+					 repo->id);
+
+		low_mirror_list_load_stats (all_mirrors, stats_file);
+
+		free (stats_file);
+	}
+
 	return all_mirrors;
 }
 
+/*
+ * Downloads for the same repo can start on several threads at once, and
+ * they all have to share one list to share its stats.
+ */
 LowMirrorList *
 low_repo_sqlite_get_mirror_list (LowRepo *repo)
 {
 	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) repo;
+	LowMirrorList *mirrors;
 
+	pthread_mutex_lock (&repo_sqlite->mirrors_lock);
 	if (repo_sqlite->mirrors == NULL) {
 		repo_sqlite->mirrors = build_mirror_list (repo);
 	}
+	mirrors = repo_sqlite->mirrors;
+	pthread_mutex_unlock (&repo_sqlite->mirrors_lock);
 
-	return repo_sqlite->mirrors;
+	return mirrors;
 }
 
 LowDelta *
@@ -947,10 +1943,16 @@ low_sqlite_package_get_files (LowPackage *pkg)
 	sqlite3_stmt *pp_stmt;
 	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) pkg->repo;
 
+	/* Without filelists, there are no files to list */
+	if (!low_repo_sqlite_attach_filelists (repo_sqlite)) {
+		files[0] = NULL;
+		return files;
+	}
+
 	sqlite3_prepare (repo_sqlite->primary_db, stmt, -1, &pp_stmt, NULL);
 	sqlite3_bind_int (pp_stmt, 1, *((int *) pkg->id));
 
-	while (sqlite3_step (pp_stmt) != SQLITE_DONE) {
+	while (sqlite3_step (pp_stmt) == SQLITE_ROW) {
 		int j;
 		const unsigned char *dir = sqlite3_column_text (pp_stmt, 0);
 		const unsigned char *names = sqlite3_column_text (pp_stmt, 1);
@@ -975,4 +1977,46 @@ low_sqlite_package_get_files (LowPackage *pkg)
 	return files;
 }
 
+/*
+ * Filelists are only attached, and maybe fetched, for files primary
+ * doesn't carry.
+ */
+bool
+low_sqlite_package_has_file (LowPackage *pkg, const char *file)
+{
+	const char *primary_stmt = "SELECT 1 FROM files "
+				   "WHERE pkgKey = :pkgKey AND name = :file";
+	const char *filelists_stmt = "SELECT 1 FROM filelist "
+				     "WHERE pkgKey = :pkgKey "
+				     "AND dirname = :dir "
+				     "AND filename_match (filenames, :file)";
+
+	LowRepoSqlite *repo_sqlite = (LowRepoSqlite *) pkg->repo;
+	const char *slash = rindex (file, '/');
+	sqlite3_stmt *pp_stmt;
+	bool found;
+
+	if (low_repo_sqlite_is_primary_file (file)) {
+		sqlite3_prepare (repo_sqlite->primary_db, primary_stmt, -1,
+				 &pp_stmt, NULL);
+		sqlite3_bind_int (pp_stmt, 1, *((int *) pkg->id));
+		sqlite3_bind_text (pp_stmt, 2, file, -1, SQLITE_STATIC);
+	} else if (slash != NULL &&
+		   low_repo_sqlite_attach_filelists (repo_sqlite)) {
+		sqlite3_prepare (repo_sqlite->primary_db, filelists_stmt, -1,
+				 &pp_stmt, NULL);
+		sqlite3_bind_int (pp_stmt, 1, *((int *) pkg->id));
+		sqlite3_bind_text (pp_stmt, 2, strndup (file, slash - file),
+				   -1, free);
+		sqlite3_bind_text (pp_stmt, 3, slash + 1, -1, SQLITE_STATIC);
+	} else {
+		return false;
+	}
+
+	found = sqlite3_step (pp_stmt) == SQLITE_ROW;
+	sqlite3_finalize (pp_stmt);
+
+	return found;
+}
+
 /* vim: set ts=8 sw=8 noet: */
@@ -19,15 +19,21 @@
  *  02110-1301  USA
  */
 
+#include <stdint.h>
 #include <sqlite3.h>
 #include "low-repo.h"
 #include "low-package.h"
 #include "low-mirror-list.h"
 #include "low-delta-parser.h"
+#include "low-repomd-parser.h"
 
 #ifndef _LOW_REPO_SQLITE_H_
 #define _LOW_REPO_SQLITE_H_
 
+/* Get data into the cache, if it isn't already. False if it can't be */
+typedef bool (*LowRepoSqliteFetchFunc) (LowRepo *repo, LowRepomdData *data,
+					LowRepomdData *chunks);
+
 LowRepo *           low_repo_sqlite_initialize   (const char *id,
 						  const char *name,
 						  const char *baseurl,
@@ -36,12 +42,17 @@ LowRepo *           low_repo_sqlite_initialize   (const char *id,
 						  bool bind_dbs);
 void                low_repo_sqlite_shutdown     (LowRepo *repo);
 
+void                low_repo_sqlite_set_filelists_fetch (LowRepoSqliteFetchFunc func);
+
 LowPackageIter *    low_repo_sqlite_list_all     (LowRepo *repo);
 LowPackageIter *    low_repo_sqlite_list_by_name (LowRepo *repo,
 						  const char *name);
 
 LowPackageIter *    low_repo_sqlite_search_provides     (LowRepo *repo,
 							 const LowPackageDependency *provides);
+GList **           low_repo_sqlite_search_provides_batch	(LowRepo *repo,
+							 LowPackageDependency **provides,
+							 unsigned int count);
 LowPackageIter *    low_repo_sqlite_search_requires     (LowRepo *repo,
 							 const LowPackageDependency *requires);
 LowPackageIter *    low_repo_sqlite_search_conflicts 	(LowRepo *repo,
@@ -55,6 +66,21 @@ LowPackageIter *    low_repo_sqlite_search_files 	(LowRepo *repo,
 LowPackageIter *	low_repo_sqlite_search_details 	(LowRepo *repo,
 							 const char *querystr);
 
+bool                low_repo_sqlite_might_provide 	(LowRepo *repo,
+							 const char *name);
+bool                low_repo_sqlite_might_contain_file	(LowRepo *repo,
+							 const char *file);
+void                low_repo_sqlite_build_filters 	(LowRepo *repo);
+bool                low_repo_sqlite_add_indexes 	(const char *db_file,
+							 const char *unindexed_file);
+
+void                low_repo_sqlite_build_newest 	(LowRepo **repos,
+							 unsigned int count,
+							 uint32_t set_signature);
+bool                low_repo_sqlite_load_newest 	(LowRepo *repo,
+							 uint32_t set_signature);
+void                low_repo_sqlite_unload_newest 	(LowRepo *repo);
+
 LowMirrorList *low_repo_sqlite_get_mirror_list (LowRepo *repo);
 LowDelta *low_repo_sqlite_get_delta (LowRepo *repo);
 
@@ -24,12 +24,20 @@
 #ifndef _LOW_REPO_H_
 #define _LOW_REPO_H_
 
+#define LOW_REPO_DEFAULT_PRIORITY 99
+#define LOW_REPO_DEFAULT_COST 1000
+/* yum's default: refresh metadata that's more than 6 hours old */
+#define LOW_REPO_DEFAULT_METADATA_EXPIRE (6 * 60 * 60)
+
 typedef struct _LowRepo {
 	char *id;
 	char *name;
 	char *baseurl;
 	char *mirror_list;
 	bool enabled;
+	int priority;	/**< Lower numbers win, as with yum-priorities */
+	int cost;	/**< Orders repos of equal priority; cheaper first */
+	int metadata_expire;	/**< Seconds metadata is good for; -1 forever */
 } LowRepo;
 
 #endif /* _LOW_REPO_H__ */
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -32,23 +33,90 @@
 
 enum {
 	REPODATA_STATE_BEGIN,
-	REPODATA_STATE_PRIMARY_DB,
-	REPODATA_STATE_FILELISTS_DB,
-	REPODATA_STATE_PRIMARY,
-	REPODATA_STATE_FILELISTS,
-	REPODATA_STATE_DELTA,
-	REPODATA_STATE_PRIMARY_DB_TIMESTAMP,
-	REPODATA_STATE_FILELISTS_DB_TIMESTAMP,
-	REPODATA_STATE_PRIMARY_TIMESTAMP,
-	REPODATA_STATE_FILELISTS_TIMESTAMP,
-	REPODATA_STATE_DELTA_TIMESTAMP,
+	REPODATA_STATE_DATA,
+	REPODATA_STATE_TIMESTAMP,
+	REPODATA_STATE_CHECKSUM,
+	REPODATA_STATE_OPEN_CHECKSUM,
+	REPODATA_STATE_SIZE,
+	REPODATA_STATE_OPEN_SIZE,
 };
 
+/* Long enough for any checksum or timestamp we care about */
+#define TEXT_SIZE 256
+
 struct repodata_context {
 	int state;
 	LowRepomd *repomd;
+	LowRepomdData **data_slot;
+	LowRepomdData *data;	/**< The <data> we're inside of, if any */
+	char text[TEXT_SIZE];
+	size_t text_len;
 };
 
+static LowRepomdData *
+low_repomd_data_new (void)
+{
+	LowRepomdData *data = malloc (sizeof (LowRepomdData));
+
+	data->location = NULL;
+	data->timestamp = 0;
+	data->checksum = NULL;
+	data->checksum_type = DIGEST_NONE;
+	data->size = 0;
+	data->open_checksum = NULL;
+	data->open_checksum_type = DIGEST_NONE;
+	data->open_size = 0;
+
+	return data;
+}
+
+static void
+low_repomd_data_free (LowRepomdData *data)
+{
+	if (data != NULL) {
+		free (data->location);
+		free (data->checksum);
+		free (data->open_checksum);
+		free (data);
+	}
+}
+
+static LowRepomdData **
+low_repomd_data_for_type (LowRepomd *repomd, const char *type)
+{
+	if (strcmp (type, "primary_db") == 0) {
+		return &repomd->primary_db;
+	} else if (strcmp (type, "filelists_db") == 0) {
+		return &repomd->filelists_db;
+	} else if (strcmp (type, "primary") == 0) {
+		return &repomd->primary_xml;
+	} else if (strcmp (type, "filelists") == 0) {
+		return &repomd->filelists_xml;
+	} else if (strcmp (type, "prestodelta") == 0) {
+		return &repomd->delta_xml;
+	} else if (strcmp (type, "primary_db_chunks") == 0) {
+		return &repomd->primary_db_chunks;
+	} else if (strcmp (type, "filelists_db_chunks") == 0) {
+		return &repomd->filelists_db_chunks;
+	}
+
+	return NULL;
+}
+
+static LowDigestType
+low_repomd_checksum_type (const char **atts)
+{
+	int i;
+
+	for (i = 0; atts[i]; i += 2) {
+		if (strcmp (atts[i], "type") == 0) {
+			return low_util_digest_type_from_string (atts[i + 1]);
+		}
+	}
+
+	return DIGEST_UNKNOWN;
+}
+
 static void
 low_repomd_start_element (void *data, const char *name, const char **atts)
 {
@@ -58,74 +126,46 @@ low_repomd_start_element (void *data, const char *name, const char **atts)
 	if (strcmp (name, "data") == 0) {
 		for (i = 0; atts[i]; i += 2) {
 			if (strcmp (atts[i], "type") == 0) {
-				if (strcmp (atts[i + 1], "primary_db") == 0)
-					ctx->state = REPODATA_STATE_PRIMARY_DB;
-				else if (strcmp (atts[i + 1], "filelists_db") ==
-					 0)
-					ctx->state =
-						REPODATA_STATE_FILELISTS_DB;
-				else if (strcmp (atts[i + 1], "primary") == 0)
-					ctx->state = REPODATA_STATE_PRIMARY;
-				else if (strcmp (atts[i + 1], "filelists") == 0)
-					ctx->state = REPODATA_STATE_FILELISTS;
-				else if (strcmp (atts[i + 1], "prestodelta") ==
-					 0)
-					ctx->state = REPODATA_STATE_DELTA;
+				LowRepomdData **repomd_data =
+					low_repomd_data_for_type (ctx->repomd,
+								  atts[i + 1]);
 
+				if (repomd_data != NULL &&
+				    *repomd_data == NULL) {
+					*repomd_data = low_repomd_data_new ();
+					ctx->data_slot = repomd_data;
+					ctx->data = *repomd_data;
+					ctx->state = REPODATA_STATE_DATA;
+				}
 			}
 		}
+	} else if (ctx->data == NULL) {
+		return;
 	} else if (strcmp (name, "location") == 0) {
 		for (i = 0; atts[i]; i += 2) {
 			if (strcmp (atts[i], "href") == 0) {
-				switch (ctx->state) {
-					case REPODATA_STATE_PRIMARY_DB:
-						ctx->repomd->primary_db =
-							strdup (atts[i + 1]);
-						break;
-					case REPODATA_STATE_FILELISTS_DB:
-						ctx->repomd->filelists_db =
-							strdup (atts[i + 1]);
-						break;
-					case REPODATA_STATE_DELTA:
-						ctx->repomd->delta_xml =
-							strdup (atts[i + 1]);
-						break;
-					case REPODATA_STATE_PRIMARY:
-						ctx->repomd->primary_xml =
-							strdup (atts[i + 1]);
-						break;
-					case REPODATA_STATE_FILELISTS:
-						ctx->repomd->filelists_xml =
-							strdup (atts[i + 1]);
-						break;
-					default:
-						break;
-				}
-
+				free (ctx->data->location);
+				ctx->data->location = strdup (atts[i + 1]);
 			}
 		}
 	} else if (strcmp (name, "timestamp") == 0) {
-		switch (ctx->state) {
-			case REPODATA_STATE_PRIMARY_DB:
-				ctx->state =
-					REPODATA_STATE_PRIMARY_DB_TIMESTAMP;
-				break;
-			case REPODATA_STATE_FILELISTS_DB:
-				ctx->state =
-					REPODATA_STATE_FILELISTS_DB_TIMESTAMP;
-			case REPODATA_STATE_PRIMARY:
-				ctx->state = REPODATA_STATE_PRIMARY_TIMESTAMP;
-				break;
-			case REPODATA_STATE_FILELISTS:
-				ctx->state = REPODATA_STATE_FILELISTS_TIMESTAMP;
-
-			case REPODATA_STATE_DELTA:
-				ctx->state = REPODATA_STATE_DELTA_TIMESTAMP;
-			default:
-				break;
-		}
+		ctx->state = REPODATA_STATE_TIMESTAMP;
+		ctx->text_len = 0;
+	} else if (strcmp (name, "checksum") == 0) {
+		ctx->data->checksum_type = low_repomd_checksum_type (atts);
+		ctx->state = REPODATA_STATE_CHECKSUM;
+		ctx->text_len = 0;
+	} else if (strcmp (name, "open-checksum") == 0) {
+		ctx->data->open_checksum_type = low_repomd_checksum_type (atts);
+		ctx->state = REPODATA_STATE_OPEN_CHECKSUM;
+		ctx->text_len = 0;
+	} else if (strcmp (name, "size") == 0) {
+		ctx->state = REPODATA_STATE_SIZE;
+		ctx->text_len = 0;
+	} else if (strcmp (name, "open-size") == 0) {
+		ctx->state = REPODATA_STATE_OPEN_SIZE;
+		ctx->text_len = 0;
 	}
-
 }
 
 static void
@@ -133,36 +173,69 @@ low_repomd_end_element (void *data, const char *name)
 {
 	struct repodata_context *ctx = data;
 
-	if (strcmp (name, "data") == 0) {
+	ctx->text[ctx->text_len] = '\0';
+
+	switch (ctx->state) {
+		case REPODATA_STATE_TIMESTAMP:
+			ctx->data->timestamp = strtoul (ctx->text, NULL, 10);
+			ctx->state = REPODATA_STATE_DATA;
+			break;
+		case REPODATA_STATE_CHECKSUM:
+			free (ctx->data->checksum);
+			ctx->data->checksum = strdup (g_strstrip (ctx->text));
+			ctx->state = REPODATA_STATE_DATA;
+			break;
+		case REPODATA_STATE_OPEN_CHECKSUM:
+			free (ctx->data->open_checksum);
+			ctx->data->open_checksum =
+				strdup (g_strstrip (ctx->text));
+			ctx->state = REPODATA_STATE_DATA;
+			break;
+		case REPODATA_STATE_SIZE:
+			ctx->data->size = strtoll (ctx->text, NULL, 10);
+			ctx->state = REPODATA_STATE_DATA;
+			break;
+		case REPODATA_STATE_OPEN_SIZE:
+			ctx->data->open_size = strtoll (ctx->text, NULL, 10);
+			ctx->state = REPODATA_STATE_DATA;
+			break;
+		case REPODATA_STATE_BEGIN:
+		case REPODATA_STATE_DATA:
+		default:
+			break;
+	}
+
+	if (strcmp (name, "data") == 0 && ctx->data != NULL) {
+		/* No use to anyone if we don't know where to get it */
+		if (ctx->data->location == NULL) {
+			low_repomd_data_free (ctx->data);
+			*ctx->data_slot = NULL;
+		}
+		ctx->data = NULL;
 		ctx->state = REPODATA_STATE_BEGIN;
 	}
 }
 
 static void
-low_repomd_character_data (void *data, const XML_Char *s, int len G_GNUC_UNUSED)
+low_repomd_character_data (void *data, const XML_Char *s, int len)
 {
 	struct repodata_context *ctx = data;
+	size_t to_copy;
 
 	switch (ctx->state) {
-		case REPODATA_STATE_PRIMARY_DB_TIMESTAMP:
-			ctx->repomd->primary_db_time = strtoul (s, NULL, 10);
-			ctx->state = REPODATA_STATE_PRIMARY_DB;
+		case REPODATA_STATE_TIMESTAMP:
+		case REPODATA_STATE_CHECKSUM:
+		case REPODATA_STATE_OPEN_CHECKSUM:
+		case REPODATA_STATE_SIZE:
+		case REPODATA_STATE_OPEN_SIZE:
+			/* Expat can hand us the text in pieces */
+			to_copy = MIN ((size_t) len,
+				       TEXT_SIZE - 1 - ctx->text_len);
+			memcpy (ctx->text + ctx->text_len, s, to_copy);
+			ctx->text_len += to_copy;
 			break;
-		case REPODATA_STATE_FILELISTS_DB_TIMESTAMP:
-			ctx->repomd->filelists_db_time = strtoul (s, NULL, 10);
-			ctx->state = REPODATA_STATE_FILELISTS_DB;
-		case REPODATA_STATE_PRIMARY_TIMESTAMP:
-			ctx->repomd->primary_xml_time = strtoul (s, NULL, 10);
-			ctx->state = REPODATA_STATE_PRIMARY;
-			break;
-		case REPODATA_STATE_FILELISTS_TIMESTAMP:
-			ctx->repomd->filelists_xml_time = strtoul (s, NULL, 10);
-			ctx->state = REPODATA_STATE_FILELISTS;
-
-		case REPODATA_STATE_DELTA_TIMESTAMP:
-			ctx->repomd->delta_xml_time = strtoul (s, NULL, 10);
-			ctx->state = REPODATA_STATE_DELTA;
-
+		case REPODATA_STATE_BEGIN:
+		case REPODATA_STATE_DATA:
 		default:
 			break;
 	}
@@ -181,6 +254,9 @@ low_repomd_parse (const char *repodata)
 	XML_ParsingStatus status;
 
 	ctx.state = REPODATA_STATE_BEGIN;
+	ctx.data_slot = NULL;
+	ctx.data = NULL;
+	ctx.text_len = 0;
 
 	parser = XML_ParserCreate (NULL);
 	XML_SetUserData (parser, &ctx);
@@ -234,9 +310,13 @@ void
 low_repomd_free (LowRepomd *repomd)
 {
 	if (repomd != NULL) {
-		free (repomd->primary_db);
-		free (repomd->filelists_db);
-		free (repomd->delta_xml);
+		low_repomd_data_free (repomd->primary_db);
+		low_repomd_data_free (repomd->filelists_db);
+		low_repomd_data_free (repomd->primary_xml);
+		low_repomd_data_free (repomd->filelists_xml);
+		low_repomd_data_free (repomd->delta_xml);
+		low_repomd_data_free (repomd->primary_db_chunks);
+		low_repomd_data_free (repomd->filelists_db_chunks);
 		free (repomd);
 	}
 }
@@ -22,22 +22,33 @@
 #ifndef _LOW_REPOMD_PARSER_H_
 #define _LOW_REPOMD_PARSER_H_
 
-typedef struct _LowRepomd {
-	char *primary_db;
-	time_t primary_db_time;
-
-	char *filelists_db;
-	time_t filelists_db_time;
-
-	char *primary_xml;
-	time_t primary_xml_time;
+#include <time.h>
+#include <sys/types.h>
 
-	char *filelists_xml;
-	time_t filelists_xml_time;
+#include "low-util.h"
 
-	char *delta_xml;
-	time_t delta_xml_time;
+/**
+ * One of the files repomd.xml points to.
+ */
+typedef struct _LowRepomdData {
+	char *location;
+	time_t timestamp;
+	char *checksum;		/**< Of the file as downloaded */
+	LowDigestType checksum_type;
+	off_t size;
+	char *open_checksum;	/**< Of the file once uncompressed */
+	LowDigestType open_checksum_type;
+	off_t open_size;
+} LowRepomdData;
 
+typedef struct _LowRepomd {
+	LowRepomdData *primary_db;
+	LowRepomdData *filelists_db;
+	LowRepomdData *primary_xml;
+	LowRepomdData *filelists_xml;
+	LowRepomdData *delta_xml;
+	LowRepomdData *primary_db_chunks;	/**< Chunk indexes, if any */
+	LowRepomdData *filelists_db_chunks;
 } LowRepomd;
 
 LowRepomd *low_repomd_parse (const char *repodata);
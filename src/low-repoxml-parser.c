@@ -26,9 +26,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <expat.h>
+#include <glib.h>
 
 #include "low-sqlite-importer.h"
 
@@ -59,9 +62,9 @@ struct repoxml_context {
 
 	LowSqliteImporter *importer;
 
-	XML_Parser primary_parser;
-	XML_Parser filelists_parser;
-	XML_Parser current_parser;
+	const char *filename;
+	XML_Parser parser;
+	bool ok;
 
 	char name[256];
 	char arch[64];
@@ -70,13 +73,44 @@ struct repoxml_context {
 	char url[256];
 	char license[64];
 	char group[256];
-	char buffer[512];
-	char *p;
+	char buffer[4096];
+	char filetype[16];
+	char *p;		/**< Where character data goes next */
+	char *end;		/**< The last byte p can use, for the NUL */
 
-	char pkgid[128];
+	char pkgid[128 + 1];	/**< Room for a sha512 in hex */
 	uint32_t dependency_type;
 };
 
+/*
+ * Start collecting the character data of an element into text, which is
+ * emptied first so an element with no data doesn't pick up the last one.
+ */
+static void
+repoxml_start_text (struct repoxml_context *ctx, int state, char *text,
+		    size_t size)
+{
+	ctx->state = state;
+	ctx->p = text;
+	ctx->end = text + size - 1;
+	*text = '\0';
+}
+
+static void
+repoxml_file_start_element (struct repoxml_context *ctx, const char **atts)
+{
+	int i;
+
+	repoxml_start_text (ctx, REPOXML_STATE_FILE, ctx->buffer,
+			    sizeof (ctx->buffer));
+	strcpy (ctx->filetype, "file");
+	for (i = 0; atts[i]; i += 2) {
+		if (strcmp (atts[i], "type") == 0)
+			snprintf (ctx->filetype, sizeof (ctx->filetype), "%s",
+				  atts[i + 1]);
+	}
+}
+
 static void
 repoxml_primary_start_element (void *data, const char *name, const char **atts)
 {
@@ -92,11 +126,11 @@ repoxml_primary_start_element (void *data, const char *name, const char **atts)
 				ctx->total = atoi (atts[i + 1]);
 		}
 	} else if (strcmp (name, "name") == 0) {
-		ctx->state = REPOXML_STATE_PACKAGE_NAME;
-		ctx->p = ctx->name;
+		repoxml_start_text (ctx, REPOXML_STATE_PACKAGE_NAME, ctx->name,
+				    sizeof (ctx->name));
 	} else if (strcmp (name, "arch") == 0) {
-		ctx->state = REPOXML_STATE_PACKAGE_ARCH;
-		ctx->p = ctx->arch;
+		repoxml_start_text (ctx, REPOXML_STATE_PACKAGE_ARCH, ctx->arch,
+				    sizeof (ctx->arch));
 	} else if (strcmp (name, "version") == 0) {
 		epoch = NULL;
 		version = NULL;
@@ -119,23 +153,26 @@ repoxml_primary_start_element (void *data, const char *name, const char **atts)
 						   ctx->arch, epoch, version,
 						   release);
 	} else if (strcmp (name, "summary") == 0) {
-		ctx->p = ctx->summary;
-		ctx->state = REPOXML_STATE_SUMMARY;
+		repoxml_start_text (ctx, REPOXML_STATE_SUMMARY, ctx->summary,
+				    sizeof (ctx->summary));
 	} else if (strcmp (name, "description") == 0) {
-		ctx->p = ctx->description;
-		ctx->state = REPOXML_STATE_DESCRIPTION;
+		repoxml_start_text (ctx, REPOXML_STATE_DESCRIPTION,
+				    ctx->description,
+				    sizeof (ctx->description));
 	} else if (strcmp (name, "url") == 0) {
-		ctx->p = ctx->url;
-		ctx->state = REPOXML_STATE_URL;
+		repoxml_start_text (ctx, REPOXML_STATE_URL, ctx->url,
+				    sizeof (ctx->url));
 	} else if (strcmp (name, "checksum") == 0) {
-		ctx->p = ctx->pkgid;
-		ctx->state = REPOXML_STATE_CHECKSUM;
+		repoxml_start_text (ctx, REPOXML_STATE_CHECKSUM, ctx->pkgid,
+				    sizeof (ctx->pkgid));
 	} else if (strcmp (name, "rpm:license") == 0) {
-		ctx->p = ctx->license;
-		ctx->state = REPOXML_STATE_LICENSE;
+		repoxml_start_text (ctx, REPOXML_STATE_LICENSE, ctx->license,
+				    sizeof (ctx->license));
 	} else if (strcmp (name, "rpm:group") == 0) {
-		ctx->p = ctx->group;
-		ctx->state = REPOXML_STATE_GROUP;
+		repoxml_start_text (ctx, REPOXML_STATE_GROUP, ctx->group,
+				    sizeof (ctx->group));
+	} else if (strcmp (name, "file") == 0) {
+		repoxml_file_start_element (ctx, atts);
 	} else if (strcmp (name, "rpm:requires") == 0) {
 		ctx->state = REPOXML_STATE_REQUIRES;
 		ctx->dependency_type = DEPENDENCY_TYPE_REQUIRES;
@@ -188,6 +225,11 @@ repoxml_primary_end_element (void *data, const char *name)
 {
 	struct repoxml_context *ctx = data;
 
+	/* primary.xml lists the files most likely to be required */
+	if (ctx->state == REPOXML_STATE_FILE)
+		low_sqlite_importer_add_file (ctx->importer, ctx->buffer,
+					      ctx->filetype);
+
 	switch (ctx->state) {
 		case REPOXML_STATE_PACKAGE_NAME:
 		case REPOXML_STATE_PACKAGE_ARCH:
@@ -210,9 +252,7 @@ repoxml_primary_end_element (void *data, const char *name)
 						 0, 0, ctx->license,
 						 "", ctx->group, "", "",
 						 0, 0, "", 0, 0, 0, "", "", "");
-
-		XML_StopParser (ctx->current_parser, XML_TRUE);
-		ctx->current_parser = ctx->filelists_parser;
+		low_sqlite_importer_finish_package (ctx->importer, ctx->pkgid);
 
 		printf ("\rimporting %d/%d", ++ctx->current, ctx->total);
 		fflush (stdout);
@@ -234,6 +274,10 @@ repoxml_character_data (void *data, const XML_Char *s, int len)
 		case REPOXML_STATE_GROUP:
 		case REPOXML_STATE_CHECKSUM:
 		case REPOXML_STATE_FILE:
+			/* Anything too long to fit is cut short */
+			if (len > ctx->end - ctx->p) {
+				len = ctx->end - ctx->p;
+			}
 			memcpy (ctx->p, s, len);
 			ctx->p += len;
 			*ctx->p = '\0';
@@ -248,25 +292,18 @@ repoxml_filelists_start_element (void *data, const char *name,
 				 const char **atts)
 {
 	struct repoxml_context *ctx = data;
-	const char *pkg, *pkgid;
+	const char *pkgid;
 	int i;
 
 	if (strcmp (name, "package") == 0) {
-		pkg = NULL;
-		pkgid = NULL;
+		pkgid = "";
 		for (i = 0; atts[i]; i += 2) {
-			if (strcmp (atts[i], "name") == 0)
-				pkg = atts[i + 1];
-			else if (strcmp (atts[i], "pkgid") == 0)
+			if (strcmp (atts[i], "pkgid") == 0)
 				pkgid = atts[i + 1];
 		}
-		if (strcmp (pkgid, ctx->pkgid) != 0)
-			fprintf (stderr, "primary.xml and filelists.xml "
-				 "mismatch for %s: %s vs %s",
-				 pkg, pkgid, ctx->pkgid);
+		low_sqlite_importer_begin_filelist (ctx->importer, pkgid);
 	} else if (strcmp (name, "file") == 0) {
-		ctx->state = REPOXML_STATE_FILE;
-		ctx->p = ctx->buffer;
+		repoxml_file_start_element (ctx, atts);
 	}
 }
 
@@ -276,110 +313,152 @@ repoxml_filelists_end_element (void *data, const char *name)
 	struct repoxml_context *ctx = data;
 
 	ctx->state = REPOXML_STATE_BEGIN;
-	if (strcmp (name, "package") == 0) {
-		XML_StopParser (ctx->current_parser, XML_TRUE);
-		ctx->current_parser = ctx->primary_parser;
-		low_sqlite_importer_finish_package (ctx->importer);
-	} else if (strcmp (name, "file") == 0)
-		low_sqlite_importer_add_file (ctx->importer, ctx->buffer);
-
+	if (strcmp (name, "package") == 0)
+		low_sqlite_importer_finish_filelist (ctx->importer);
+	else if (strcmp (name, "file") == 0)
+		low_sqlite_importer_add_filelist_file (ctx->importer,
+						       ctx->buffer,
+						       ctx->filetype);
 }
 
-#define XML_BUFFER_SIZE 4096
+/* Big enough that expat, not the feeding loop, sets the pace */
+#define XML_BLOCK_SIZE (4 * 1024 * 1024)
 
-void
-low_repoxml_parse (const char *primary, const char *filelists)
+/*
+ * Map the whole file and hand it to expat a block at a time, which parses
+ * straight out of the mapping instead of copying through its own buffer.
+ */
+static gpointer
+repoxml_parse_file (gpointer data)
 {
-	struct repoxml_context ctx;
-	void *buf;
-	int len;
-	int primary_file;
-	int filelists_file;
-	char *directory;
-	char *last_slash;
-	XML_ParsingStatus status;
-
-	ctx.state = REPOXML_STATE_BEGIN;
-
-	ctx.primary_parser = XML_ParserCreate (NULL);
-	XML_SetUserData (ctx.primary_parser, &ctx);
-	XML_SetElementHandler (ctx.primary_parser,
-			       repoxml_primary_start_element,
-			       repoxml_primary_end_element);
-	XML_SetCharacterDataHandler (ctx.primary_parser,
-				     repoxml_character_data);
-
-	ctx.filelists_parser = XML_ParserCreate (NULL);
-	XML_SetUserData (ctx.filelists_parser, &ctx);
-	XML_SetElementHandler (ctx.filelists_parser,
-			       repoxml_filelists_start_element,
-			       repoxml_filelists_end_element);
-	XML_SetCharacterDataHandler (ctx.filelists_parser,
-				     repoxml_character_data);
-
-	primary_file = open (primary, O_RDONLY);
-	if (primary_file < 0) {
-		XML_ParserFree (ctx.primary_parser);
-		return;
+	struct repoxml_context *ctx = data;
+	struct stat buf;
+	const char *contents;
+	off_t offset = 0;
+	int fd;
+
+	ctx->ok = false;
+
+	fd = open (ctx->filename, O_RDONLY);
+	if (fd < 0 || fstat (fd, &buf) < 0) {
+		fprintf (stderr, "couldn't read %s: %s\n", ctx->filename,
+			 strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		return NULL;
 	}
 
-	filelists_file = open (filelists, O_RDONLY);
-	if (filelists_file < 0) {
-		XML_ParserFree (ctx.primary_parser);
-		XML_ParserFree (ctx.filelists_parser);
-		close (primary_file);
-		return;
+	if (buf.st_size == 0) {
+		contents = "";
+	} else {
+		contents = mmap (NULL, buf.st_size, PROT_READ, MAP_PRIVATE,
+				 fd, 0);
+		if (contents == MAP_FAILED) {
+			fprintf (stderr, "couldn't map %s: %s\n",
+				 ctx->filename, strerror (errno));
+			close (fd);
+			return NULL;
+		}
+		madvise ((void *) contents, buf.st_size, MADV_SEQUENTIAL);
 	}
 
-	ctx.current_parser = ctx.primary_parser;
+	ctx->ok = true;
+	do {
+		int len = MIN (buf.st_size - offset, XML_BLOCK_SIZE);
+
+		if (XML_Parse (ctx->parser, contents + offset, len,
+			       offset + len == buf.st_size) ==
+		    XML_STATUS_ERROR) {
+			fprintf (stderr, "couldn't parse %s: %s at line %lu\n",
+				 ctx->filename,
+				 XML_ErrorString (XML_GetErrorCode
+						  (ctx->parser)),
+				 (unsigned long)
+				 XML_GetCurrentLineNumber (ctx->parser));
+			ctx->ok = false;
+			break;
+		}
+		offset += len;
+	} while (offset < buf.st_size);
 
-	ctx.current = 0;
+	if (buf.st_size != 0)
+		munmap ((void *) contents, buf.st_size);
+	close (fd);
 
-	last_slash = strrchr (primary, '/');
-	directory = strndup (primary, last_slash - primary);
-	ctx.importer = low_sqlite_importer_new (directory);
+	return NULL;
+}
 
-	do {
-		XML_GetParsingStatus (ctx.current_parser, &status);
-		switch (status.parsing) {
-			case XML_SUSPENDED:
-				XML_ResumeParser (ctx.current_parser);
-				break;
-			case XML_PARSING:
-			case XML_INITIALIZED:
-				buf = XML_GetBuffer (ctx.current_parser,
-						     XML_BUFFER_SIZE);
-				if (ctx.current_parser == ctx.primary_parser)
-					len = read (primary_file, buf,
-						    XML_BUFFER_SIZE);
-				else
-					len = read (filelists_file, buf,
-						    XML_BUFFER_SIZE);
-				if (len < 0) {
-					fprintf (stderr,
-						 "couldn't read input: %s\n",
-						 strerror (errno));
-					return;
-				}
-
-				XML_ParseBuffer (ctx.current_parser, len,
-						 len == 0);
-				break;
-			case XML_FINISHED:
-			default:
-				break;
-		}
-	} while (status.parsing != XML_FINISHED);
+static void
+repoxml_context_init (struct repoxml_context *ctx, const char *filename,
+		      LowSqliteImporter *importer,
+		      XML_StartElementHandler start,
+		      XML_EndElementHandler end)
+{
+	ctx->state = REPOXML_STATE_BEGIN;
+	ctx->total = 0;
+	ctx->current = 0;
+	ctx->importer = importer;
+	ctx->filename = filename;
+
+	ctx->parser = XML_ParserCreate (NULL);
+	XML_SetUserData (ctx->parser, ctx);
+	XML_SetElementHandler (ctx->parser, start, end);
+	XML_SetCharacterDataHandler (ctx->parser, repoxml_character_data);
+}
 
-	free (directory);
+/*
+ * primary.xml and filelists.xml go into separate databases, so parse them
+ * at the same time, the filelists on a thread of their own.
+ */
+void
+low_repoxml_parse (const char *primary, const char *filelists)
+{
+	struct repoxml_context primary_ctx;
+	struct repoxml_context filelists_ctx;
+	LowSqliteImporter *importer;
+	GThread *filelists_thread;
+	char *directory;
+	char *last_slash;
 
-	XML_ParserFree (ctx.primary_parser);
-	XML_ParserFree (ctx.filelists_parser);
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+	if (!g_thread_supported ()) {
+		g_thread_init (NULL);
+	}
+#endif
 
-	low_sqlite_importer_free (ctx.importer);
+	last_slash = strrchr (primary, '/');
+	if (last_slash == NULL)
+		directory = strdup (".");
+	else
+		directory = strndup (primary, last_slash - primary);
+	importer = low_sqlite_importer_new (directory);
+	free (directory);
 
-	close (primary_file);
-	close (filelists_file);
+	repoxml_context_init (&primary_ctx, primary, importer,
+			      repoxml_primary_start_element,
+			      repoxml_primary_end_element);
+	repoxml_context_init (&filelists_ctx, filelists, importer,
+			      repoxml_filelists_start_element,
+			      repoxml_filelists_end_element);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+	filelists_thread = g_thread_new ("filelists", repoxml_parse_file,
+					 &filelists_ctx);
+#else
+	filelists_thread = g_thread_create (repoxml_parse_file,
+					    &filelists_ctx, TRUE, NULL);
+#endif
+	repoxml_parse_file (&primary_ctx);
+	g_thread_join (filelists_thread);
+
+	/* Keep whatever was there before rather than a partial import */
+	if (!primary_ctx.ok || !filelists_ctx.ok)
+		importer->failed = true;
+
+	XML_ParserFree (primary_ctx.parser);
+	XML_ParserFree (filelists_ctx.parser);
+
+	low_sqlite_importer_free (importer);
 
 	return;
 }
@@ -21,6 +21,8 @@
  *  02110-1301  USA
  */
 
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,6 +37,20 @@
 	"INSERT INTO packages (name, arch, epoch, version, release)" \
 	"VALUES (?, ?, ?, ?, ?)"
 
+#define PKG_ID_SET "UPDATE packages SET pkgId=? WHERE pkgKey=?"
+
+#define FILELISTS_PKG_ADD "INSERT INTO packages (pkgKey, pkgId) VALUES (?, ?)"
+
+#define DEP_ADD \
+	"INSERT INTO %s (name, flags, epoch, version, release, pkgKey%s) " \
+	"VALUES (?, ?, ?, ?, ?, ?%s)"
+
+#define FILE_ADD "INSERT INTO files (name, type, pkgKey) VALUES (?, ?, ?)"
+
+#define FILELIST_ADD \
+	"INSERT INTO filelist (pkgKey, dirname, filenames, filetypes) " \
+	"VALUES (?, ?, ?, ?)"
+
 #define PKG_DETAILS_ADD \
 	"UPDATE packages SET " \
 	"summary=?, description=?, url=?, time_file=?, time_build=?, " \
@@ -69,8 +85,8 @@ primary_package_write (sqlite3 *db, sqlite3_stmt *handle, const char *name,
 
 	sqlite3_bind_text (handle, 1, name, -1, SQLITE_STATIC);
 	sqlite3_bind_text (handle, 2, arch, -1, SQLITE_STATIC);
-	sqlite3_bind_text (handle, 3, version, -1, SQLITE_STATIC);
-	sqlite3_bind_text (handle, 4, epoch, -1, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 3, epoch, -1, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 4, version, -1, SQLITE_STATIC);
 	sqlite3_bind_text (handle, 5, release, -1, SQLITE_STATIC);
 
 	rc = sqlite3_step (handle);
@@ -163,29 +179,160 @@ low_sqlite_importer_add_details (LowSqliteImporter *importer,
 }
 
 void
-low_sqlite_importer_add_dependency (LowSqliteImporter *importer G_GNUC_UNUSED,
-				    const char *name,
-				    const char *sense G_GNUC_UNUSED,
-				    LowSqliteImporterDepType type G_GNUC_UNUSED,
-				    bool is_pre G_GNUC_UNUSED,
-				    const char *epoch G_GNUC_UNUSED,
-				    const char *version G_GNUC_UNUSED,
-				    const char *release G_GNUC_UNUSED)
+low_sqlite_importer_add_dependency (LowSqliteImporter *importer,
+				    const char *name, const char *sense,
+				    LowSqliteImporterDepType type, bool is_pre,
+				    const char *epoch, const char *version,
+				    const char *release)
 {
-	low_debug ("dep - %s", name);
+	sqlite3_stmt *handle = importer->dep_stmts[type];
+
+	/* An unversioned dependency has no flags, rather than empty ones */
+	if (sense != NULL && *sense == '\0')
+		sense = NULL;
+
+	sqlite3_bind_text (handle, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 2, sense, -1, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 3, epoch, -1, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 4, version, -1, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 5, release, -1, SQLITE_STATIC);
+	sqlite3_bind_int (handle, 6, importer->row_id);
+	if (type == DEPENDENCY_TYPE_REQUIRES)
+		sqlite3_bind_text (handle, 7, is_pre ? "TRUE" : "FALSE", -1,
+				   SQLITE_STATIC);
+
+	if (sqlite3_step (handle) != SQLITE_DONE)
+		low_debug ("Error adding dependency %s", name);
+	sqlite3_reset (handle);
 }
 
 void
-low_sqlite_importer_add_file (LowSqliteImporter *importer G_GNUC_UNUSED,
-			      const char *name)
+low_sqlite_importer_add_file (LowSqliteImporter *importer, const char *name,
+			      const char *type)
 {
-	low_debug ("file - %s", name);
+	sqlite3_bind_text (importer->file_stmt, 1, name, -1, SQLITE_STATIC);
+	sqlite3_bind_text (importer->file_stmt, 2, type ? type : "file", -1,
+			   SQLITE_STATIC);
+	sqlite3_bind_int (importer->file_stmt, 3, importer->row_id);
+
+	if (sqlite3_step (importer->file_stmt) != SQLITE_DONE)
+		low_debug ("Error adding file %s", name);
+	sqlite3_reset (importer->file_stmt);
 }
 
 void
-low_sqlite_importer_finish_package (LowSqliteImporter *importer G_GNUC_UNUSED)
+low_sqlite_importer_finish_package (LowSqliteImporter *importer,
+				    const char *pkgid)
 {
+	sqlite3_bind_text (importer->pkg_id_stmt, 1, pkgid, -1, SQLITE_STATIC);
+	sqlite3_bind_int (importer->pkg_id_stmt, 2, importer->row_id);
+	sqlite3_step (importer->pkg_id_stmt);
+	sqlite3_reset (importer->pkg_id_stmt);
 
+	g_hash_table_insert (importer->pkg_keys, strdup (pkgid),
+			     GINT_TO_POINTER (importer->row_id));
+}
+
+/*
+ * filelists.xml is imported on its own, so its packages are keyed in the
+ * order they appear there. low_sqlite_importer_free () fixes up the keys
+ * if that turns out not to match primary.xml.
+ */
+void
+low_sqlite_importer_begin_filelist (LowSqliteImporter *importer,
+				    const char *pkgid)
+{
+	g_ptr_array_add (importer->filelist_pkgids, strdup (pkgid));
+	importer->filelist_row_id = importer->filelist_pkgids->len;
+
+	sqlite3_bind_int (importer->filelists_pkg_stmt, 1,
+			  importer->filelist_row_id);
+	sqlite3_bind_text (importer->filelists_pkg_stmt, 2, pkgid, -1,
+			   SQLITE_STATIC);
+	sqlite3_step (importer->filelists_pkg_stmt);
+	sqlite3_reset (importer->filelists_pkg_stmt);
+}
+
+struct importer_dir {
+	GString *filenames;
+	GString *filetypes;
+};
+
+static void
+importer_dir_free (struct importer_dir *dir)
+{
+	g_string_free (dir->filenames, TRUE);
+	g_string_free (dir->filetypes, TRUE);
+	free (dir);
+}
+
+void
+low_sqlite_importer_add_filelist_file (LowSqliteImporter *importer,
+				       const char *name, const char *type)
+{
+	struct importer_dir *dir;
+	const char *last_slash;
+	char *dirname;
+	char filetype;
+
+	last_slash = strrchr (name, '/');
+	if (last_slash == NULL) {
+		low_debug ("Skipping relative file %s", name);
+		return;
+	}
+
+	/* filelist keeps one row per directory, with its files joined by / */
+	if (last_slash == name)
+		dirname = strdup ("/");
+	else
+		dirname = strndup (name, last_slash - name);
+
+	dir = g_hash_table_lookup (importer->dirs, dirname);
+	if (dir == NULL) {
+		dir = malloc (sizeof (struct importer_dir));
+		dir->filenames = g_string_new (NULL);
+		dir->filetypes = g_string_new (NULL);
+		g_hash_table_insert (importer->dirs, dirname, dir);
+	} else {
+		free (dirname);
+		g_string_append_c (dir->filenames, '/');
+	}
+
+	if (type != NULL && !strcmp (type, "dir"))
+		filetype = 'd';
+	else if (type != NULL && !strcmp (type, "ghost"))
+		filetype = 'g';
+	else
+		filetype = 'f';
+
+	g_string_append (dir->filenames, last_slash + 1);
+	g_string_append_c (dir->filetypes, filetype);
+}
+
+static void
+filelist_dir_write (gpointer key, gpointer value, gpointer data)
+{
+	LowSqliteImporter *importer = data;
+	struct importer_dir *dir = value;
+	sqlite3_stmt *handle = importer->filelist_stmt;
+
+	sqlite3_bind_int (handle, 1, importer->filelist_row_id);
+	sqlite3_bind_text (handle, 2, key, -1, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 3, dir->filenames->str,
+			   dir->filenames->len, SQLITE_STATIC);
+	sqlite3_bind_text (handle, 4, dir->filetypes->str,
+			   dir->filetypes->len, SQLITE_STATIC);
+
+	if (sqlite3_step (handle) != SQLITE_DONE)
+		low_debug ("Error adding filelist for %s", (char *) key);
+	sqlite3_reset (handle);
+}
+
+void
+low_sqlite_importer_finish_filelist (LowSqliteImporter *importer)
+{
+	g_hash_table_foreach (importer->dirs, filelist_dir_write, importer);
+	g_hash_table_remove_all (importer->dirs);
 }
 
 static void
@@ -345,7 +492,6 @@ build_primary_schema (sqlite3 *primary)
 {
 	create_dbinfo_table (primary);
 	create_primary_tables (primary);
-	index_primary_tables (primary);
 }
 
 static void
@@ -409,26 +555,67 @@ build_filelists_schema (sqlite3 *filelists)
 {
 	create_dbinfo_table (filelists);
 	create_filelist_tables (filelists);
-	index_filelist_tables (filelists);
+}
+
+/*
+ * Nothing reads the databases until they're renamed into place, and a
+ * failed import is simply redone, so skip the journal and fsyncs.
+ */
+static sqlite3 *
+importer_db_open (const char *file)
+{
+	sqlite3 *db;
+
+	unlink (file);
+	sqlite3_open (file, &db);
+
+	sqlite3_exec (db, "PRAGMA journal_mode = OFF", NULL, NULL, NULL);
+	sqlite3_exec (db, "PRAGMA synchronous = OFF", NULL, NULL, NULL);
+
+	return db;
+}
+
+static void
+prepare_dependency_statements (LowSqliteImporter *importer)
+{
+	const char *deps[] = { "provides", "requires", "conflicts",
+		"obsoletes"
+	};
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		bool requires = i == DEPENDENCY_TYPE_REQUIRES;
+		char *query = g_strdup_printf (DEP_ADD, deps[i],
+					       requires ? ", pre" : "",
+					       requires ? ", ?" : "");
+
+		importer->dep_stmts[i] =
+			prepare_statement (importer->primary_db, query);
+		free (query);
+	}
 }
 
 LowSqliteImporter *
 low_sqlite_importer_new (const char *directory)
 {
-	char *primary_file = g_strdup_printf ("%s/primary.sqlite", directory);
-	char *filelists_file = g_strdup_printf ("%s/filelists.sqlite",
-						directory);
-
 	LowSqliteImporter *importer = malloc (sizeof (LowSqliteImporter));
+	char *primary_tmp;
+	char *filelists_tmp;
 
-	unlink (primary_file);
-	unlink (filelists_file);
+	importer->primary_file =
+		g_strdup_printf ("%s/" LOW_SQLITE_IMPORTER_PRIMARY, directory);
+	importer->filelists_file =
+		g_strdup_printf ("%s/" LOW_SQLITE_IMPORTER_FILELISTS,
+				 directory);
 
-	sqlite3_open (primary_file, &(importer->primary_db));
-	sqlite3_open (filelists_file, &(importer->filelists_db));
+	primary_tmp = g_strdup_printf ("%s.tmp", importer->primary_file);
+	filelists_tmp = g_strdup_printf ("%s.tmp", importer->filelists_file);
 
-	free (primary_file);
-	free (filelists_file);
+	importer->primary_db = importer_db_open (primary_tmp);
+	importer->filelists_db = importer_db_open (filelists_tmp);
+
+	free (primary_tmp);
+	free (filelists_tmp);
 
 	build_primary_schema (importer->primary_db);
 	build_filelists_schema (importer->filelists_db);
@@ -436,19 +623,175 @@ low_sqlite_importer_new (const char *directory)
 	importer->pkg_stmt = prepare_statement (importer->primary_db, PKG_ADD);
 	importer->pkg_details_stmt = prepare_statement (importer->primary_db,
 							PKG_DETAILS_ADD);
+	importer->pkg_id_stmt = prepare_statement (importer->primary_db,
+						   PKG_ID_SET);
+	importer->file_stmt = prepare_statement (importer->primary_db,
+						 FILE_ADD);
+	prepare_dependency_statements (importer);
+
+	importer->filelists_pkg_stmt =
+		prepare_statement (importer->filelists_db, FILELISTS_PKG_ADD);
+	importer->filelist_stmt = prepare_statement (importer->filelists_db,
+						     FILELIST_ADD);
+
+	importer->row_id = 0;
+	importer->pkg_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+						    free, NULL);
+
+	importer->failed = false;
+
+	importer->filelist_row_id = 0;
+	importer->filelist_pkgids = g_ptr_array_new ();
+	importer->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, free,
+						(GDestroyNotify)
+						importer_dir_free);
+
+	/* Everything goes in as one transaction per database */
+	sqlite3_exec (importer->primary_db, "BEGIN", NULL, NULL, NULL);
+	sqlite3_exec (importer->filelists_db, "BEGIN", NULL, NULL, NULL);
 
 	return importer;
 }
 
-void
-low_sqlite_importer_free (LowSqliteImporter *importer)
+/*
+ * Index and commit the database, then move it over the old one.
+ */
+static void
+importer_db_finish (sqlite3 *db, void (*index_tables) (sqlite3 *),
+		    const char *file, bool failed)
+{
+	char *tmp = g_strdup_printf ("%s.tmp", file);
+
+	if (failed) {
+		sqlite3_close (db);
+		unlink (tmp);
+		free (tmp);
+		return;
+	}
+
+	/* Building the indexes once at the end beats updating them per row */
+	index_tables (db);
+
+	if (sqlite3_exec (db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf (stderr, "Unable to write %s: %s\n", file,
+			 sqlite3_errmsg (db));
+		sqlite3_close (db);
+		unlink (tmp);
+	} else {
+		sqlite3_close (db);
+		if (rename (tmp, file) < 0) {
+			fprintf (stderr, "Unable to move %s into place: %s\n",
+				 file, strerror (errno));
+			unlink (tmp);
+		}
+	}
+
+	free (tmp);
+}
+
+#define FILELIST_KEY_SET "UPDATE filelist SET pkgKey = ? WHERE pkgKey = ?"
+#define FILELISTS_PKG_KEY_SET "UPDATE packages SET pkgKey = ? WHERE pkgKey = ?"
+
+static int
+primary_key_for_filelist (LowSqliteImporter *importer, unsigned int i)
 {
-	sqlite3_exec (importer->primary_db, "COMMIT", NULL, NULL, NULL);
-	sqlite3_exec (importer->filelists_db, "COMMIT", NULL, NULL, NULL);
+	return GPOINTER_TO_INT (g_hash_table_lookup
+				(importer->pkg_keys,
+				 g_ptr_array_index (importer->filelist_pkgids,
+						    i)));
+}
+
+/*
+ * Give each filelists package the key its pkgId has in primary. That's
+ * almost always the key it already has, as createrepo writes both files
+ * in the same order.
+ */
+static void
+filelist_keys_correlate (LowSqliteImporter *importer)
+{
+	sqlite3 *db = importer->filelists_db;
+	sqlite3_stmt *filelist_stmt;
+	sqlite3_stmt *pkg_stmt;
+	unsigned int i;
+
+	for (i = 0; i < importer->filelist_pkgids->len; i++) {
+		if (primary_key_for_filelist (importer, i) != (int) i + 1)
+			break;
+	}
+	if (i == importer->filelist_pkgids->len)
+		return;
+
+	low_debug ("primary.xml and filelists.xml are in different orders");
 
-	sqlite3_close (importer->primary_db);
-	sqlite3_close (importer->filelists_db);
+	/* Move every key out of the way first, so none collide */
+	index_filelist_tables (db);
+	sqlite3_exec (db, "UPDATE filelist SET pkgKey = -pkgKey", NULL, NULL,
+		      NULL);
+	sqlite3_exec (db, "UPDATE packages SET pkgKey = -pkgKey", NULL, NULL,
+		      NULL);
 
+	filelist_stmt = prepare_statement (db, FILELIST_KEY_SET);
+	pkg_stmt = prepare_statement (db, FILELISTS_PKG_KEY_SET);
+
+	for (i = 0; i < importer->filelist_pkgids->len; i++) {
+		int key = primary_key_for_filelist (importer, i);
+
+		if (key == 0) {
+			low_debug ("%s is not in primary.xml",
+				   (char *) g_ptr_array_index
+				   (importer->filelist_pkgids, i));
+			continue;
+		}
+
+		sqlite3_bind_int (filelist_stmt, 1, key);
+		sqlite3_bind_int (filelist_stmt, 2, -((int) i + 1));
+		sqlite3_step (filelist_stmt);
+		sqlite3_reset (filelist_stmt);
+
+		sqlite3_bind_int (pkg_stmt, 1, key);
+		sqlite3_bind_int (pkg_stmt, 2, -((int) i + 1));
+		sqlite3_step (pkg_stmt);
+		sqlite3_reset (pkg_stmt);
+	}
+
+	sqlite3_finalize (filelist_stmt);
+	sqlite3_finalize (pkg_stmt);
+
+	/* The trigger takes their files with them */
+	sqlite3_exec (db, "DELETE FROM packages WHERE pkgKey < 0", NULL, NULL,
+		      NULL);
+}
+
+void
+low_sqlite_importer_free (LowSqliteImporter *importer)
+{
+	unsigned int i;
+
+	sqlite3_finalize (importer->pkg_stmt);
+	sqlite3_finalize (importer->pkg_details_stmt);
+	sqlite3_finalize (importer->pkg_id_stmt);
+	sqlite3_finalize (importer->file_stmt);
+	for (i = 0; i < 4; i++)
+		sqlite3_finalize (importer->dep_stmts[i]);
+	sqlite3_finalize (importer->filelists_pkg_stmt);
+	sqlite3_finalize (importer->filelist_stmt);
+
+	importer_db_finish (importer->primary_db, index_primary_tables,
+			    importer->primary_file, importer->failed);
+
+	if (!importer->failed)
+		filelist_keys_correlate (importer);
+	importer_db_finish (importer->filelists_db, index_filelist_tables,
+			    importer->filelists_file, importer->failed);
+
+	g_hash_table_destroy (importer->pkg_keys);
+	for (i = 0; i < importer->filelist_pkgids->len; i++)
+		free (g_ptr_array_index (importer->filelist_pkgids, i));
+	g_ptr_array_free (importer->filelist_pkgids, TRUE);
+	g_hash_table_destroy (importer->dirs);
+
+	free (importer->primary_file);
+	free (importer->filelists_file);
 	free (importer);
 }
 
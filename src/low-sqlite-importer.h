@@ -24,6 +24,7 @@
 
 #include <stdbool.h>
 
+#include <glib.h>
 #include <sqlite3.h>
 
 typedef enum {
@@ -33,14 +34,39 @@ typedef enum {
 	DEPENDENCY_TYPE_OBSOLETES
 } LowSqliteImporterDepType;
 
+/* The databases the importer writes, in the directory it's given */
+#define LOW_SQLITE_IMPORTER_PRIMARY "primary.sqlite"
+#define LOW_SQLITE_IMPORTER_FILELISTS "filelists.sqlite"
+
+/*
+ * The primary calls (begin_package through finish_package) and the
+ * filelist calls only touch their own database, so primary.xml and
+ * filelists.xml can be imported on separate threads.
+ */
 typedef struct _LowSqliteImporter {
 	sqlite3 *primary_db;
 	sqlite3 *filelists_db;
 
+	char *primary_file;
+	char *filelists_file;
+
 	sqlite3_stmt *pkg_stmt;
 	sqlite3_stmt *pkg_details_stmt;
+	sqlite3_stmt *pkg_id_stmt;
+	sqlite3_stmt *file_stmt;
+	sqlite3_stmt *dep_stmts[4];	/* by LowSqliteImporterDepType */
+
+	sqlite3_stmt *filelists_pkg_stmt;
+	sqlite3_stmt *filelist_stmt;
 
 	int row_id;
+	GHashTable *pkg_keys;		/* pkgId to primary pkgKey */
+
+	int filelist_row_id;
+	GPtrArray *filelist_pkgids;	/* by filelists pkgKey - 1 */
+	GHashTable *dirs;		/* the current package's filelist */
+
+	bool failed;			/* discard the databases on free */
 } LowSqliteImporter;
 
 LowSqliteImporter *low_sqlite_importer_new (const char *directory);
@@ -73,8 +99,17 @@ void low_sqlite_importer_add_dependency (LowSqliteImporter *importer,
 					 const char *version,
 					 const char *release);
 void low_sqlite_importer_add_file (LowSqliteImporter *importer,
-				   const char *name);
-void low_sqlite_importer_finish_package (LowSqliteImporter *importer);
+				   const char *name, const char *type);
+void low_sqlite_importer_finish_package (LowSqliteImporter *importer,
+					 const char *pkgid);
+
+void low_sqlite_importer_begin_filelist (LowSqliteImporter *importer,
+					 const char *pkgid);
+void low_sqlite_importer_add_filelist_file (LowSqliteImporter *importer,
+					    const char *name,
+					    const char *type);
+void low_sqlite_importer_finish_filelist (LowSqliteImporter *importer);
+
 void low_sqlite_importer_free (LowSqliteImporter *importer);
 
 #endif /* _LOW_SQLITE_IMPORTER_H_ */
@@ -533,23 +533,6 @@ low_transaction_dep_satisfied_by_deplist (const LowPackageDependency *needle,
 	return false;
 }
 
-/**
- * Check if a requires is in a list of files
- */
-static bool
-low_transaction_dep_in_filelist (const char *needle, char **haystack)
-{
-	int i;
-
-	for (i = 0; haystack[i] != NULL; i++) {
-		if (!strcmp (needle, haystack[i])) {
-			return true;
-		}
-	}
-
-	return false;
-}
-
 static LowTransactionStatus
 select_best_provides (LowTransaction *trans, LowPackage *pkg,
 		      LowPackageIter *iter, LowPackageDependency *requires,
@@ -647,6 +630,33 @@ low_transaction_check_providing_is_installed (LowTransaction *trans,
 	return false;
 }
 
+/*
+ * Is requires already met by an installed package that we're keeping?
+ */
+static bool
+low_transaction_requires_is_installed (LowTransaction *trans,
+				       LowPackageDependency *requires)
+{
+	LowPackageIter *providing;
+
+	providing = low_repo_rpmdb_search_provides (trans->rpmdb, requires);
+	if (low_transaction_check_providing_is_installed (trans, providing)) {
+		return true;
+	}
+
+	/* Check files if appropriate */
+	if (requires->name[0] == '/') {
+		providing = low_repo_rpmdb_search_files (trans->rpmdb,
+							 requires->name);
+		if (low_transaction_check_providing_is_installed (trans,
+								  providing)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static LowTransactionStatus
 low_transaction_check_package_requires (LowTransaction *trans, LowPackage *pkg,
 					bool check_available,
@@ -656,28 +666,36 @@ low_transaction_check_package_requires (LowTransaction *trans, LowPackage *pkg,
 	LowTransactionStatus status = LOW_TRANSACTION_NO_CHANGE;
 	LowPackageDependency **requires;
 	LowPackageDependency **provides;
-	char **files;
+	LowPackageDependency **unmet;
+	LowPackageIter **providing;
 	int i;
+	unsigned int j;
+	unsigned int unmet_count = 0;
 	bool pkgs_added = false;
 
 	low_debug_pkg ("Checking requires for", pkg);
 
 	requires = low_package_get_requires (pkg);
 	provides = low_package_get_provides (pkg);
-	files = low_package_get_files (pkg);
 
-	for (i = 0; requires[i] != NULL; i++) {
-		LowPackageIter *providing;
+	for (i = 0; requires[i] != NULL; i++);
+	unmet = malloc (sizeof (LowPackageDependency *) * (i + 1));
 
+	/* First find the requires that installed packages don't cover */
+	for (i = 0; requires[i] != NULL; i++) {
 		if (dep && strcmp (dep->name, requires[i]->name) != 0) {
 			low_debug ("skipping requires not matching given dep");
 			continue;
 		}
 
+		/*
+		 * Ask about the one file, rather than get every file, as
+		 * the whole list could mean fetching filelists.
+		 */
 		if (low_transaction_dep_satisfied_by_deplist (requires[i],
 							      provides)
-		    || low_transaction_dep_in_filelist (requires[i]->name,
-							files)) {
+		    || (requires[i]->name[0] == '/' &&
+			low_package_has_file (pkg, requires[i]->name))) {
 			low_debug ("Self provided requires %s, skipping",
 				   requires[i]->name);
 			continue;
@@ -697,42 +715,50 @@ low_transaction_check_package_requires (LowTransaction *trans, LowPackage *pkg,
 			continue;
 		}
 
-		providing =
-			low_repo_rpmdb_search_provides (trans->rpmdb,
-							requires[i]);
-
-		if (low_transaction_check_providing_is_installed (trans,
-								  providing)) {
+		if (low_transaction_requires_is_installed (trans,
+							   requires[i])) {
 			continue;
 		}
 
-		/* Check files if appropriate */
-		if (requires[i]->name[0] == '/') {
-			providing =
-				low_repo_rpmdb_search_files (trans->rpmdb,
-							     requires[i]->name);
-			if (low_transaction_check_providing_is_installed (trans,
-									  providing)) {
-				continue;
-			}
+		unmet[unmet_count++] = requires[i];
+	}
+
+	/* Then look them all up in the available repos in one go */
+	providing = NULL;
+	if (unmet_count > 0) {
+		providing = low_repo_set_search_provides_batch (trans->repos,
+								unmet,
+								unmet_count);
+	}
+
+	for (j = 0; j < unmet_count; j++) {
+		LowPackageIter *iter = providing[j];
+		providing[j] = NULL;
+
+		/*
+		 * Anything we've added since the first pass could be
+		 * replacing the installed package that we expected to
+		 * provide this, so check again.
+		 */
+		if (pkgs_added &&
+		    low_transaction_requires_is_installed (trans, unmet[j])) {
+			low_package_iter_free (iter);
+			continue;
 		}
 
 		/* Check available packages */
-		providing = low_repo_set_search_provides (trans->repos,
-							  requires[i]);
-		status = select_best_provides (trans, pkg, providing,
-					       requires[i], !check_available);
+		status = select_best_provides (trans, pkg, iter, unmet[j],
+					       !check_available);
 		if (status == LOW_TRANSACTION_PACKAGES_ADDED) {
 			pkgs_added = true;
 		}
 		if (status == LOW_TRANSACTION_UNRESOLVABLE &&
-		    requires[i]->name[0] == '/') {
-			providing =
-				low_repo_set_search_files (trans->repos,
-							   requires[i]->name);
+		    unmet[j]->name[0] == '/') {
+			iter = low_repo_set_search_files (trans->repos,
+							  unmet[j]->name);
 
-			status = select_best_provides (trans, pkg, providing,
-						       requires[i],
+			status = select_best_provides (trans, pkg, iter,
+						       unmet[j],
 						       !check_available);
 			if (status == LOW_TRANSACTION_PACKAGES_ADDED) {
 				pkgs_added = true;
@@ -745,14 +771,22 @@ low_transaction_check_package_requires (LowTransaction *trans, LowPackage *pkg,
 			continue;
 		}
 
-		low_debug ("%s not provided by installed pkg",
-			   requires[i]->name);
+		low_debug ("%s not provided by installed pkg", unmet[j]->name);
+
+		for (; j < unmet_count; j++) {
+			low_package_iter_free (providing[j]);
+		}
+		free (providing);
+		free (unmet);
+
 		return LOW_TRANSACTION_UNRESOLVABLE;
 	}
 
+	free (providing);
+	free (unmet);
+
 //      low_package_dependency_list_free (provides);
 //      low_package_dependency_list_free (requires);
-	g_strfreev (files);
 
 	if (pkgs_added) {
 		return LOW_TRANSACTION_PACKAGES_ADDED;
@@ -769,7 +803,6 @@ low_transaction_check_removal (LowTransaction *trans,
 	LowPackageDependency **provides;
 	LowPackageDependency **update_provides = NULL;
 	char **files;
-	char **update_files = NULL;
 	int i;
 
 	low_debug_pkg ("Checking removal of", pkg);
@@ -780,7 +813,6 @@ low_transaction_check_removal (LowTransaction *trans,
 	if (from_update) {
 		update_provides =
 			low_package_get_provides (member->related_pkg);
-		update_files = low_package_get_files (member->related_pkg);
 	}
 
 	for (i = 0; provides[i] != NULL; i++) {
@@ -841,12 +873,7 @@ low_transaction_check_removal (LowTransaction *trans,
 	for (i = 0; files[i] != NULL; i++) {
 		LowPackageIter *iter;
 		LowPackageDependency *file_dep;
-
-		if (from_update &&
-		    low_transaction_dep_in_filelist (files[i], update_files)) {
-			low_debug ("File contained in update");
-			continue;
-		}
+		bool update_checked = false;
 
 		file_dep = low_package_dependency_new (files[i],
 						       DEPENDENCY_SENSE_NONE,
@@ -866,6 +893,22 @@ low_transaction_check_removal (LowTransaction *trans,
 				continue;
 			}
 
+			/*
+			 * Only ask the update about files that something
+			 * needs. Few are, and asking about the rest could
+			 * mean fetching its filelists.
+			 */
+			if (from_update && !update_checked) {
+				update_checked = true;
+				if (low_package_has_file (member->related_pkg,
+							  files[i])) {
+					low_debug ("File contained in update");
+					low_package_unref (iter->pkg);
+					low_package_iter_free (iter);
+					break;
+				}
+			}
+
 			if (from_update) {
 				if (low_transaction_add_update (trans, iter->pkg)) {
 					low_debug ("found updating package");
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/stat.h>
 #include <rpm/rpmlib.h>
 
 #define MAXLINE 10000
@@ -183,4 +184,81 @@ low_util_digest_type_from_string (const char *string)
 	}
 }
 
+/**
+ * Turn a yum style length of time (like "90", "90m", "6h", "2d", or
+ * "never") into seconds. "never" is -1. Anything we can't make sense of
+ * is fallback.
+ */
+int
+low_util_parse_duration (const char *string, int fallback)
+{
+	char *end;
+	long value;
+
+	if (string == NULL) {
+		return fallback;
+	}
+
+	if (!strcmp (string, "never") || !strcmp (string, "-1")) {
+		return -1;
+	}
+
+	value = strtol (string, &end, 10);
+	if (end == string || value < 0) {
+		return fallback;
+	}
+
+	switch (*end) {
+		case 'd':
+			value *= 24;
+			/* fall through */
+		case 'h':
+			value *= 60;
+			/* fall through */
+		case 'm':
+			value *= 60;
+			/* fall through */
+		case 's':
+			end++;
+			break;
+		default:
+			break;
+	}
+
+	if (*end != '\0') {
+		return fallback;
+	}
+
+	return value;
+}
+
+/**
+ * Fill in stamp for file as it is now. Returns false if it can't be
+ * stat'd.
+ */
+bool
+low_util_file_stamp (const char *file, LowFileStamp *stamp)
+{
+	struct stat buf;
+
+	if (stat (file, &buf) != 0) {
+		return false;
+	}
+
+	stamp->size = buf.st_size;
+	stamp->mtime = buf.st_mtime;
+	stamp->inode = buf.st_ino;
+
+	return true;
+}
+
+bool
+low_util_file_stamp_equal (const LowFileStamp *stamp1,
+			   const LowFileStamp *stamp2)
+{
+	return stamp1->size == stamp2->size &&
+		stamp1->mtime == stamp2->mtime &&
+		stamp1->inode == stamp2->inode;
+}
+
 /* vim: set ts=8 sw=8 noet: */
@@ -23,6 +23,7 @@
 #define _LOW_UTIL_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * Package digest types we understand
@@ -35,12 +36,29 @@ typedef enum {
 	DIGEST_NONE
 } LowDigestType;
 
+/**
+ * Which file a cache file was built from: its size, mtime and inode when
+ * it was read. A replaced file differs in at least one, even if it was
+ * replaced within the same second.
+ */
+typedef struct _LowFileStamp {
+	uint64_t size;
+	int64_t mtime;
+	uint64_t inode;
+} LowFileStamp;
+
 char **low_util_word_wrap (const char *text, int width);
 
 int low_util_evr_cmp (const char *evr1, const char *evr2);
 
 LowDigestType low_util_digest_type_from_string (const char *string);
 
+int low_util_parse_duration (const char *string, int fallback);
+
+bool low_util_file_stamp (const char *file, LowFileStamp *stamp);
+bool low_util_file_stamp_equal (const LowFileStamp *stamp1,
+				const LowFileStamp *stamp2);
+
 #endif /* _LOW_UTIL_H_ */
 
 /* vim: set ts=8 sw=8 noet: */
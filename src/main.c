@@ -23,17 +23,20 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <glob.h>
 #include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
 
-#include <bzlib.h>
 #include <glib.h>
 #include <rpm/rpmdb.h>
-#include <zlib.h>
 
 #include "config.h"
 
 #include "low-arch.h"
 #include "low-debug.h"
+#include "low-decompress.h"
 #include "low-config.h"
 #include "low-package.h"
 #include "low-repo-rpmdb.h"
@@ -41,6 +44,7 @@
 #include "low-repo-sqlite.h"
 #include "low-repomd-parser.h"
 #include "low-repoxml-parser.h"
+#include "low-sqlite-importer.h"
 #include "low-transaction.h"
 #include "low-util.h"
 #include "low-download.h"
@@ -255,16 +259,85 @@ print_all_packages (LowPackageIter *iter, bool show_all)
 	}
 }
 
+unsigned int max_parallel_downloads = LOW_DOWNLOAD_DEFAULT_MAX_CONNECTIONS;
+unsigned int max_mirror_connections =
+	LOW_DOWNLOAD_DEFAULT_MAX_MIRROR_CONNECTIONS;
+
+/* Files at least this many MB are fetched in segments; 0 for never */
+unsigned int segmented_download_size = 0;
+unsigned int max_download_segments = LOW_DOWNLOAD_DEFAULT_MAX_SEGMENTS;
+bool hedged_downloads = false;
+
+/* Deltas rebuilt at once; 0 for one per CPU */
+unsigned int delta_rebuild_workers = 0;
+
+/* MB of files being downloaded at once; 0 for no limit */
+unsigned int max_download_inflight = 0;
+
+/* Shared by every download a command makes, so connections get reused */
+LowDownloadSession *download_session = NULL;
+
 static bool
 initialize_repos (LowRepo **repo_rpmdb, LowRepoSet **repos)
 {
 	LowConfig *config;
+	long low_speed_limit = LOW_DOWNLOAD_DEFAULT_LOW_SPEED_LIMIT;
+	long low_speed_time = LOW_DOWNLOAD_DEFAULT_LOW_SPEED_TIME;
+	int value;
 
 	*repo_rpmdb = low_repo_rpmdb_initialize ();
 	config = low_config_initialize (*repo_rpmdb);
 
 	*repos = low_repo_set_initialize_from_config (config, true);
 
+	value = low_config_get_int (config, "main", "max_parallel_downloads");
+	if (value > 0) {
+		max_parallel_downloads = value;
+	}
+
+	value = low_config_get_int (config, "main",
+				    "max_connections_per_mirror");
+	if (value > 0) {
+		max_mirror_connections = value;
+	}
+
+	value = low_config_get_int (config, "main", "segmented_download_size");
+	if (value > 0) {
+		segmented_download_size = value;
+	}
+
+	value = low_config_get_int (config, "main", "max_download_segments");
+	if (value > 0) {
+		max_download_segments = value;
+	}
+
+	hedged_downloads = low_config_get_bool (config, "main",
+						"hedged_downloads");
+
+	value = low_config_get_int (config, "main", "delta_rebuild_workers");
+	if (value > 0) {
+		delta_rebuild_workers = value;
+	}
+
+	value = low_config_get_int (config, "main", "max_download_inflight");
+	if (value > 0) {
+		max_download_inflight = value;
+	}
+
+	/* Same names and meanings as yum */
+	value = low_config_get_int (config, "main", "minrate");
+	if (value > 0) {
+		low_speed_limit = value;
+	}
+
+	value = low_config_get_int (config, "main", "timeout");
+	if (value > 0) {
+		low_speed_time = value;
+	}
+
+	low_download_session_set_low_speed (download_session, low_speed_limit,
+					    low_speed_time);
+
 	low_config_free (config);
 
 	if (!repos) {
@@ -426,6 +499,14 @@ print_updates (LowRepo *repo_rpmdb, LowConfig *config)
 	return EXIT_SUCCESS;
 }
 
+bool show_duplicates = false;
+
+LowOption list_options[] = {
+	{OPTION_BOOL, 0, "show-duplicates", &show_duplicates, NULL,
+		"Show every available version of packages"},
+	LOW_OPTION_END
+};
+
 static int
 command_list (int argc, const char *argv[])
 {
@@ -450,6 +531,8 @@ command_list (int argc, const char *argv[])
 		LowRepoSet *repos =
 			low_repo_set_initialize_from_config (config, true);
 
+		low_repo_set_set_newest_only (repos, !show_duplicates);
+
 		iter = low_repo_set_list_all (repos);
 		print_all_packages_short (iter);
 
@@ -461,6 +544,7 @@ command_list (int argc, const char *argv[])
 		print_all_packages_short (iter);
 
 		repos = low_repo_set_initialize_from_config (config, true);
+		low_repo_set_set_newest_only (repos, !show_duplicates);
 
 		iter = low_repo_set_list_by_name (repos, argv[0]);
 		print_all_packages_short (iter);
@@ -759,10 +843,49 @@ download_callback (void *clientp, double dltotal, double dlnow,
 	return 0;
 }
 
-static bool
-download_package (LowPackage *pkg)
+static LowDownloadQueue *
+create_download_queue (void)
+{
+	LowDownloadQueue *queue =
+		low_download_queue_new (download_session,
+					max_parallel_downloads,
+					max_mirror_connections);
+
+	low_download_queue_set_segmented (queue,
+					  (off_t) segmented_download_size *
+					  1024 * 1024,
+					  max_download_segments);
+	low_download_queue_set_hedged (queue, hedged_downloads);
+	low_download_queue_set_max_inflight (queue,
+					     (off_t) max_download_inflight *
+					     1024 * 1024);
+
+	return queue;
+}
+
+static void
+download_queue_callback (unsigned int files_done, unsigned int files_total,
+			 double dlnow, double dltotal)
+{
+	char *files = g_strdup_printf ("(%u/%u)", files_done, files_total);
+
+	download_callback (files, dltotal, dlnow, 0, 0);
+	free (files);
+}
+
+static void
+download_done_callback (void *data, bool successful)
+{
+	LowPackage *pkg = data;
+
+	if (!successful) {
+		printf ("\nUnable to download %s\n", pkg->name);
+	}
+}
+
+static void
+queue_package_download (LowDownloadQueue *queue, LowPackage *pkg)
 {
-	int res;
 	LowMirrorList *mirrors = low_repo_sqlite_get_mirror_list (pkg->repo);
 
 	char *local_file = create_package_filepath (pkg);
@@ -775,48 +898,56 @@ download_package (LowPackage *pkg)
 	}
 	free (dirname);
 
-	res = low_download_if_missing (mirrors, pkg->location_href, local_file,
-				       filename, pkg->digest, pkg->digest_type,
-				       pkg->size, download_callback);
+	low_download_queue_add (queue, mirrors, pkg->location_href, local_file,
+				filename, pkg->digest, pkg->digest_type,
+				pkg->size, download_done_callback, pkg);
 	free (local_file);
-
-	return res == 0;
 }
 
-static char *
-create_delta_filepath (LowRepo *repo, LowPackageDelta *pkg_delta)
+#define MB (1024.0 * 1024.0)
+
+static void
+print_download_stats (LowDownloadQueue *queue)
 {
-	const char *filename = get_file_basename (pkg_delta->filename);
-	char *local_file = g_strdup_printf ("%s/%s/deltas/%s",
-					    LOCAL_CACHE, repo->id,
-					    filename);
+	if (queue->fetched == 0 || queue->elapsed <= 0) {
+		return;
+	}
 
-	return local_file;
+	printf ("Downloaded %.1f MB in %.1fs (%.1f MB/s)\n",
+		queue->fetched / MB, queue->elapsed,
+		queue->fetched / MB / queue->elapsed);
 }
 
+/*
+ * Fetch everything in the queue, with one progress line for the lot.
+ */
 static bool
-download_delta (LowRepo *repo, LowPackageDelta *pkg_delta)
+run_download_queue (LowDownloadQueue *queue)
 {
-	int res;
-	LowMirrorList *mirrors = low_repo_sqlite_get_mirror_list (repo);
-
-	const char *filename = get_file_basename (pkg_delta->filename);
-	char *local_file = create_delta_filepath (repo, pkg_delta);
-	char *dirname = g_strdup_printf ("%s/%s/deltas", LOCAL_CACHE,
-					 repo->id);
+	bool successful = true;
 
-	if (!g_file_test (dirname, G_FILE_TEST_EXISTS)) {
-		mkdir (dirname, 0755);
+	if (queue->files_total > 0) {
+		successful = low_download_queue_run (queue,
+						     download_queue_callback)
+			== 0;
+		printf ("\n");
+		print_download_stats (queue);
 	}
-	free (dirname);
 
-	res = low_download_if_missing (mirrors, pkg_delta->filename, local_file,
-				       filename, pkg_delta->digest,
-				       pkg_delta->digest_type, pkg_delta->size,
-				       download_callback);
-	free (local_file);
+	low_download_queue_free (queue);
 
-	return res == 0;
+	return successful;
+}
+
+static char *
+create_delta_filepath (LowRepo *repo, LowPackageDelta *pkg_delta)
+{
+	const char *filename = get_file_basename (pkg_delta->filename);
+	char *local_file = g_strdup_printf ("%s/%s/deltas/%s",
+					    LOCAL_CACHE, repo->id,
+					    filename);
+
+	return local_file;
 }
 
 static bool
@@ -845,7 +976,10 @@ apply_delta (LowPackageDelta *pkg_delta, LowPackage *new_pkg)
 	char *command = g_strdup_printf ("/usr/bin/applydeltarpm -a %s %s %s",
 					 pkg_delta->arch, delta_file, rpm_file);
 
-	printf ("Rebuilding %s\n", get_file_basename (rpm_file));
+	low_debug ("Rebuilding %s", get_file_basename (rpm_file));
+	free (delta_file);
+	free (rpm_file);
+
 	if (g_spawn_command_line_sync (command, NULL, NULL, &res, NULL)) {
 		free (command);
 		return res == 0;
@@ -855,35 +989,290 @@ apply_delta (LowPackageDelta *pkg_delta, LowPackage *new_pkg)
 	return false;
 }
 
-static bool
-construct_delta (LowPackage *new_pkg, LowPackage *old_pkg)
+static LowPackageDelta *
+find_delta (LowPackage *new_pkg, LowPackage *old_pkg)
 {
-	LowPackageDelta *pkg_delta;
 	LowDelta *delta;
 
 	delta = low_repo_sqlite_get_delta (new_pkg->repo);
 	if (delta == NULL) {
-		return false;
+		return NULL;
 	}
 
-	pkg_delta = low_delta_find_delta (delta, new_pkg, old_pkg);
-	if (pkg_delta == NULL) {
-		return false;
+	return low_delta_find_delta (delta, new_pkg, old_pkg);
+}
+
+/*
+ * Updates with a delta go through three stages that all run at once: the
+ * delta comes down in the download queue along with everything else, a
+ * pool of workers rebuilds the new package from it, and another worker
+ * checks the rebuilt package against its digest. Anything that falls
+ * over along the way goes back on the download queue in full.
+ */
+typedef struct _LowDeltaPipeline LowDeltaPipeline;
+
+typedef struct _LowDeltaJob {
+	LowDeltaPipeline *pipeline;
+	LowPackage *new_pkg;
+	LowPackageDelta *pkg_delta;
+	bool successful;
+	double rebuild_time;
+	double digest_time;
+} LowDeltaJob;
+
+struct _LowDeltaPipeline {
+	LowDownloadQueue *queue;
+	GThreadPool *rebuild_pool;
+	GThreadPool *digest_pool;
+	GList *backlog;		/**< Downloaded, waiting for a rebuilder */
+	GAsyncQueue *results;	/**< Jobs done with, back to the main thread */
+	unsigned int outstanding; /**< Jobs in the backlog or worker stages */
+	unsigned int delta_failures;
+
+	/* Totals for the jobs that have come back */
+	unsigned int attempted;
+	double rebuild_time;
+	unsigned int checked;	/**< Rebuilt, and on to the digest stage */
+	double checked_bytes;
+	double digest_time;
+};
+
+/* Deltas handed to the rebuild workers, per worker, before we hold off */
+#define DELTA_JOBS_PER_WORKER 2
+
+static void
+delta_rebuild_worker (gpointer data, gpointer user_data)
+{
+	LowDeltaJob *job = data;
+	LowDeltaPipeline *pipeline = user_data;
+	GTimer *timer = g_timer_new ();
+
+	job->successful = verify_delta (job->pkg_delta->sequence,
+					job->pkg_delta->arch) &&
+		apply_delta (job->pkg_delta, job->new_pkg);
+
+	job->rebuild_time = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	if (job->successful) {
+		g_thread_pool_push (pipeline->digest_pool, job, NULL);
+	} else {
+		g_async_queue_push (pipeline->results, job);
 	}
+}
 
-	if (!download_delta (new_pkg->repo, pkg_delta)) {
-		return false;
+static void
+delta_digest_worker (gpointer data, gpointer user_data)
+{
+	LowDeltaJob *job = data;
+	LowDeltaPipeline *pipeline = user_data;
+	LowPackage *pkg = job->new_pkg;
+	char *rpm_file = create_package_filepath (pkg);
+	GTimer *timer = g_timer_new ();
+
+	job->successful = !low_download_is_missing (rpm_file, pkg->digest,
+						    pkg->digest_type,
+						    pkg->size);
+	if (!job->successful) {
+		unlink (rpm_file);
 	}
+	free (rpm_file);
 
-	if (!verify_delta (pkg_delta->sequence, pkg_delta->arch)) {
-		return false;
+	job->digest_time = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	g_async_queue_push (pipeline->results, job);
+}
+
+/*
+ * Move things along from the main thread: feed downloaded deltas to the
+ * rebuilders as they have room, and fall back to a full download for any
+ * update whose delta didn't work out.
+ */
+static void
+delta_pipeline_finish_job (LowDeltaPipeline *pipeline, LowDeltaJob *job)
+{
+	pipeline->outstanding--;
+
+	pipeline->attempted++;
+	pipeline->rebuild_time += job->rebuild_time;
+	if (job->digest_time > 0) {
+		pipeline->checked++;
+		pipeline->checked_bytes += job->new_pkg->size;
+		pipeline->digest_time += job->digest_time;
 	}
 
-	if (!apply_delta (pkg_delta, new_pkg)) {
-		return false;
+	if (!job->successful) {
+		low_debug ("Unable to rebuild %s from a delta",
+			   job->new_pkg->name);
+		queue_package_download (pipeline->queue, job->new_pkg);
 	}
+	free (job);
+}
 
-	return true;
+static void
+delta_pipeline_poll (LowDownloadQueue *queue G_GNUC_UNUSED, void *data)
+{
+	LowDeltaPipeline *pipeline = data;
+	LowDeltaJob *job;
+
+	while ((job = g_async_queue_try_pop (pipeline->results)) != NULL) {
+		delta_pipeline_finish_job (pipeline, job);
+	}
+
+	while (pipeline->backlog != NULL &&
+	       g_thread_pool_unprocessed (pipeline->rebuild_pool) <
+	       DELTA_JOBS_PER_WORKER * delta_rebuild_workers) {
+		job = pipeline->backlog->data;
+		pipeline->backlog = g_list_delete_link (pipeline->backlog,
+							pipeline->backlog);
+		g_thread_pool_push (pipeline->rebuild_pool, job, NULL);
+	}
+}
+
+static void
+delta_download_done_callback (void *data, bool successful)
+{
+	LowDeltaJob *job = data;
+	LowDeltaPipeline *pipeline = job->pipeline;
+
+	if (!successful) {
+		pipeline->delta_failures++;
+		queue_package_download (pipeline->queue, job->new_pkg);
+		free (job);
+		return;
+	}
+
+	pipeline->outstanding++;
+	pipeline->backlog = g_list_append (pipeline->backlog, job);
+}
+
+static void
+queue_delta_download (LowDeltaPipeline *pipeline, LowPackage *new_pkg,
+		      LowPackageDelta *pkg_delta)
+{
+	LowMirrorList *mirrors =
+		low_repo_sqlite_get_mirror_list (new_pkg->repo);
+	LowDeltaJob *job = malloc (sizeof (LowDeltaJob));
+
+	const char *filename = get_file_basename (pkg_delta->filename);
+	char *local_file = create_delta_filepath (new_pkg->repo, pkg_delta);
+	char *dirname = g_strdup_printf ("%s/%s/deltas", LOCAL_CACHE,
+					 new_pkg->repo->id);
+
+	if (!g_file_test (dirname, G_FILE_TEST_EXISTS)) {
+		mkdir (dirname, 0755);
+	}
+	free (dirname);
+
+	job->pipeline = pipeline;
+	job->new_pkg = new_pkg;
+	job->pkg_delta = pkg_delta;
+	job->successful = true;
+	job->rebuild_time = 0;
+	job->digest_time = 0;
+
+	low_download_queue_add (pipeline->queue, mirrors, pkg_delta->filename,
+				local_file, filename, pkg_delta->digest,
+				pkg_delta->digest_type, pkg_delta->size,
+				delta_download_done_callback, job);
+	free (local_file);
+}
+
+/*
+ * Run the download queue and the delta stages until everything's either
+ * here or given up on. Returns false if any package didn't make it.
+ */
+static bool
+delta_pipeline_run (LowDeltaPipeline *pipeline)
+{
+	LowDownloadQueue *queue = pipeline->queue;
+	int failed = 0;
+
+	while (1) {
+		if (queue->files_total > queue->files_done) {
+			failed += low_download_queue_run
+				(queue, download_queue_callback);
+			printf ("\n");
+		}
+
+		delta_pipeline_poll (queue, pipeline);
+		if (pipeline->outstanding == 0 &&
+		    queue->files_total == queue->files_done) {
+			break;
+		}
+
+		/* Nothing to download until a rebuild finishes or fails */
+		if (queue->files_total == queue->files_done) {
+			delta_pipeline_finish_job
+				(pipeline, g_async_queue_pop (pipeline->results));
+		}
+	}
+
+	print_download_stats (queue);
+
+	if (pipeline->attempted > 0) {
+		printf ("Rebuilt %u of %u packages from deltas in %.1fs of "
+			"work\n", pipeline->checked, pipeline->attempted,
+			pipeline->rebuild_time);
+	}
+
+	if (pipeline->checked > 0 && pipeline->digest_time > 0) {
+		printf ("Checked %u rebuilt packages in %.1fs (%.1f MB/s)\n",
+			pipeline->checked, pipeline->digest_time,
+			pipeline->checked_bytes / MB / pipeline->digest_time);
+	}
+
+	/* A failed delta is no loss if the full package came down instead */
+	return failed - (int) pipeline->delta_failures == 0;
+}
+
+static LowDeltaPipeline *
+delta_pipeline_new (LowDownloadQueue *queue)
+{
+	LowDeltaPipeline *pipeline = malloc (sizeof (LowDeltaPipeline));
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+	if (!g_thread_supported ()) {
+		g_thread_init (NULL);
+	}
+#endif
+
+	if (delta_rebuild_workers == 0) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+		delta_rebuild_workers = cpus > 0 ? cpus : 1;
+	}
+
+	pipeline->queue = queue;
+	pipeline->rebuild_pool = g_thread_pool_new (delta_rebuild_worker,
+						    pipeline,
+						    delta_rebuild_workers,
+						    FALSE, NULL);
+	pipeline->digest_pool = g_thread_pool_new (delta_digest_worker,
+						   pipeline, 1, FALSE, NULL);
+	pipeline->backlog = NULL;
+	pipeline->results = g_async_queue_new ();
+	pipeline->outstanding = 0;
+	pipeline->delta_failures = 0;
+	pipeline->attempted = 0;
+	pipeline->rebuild_time = 0;
+	pipeline->checked = 0;
+	pipeline->checked_bytes = 0;
+	pipeline->digest_time = 0;
+
+	low_download_queue_set_poll (queue, delta_pipeline_poll, pipeline);
+
+	return pipeline;
+}
+
+static void
+delta_pipeline_free (LowDeltaPipeline *pipeline)
+{
+	g_thread_pool_free (pipeline->rebuild_pool, FALSE, TRUE);
+	g_thread_pool_free (pipeline->digest_pool, FALSE, TRUE);
+	g_async_queue_unref (pipeline->results);
+	free (pipeline);
 }
 
 static int
@@ -892,6 +1281,7 @@ command_download (int argc G_GNUC_UNUSED, const char *argv[])
 	LowRepo *repo_rpmdb;
 	LowRepoSet *repos;
 	LowPackageIter *iter;
+	LowDownloadQueue *queue;
 	int found_pkg;
 	int ret = EXIT_SUCCESS;
 
@@ -899,17 +1289,17 @@ command_download (int argc G_GNUC_UNUSED, const char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	queue = create_download_queue ();
+
 	iter = low_repo_set_list_by_name (repos, argv[0]);
 	found_pkg = 0;
 	while (iter = low_package_iter_next (iter), iter != NULL) {
-		LowPackage *pkg = iter->pkg;
 		found_pkg = 1;
-		if (!download_package (pkg)) {
-			printf ("Unable to download %s\n", pkg->name);
-		}
-		low_package_unref (pkg);
+		queue_package_download (queue, iter->pkg);
 	}
 
+	run_download_queue (queue);
+
 	if (!found_pkg) {
 		printf ("No such package: %s\n", argv[0]);
 		ret = EXIT_FAILURE;
@@ -983,16 +1373,14 @@ static bool
 download_required_packages (LowTransaction *trans)
 {
 	GList *list;
-
-	bool successful = true;
+	LowDownloadQueue *queue = create_download_queue ();
+	LowDeltaPipeline *pipeline = delta_pipeline_new (queue);
+	bool successful;
 
 	list = g_hash_table_get_values (trans->install);
 	while (list != NULL) {
 		LowTransactionMember *member = list->data;
-		if (!download_package (member->pkg)) {
-			printf ("Unable to download %s\n", member->pkg->name);
-			successful = false;
-		}
+		queue_package_download (queue, member->pkg);
 		list = list->next;
 	}
 
@@ -1003,12 +1391,15 @@ download_required_packages (LowTransaction *trans)
 
 		char *local_file = create_package_filepath (member->pkg);
 		if (low_download_is_missing (local_file, pkg->digest,
-					     pkg->digest_type, pkg->size) &&
-		    !construct_delta (member->pkg, member->related_pkg)) {
-			if (!download_package (member->pkg)) {
-				printf ("Unable to download %s\n",
-					member->pkg->name);
-				successful = false;
+					     pkg->digest_type, pkg->size)) {
+			LowPackageDelta *pkg_delta =
+				find_delta (member->pkg, member->related_pkg);
+
+			if (pkg_delta != NULL) {
+				queue_delta_download (pipeline, member->pkg,
+						      pkg_delta);
+			} else {
+				queue_package_download (queue, member->pkg);
 			}
 		}
 		list = list->next;
@@ -1016,6 +1407,11 @@ download_required_packages (LowTransaction *trans)
 		free (local_file);
 	}
 
+	successful = delta_pipeline_run (pipeline);
+
+	delta_pipeline_free (pipeline);
+	low_download_queue_free (queue);
+
 	return successful;
 }
 
@@ -1326,6 +1722,10 @@ command_install (int argc, const char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	/* Don't look past the best priority repos that have what we need */
+	low_repo_set_set_search_mode (repos, SEARCH_FIRST_MATCH);
+	low_repo_set_set_newest_only (repos, true);
+
 	trans = low_transaction_new (repo_rpmdb, repos, transaction_callback,
 				     &counter);
 
@@ -1383,6 +1783,10 @@ command_update (int argc, const char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	/* Don't look past the best priority repos that have what we need */
+	low_repo_set_set_search_mode (repos, SEARCH_FIRST_MATCH);
+	low_repo_set_set_newest_only (repos, true);
+
 	trans = low_transaction_new (repo_rpmdb, repos, transaction_callback,
 				     &counter);
 
@@ -1472,10 +1876,59 @@ command_remove (int argc, const char *argv[])
 	return res;
 }
 
+/*
+ * Repos are refreshed by a pool of workers. A repo's first job fetches its
+ * mirror list and repomd.xml, then hands each repodata file it needs back
+ * to the pool as a job of its own. Whichever file job finishes last wraps
+ * the repo up, and passes it back to the main thread to report on. No job
+ * waits on another, so the pool's size bounds how many downloads run at
+ * once across every repo.
+ */
+typedef struct _LowRefresh {
+	LowRepo *repo;
+	LowRepomd *repomd;
+	LowRepomd *old_repomd;	/**< What repomd replaced, if anything */
+	GAsyncQueue *done;	/**< Refreshes finished with, to report on */
+	GTimer *timer;
+	volatile gint files_left;
+	volatile gint files_fetched;
+	char *failed_file;	/**< The first file we couldn't get, if any */
+} LowRefresh;
+
+typedef struct _LowRefreshJob {
+	LowRefresh *refresh;
+	LowRepomdData *data;	/**< NULL for the repomd.xml stage */
+	LowRepomdData *chunks;	/**< data's chunk index, if it has one */
+	LowRepomdData *old_data;	/**< What data replaces, if anything */
+} LowRefreshJob;
+
+/* Repodata files downloaded at once, over all repos */
+unsigned int max_parallel_refresh = LOW_DOWNLOAD_DEFAULT_MAX_CONNECTIONS;
+
+static GThreadPool *refresh_pool = NULL;
+
+static void
+refresh_failed (LowRefresh *refresh, const char *relative_name)
+{
+	char *failed_file = strdup (get_file_basename (relative_name));
+
+	if (!g_atomic_pointer_compare_and_exchange ((gpointer *)
+						    &refresh->failed_file,
+						    NULL, failed_file)) {
+		free (failed_file);
+	}
+}
+
+/*
+ * Fetch relative_name into a tmp file in the cache, if it's changed since
+ * validators were saved. Returns NULL if it couldn't be fetched, or if
+ * *modified comes back false.
+ */
 static char *
-download_repodata_file (LowRepo *repo, const char *relative_name)
+download_repodata_file (LowRefresh *refresh, const char *relative_name,
+			LowDownloadValidators *validators, bool *modified)
 {
-	int ret;
+	LowRepo *repo = refresh->repo;
 	LowMirrorList *mirrors = low_repo_sqlite_get_mirror_list (repo);
 
 	const char *basename = get_file_basename (relative_name);
@@ -1483,153 +1936,541 @@ download_repodata_file (LowRepo *repo, const char *relative_name)
 					    LOCAL_CACHE, repo->id,
 					    basename);
 
-	/* Just something nice to display */
-	char *displayed_basename;
-	if (strlen (basename) > 24) {
-		int offset = strlen (basename) - 24;
-		displayed_basename =
-			g_strdup_printf ("%s - ...%s", repo->id,
-					 basename + offset);
-	} else {
-		displayed_basename = g_strdup_printf ("%s - %s", repo->id,
-						      basename);
+	if (mirrors == NULL ||
+	    low_download_from_mirror_if_modified (download_session, mirrors,
+						  relative_name, local_file,
+						  repo->id, validators,
+						  modified, NULL) != 0) {
+		refresh_failed (refresh, relative_name);
+		free (local_file);
+		return NULL;
 	}
 
-	/* XXX use if_missing here for non repomd.xml */
-	ret = low_download_from_mirror (mirrors, relative_name, local_file,
-					displayed_basename, download_callback);
-
-	free (displayed_basename);
-
-	if (ret != 0) {
-		printf ("\nUnable to download %s\n", basename);
-		exit (EXIT_FAILURE);
+	if (!*modified) {
+		free (local_file);
+		return NULL;
 	}
+
 	return local_file;
 }
 
-#define BUF_SIZE 1024
+static char *
+create_repodata_filename (LowRepo *repo, const char *relative_name)
+{
+	const char *basename = get_file_basename (relative_name);
+	return g_strdup_printf ("%s/%s/%s", LOCAL_CACHE, repo->id, basename);
+}
 
-/* XXX should do this while downloading */
 static char *
-uncompress_file_bz2 (const char *filename)
-{
-	int error;
-	int size_read;
-	FILE *file;
-	BZFILE *compressed;
-	int fd;
-	char buf[BUF_SIZE];
-	char *uncompressed_name = malloc (strlen (filename) - 3);
-	strncpy (uncompressed_name, filename, strlen (filename) - 4);
-	uncompressed_name[strlen (filename) - 4] = '\0';
-
-	file = fopen (filename, "r");
-	compressed = BZ2_bzReadOpen (&error, file, 0, 0, NULL, 0);
-
-	fd = open (uncompressed_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-
-	printf ("Uncompressing...\n");
-	while (size_read = BZ2_bzRead (&error, compressed, &buf, BUF_SIZE),
-	       size_read != 0) {
-		if (write (fd, buf, size_read) == -1) {
-			/* XXX do something better here on failure */
-			exit (EXIT_FAILURE);
-		}
-	}
+create_uncompressed_repodata_filename (LowRepo *repo,
+				       const char *relative_name)
+{
+	char *filename = create_repodata_filename (repo, relative_name);
+	char *uncompressed_name = low_decompress_strip_extension (filename);
 
-	close (fd);
+	free (filename);
 
 	return uncompressed_name;
 }
 
+static bool
+repodata_missing (LowRepo *repo, LowRepomdData *data)
+{
+	char *uncompressed_name =
+		create_uncompressed_repodata_filename (repo, data->location);
+	char *name = create_repodata_filename (repo, data->location);
+	const char *digest = data->open_checksum;
+	LowDigestType digest_type = data->open_checksum_type;
+	off_t size = data->open_size;
+	bool missing = true;
+
+	/* Stored as is, the download checksum is the file's own */
+	if (!strcmp (name, uncompressed_name)) {
+		digest = data->checksum;
+		digest_type = data->checksum_type;
+		size = data->size;
+	}
+	free (name);
+
+	if (low_download_is_verified (uncompressed_name, data->checksum,
+				      data->open_checksum)) {
+		missing = false;
+	} else if (digest != NULL && size > 0 &&
+		   !low_download_is_missing (uncompressed_name, digest,
+					     digest_type, size)) {
+		/* Read through once; remember so we needn't again */
+		low_download_record_verified (uncompressed_name,
+					      data->checksum,
+					      data->open_checksum);
+		missing = false;
+	}
+
+	free (uncompressed_name);
+
+	return missing;
+}
+
+/*
+ * We add our own indexes to the dbs we keep (see index_repodata_file),
+ * which rewrites some of their pages. A db that comes in chunks keeps an
+ * untouched copy of itself here, for the next update to take chunks from.
+ */
 static char *
-uncompress_file_gz (const char *filename)
+unindexed_repodata_filename (const char *local_file)
 {
-	int size_read;
-	gzFile *compressed;
-	int fd;
-	char buf[BUF_SIZE];
-	char *uncompressed_name = malloc (strlen (filename) - 2);
-	strncpy (uncompressed_name, filename, strlen (filename) - 3);
-	uncompressed_name[strlen (filename) - 3] = '\0';
+	return g_strdup_printf ("%s.unindexed", local_file);
+}
 
-	compressed = gzopen (filename, "rb");
+/*
+ * The chunk index data comes with, fetched into index_file.
+ */
+static LowChunkIndex *
+fetch_repodata_chunk_index (LowRepo *repo, LowRepomdData *data,
+			    LowRepomdData *chunks, const char *index_file)
+{
+	LowMirrorList *mirrors = low_repo_sqlite_get_mirror_list (repo);
+	LowChunkIndex *index;
 
-	fd = open (uncompressed_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (low_download_uncompressed (download_session, mirrors,
+				       chunks->location, index_file, repo->id,
+				       chunks->checksum,
+				       chunks->checksum_type, NULL) != 0) {
+		return NULL;
+	}
 
-	printf ("Uncompressing...\n");
-	while (size_read = gzread (compressed, &buf, BUF_SIZE), size_read != 0) {
-		if (write (fd, buf, size_read) == -1) {
-			/* XXX do something better here on failure */
-			exit (EXIT_FAILURE);
-		}
+	index = low_chunk_index_load (index_file);
+
+	/* It has to be the index of the file we're after */
+	if (index == NULL || (data->size > 0 && index->size != data->size)) {
+		low_debug ("%s doesn't match %s", chunks->location,
+			   data->location);
+		low_chunk_index_free (index);
+		return NULL;
 	}
 
-	close (fd);
+	return index;
+}
 
-	return uncompressed_name;
+/*
+ * Try to build local_file out of old_file, laid out as old_index says,
+ * and only the chunks of new_index that changed since.
+ */
+static bool
+fetch_repodata_chunks (LowRepo *repo, LowRepomdData *data,
+		       LowChunkIndex *new_index, const char *old_file,
+		       LowChunkIndex *old_index, const char *local_file)
+{
+	LowMirrorList *mirrors = low_repo_sqlite_get_mirror_list (repo);
+	char *unindexed_file = unindexed_repodata_filename (old_file);
+	const char *from_file = old_file;
+	bool updated;
+
+	/* Past half, one big request beats lots of little ones */
+	if (low_chunk_index_missing (old_index, new_index) >=
+	    new_index->size / 2) {
+		free (unindexed_file);
+		return false;
+	}
+
+	/*
+	 * Without the untouched copy, most of the indexed one still matches,
+	 * and the chunks that don't are fetched.
+	 */
+	if (access (unindexed_file, R_OK) == 0) {
+		from_file = unindexed_file;
+	}
+
+	updated = low_download_chunked (download_session, mirrors,
+					data->location, local_file, repo->id,
+					new_index, from_file, old_index) == 0;
+	free (unindexed_file);
+
+	return updated;
 }
 
-static char *
-create_repodata_filename (LowRepo *repo, const char *relative_name)
+/*
+ * Add our own indexes to a db we have. That changes the file, so a copy
+ * already checked against repomd is recorded as checked again, rather
+ * than being fetched over on the next refresh. One with a chunk index
+ * beside it is copied first, for fetch_repodata_chunks.
+ */
+static void
+index_repodata_file (LowRepo *repo, LowRepomdData *data)
 {
-	const char *basename = get_file_basename (relative_name);
-	return g_strdup_printf ("%s/%s/%s", LOCAL_CACHE, repo->id, basename);
+	char *local_file =
+		create_uncompressed_repodata_filename (repo, data->location);
+	char *index_file = g_strdup_printf ("%s.chunks", local_file);
+	char *unindexed_file = NULL;
+	bool verified = low_download_is_verified (local_file, data->checksum,
+						  data->open_checksum);
+
+	if (access (index_file, R_OK) == 0) {
+		unindexed_file = unindexed_repodata_filename (local_file);
+	}
+
+	if (low_repo_sqlite_add_indexes (local_file, unindexed_file) &&
+	    verified) {
+		low_download_record_verified (local_file, data->checksum,
+					      data->open_checksum);
+	}
+
+	free (unindexed_file);
+	free (index_file);
+	free (local_file);
 }
 
+/*
+ * Download data, uncompressing it into the cache on the way in, so the
+ * compressed copy never touches the disk. If it comes in chunks, only
+ * the chunks that changed since old_file are fetched, when we can.
+ *
+ * The new chunk index is fetched beside the old one, not over it, since
+ * old_file can be local_file, and only replaces it once local_file is
+ * up to date.
+ */
 static bool
-repodata_missing (LowRepo *repo, const char *relative_name)
+fetch_repodata (LowRepo *repo, LowRepomdData *data, LowRepomdData *chunks,
+		const char *old_file)
 {
-	char *filename = create_repodata_filename (repo, relative_name);
-	const char *last_dot = rindex (filename, '.');
-	char *uncompressed_name = malloc ((last_dot - filename) + 1);
-	strncpy (uncompressed_name, filename, last_dot - filename);
-	uncompressed_name[last_dot - filename] = '\0';
+	LowMirrorList *mirrors = low_repo_sqlite_get_mirror_list (repo);
+	char *local_file =
+		create_uncompressed_repodata_filename (repo, data->location);
+	char *index_file = g_strdup_printf ("%s.chunks", local_file);
+	char *new_index_file = g_strdup_printf ("%s.new", index_file);
+	LowChunkIndex *old_index = NULL;
+	LowChunkIndex *new_index = NULL;
+	int ret = -1;
 
-	free (filename);
+	if (chunks != NULL && old_file != NULL) {
+		char *old_index_file = g_strdup_printf ("%s.chunks", old_file);
 
-	/* XXX verify checksum */
-	if (!g_file_test (uncompressed_name, G_FILE_TEST_EXISTS)) {
-		free (uncompressed_name);
-		return true;
+		old_index = low_chunk_index_load (old_index_file);
+		free (old_index_file);
+	}
+
+	if (chunks != NULL) {
+		new_index = fetch_repodata_chunk_index (repo, data, chunks,
+							new_index_file);
+	}
+
+	if (old_index != NULL && new_index != NULL &&
+	    fetch_repodata_chunks (repo, data, new_index, old_file,
+				   old_index, local_file)) {
+		ret = 0;
 	} else {
-		free (uncompressed_name);
-		return false;
+		ret = low_download_uncompressed (download_session, mirrors,
+						 data->location, local_file,
+						 repo->id, data->checksum,
+						 data->checksum_type, NULL);
+	}
+
+	if (ret == 0) {
+		/* Checked on the way in, whole or chunk by chunk */
+		low_download_record_verified (local_file, data->checksum,
+					      data->open_checksum);
+	}
+
+	if (ret == 0 && new_index != NULL) {
+		rename (new_index_file, index_file);
+	} else if (ret == 0) {
+		/* Whatever was here before describes some other file */
+		unlink (index_file);
+	}
+	unlink (new_index_file);
+
+	/*
+	 * The untouched copies of what was here, and of what we updated
+	 * from, are out of date now. index_repodata_file makes a new one.
+	 */
+	if (ret == 0) {
+		char *unindexed_file = unindexed_repodata_filename (local_file);
+
+		unlink (unindexed_file);
+		free (unindexed_file);
 	}
+	if (ret == 0 && old_file != NULL) {
+		char *unindexed_file = unindexed_repodata_filename (old_file);
+
+		unlink (unindexed_file);
+		free (unindexed_file);
+	}
+
+	low_chunk_index_free (old_index);
+	low_chunk_index_free (new_index);
+	free (new_index_file);
+	free (index_file);
+	free (local_file);
+
+	return ret == 0;
 }
 
-static void
-fetch_repodata_file (LowRepo *repo, const char *relative_name, bool is_bz2)
+static bool
+fetch_repodata_file (LowRefreshJob *job)
+{
+	LowRefresh *refresh = job->refresh;
+	LowRepomdData *data = job->data;
+	char *old_file = NULL;
+	bool fetched;
+
+	if (job->old_data != NULL) {
+		old_file = create_uncompressed_repodata_filename
+			(refresh->repo, job->old_data->location);
+	}
+
+	fetched = fetch_repodata (refresh->repo, data, job->chunks, old_file);
+	free (old_file);
+
+	if (!fetched) {
+		refresh_failed (refresh, data->location);
+	}
+
+	return fetched;
+}
+
+/*
+ * The copy of some earlier filelists db that has a chunk index beside it,
+ * if there is one, to update the current one from. An out of date
+ * local_file, where the name doesn't change, is the best bet.
+ */
+static char *
+find_old_filelists_db (LowRepo *repo, const char *local_file)
+{
+	char *pattern = g_strdup_printf ("%s/%s/*filelists*.chunks",
+					 LOCAL_CACHE, repo->id);
+	char *index_file = g_strdup_printf ("%s.chunks", local_file);
+	char *old_file = NULL;
+	glob_t matches;
+	size_t i;
+
+	if (access (index_file, R_OK) == 0 && access (local_file, R_OK) == 0) {
+		old_file = strdup (local_file);
+	} else if (glob (pattern, 0, NULL, &matches) == 0) {
+		for (i = 0; i < matches.gl_pathc && old_file == NULL; i++) {
+			char *db_file = strndup (matches.gl_pathv[i],
+						 strlen (matches.gl_pathv[i]) -
+						 strlen (".chunks"));
+
+			if (access (db_file, R_OK) == 0) {
+				old_file = db_file;
+			} else {
+				free (db_file);
+			}
+		}
+		globfree (&matches);
+	}
+	free (index_file);
+	free (pattern);
+
+	return old_file;
+}
+
+/*
+ * Refresh leaves filelists out, as most commands never look at them. This
+ * fetches a repo's the first time one does.
+ */
+static bool
+fetch_filelists_db (LowRepo *repo, LowRepomdData *data, LowRepomdData *chunks)
 {
-	char *tmp_file;
 	char *local_file;
-	char *db_file;
+	char *old_file;
+	bool fetched;
+
+	if (!repodata_missing (repo, data)) {
+		return true;
+	}
 
-	tmp_file = download_repodata_file (repo, relative_name);
-	local_file = create_repodata_filename (repo, relative_name);
-	rename (tmp_file, local_file);
+	printf ("Fetching file lists for %s\n", repo->id);
 
-	if (is_bz2) {
-		db_file = uncompress_file_bz2 (local_file);
+	local_file = create_uncompressed_repodata_filename (repo,
+							    data->location);
+	old_file = chunks != NULL ?
+		find_old_filelists_db (repo, local_file) : NULL;
+
+	fetched = fetch_repodata (repo, data, chunks, old_file);
+	if (fetched) {
+		index_repodata_file (repo, data);
+		/* The files filter waits on filelists too */
+		low_repo_sqlite_build_filters (repo);
 	} else {
-		db_file = uncompress_file_gz (local_file);
+		fprintf (stderr, "Unable to fetch file lists for %s\n",
+			 repo->id);
 	}
 
+	free (old_file);
 	free (local_file);
+
+	return fetched;
+}
+
+static time_t
+repomd_data_timestamp (LowRepomdData *data)
+{
+	return data != NULL ? data->timestamp : 0;
+}
+
+/*
+ * Build whatever we need from the new repodata, once it's all here.
+ */
+static void
+refresh_repo_finish (LowRefresh *refresh)
+{
+	LowRepo *repo = refresh->repo;
+	LowRepomd *repomd = refresh->repomd;
+
+	/* Don't build from a half-updated set of files */
+	if (refresh->failed_file != NULL) {
+		g_timer_stop (refresh->timer);
+		g_async_queue_push (refresh->done, refresh);
+		return;
+	}
+
+	if (repomd->primary_db) {
+		/* Before the filters, which must be built from the indexed dbs */
+		index_repodata_file (repo, repomd->primary_db);
+		if (repomd->filelists_db != NULL &&
+		    !repodata_missing (repo, repomd->filelists_db)) {
+			index_repodata_file (repo, repomd->filelists_db);
+		}
+		low_repo_sqlite_build_filters (repo);
+	} else if (repomd->primary_xml && repomd->filelists_xml) {
+		char *primary_file;
+		char *filelists_file;
+		char *imported_db;
+
+		primary_file = create_uncompressed_repodata_filename
+			(repo, repomd->primary_xml->location);
+		filelists_file = create_uncompressed_repodata_filename
+			(repo, repomd->filelists_xml->location);
+
+		low_repoxml_parse (primary_file, filelists_file);
+
+		/* The sqlite repo opens what it was imported into */
+		imported_db = create_repodata_filename
+			(repo, LOW_SQLITE_IMPORTER_PRIMARY);
+		low_repo_sqlite_add_indexes (imported_db, NULL);
+		low_repo_sqlite_build_filters (repo);
+
+		free (imported_db);
+		free (primary_file);
+		free (filelists_file);
+	}
+
+	g_timer_stop (refresh->timer);
+	g_async_queue_push (refresh->done, refresh);
+}
+
+static void
+refresh_repo_add_file (GList **files, LowRefresh *refresh,
+		       LowRepomdData *data, LowRepomdData *chunks,
+		       LowRepomdData *old_data)
+{
+	if (data != NULL && repodata_missing (refresh->repo, data)) {
+		LowRefreshJob *job = malloc (sizeof (LowRefreshJob));
+
+		job->refresh = refresh;
+		job->data = data;
+		job->chunks = chunks;
+		job->old_data = old_data;
+
+		*files = g_list_prepend (*files, job);
+	}
+}
+
+/*
+ * Queue up whichever of the files repomd lists we don't have yet.
+ */
+static void
+refresh_repo_queue_files (LowRefresh *refresh)
+{
+	LowRepomd *repomd = refresh->repomd;
+	LowRepomd *old_repomd = refresh->old_repomd;
+	GList *files = NULL;
+	GList *cur;
+
+	if (repomd->primary_db) {
+		/* filelists wait until something needs them */
+		refresh_repo_add_file (&files, refresh, repomd->primary_db,
+				       repomd->primary_db_chunks,
+				       old_repomd != NULL ?
+				       old_repomd->primary_db : NULL);
+	} else {
+		refresh_repo_add_file (&files, refresh, repomd->primary_xml,
+				       NULL, NULL);
+		refresh_repo_add_file (&files, refresh,
+				       repomd->filelists_xml, NULL, NULL);
+	}
+	refresh_repo_add_file (&files, refresh, repomd->delta_xml, NULL,
+			       NULL);
+
+	if (files == NULL) {
+		refresh_repo_finish (refresh);
+		return;
+	}
+
+	/* Set before any of them can finish */
+	refresh->files_left = g_list_length (files);
+	for (cur = files; cur != NULL; cur = cur->next) {
+		g_thread_pool_push (refresh_pool, cur->data, NULL);
+	}
+	g_list_free (files);
+}
+
+/*
+ * Metadata fetched less than metadata_expire ago is used as is, without
+ * asking the mirrors about it at all.
+ */
+static bool
+repomd_is_fresh (LowRepo *repo, const char *repomd_file)
+{
+	struct stat buf;
+
+	if (stat (repomd_file, &buf) != 0) {
+		return false;
+	}
+
+	return repo->metadata_expire < 0 ||
+		time (NULL) - buf.st_mtime < repo->metadata_expire;
+}
+
+/*
+ * Fetch the mirror list at url into local_file, if it's changed since
+ * last time. If it can't be fetched, we keep the one we had.
+ */
+static void
+refresh_mirror_list (LowRepo *repo, const char *url, const char *local_file)
+{
+	LowDownloadValidators *validators =
+		low_download_validators_load (local_file);
+	char *tmp_file = g_strdup_printf ("%s.tmp", local_file);
+	bool modified;
+
+	if (low_download_if_modified (download_session, url, tmp_file,
+				      repo->id, validators, &modified,
+				      NULL) == 0 && modified &&
+	    rename (tmp_file, local_file) == 0) {
+		low_download_validators_save (validators, local_file);
+	}
+
 	free (tmp_file);
-	free (db_file);
+	low_download_validators_free (validators);
 }
 
+/*
+ * Fetch the mirror list and repomd.xml, then queue up the repodata files
+ * that have changed, to download alongside each other.
+ */
 static void
-refresh_repo (LowRepo *repo)
+refresh_repo_start (LowRefresh *refresh)
 {
+	LowRepo *repo = refresh->repo;
 	char *local_file;
 	char *tmp_file;
 	char *dirname;
+	LowDownloadValidators *validators;
 	LowRepomd *old_repomd;
 	LowRepomd *new_repomd;
 	LowRepomd *repomd;
+	bool modified = true;
 
 	dirname = g_strdup_printf ("/var/cache/yum/%s", repo->id);
 	if (!g_file_test (dirname, G_FILE_TEST_EXISTS)) {
@@ -1637,91 +2478,119 @@ refresh_repo (LowRepo *repo)
 	}
 	free (dirname);
 
+	local_file = create_repodata_filename (repo, "repodata/repomd.xml");
+	old_repomd = low_repomd_parse (local_file);
+
+	if (old_repomd != NULL && repomd_is_fresh (repo, local_file)) {
+		low_debug ("%s: metadata not expired", repo->id);
+		refresh->repomd = old_repomd;
+		free (local_file);
+		refresh_repo_queue_files (refresh);
+		return;
+	}
+
 	if (repo->mirror_list) {
-		char *display;
+		char *mirror_file;
+
 		/*
 		 * copy yum's hack to decide if the mirrorlist is plain text,
 		 * or fancy metalink.
 		 */
 		if (strstr (repo->mirror_list, "metalink")) {
-			display = g_strdup_printf ("%s - metalink", repo->id);
-			local_file = create_repodata_filename (repo,
-							       "metalink.xml");
+			mirror_file = create_repodata_filename (repo,
+								"metalink.xml");
 		} else {
-			display = g_strdup_printf ("%s - mirrorlist.txt",
-						   repo->id);
-			local_file =
+			mirror_file =
 				create_repodata_filename (repo,
 							  "mirrorlist.txt");
 		}
-		low_download (repo->mirror_list, local_file, display,
-			      download_callback);
+		refresh_mirror_list (repo, repo->mirror_list, mirror_file);
 
-		free (display);
-		free (local_file);
+		free (mirror_file);
 	}
 
-	local_file = create_repodata_filename (repo, "repodata/repomd.xml");
-	old_repomd = low_repomd_parse (local_file);
+	/* Without a copy to fall back on, ask for it outright */
+	validators = low_download_validators_load (local_file);
+	if (old_repomd == NULL) {
+		free (validators->etag);
+		free (validators->last_modified);
+		validators->etag = NULL;
+		validators->last_modified = NULL;
+	}
 
-	tmp_file = download_repodata_file (repo, "repodata/repomd.xml");
-	new_repomd = low_repomd_parse (tmp_file);
+	tmp_file = download_repodata_file (refresh, "repodata/repomd.xml",
+					   validators, &modified);
+	new_repomd = tmp_file != NULL ? low_repomd_parse (tmp_file) : NULL;
 
-	if (old_repomd == NULL ||
-	    old_repomd->primary_db_time < new_repomd->primary_db_time ||
-	    old_repomd->filelists_db_time < new_repomd->filelists_db_time) {
+	if (refresh->failed_file != NULL) {
+		repomd = old_repomd;
+	} else if (!modified) {
+		/* Unchanged; good for another metadata_expire */
+		utime (local_file, NULL);
+		repomd = old_repomd;
+	} else if (new_repomd == NULL) {
+		refresh_failed (refresh, "repodata/repomd.xml");
+		repomd = old_repomd;
+	} else if (old_repomd == NULL ||
+		   repomd_data_timestamp (old_repomd->primary_db) <
+		   repomd_data_timestamp (new_repomd->primary_db) ||
+		   repomd_data_timestamp (old_repomd->filelists_db) <
+		   repomd_data_timestamp (new_repomd->filelists_db)) {
 		rename (tmp_file, local_file);
+		low_download_validators_save (validators, local_file);
 		repomd = new_repomd;
-		low_repomd_free (old_repomd);
+		/* Kept to update from, for files that come in chunks */
+		refresh->old_repomd = old_repomd;
 	} else {
+		/* What we have is as new as the mirror's, at least */
+		utime (local_file, NULL);
 		repomd = old_repomd;
 		low_repomd_free (new_repomd);
 	}
 
 	free (local_file);
-	free (tmp_file);
+	if (tmp_file != NULL) {
+		unlink (tmp_file);
+		free (tmp_file);
+	}
+	low_download_validators_free (validators);
 
-	if (repomd->primary_db) {
-		if (repodata_missing (repo, repomd->primary_db)) {
-			fetch_repodata_file (repo, repomd->primary_db, true);
-		}
+	refresh->repomd = repomd;
+	if (repomd == NULL || refresh->failed_file != NULL) {
+		refresh_repo_finish (refresh);
+		return;
+	}
 
-		if (repodata_missing (repo, repomd->filelists_db)) {
-			fetch_repodata_file (repo, repomd->filelists_db, true);
-		}
-	} else {
-		char *primary_file;
-		char *filelists_file;
+	refresh_repo_queue_files (refresh);
+}
 
-		if (repodata_missing (repo, repomd->primary_xml)) {
-			fetch_repodata_file (repo, repomd->primary_xml, false);
-		}
+static void
+refresh_worker (gpointer data, gpointer user_data G_GNUC_UNUSED)
+{
+	LowRefreshJob *job = data;
+	LowRefresh *refresh = job->refresh;
 
-		if (repodata_missing (repo, repomd->filelists_xml)) {
-			fetch_repodata_file (repo, repomd->filelists_xml,
-					     false);
+	if (job->data == NULL) {
+		refresh_repo_start (refresh);
+	} else {
+		if (fetch_repodata_file (job)) {
+			g_atomic_int_inc (&refresh->files_fetched);
 		}
 
-		primary_file = create_repodata_filename (repo,
-							 repomd->primary_xml);
-		filelists_file =
-			create_repodata_filename (repo, repomd->filelists_xml);
-
-		/* XXX Do something better here */
-		primary_file[strlen (primary_file) - 3] = '\0';
-		filelists_file[strlen (filelists_file) - 3] = '\0';
-
-		low_repoxml_parse (primary_file, filelists_file);
-
-		free (primary_file);
-		free (filelists_file);
+		if (g_atomic_int_dec_and_test (&refresh->files_left)) {
+			refresh_repo_finish (refresh);
+		}
 	}
 
-	if (repomd->delta_xml && repodata_missing (repo, repomd->delta_xml)) {
-		fetch_repodata_file (repo, repomd->delta_xml, false);
-	}
+	free (job);
+}
+
+static GList *refresh_list = NULL;
 
-	low_repomd_free (repomd);
+static void
+add_to_refresh_list (LowRepo *repo)
+{
+	refresh_list = g_list_append (refresh_list, repo);
 }
 
 static int
@@ -1731,19 +2600,91 @@ command_refresh (int argc G_GNUC_UNUSED, const char **argv G_GNUC_UNUSED)
 	LowRepoSet *repos;
 	LowConfig *config;
 	LowRepoSetFilter filter = ENABLED;
+	GAsyncQueue *done;
+	GList *cur;
+	unsigned int i;
+	unsigned int failures = 0;
+	int value;
 
 	repo_rpmdb = low_repo_rpmdb_initialize ();
 
 	config = low_config_initialize (repo_rpmdb);
 	repos = low_repo_set_initialize_from_config (config, false);
 
-	low_repo_set_for_each (repos, filter, refresh_repo);
+	value = low_config_get_int (config, "main", "max_parallel_refresh");
+	if (value > 0) {
+		max_parallel_refresh = value;
+	}
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+	if (!g_thread_supported ()) {
+		g_thread_init (NULL);
+	}
+#endif
+
+	done = g_async_queue_new ();
+	refresh_pool = g_thread_pool_new (refresh_worker, NULL,
+					  max_parallel_refresh, FALSE, NULL);
+
+	low_repo_set_for_each (repos, filter, add_to_refresh_list);
+	for (cur = refresh_list; cur != NULL; cur = cur->next) {
+		LowRefresh *refresh = malloc (sizeof (LowRefresh));
+		LowRefreshJob *job = malloc (sizeof (LowRefreshJob));
+
+		refresh->repo = cur->data;
+		refresh->repomd = NULL;
+		refresh->old_repomd = NULL;
+		refresh->done = done;
+		refresh->timer = g_timer_new ();
+		refresh->files_left = 0;
+		refresh->files_fetched = 0;
+		refresh->failed_file = NULL;
+
+		job->refresh = refresh;
+		job->data = NULL;
+		job->chunks = NULL;
+		job->old_data = NULL;
+
+		g_thread_pool_push (refresh_pool, job, NULL);
+	}
+
+	/* Report on each repo as it's done, in whatever order that is */
+	for (i = 0; i < g_list_length (refresh_list); i++) {
+		LowRefresh *refresh = g_async_queue_pop (done);
+
+		if (refresh->failed_file != NULL) {
+			printf ("%s: unable to download %s\n",
+				refresh->repo->id, refresh->failed_file);
+			failures++;
+		} else if (refresh->files_fetched == 0) {
+			printf ("%s: up to date (%.1fs)\n", refresh->repo->id,
+				g_timer_elapsed (refresh->timer, NULL));
+		} else {
+			printf ("%s: fetched %d files in %.1fs\n",
+				refresh->repo->id, refresh->files_fetched,
+				g_timer_elapsed (refresh->timer, NULL));
+		}
+
+		low_repomd_free (refresh->repomd);
+		low_repomd_free (refresh->old_repomd);
+		g_timer_destroy (refresh->timer);
+		free (refresh->failed_file);
+		free (refresh);
+	}
+
+	g_thread_pool_free (refresh_pool, FALSE, TRUE);
+	refresh_pool = NULL;
+	g_async_queue_unref (done);
+	g_list_free (refresh_list);
+	refresh_list = NULL;
+
+	low_repo_set_build_newest (repos);
 
 	low_repo_set_free (repos);
 	low_config_free (config);
 	low_repo_rpmdb_shutdown (repo_rpmdb);
 
-	return EXIT_SUCCESS;
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /**
@@ -1809,7 +2750,7 @@ const SubCommand commands[] = {
 	{"info", "PACKAGE", "Display package details", command_info,
 	 info_options},
 	{"list", "[all|installed|PACKAGE]", "Display a group of packages",
-	 command_list, NULL},
+	 command_list, list_options},
 	{"download", NO_USAGE,
 	 "Download (but don't install) a list of packages", command_download,
 	 NULL},
@@ -1901,6 +2842,7 @@ main (int argc, const char *argv[])
 {
 	unsigned int i;
 	int consumed;
+	int res;
 
 	argc--;
 	argv++;
@@ -1939,7 +2881,14 @@ main (int argc, const char *argv[])
 				argc -= consumed;
 				argv += consumed;
 			}
-			return commands[i].func (argc, argv);
+
+			download_session = low_download_session_new ();
+			low_repo_sqlite_set_filelists_fetch
+				(fetch_filelists_db);
+			res = commands[i].func (argc, argv);
+			low_download_session_free (download_session);
+
+			return res;
 		}
 	}
 	printf ("Unknown command: %s\n", argv[0]);
@@ -211,6 +211,21 @@ low_fake_package_get_files (LowPackage *pkg)
 	return g_strdupv (((LowFakePackage *) pkg)->files);
 }
 
+static bool
+low_fake_package_has_file (LowPackage *pkg, const char *file)
+{
+	char **files = ((LowFakePackage *) pkg)->files;
+	int i;
+
+	for (i = 0; files[i] != NULL; i++) {
+		if (!strcmp (files[i], file)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /**********************************************************************
  * Repo & Package creation from parsed YAML functions
  **********************************************************************/
@@ -333,6 +348,7 @@ low_package_from_hash (GHashTable *hash)
 	pkg->get_conflicts = low_fake_package_get_conflicts;
 	pkg->get_obsoletes = low_fake_package_get_obsoletes;
 	pkg->get_files = low_fake_package_get_files;
+	pkg->has_file = low_fake_package_has_file;
 
 	low_debug_pkg ("found package", pkg);
 
@@ -580,10 +596,9 @@ run_test (GHashTable *test)
 		low_repo_from_list ("available", "available", true,
 				    g_hash_table_lookup (test, "available"));
 
-	repo_set = malloc (sizeof (LowRepoSet));
-	repo_set->repos = g_hash_table_new (NULL, NULL);
+	repo_set = low_repo_set_new ();
 
-	g_hash_table_insert (repo_set->repos, available->id, available);
+	low_repo_set_add (repo_set, available);
 
 	trans = low_transaction_new (installed, repo_set, NULL, NULL);
 
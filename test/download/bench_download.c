@@ -0,0 +1,507 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+/*
+ * Drive low's downloaders against mirror-sim.py, the same way refresh and
+ * install do, and report throughput and tail latency for each part.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <glib.h>
+#include <nss3/nss.h>
+
+#include "low-debug.h"
+#include "low-download.h"
+#include "low-mirror-list.h"
+#include "low-repomd-parser.h"
+#include "low-util.h"
+
+#define MB (1024.0 * 1024.0)
+
+/* How many packages to fetch one at a time, like low_download_if_missing */
+#define SERIAL_PACKAGES 20
+
+typedef struct _BenchPackage {
+	char *relative_path;
+	off_t size;
+	LowDigestType digest_type;
+	char *digest;
+} BenchPackage;
+
+/**
+ * Timings for one kind of download, over every round.
+ */
+typedef struct _BenchPhase {
+	const char *name;
+	GArray *latencies;	/**< Seconds for each file */
+	unsigned int failures;
+	double bytes;
+	double seconds;		/**< Wall clock time spent in this phase */
+	double started;
+} BenchPhase;
+
+static double
+now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Read the manifest mirror-sim.py writes: one
+ * "relative_path size digest_type digest" line per package.
+ */
+static GList *
+read_manifest (const char *manifest)
+{
+	GList *packages = NULL;
+	char path[1024];
+	char type[16];
+	char digest[129];
+	long long size;
+
+	FILE *file = fopen (manifest, "r");
+	if (file == NULL) {
+		fprintf (stderr, "Error opening manifest: %s\n", manifest);
+		return NULL;
+	}
+
+	while (fscanf (file, "%1023s %lld %15s %128s", path, &size, type,
+		       digest) == 4) {
+		BenchPackage *pkg = malloc (sizeof (BenchPackage));
+
+		pkg->relative_path = strdup (path);
+		pkg->size = size;
+		pkg->digest_type = low_util_digest_type_from_string (type);
+		pkg->digest = strdup (digest);
+
+		packages = g_list_append (packages, pkg);
+	}
+
+	fclose (file);
+
+	return packages;
+}
+
+static void
+bench_package_free (gpointer data, gpointer user_data G_GNUC_UNUSED)
+{
+	BenchPackage *pkg = data;
+
+	free (pkg->relative_path);
+	free (pkg->digest);
+	free (pkg);
+}
+
+static void
+bench_phase_init (BenchPhase *phase, const char *name)
+{
+	phase->name = name;
+	phase->latencies = g_array_new (FALSE, FALSE, sizeof (double));
+	phase->failures = 0;
+	phase->bytes = 0;
+	phase->seconds = 0;
+	phase->started = 0;
+}
+
+static void
+bench_phase_record (BenchPhase *phase, double started, off_t size,
+		    bool successful)
+{
+	double latency = now () - started;
+
+	if (successful) {
+		g_array_append_val (phase->latencies, latency);
+		phase->bytes += size;
+	} else {
+		phase->failures++;
+	}
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile (GArray *sorted, unsigned int pct)
+{
+	unsigned int i;
+
+	if (sorted->len == 0) {
+		return 0;
+	}
+
+	i = (sorted->len - 1) * pct / 100;
+	return g_array_index (sorted, double, i);
+}
+
+static void
+bench_phase_report (BenchPhase *phase)
+{
+	GArray *sorted = phase->latencies;
+
+	g_array_sort (sorted, compare_doubles);
+
+	printf ("%-8s %5u files %3u failed %8.1f MB %7.2f MB/s   "
+		"p50 %6.3fs  p95 %6.3fs  p99 %6.3fs  max %6.3fs\n",
+		phase->name, sorted->len, phase->failures, phase->bytes / MB,
+		phase->seconds > 0 ? phase->bytes / MB / phase->seconds : 0,
+		percentile (sorted, 50), percentile (sorted, 95),
+		percentile (sorted, 99), percentile (sorted, 100));
+
+	g_array_free (phase->latencies, TRUE);
+}
+
+static off_t
+file_size (const char *file)
+{
+	struct stat buf;
+
+	if (stat (file, &buf) != 0) {
+		return 0;
+	}
+
+	return buf.st_size;
+}
+
+/**
+ * Do what refresh_repo does over the network: fetch the mirror list, then
+ * repomd.xml (only if it's changed since the last round) and the primary
+ * db (only if repomd.xml changed) from a mirror. Returns the mirror list,
+ * to use for the package phases.
+ */
+static LowMirrorList *
+bench_refresh (LowDownloadSession *session, BenchPhase *phase,
+	       const char *mirror_list_url, const char *workdir)
+{
+	LowMirrorList *mirrors;
+	LowRepomd *repomd;
+	LowDownloadValidators *validators;
+	char *local_file;
+	char *tmp_file;
+	char *stats_file;
+	double started;
+	bool modified = true;
+	int res;
+	bool metalink = strstr (mirror_list_url, "metalink") != NULL;
+
+	local_file = g_strdup_printf ("%s/%s", workdir, metalink ?
+				      "metalink.xml" : "mirrorlist.txt");
+
+	phase->started = now ();
+	started = now ();
+	res = low_download (session, mirror_list_url, local_file,
+			    "mirrorlist", NULL);
+	bench_phase_record (phase, started, file_size (local_file), res == 0);
+
+	if (metalink) {
+		mirrors = low_mirror_list_new_from_metalink (local_file);
+	} else {
+		mirrors = low_mirror_list_new_from_txt_file (local_file);
+	}
+	free (local_file);
+
+	if (mirrors == NULL) {
+		phase->seconds += now () - phase->started;
+		return NULL;
+	}
+
+	/* Keep mirror stats between rounds, as between runs of low */
+	stats_file = g_strdup_printf ("%s/mirrorstats", workdir);
+	low_mirror_list_load_stats (mirrors, stats_file);
+	free (stats_file);
+
+	local_file = g_strdup_printf ("%s/repomd.xml", workdir);
+	tmp_file = g_strdup_printf ("%s.tmp", local_file);
+	validators = low_download_validators_load (local_file);
+	started = now ();
+	res = low_download_from_mirror_if_modified (session, mirrors,
+						    "repodata/repomd.xml",
+						    tmp_file, "repomd.xml",
+						    validators, &modified,
+						    NULL);
+	if (res == 0 && modified && rename (tmp_file, local_file) == 0) {
+		low_download_validators_save (validators, local_file);
+	}
+	bench_phase_record (phase, started,
+			    res == 0 && modified ? file_size (local_file) : 0,
+			    res == 0);
+	low_download_validators_free (validators);
+	free (tmp_file);
+
+	repomd = modified ? low_repomd_parse (local_file) : NULL;
+	free (local_file);
+
+	if (repomd != NULL && repomd->primary_db != NULL) {
+		LowRepomdData *primary_db = repomd->primary_db;
+
+		local_file = g_strdup_printf ("%s/primary.sqlite", workdir);
+		started = now ();
+		res = low_download_uncompressed (session, mirrors,
+						 primary_db->location,
+						 local_file, "primary_db",
+						 primary_db->checksum,
+						 primary_db->checksum_type,
+						 NULL);
+		bench_phase_record (phase, started, file_size (local_file),
+				    res == 0);
+		free (local_file);
+	}
+	low_repomd_free (repomd);
+
+	phase->seconds += now () - phase->started;
+
+	return mirrors;
+}
+
+static char *
+package_file (const char *workdir, BenchPackage *pkg)
+{
+	const char *name = strrchr (pkg->relative_path, '/');
+
+	name = name ? name + 1 : pkg->relative_path;
+	return g_strdup_printf ("%s/packages/%s", workdir, name);
+}
+
+/**
+ * Fetch a few packages one after another, each on its own.
+ */
+static void
+bench_serial (LowDownloadSession *session, BenchPhase *phase,
+	      LowMirrorList *mirrors, GList *packages, const char *workdir)
+{
+	unsigned int i;
+
+	phase->started = now ();
+
+	for (i = 0; packages != NULL && i < SERIAL_PACKAGES;
+	     packages = packages->next, i++) {
+		BenchPackage *pkg = packages->data;
+		char *local_file = package_file (workdir, pkg);
+		double started = now ();
+		int res;
+
+		unlink (local_file);
+		res = low_download_if_missing (session, mirrors,
+					       pkg->relative_path, local_file,
+					       pkg->relative_path, pkg->digest,
+					       pkg->digest_type, pkg->size,
+					       NULL);
+		bench_phase_record (phase, started, pkg->size, res == 0);
+
+		free (local_file);
+	}
+
+	phase->seconds += now () - phase->started;
+}
+
+typedef struct _BenchQueued {
+	BenchPhase *phase;
+	BenchPackage *pkg;
+} BenchQueued;
+
+static void
+bench_queue_done (void *data, bool successful)
+{
+	BenchQueued *queued = data;
+
+	bench_phase_record (queued->phase, queued->phase->started,
+			    queued->pkg->size, successful);
+	free (queued);
+}
+
+/**
+ * Fetch every package through a download queue, as
+ * download_required_packages does. Latency is from the start of the run
+ * until each file is done.
+ */
+static void
+bench_queue (LowDownloadSession *session, BenchPhase *phase,
+	     LowMirrorList *mirrors, GList *packages, const char *workdir,
+	     unsigned int max_connections, off_t segment_min_size,
+	     bool hedged, off_t max_inflight)
+{
+	LowDownloadQueue *queue =
+		low_download_queue_new (session, max_connections,
+					LOW_DOWNLOAD_DEFAULT_MAX_MIRROR_CONNECTIONS);
+
+	low_download_queue_set_segmented (queue, segment_min_size,
+					  LOW_DOWNLOAD_DEFAULT_MAX_SEGMENTS);
+	low_download_queue_set_hedged (queue, hedged);
+	low_download_queue_set_max_inflight (queue, max_inflight);
+
+	for (; packages != NULL; packages = packages->next) {
+		BenchPackage *pkg = packages->data;
+		char *local_file = package_file (workdir, pkg);
+		BenchQueued *queued = malloc (sizeof (BenchQueued));
+
+		queued->phase = phase;
+		queued->pkg = pkg;
+
+		unlink (local_file);
+		low_download_queue_add (queue, mirrors, pkg->relative_path,
+					local_file, pkg->relative_path,
+					pkg->digest, pkg->digest_type,
+					pkg->size, bench_queue_done, queued);
+		free (local_file);
+	}
+
+	phase->started = now ();
+	low_download_queue_run (queue, NULL);
+	phase->seconds += now () - phase->started;
+
+	low_download_queue_free (queue);
+}
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+		 "Usage: %s [-r ROUNDS] [-c CONNECTIONS] [-s SEGMENT_MB] [-H]\n"
+		 "          [-i INFLIGHT_MB] [-t STALL_SECS]\n"
+		 "          MIRRORLIST_URL MANIFEST WORKDIR\n",
+		 name);
+}
+
+int
+main (int argc, char *argv[])
+{
+	LowDownloadSession *session;
+	GList *packages;
+	BenchPhase refresh;
+	BenchPhase serial;
+	BenchPhase queued;
+	const char *mirror_list_url;
+	const char *workdir;
+	char *packages_dir;
+	unsigned int rounds = 3;
+	unsigned int max_connections = LOW_DOWNLOAD_DEFAULT_MAX_CONNECTIONS;
+	off_t segment_min_size = 0;
+	off_t max_inflight = 0;
+	long low_speed_time = LOW_DOWNLOAD_DEFAULT_LOW_SPEED_TIME;
+	bool hedged = false;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "r:c:s:Hi:t:")) != -1) {
+		switch (opt) {
+			case 'r':
+				rounds = atoi (optarg);
+				break;
+			case 'c':
+				max_connections = atoi (optarg);
+				break;
+			case 's':
+				segment_min_size = atoll (optarg) * MB;
+				break;
+			case 'H':
+				hedged = true;
+				break;
+			case 'i':
+				max_inflight = atoll (optarg) * MB;
+				break;
+			case 't':
+				low_speed_time = atol (optarg);
+				break;
+			default:
+				usage (argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind != 3) {
+		usage (argv[0]);
+		return 1;
+	}
+
+	mirror_list_url = argv[optind];
+	workdir = argv[optind + 2];
+
+	packages = read_manifest (argv[optind + 1]);
+	if (packages == NULL) {
+		return 1;
+	}
+
+	low_debug_init ();
+	/* Outside of rpm, nobody else will set up NSS for the digests */
+	NSS_NoDB_Init (NULL);
+
+	packages_dir = g_strdup_printf ("%s/packages", workdir);
+	mkdir (workdir, 0755);
+	mkdir (packages_dir, 0755);
+	free (packages_dir);
+
+	bench_phase_init (&refresh, "refresh");
+	bench_phase_init (&serial, "serial");
+	bench_phase_init (&queued, "queue");
+
+	session = low_download_session_new ();
+	low_download_session_set_low_speed (session,
+					    LOW_DOWNLOAD_DEFAULT_LOW_SPEED_LIMIT,
+					    low_speed_time);
+
+	for (i = 0; i < rounds; i++) {
+		LowMirrorList *mirrors = bench_refresh (session, &refresh,
+							mirror_list_url,
+							workdir);
+		if (mirrors == NULL) {
+			fprintf (stderr, "Unable to get a mirror list\n");
+			break;
+		}
+
+		bench_serial (session, &serial, mirrors, packages, workdir);
+		bench_queue (session, &queued, mirrors, packages, workdir,
+			     max_connections, segment_min_size, hedged,
+			     max_inflight);
+
+		low_mirror_list_save_stats (mirrors);
+		low_mirror_list_free (mirrors);
+	}
+
+	low_download_session_free (session);
+
+	printf ("%u rounds, %u packages\n", rounds, g_list_length (packages));
+	bench_phase_report (&refresh);
+	bench_phase_report (&serial);
+	bench_phase_report (&queued);
+
+	g_list_foreach (packages, bench_package_free, NULL);
+	g_list_free (packages);
+
+	NSS_Shutdown ();
+
+	return refresh.failures + serial.failures + queued.failures ? 1 : 0;
+}
+
+/* vim: set ts=8 sw=8 noet: */
@@ -0,0 +1,493 @@
+#!/usr/bin/env python3
+#
+#  Low: a yum-like package manager
+#
+#  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+#  02110-1301  USA
+#
+#  A stand-in for a set of yum mirrors, served on loopback.
+#
+#  Generates a small repo (repomd.xml, a bzip2ed primary sqlite db, and
+#  random rpm payloads), then serves it from one port per mirror, plus a
+#  control port with mirrorlist.txt and metalink.xml. Each mirror can be
+#  given latency, a bandwidth cap, a failure rate, and a chance to stall
+#  part way through a response:
+#
+#    mirror-sim.py --dir /tmp/sim --mirror latency=0.05,rate=4M \
+#                  --mirror latency=0.2,rate=256K,fail=0.2 --mirror stall=0.5
+#
+#  With --chunked, the primary db is written as separately gzipped
+#  content-defined chunks instead, with a chunk index (primary_db_chunks in
+#  repomd.xml), for trying out updates that only fetch changed chunks.
+#
+#  Once the repo is written and every port is listening, the control url
+#  is printed on stdout and the server runs until killed.
+
+import argparse
+import bz2
+import email.utils
+import gzip
+import hashlib
+import os
+import random
+import socket
+import sqlite3
+import sys
+import threading
+import time
+
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+CHUNK_SIZE = 16 * 1024
+
+
+def parse_size(value):
+    units = {"K": 1024, "M": 1024 * 1024, "G": 1024 * 1024 * 1024}
+    if value[-1].upper() in units:
+        return int(float(value[:-1]) * units[value[-1].upper()])
+    return int(value)
+
+
+class MirrorProfile(object):
+    """How badly a single mirror behaves."""
+
+    def __init__(self, spec=""):
+        self.latency = 0.0      # Seconds before the response starts
+        self.rate = 0           # Bytes per second; 0 for no cap
+        self.fail = 0.0         # Chance of a 503 or a dropped connection
+        self.stall = 0.0        # Chance of going quiet mid-response
+        self.preference = 100
+
+        for option in filter(None, spec.split(",")):
+            key, value = option.split("=", 1)
+            if key == "latency":
+                self.latency = float(value)
+            elif key == "rate":
+                self.rate = parse_size(value)
+            elif key == "fail":
+                self.fail = float(value)
+            elif key == "stall":
+                self.stall = float(value)
+            elif key == "preference":
+                self.preference = int(value)
+            else:
+                raise ValueError("unknown mirror option: %s" % key)
+
+
+def sha256_file(path):
+    digest = hashlib.sha256()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(1024 * 1024), b""):
+            digest.update(block)
+    return digest.hexdigest()
+
+
+def write_payload(path, size, rng):
+    with open(path, "wb") as f:
+        left = size
+        while left > 0:
+            n = min(left, 1024 * 1024)
+            f.write(rng.getrandbits(n * 8).to_bytes(n, "little"))
+            left -= n
+
+
+# A fixed random byte table for the rolling hash, so boundaries are stable
+GEAR = [random.Random(i).getrandbits(32) for i in range(256)]
+
+
+def content_chunks(data, min_size=2048, avg_bits=13, max_size=64 * 1024):
+    """Split data where a rolling hash of the bytes before says to, so an
+    edit only moves the chunk boundaries right around it."""
+    # The top bits of the hash have seen the most bytes
+    mask = ((1 << avg_bits) - 1) << (32 - avg_bits)
+    start = 0
+    h = 0
+    for i, byte in enumerate(data):
+        h = ((h << 1) + GEAR[byte]) & 0xffffffff
+        length = i + 1 - start
+        if (length >= min_size and h & mask == 0) or length >= max_size:
+            yield data[start:i + 1]
+            start = i + 1
+            h = 0
+    if start < len(data):
+        yield data[start:]
+
+
+def compress_chunked(data):
+    """Gzip each chunk of data on its own. Returns the whole (still a
+    valid gzip file) and its chunk index."""
+    compressed = []
+    index = ["sha256\n"]
+    offset = 0
+    for chunk in content_chunks(data):
+        member = gzip.compress(chunk, mtime=0)
+        index.append("%d %d %d %s\n" % (offset, len(member), len(chunk),
+                                         hashlib.sha256(chunk).hexdigest()))
+        compressed.append(member)
+        offset += len(member)
+    return b"".join(compressed), "".join(index).encode()
+
+
+def repomd_data(data_type, href, compressed, uncompressed, timestamp):
+    entry = ['  <data type="%s">\n' % data_type,
+             '    <checksum type="sha256">%s</checksum>\n'
+             % hashlib.sha256(compressed).hexdigest()]
+    if uncompressed is not None:
+        entry.append('    <open-checksum type="sha256">%s</open-checksum>\n'
+                     % hashlib.sha256(uncompressed).hexdigest())
+    entry.append('    <location href="%s"/>\n'
+                 '    <timestamp>%d</timestamp>\n'
+                 '    <size>%d</size>\n'
+                 % (href, timestamp, len(compressed)))
+    if uncompressed is not None:
+        entry.append('    <open-size>%d</open-size>\n' % len(uncompressed))
+    entry.append('  </data>\n')
+    return "".join(entry)
+
+
+def write_repodata(args, name, compressed):
+    """Write compressed out under a name with its checksum in it, the way
+    createrepo does. Returns the href."""
+    digest = hashlib.sha256(compressed).hexdigest()
+    href = "repodata/%s-%s" % (digest, name)
+    with open(os.path.join(args.dir, href), "wb") as f:
+        f.write(compressed)
+    return href
+
+
+def generate_repo(args):
+    """Write out the repo, and a manifest of its packages for the bench."""
+    rng = random.Random(args.seed)
+    packages_dir = os.path.join(args.dir, "packages")
+    repodata_dir = os.path.join(args.dir, "repodata")
+    os.makedirs(packages_dir, exist_ok=True)
+    os.makedirs(repodata_dir, exist_ok=True)
+
+    packages = []
+    for i in range(args.packages):
+        # Mostly small packages, with a long tail of big ones
+        size = int(min(args.max_size,
+                       max(args.min_size,
+                           rng.lognormvariate(12, 1.5))))
+        name = "sim-%04d" % i
+        href = "packages/%s-1.0-1.noarch.rpm" % name
+        path = os.path.join(args.dir, href)
+        write_payload(path, size, rng)
+        packages.append((name, href, size, sha256_file(path)))
+
+    db_file = os.path.join(args.dir, "primary.sqlite")
+    if os.path.exists(db_file):
+        os.unlink(db_file)
+    db = sqlite3.connect(db_file)
+    db.execute("CREATE TABLE packages (pkgKey INTEGER PRIMARY KEY, "
+               "pkgId TEXT, name TEXT, arch TEXT, version TEXT, "
+               "epoch TEXT, release TEXT, summary TEXT, "
+               "description TEXT, url TEXT, time_file INTEGER, "
+               "time_build INTEGER, rpm_license TEXT, "
+               "size_package INTEGER, size_installed INTEGER, "
+               "location_href TEXT, checksum_type TEXT)")
+    for name, href, size, digest in packages:
+        db.execute("INSERT INTO packages (pkgId, name, arch, version, "
+                   "epoch, release, summary, description, url, "
+                   "time_file, time_build, rpm_license, size_package, "
+                   "size_installed, location_href, checksum_type) "
+                   "VALUES (?, ?, 'noarch', '1.0', '0', '1', ?, ?, '', "
+                   "0, 0, 'GPLv2+', ?, ?, ?, 'sha256')",
+                   (digest, name, name, name, size, size, href))
+    db.commit()
+    db.close()
+
+    with open(db_file, "rb") as f:
+        uncompressed = f.read()
+    os.unlink(db_file)
+
+    now = int(time.time())
+    entries = []
+    if args.chunked:
+        compressed, index = compress_chunked(uncompressed)
+        href = write_repodata(args, "primary.sqlite.gz", compressed)
+        index_href = write_repodata(args, "primary.sqlite.chunks", index)
+        entries.append(repomd_data("primary_db_chunks", index_href, index,
+                                   None, now))
+    else:
+        compressed = bz2.compress(uncompressed)
+        href = write_repodata(args, "primary.sqlite.bz2", compressed)
+    entries.insert(0, repomd_data("primary_db", href, compressed,
+                                  uncompressed, now))
+
+    with open(os.path.join(repodata_dir, "repomd.xml"), "w") as f:
+        f.write('<?xml version="1.0" encoding="UTF-8"?>\n'
+                '<repomd xmlns="http://linux.duke.edu/metadata/repo">\n'
+                '%s'
+                '</repomd>\n' % "".join(entries))
+
+    with open(os.path.join(args.dir, "manifest"), "w") as f:
+        for name, href, size, digest in packages:
+            f.write("%s %d sha256 %s\n" % (href, size, digest))
+
+
+def parse_range(header, size):
+    """Turn a 'bytes=a-b' header into an inclusive (start, end), or None."""
+    if not header or not header.startswith("bytes="):
+        return None
+    spec = header[len("bytes="):]
+    if "," in spec:
+        return None
+    start, end = spec.split("-", 1)
+    if start == "":
+        start = max(0, size - int(end))
+        end = size - 1
+    else:
+        start = int(start)
+        end = int(end) if end else size - 1
+    if start >= size or start > end:
+        return None
+    return (start, min(end, size - 1))
+
+
+def make_handler(root, profile, stats, rng):
+
+    class MirrorHandler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, format, *args):
+            pass
+
+        def not_modified(self, etag, mtime):
+            if_none_match = self.headers.get("If-None-Match")
+            if if_none_match is not None:
+                return etag in [t.strip() for t in if_none_match.split(",")]
+
+            if_modified_since = self.headers.get("If-Modified-Since")
+            if if_modified_since is None:
+                return False
+            try:
+                since = email.utils.parsedate_to_datetime(if_modified_since)
+            except (TypeError, ValueError):
+                return False
+            return int(mtime) <= since.timestamp()
+
+        def send_file(self, head_only):
+            path = os.path.normpath(os.path.join(root,
+                                                 self.path.lstrip("/")))
+            if not path.startswith(root) or not os.path.isfile(path):
+                self.send_error(404)
+                return
+
+            time.sleep(profile.latency)
+
+            with stats["lock"]:
+                stats["requests"] += 1
+                failing = rng.random() < profile.fail
+                stalling = rng.random() < profile.stall
+
+            if failing and rng.random() < 0.5:
+                self.send_error(503)
+                return
+
+            size = os.path.getsize(path)
+            mtime = os.path.getmtime(path)
+            etag = '"%x-%x"' % (int(mtime), size)
+            if self.not_modified(etag, mtime):
+                with stats["lock"]:
+                    stats["not_modified"] += 1
+                self.send_response(304)
+                self.send_header("ETag", etag)
+                self.end_headers()
+                return
+
+            byte_range = parse_range(self.headers.get("Range"), size)
+            if self.headers.get("Range") and byte_range is None:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % size)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+
+            if byte_range:
+                start, end = byte_range
+                self.send_response(206)
+                self.send_header("Content-Range",
+                                 "bytes %d-%d/%d" % (start, end, size))
+            else:
+                start, end = 0, size - 1
+                self.send_response(200)
+            self.send_header("Content-Length", str(end - start + 1))
+            self.send_header("Accept-Ranges", "bytes")
+            self.send_header("Last-Modified", self.date_time_string(mtime))
+            self.send_header("ETag", etag)
+            self.end_headers()
+
+            if head_only:
+                return
+
+            # Failures and stalls happen somewhere in the middle
+            cut = start + (end - start + 1) // 2
+
+            with open(path, "rb") as f:
+                f.seek(start)
+                sent_at = time.time()
+                offset = start
+                while offset <= end:
+                    if (failing or stalling) and offset >= cut:
+                        break
+                    n = min(CHUNK_SIZE, end - offset + 1)
+                    self.wfile.write(f.read(n))
+                    offset += n
+                    with stats["lock"]:
+                        stats["bytes"] += n
+                    if profile.rate:
+                        sent_at += n / float(profile.rate)
+                        delay = sent_at - time.time()
+                        if delay > 0:
+                            time.sleep(delay)
+
+            if stalling:
+                # Hold the connection open without sending anything
+                time.sleep(3600)
+            if failing or stalling:
+                self.close_connection = True
+                self.connection.shutdown(socket.SHUT_RDWR)
+
+        def do_GET(self):
+            try:
+                self.send_file(False)
+            except (BrokenPipeError, ConnectionResetError):
+                self.close_connection = True
+
+        def do_HEAD(self):
+            self.send_file(True)
+
+    return MirrorHandler
+
+
+def make_control_handler(host, mirror_ports, profiles, stats):
+
+    class ControlHandler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, format, *args):
+            pass
+
+        def reply(self, body, content_type):
+            body = body.encode("utf-8")
+            self.send_response(200)
+            self.send_header("Content-Type", content_type)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def do_GET(self):
+            urls = ["http://%s:%d/" % (host, port) for port in mirror_ports]
+            if self.path == "/mirrorlist.txt":
+                self.reply("".join(url + "\n" for url in urls), "text/plain")
+            elif self.path == "/metalink.xml":
+                body = ['<?xml version="1.0" encoding="utf-8"?>\n'
+                        '<metalink version="3.0" '
+                        'xmlns="http://www.metalinker.org/">\n'
+                        ' <files>\n  <file name="repomd.xml">\n'
+                        '   <resources>\n']
+                for url, profile in zip(urls, profiles):
+                    body.append('    <url protocol="http" type="http" '
+                                'preference="%d">%srepodata/repomd.xml'
+                                '</url>\n' % (profile.preference, url))
+                body.append('   </resources>\n  </file>\n </files>\n'
+                            '</metalink>\n')
+                self.reply("".join(body), "application/metalink+xml")
+            elif self.path == "/stats":
+                lines = []
+                for port, stat in zip(mirror_ports, stats):
+                    lines.append("%d %d %d %d\n" % (port, stat["requests"],
+                                                    stat["bytes"],
+                                                    stat["not_modified"]))
+                self.reply("".join(lines), "text/plain")
+            else:
+                self.send_error(404)
+
+    return ControlHandler
+
+
+def serve(server):
+    thread = threading.Thread(target=server.serve_forever)
+    thread.daemon = True
+    thread.start()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Serve a fake yum repo "
+                                     "from several misbehaving mirrors.")
+    parser.add_argument("--dir", required=True,
+                        help="where to generate the repo")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=0,
+                        help="control port; mirrors use the ports after it "
+                        "(default: any free ports)")
+    parser.add_argument("--packages", type=int, default=200)
+    parser.add_argument("--min-size", type=parse_size, default=16 * 1024)
+    parser.add_argument("--max-size", type=parse_size,
+                        default=64 * 1024 * 1024)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--mirror", action="append", default=[],
+                        metavar="SPEC",
+                        help="a mirror, as comma separated latency=SECS, "
+                        "rate=BYTES, fail=P, stall=P, preference=N")
+    parser.add_argument("--chunked", action="store_true",
+                        help="write the primary db as independently "
+                        "gzipped chunks, with a chunk index")
+    parser.add_argument("--no-generate", action="store_true",
+                        help="serve a repo generated earlier")
+    args = parser.parse_args()
+
+    args.dir = os.path.abspath(args.dir)
+    if not args.no_generate:
+        generate_repo(args)
+
+    profiles = [MirrorProfile(spec) for spec in args.mirror] or \
+        [MirrorProfile()]
+    rng = random.Random(args.seed)
+
+    servers = []
+    stats = []
+    for i, profile in enumerate(profiles):
+        stat = {"lock": threading.Lock(), "requests": 0, "bytes": 0,
+                "not_modified": 0}
+        port = args.port + 1 + i if args.port else 0
+        handler = make_handler(args.dir, profile, stat, rng)
+        servers.append(ThreadingHTTPServer((args.host, port), handler))
+        stats.append(stat)
+
+    mirror_ports = [server.server_address[1] for server in servers]
+    control = ThreadingHTTPServer((args.host, args.port),
+                                  make_control_handler(args.host,
+                                                       mirror_ports,
+                                                       profiles, stats))
+    for server in servers:
+        server.daemon_threads = True
+        serve(server)
+    control.daemon_threads = True
+
+    print("http://%s:%d/" % (args.host, control.server_address[1]))
+    sys.stdout.flush()
+
+    try:
+        control.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
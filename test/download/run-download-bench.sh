@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+#  Low: a yum-like package manager
+#
+#  Copyright (C) 2010 James Bowes <jbowes@repl.ca>
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+#  02110-1301  USA
+#
+#  Benchmark downloads against a set of simulated mirrors on loopback.
+#  Any arguments are passed on to bench_download (see its usage).
+#
+#  The mirrors can be changed with MIRRORS, a space separated list of
+#  mirror-sim.py --mirror specs, and the repo with PACKAGES and MAX_SIZE.
+
+DIRNAME=`dirname $0`
+
+PACKAGES=${PACKAGES:-200}
+MAX_SIZE=${MAX_SIZE:-32M}
+MIRRORS=${MIRRORS:-"latency=0.02,rate=8M latency=0.05,rate=4M \
+latency=0.3,rate=512K latency=0.05,rate=4M,fail=0.2 \
+latency=0.05,rate=4M,stall=0.05"}
+
+WORKDIR=`mktemp -d -t low-bench.XXXXXX`
+
+function cleanup {
+    if [ -n "$SIM_PID" ]; then
+        kill $SIM_PID 2> /dev/null
+        wait $SIM_PID 2> /dev/null
+    fi
+    rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+MIRROR_ARGS=""
+for mirror in $MIRRORS; do
+    MIRROR_ARGS="$MIRROR_ARGS --mirror $mirror"
+done
+
+printf "Generating a repo of $PACKAGES packages... "
+mkfifo $WORKDIR/url
+python3 $DIRNAME/mirror-sim.py --dir $WORKDIR/repo --packages $PACKAGES \
+    --max-size $MAX_SIZE $MIRROR_ARGS > $WORKDIR/url &
+SIM_PID=$!
+
+read URL < $WORKDIR/url
+if [ -z "$URL" ]; then
+    echo "*** UNABLE TO START MIRROR SIMULATOR ***"
+    exit 1
+fi
+echo "serving from $URL"
+
+for list in mirrorlist.txt metalink.xml; do
+    echo "Using $list:"
+    rm -rf $WORKDIR/cache
+    test/download/bench_download -t 5 "$@" $URL$list $WORKDIR/repo/manifest \
+        $WORKDIR/cache || FAILED=1
+done
+
+if [ -n "$FAILED" ]; then
+    echo "*** DOWNLOAD BENCHMARK HAD FAILURES ***"
+    exit 1
+fi
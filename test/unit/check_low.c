@@ -19,13 +19,26 @@
  *  02110-1301  USA
  */
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "config.h"
+#include <bzlib.h>
 #include <check.h>
+#include <sqlite3.h>
 
+#include "low-bloom.h"
+#include "low-chunks.h"
+#include "low-decompress.h"
+#include "low-mirror-list.h"
+#include "low-newest.h"
 #include "low-package.h"
 #include "low-repo-set.h"
+#include "low-repomd-parser.h"
+#include "low-repoxml-parser.h"
 #include "low-util.h"
 
 #include "low-repo-sqlite-fake.h"
@@ -193,14 +206,568 @@ START_TEST (test_low_util_word_wrap_wrap_one_line_to_two)
 	fail_unless (!strcmp ("string", output[1]), "unexpected wrapping");
 } END_TEST
 
+START_TEST (test_low_util_parse_duration)
+{
+	fail_unless (low_util_parse_duration ("90", 0) == 90,
+		     "plain seconds");
+	fail_unless (low_util_parse_duration ("90m", 0) == 90 * 60,
+		     "minutes");
+	fail_unless (low_util_parse_duration ("6h", 0) == 6 * 60 * 60,
+		     "hours");
+	fail_unless (low_util_parse_duration ("2d", 0) == 2 * 24 * 60 * 60,
+		     "days");
+	fail_unless (low_util_parse_duration ("never", 0) == -1, "never");
+	fail_unless (low_util_parse_duration ("6x", 5) == 5, "bad suffix");
+	fail_unless (low_util_parse_duration (NULL, 5) == 5, "no value");
+} END_TEST
+
+START_TEST (test_low_util_file_stamp_replaced_in_same_second)
+{
+	const char *filename = "check_low.stamp";
+	const char *tmp_filename = "check_low.stamp.tmp";
+	LowFileStamp before;
+	LowFileStamp after;
+	FILE *fp;
+
+	fp = fopen (filename, "w");
+	fputs ("one", fp);
+	fclose (fp);
+	fail_unless (low_util_file_stamp (filename, &before), "no stamp");
+
+	/* Same size, and almost certainly the same second */
+	fp = fopen (tmp_filename, "w");
+	fputs ("two", fp);
+	fclose (fp);
+	rename (tmp_filename, filename);
+	fail_unless (low_util_file_stamp (filename, &after), "no stamp");
+	unlink (filename);
+
+	fail_if (low_util_file_stamp_equal (&before, &after),
+		 "replaced file has the same stamp");
+	fail_if (low_util_file_stamp (filename, &after),
+		 "stamped a missing file");
+} END_TEST
+
+START_TEST (test_low_bloom_might_contain)
+{
+	LowBloom *bloom = low_bloom_new (3);
+
+	low_bloom_add (bloom, "foo");
+	low_bloom_add (bloom, "/usr/bin/bar");
+	low_bloom_add (bloom, "libbaz.so.1()(64bit)");
+
+	fail_unless (low_bloom_might_contain (bloom, "foo"), "foo missing");
+	fail_unless (low_bloom_might_contain (bloom, "/usr/bin/bar"),
+		     "/usr/bin/bar missing");
+	fail_unless (low_bloom_might_contain (bloom, "libbaz.so.1()(64bit)"),
+		     "libbaz.so.1()(64bit) missing");
+	fail_if (low_bloom_might_contain (bloom, "quux"), "quux found");
+
+	low_bloom_free (bloom);
+} END_TEST
+
+START_TEST (test_low_bloom_write_and_load)
+{
+	const char *filename = "check_low.bloom";
+	LowBloom *bloom = low_bloom_new (1);
+	LowFileStamp source = { 1234, 5678, 42 };
+
+	low_bloom_add (bloom, "foo");
+	bloom->source = source;
+	fail_unless (low_bloom_write (bloom, filename), "unable to write");
+	low_bloom_free (bloom);
+
+	bloom = low_bloom_load (filename);
+	unlink (filename);
+
+	fail_unless (bloom != NULL, "unable to load");
+	fail_unless (low_util_file_stamp_equal (&bloom->source, &source),
+		     "wrong source");
+	fail_unless (low_bloom_might_contain (bloom, "foo"), "foo missing");
+	fail_if (low_bloom_might_contain (bloom, "bar"), "bar found");
+
+	low_bloom_free (bloom);
+} END_TEST
+
+static bool
+write_bloom_header (const char *filename, uint32_t nbits, uint32_t nhashes)
+{
+	FILE *fp = fopen (filename, "w");
+	LowFileStamp source = { 0, 0, 0 };
+	bool ok;
+
+	if (fp == NULL) {
+		return false;
+	}
+
+	ok = fwrite ("LOWBLM02", 8, 1, fp) == 1 &&
+		fwrite (&nbits, sizeof (nbits), 1, fp) == 1 &&
+		fwrite (&nhashes, sizeof (nhashes), 1, fp) == 1 &&
+		fwrite (&source, sizeof (source), 1, fp) == 1;
+
+	/* Zero the bit array, so only the header is wrong */
+	for (nbits /= 8; ok && nbits > 0; nbits--) {
+		ok = fputc (0, fp) != EOF;
+	}
+
+	return fclose (fp) == 0 && ok;
+}
+
+START_TEST (test_low_bloom_load_rejects_bad_header)
+{
+	const char *filename = "check_low.bloom";
+	LowBloom *bloom;
+
+	fail_unless (write_bloom_header (filename, 4, 7), "unable to write");
+	bloom = low_bloom_load (filename);
+	fail_unless (bloom == NULL, "loaded a filter with no bit array");
+	low_bloom_free (bloom);
+
+	fail_unless (write_bloom_header (filename, 1024, 0),
+		     "unable to write");
+	bloom = low_bloom_load (filename);
+	fail_unless (bloom == NULL, "loaded a filter with no hashes");
+	low_bloom_free (bloom);
+
+	fail_unless (write_bloom_header (filename, 1024, 1000),
+		     "unable to write");
+	bloom = low_bloom_load (filename);
+	fail_unless (bloom == NULL, "loaded a filter with too many hashes");
+	low_bloom_free (bloom);
+
+	fail_unless (write_bloom_header (filename, 1024, 7),
+		     "unable to write");
+	bloom = low_bloom_load (filename);
+	unlink (filename);
+	fail_unless (bloom != NULL, "unable to load a good filter");
+	low_bloom_free (bloom);
+} END_TEST
+
+START_TEST (test_low_newest_write_and_load)
+{
+	const char *filename = "check_low.keys";
+	uint32_t keys[] = { 42, 7, 19 };
+	LowFileStamp source = { 1234, 5678, 42 };
+	LowNewest *newest;
+
+	fail_unless (low_newest_write (filename, 1234, &source, keys, 3),
+		     "unable to write");
+
+	newest = low_newest_load (filename);
+	unlink (filename);
+
+	fail_unless (newest != NULL, "unable to load");
+	fail_unless (newest->signature == 1234, "wrong signature");
+	fail_unless (low_util_file_stamp_equal (&newest->source, &source),
+		     "wrong source");
+	fail_unless (low_newest_contains (newest, 7), "7 missing");
+	fail_unless (low_newest_contains (newest, 19), "19 missing");
+	fail_unless (low_newest_contains (newest, 42), "42 missing");
+	fail_if (low_newest_contains (newest, 8), "8 found");
+
+	low_newest_free (newest);
+} END_TEST
+
+START_TEST (test_low_decompressor_bz2_in_pieces)
+{
+	const char *compressed_name = "check_low.test.bz2";
+	const char *file = "check_low.test";
+	char text[4096];
+	char compressed[8192];
+	char uncompressed[sizeof (text) * 2];
+	unsigned int compressed_len = sizeof (compressed) / 2;
+	unsigned int second_len = sizeof (compressed) / 2;
+	unsigned int i;
+	LowDecompressor *decompressor;
+	char *stripped;
+	FILE *fp;
+	int fd;
+
+	for (i = 0; i < sizeof (text); i++) {
+		text[i] = 'a' + i % 26;
+	}
+
+	/* Two streams back to back, like pbzip2 makes */
+	BZ2_bzBuffToBuffCompress (compressed, &compressed_len, text,
+				  sizeof (text), 9, 0, 0);
+	BZ2_bzBuffToBuffCompress (compressed + compressed_len, &second_len,
+				  text, sizeof (text), 9, 0, 0);
+	compressed_len += second_len;
+
+	stripped = low_decompress_strip_extension (compressed_name);
+	fail_unless (!strcmp (stripped, file), "extension not stripped");
+	free (stripped);
+
+	fd = open (file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	decompressor = low_decompressor_new (compressed_name, fd);
+	for (i = 0; i < compressed_len; i += 7) {
+		fail_unless (low_decompressor_write (decompressor,
+						     compressed + i,
+						     MIN (7, compressed_len -
+							  i)),
+			     "unable to uncompress");
+	}
+	fail_unless (low_decompressor_finish (decompressor), "not finished");
+	low_decompressor_free (decompressor);
+	close (fd);
+
+	fp = fopen (file, "r");
+	fail_unless (fread (uncompressed, 1, sizeof (uncompressed), fp) ==
+		     sizeof (uncompressed), "wrong length");
+	fail_unless (fgetc (fp) == EOF, "too long");
+	fclose (fp);
+	unlink (file);
+
+	fail_unless (!memcmp (uncompressed, text, sizeof (text)) &&
+		     !memcmp (uncompressed + sizeof (text), text,
+			      sizeof (text)),
+		     "contents differ");
+} END_TEST
+
+START_TEST (test_low_decompress_strip_extension)
+{
+	const char *names[][2] = {
+		{ "repodata/primary.sqlite.bz2", "repodata/primary.sqlite" },
+		{ "abc-primary.sqlite.gz", "abc-primary.sqlite" },
+		{ "abc-primary.sqlite.xz", "abc-primary.sqlite" },
+		{ "abc-primary.sqlite.zst", "abc-primary.sqlite" },
+		{ "abc-prestodelta.xml", "abc-prestodelta.xml" },
+		{ ".xz", ".xz" },
+	};
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS (names); i++) {
+		char *stripped = low_decompress_strip_extension (names[i][0]);
+
+		fail_unless (!strcmp (stripped, names[i][1]),
+			     "%s stripped to %s", names[i][0], stripped);
+		free (stripped);
+	}
+} END_TEST
+
+static LowChunkIndex *
+write_chunk_index (const char *filename, const char *contents)
+{
+	LowChunkIndex *index;
+	FILE *file;
+
+	file = fopen (filename, "w");
+	fprintf (file, "%s", contents);
+	fclose (file);
+
+	index = low_chunk_index_load (filename);
+	unlink (filename);
+
+	return index;
+}
+
+START_TEST (test_low_chunk_index_missing_changed_chunks)
+{
+	const char *index_file = "check_low.chunks";
+	LowChunkIndex *old_index;
+	LowChunkIndex *new_index;
+	LowChunk *chunk;
+
+	old_index = write_chunk_index (index_file,
+				       "sha256\n"
+				       "0 10 100 aaaa\n"
+				       "10 20 200 bbbb\n"
+				       "30 30 300 cccc\n");
+	new_index = write_chunk_index (index_file,
+				       "sha256\n"
+				       "0 10 100 aaaa\n"
+				       "10 25 250 dddd\n"
+				       "35 30 300 cccc\n");
+
+	fail_unless (old_index != NULL && new_index != NULL,
+		     "unable to load");
+	fail_unless (new_index->n_chunks == 3 && new_index->size == 65 &&
+		     new_index->open_size == 650, "wrong totals");
+
+	chunk = low_chunk_index_lookup (old_index, &new_index->chunks[2]);
+	fail_unless (chunk != NULL && chunk->open_offset == 300,
+		     "moved chunk not found");
+	fail_unless (low_chunk_index_lookup (old_index,
+					     &new_index->chunks[1]) == NULL,
+		     "changed chunk found");
+
+	fail_unless (low_chunk_index_missing (old_index, new_index) == 25,
+		     "wrong missing size");
+	fail_unless (low_chunk_index_missing (NULL, new_index) == 65,
+		     "wrong missing size without old index");
+
+	low_chunk_index_free (old_index);
+	low_chunk_index_free (new_index);
+
+	/* Gaps mean it's not an index of one file */
+	fail_unless (write_chunk_index (index_file,
+					"sha256\n"
+					"0 10 100 aaaa\n"
+					"20 10 100 bbbb\n") == NULL,
+		     "index with a gap loaded");
+} END_TEST
+
+START_TEST (test_low_mirror_list_stats_prefer_fast_mirror)
+{
+	const char *list_file = "check_low.mirrorlist";
+	const char *stats_file = "check_low.mirrorstats";
+	LowMirrorList *mirrors;
+	FILE *file;
+
+	file = fopen (list_file, "w");
+	fprintf (file, "http://slow.example.com/\nhttp://fast.example.com/\n");
+	fclose (file);
+
+	mirrors = low_mirror_list_new_from_txt_file (list_file);
+	low_mirror_list_load_stats (mirrors, stats_file);
+	low_mirror_list_record_transfer (mirrors, "http://slow.example.com/",
+					 1024 * 1024, 10.0, 0.5);
+	low_mirror_list_record_transfer (mirrors, "http://fast.example.com/",
+					 1024 * 1024, 1.0, 0.1);
+	fail_unless (low_mirror_list_save_stats (mirrors), "unable to save");
+	low_mirror_list_free (mirrors);
+
+	mirrors = low_mirror_list_new_from_txt_file (list_file);
+	low_mirror_list_load_stats (mirrors, stats_file);
+	unlink (list_file);
+	unlink (stats_file);
+
+	fail_unless (!strcmp (low_mirror_list_lookup_random_mirror (mirrors),
+			      "http://fast.example.com/"),
+		     "slow mirror picked");
+
+	low_mirror_list_mark_as_bad (mirrors, "http://fast.example.com/");
+	fail_unless (!strcmp (low_mirror_list_lookup_random_mirror (mirrors),
+			      "http://slow.example.com/"),
+		     "bad mirror picked");
+
+	low_mirror_list_free (mirrors);
+} END_TEST
+
+START_TEST (test_low_repomd_parse_checksums)
+{
+	const char *repomd_file = "check_low.repomd";
+	LowRepomd *repomd;
+	FILE *file;
+
+	file = fopen (repomd_file, "w");
+	fprintf (file,
+		 "<repomd><data type=\"primary_db\">"
+		 "<checksum type=\"sha256\">abc</checksum>"
+		 "<open-checksum type=\"sha1\">def</open-checksum>"
+		 "<location href=\"repodata/primary.sqlite.bz2\"/>"
+		 "<timestamp>1234</timestamp>"
+		 "<size>10</size><open-size>20</open-size>"
+		 "</data></repomd>");
+	fclose (file);
+
+	repomd = low_repomd_parse (repomd_file);
+	unlink (repomd_file);
+
+	fail_unless (repomd != NULL && repomd->primary_db != NULL,
+		     "primary_db not found");
+	fail_unless (!strcmp (repomd->primary_db->checksum, "abc") &&
+		     repomd->primary_db->checksum_type == DIGEST_SHA256,
+		     "wrong checksum");
+	fail_unless (!strcmp (repomd->primary_db->open_checksum, "def") &&
+		     repomd->primary_db->open_checksum_type == DIGEST_SHA1,
+		     "wrong open-checksum");
+	fail_unless (repomd->primary_db->size == 10 &&
+		     repomd->primary_db->open_size == 20, "wrong sizes");
+	fail_unless (repomd->primary_db->timestamp == 1234,
+		     "wrong timestamp");
+
+	low_repomd_free (repomd);
+} END_TEST
+
+static int
+query_int (sqlite3 *db, const char *query)
+{
+	sqlite3_stmt *stmt;
+	int result = -1;
+
+	sqlite3_prepare (db, query, -1, &stmt, NULL);
+	if (sqlite3_step (stmt) == SQLITE_ROW)
+		result = sqlite3_column_int (stmt, 0);
+	sqlite3_finalize (stmt);
+
+	return result;
+}
+
+static void
+repoxml_parse_strings (const char *primary_xml, const char *filelists_xml)
+{
+	FILE *file;
+
+	mkdir ("check_low_repoxml", 0755);
+
+	file = fopen ("check_low_repoxml/primary.xml", "w");
+	fprintf (file, "%s", primary_xml);
+	fclose (file);
+
+	file = fopen ("check_low_repoxml/filelists.xml", "w");
+	fprintf (file, "%s", filelists_xml);
+	fclose (file);
+
+	low_repoxml_parse ("check_low_repoxml/primary.xml",
+			   "check_low_repoxml/filelists.xml");
+
+	unlink ("check_low_repoxml/primary.xml");
+	unlink ("check_low_repoxml/filelists.xml");
+}
+
+static void
+repoxml_remove_dbs (void)
+{
+	unlink ("check_low_repoxml/primary.sqlite");
+	unlink ("check_low_repoxml/filelists.sqlite");
+	rmdir ("check_low_repoxml");
+}
+
+START_TEST (test_low_repoxml_parse_dependencies_and_files)
+{
+	sqlite3 *db;
+
+	repoxml_parse_strings ("<metadata packages=\"1\">"
+			       "<package type=\"rpm\"><name>foo</name>"
+			       "<arch>noarch</arch>"
+			       "<version epoch=\"0\" ver=\"1.0\" rel=\"1\"/>"
+			       "<checksum type=\"sha256\" pkgid=\"YES\">"
+			       "abcd</checksum>"
+			       "<format><rpm:provides>"
+			       "<rpm:entry name=\"foo\" flags=\"EQ\" "
+			       "epoch=\"0\" ver=\"1.0\" rel=\"1\"/>"
+			       "</rpm:provides><rpm:requires>"
+			       "<rpm:entry name=\"bar\" pre=\"1\"/>"
+			       "<rpm:entry name=\"/bin/sh\"/>"
+			       "</rpm:requires>"
+			       "<file>/usr/bin/foo</file>"
+			       "</format></package></metadata>",
+			       "<filelists packages=\"1\">"
+			       "<package pkgid=\"abcd\" name=\"foo\" "
+			       "arch=\"noarch\">"
+			       "<file type=\"dir\">/usr/share/foo</file>"
+			       "<file>/usr/share/foo/a</file>"
+			       "<file>/usr/share/foo/b</file>"
+			       "<file>/usr/bin/foo</file>"
+			       "</package></filelists>");
+
+	fail_unless (sqlite3_open ("check_low_repoxml/primary.sqlite",
+				   &db) == SQLITE_OK, "unable to open primary");
+	fail_unless (query_int (db, "SELECT count(*) FROM packages "
+				"WHERE pkgId = 'abcd' AND epoch = '0' "
+				"AND version = '1.0'") == 1, "wrong package");
+	fail_unless (query_int (db, "SELECT count(*) FROM provides "
+				"WHERE name = 'foo' AND flags = 'EQ' "
+				"AND pkgKey = 1") == 1, "wrong provides");
+	fail_unless (query_int (db, "SELECT count(*) FROM requires "
+				"WHERE flags IS NULL AND pre = 'TRUE'") == 1,
+		     "wrong requires");
+	fail_unless (query_int (db, "SELECT count(*) FROM files "
+				"WHERE name = '/usr/bin/foo'") == 1,
+		     "primary file missing");
+	sqlite3_close (db);
+
+	fail_unless (sqlite3_open ("check_low_repoxml/filelists.sqlite",
+				   &db) == SQLITE_OK, "unable to open filelists");
+	fail_unless (query_int (db, "SELECT count(*) FROM filelist "
+				"WHERE dirname = '/usr/share/foo' "
+				"AND filenames = 'a/b' "
+				"AND filetypes = 'ff'") == 1,
+		     "wrong filelist");
+	fail_unless (query_int (db, "SELECT count(*) FROM packages "
+				"WHERE pkgId = 'abcd'") == 1,
+		     "wrong filelists package");
+	sqlite3_close (db);
+
+	repoxml_remove_dbs ();
+} END_TEST
+
+START_TEST (test_low_repoxml_parse_filelists_in_another_order)
+{
+	sqlite3 *db;
+
+	repoxml_parse_strings ("<metadata packages=\"2\">"
+			       "<package type=\"rpm\"><name>foo</name>"
+			       "<version ver=\"1\" rel=\"1\"/>"
+			       "<checksum type=\"sha256\" pkgid=\"YES\">"
+			       "aaaa</checksum></package>"
+			       "<package type=\"rpm\"><name>bar</name>"
+			       "<version ver=\"1\" rel=\"1\"/>"
+			       "<checksum type=\"sha256\" pkgid=\"YES\">"
+			       "bbbb</checksum></package>"
+			       "</metadata>",
+			       "<filelists packages=\"3\">"
+			       "<package pkgid=\"bbbb\" name=\"bar\">"
+			       "<file>/usr/bin/bar</file></package>"
+			       "<package pkgid=\"cccc\" name=\"baz\">"
+			       "<file>/usr/bin/baz</file></package>"
+			       "<package pkgid=\"aaaa\" name=\"foo\">"
+			       "<file>/usr/bin/foo</file></package>"
+			       "</filelists>");
+
+	fail_unless (sqlite3_open ("check_low_repoxml/filelists.sqlite",
+				   &db) == SQLITE_OK, "unable to open filelists");
+	fail_unless (query_int (db, "SELECT pkgKey FROM filelist "
+				"WHERE filenames = 'foo'") == 1,
+		     "foo has the wrong key");
+	fail_unless (query_int (db, "SELECT pkgKey FROM filelist "
+				"WHERE filenames = 'bar'") == 2,
+		     "bar has the wrong key");
+	fail_unless (query_int (db, "SELECT count(*) FROM packages") == 2,
+		     "package not in primary kept");
+	fail_unless (query_int (db, "SELECT count(*) FROM filelist") == 2,
+		     "files of package not in primary kept");
+	sqlite3_close (db);
+
+	repoxml_remove_dbs ();
+} END_TEST
+
+START_TEST (test_low_repoxml_parse_empty_file_and_long_pkgid)
+{
+	/* A sha512 pkgid, as long as they come */
+	const char *sha512 = "0123456789abcdef0123456789abcdef"
+			     "0123456789abcdef0123456789abcdef"
+			     "0123456789abcdef0123456789abcdef"
+			     "0123456789abcdef0123456789abcdef";
+	char primary_xml[1024];
+	char filelists_xml[1024];
+	sqlite3 *db;
+
+	snprintf (primary_xml, sizeof (primary_xml),
+		  "<metadata packages=\"1\">"
+		  "<package type=\"rpm\"><name>foo</name>"
+		  "<version ver=\"1\" rel=\"1\"/>"
+		  "<checksum type=\"sha512\" pkgid=\"YES\">%s</checksum>"
+		  "</package></metadata>", sha512);
+	snprintf (filelists_xml, sizeof (filelists_xml),
+		  "<filelists packages=\"1\">"
+		  "<package pkgid=\"%s\" name=\"foo\">"
+		  "<file>/usr/bin/foo</file><file/>"
+		  "</package></filelists>", sha512);
+	repoxml_parse_strings (primary_xml, filelists_xml);
+
+	fail_unless (sqlite3_open ("check_low_repoxml/filelists.sqlite",
+				   &db) == SQLITE_OK, "unable to open filelists");
+	fail_unless (query_int (db, "SELECT count(*) FROM filelist "
+				"WHERE pkgKey = 1 AND dirname = '/usr/bin' "
+				"AND filenames = 'foo' "
+				"AND filetypes = 'f'") == 1,
+		     "wrong filelist");
+	fail_unless (query_int (db, "SELECT count(*) FROM packages "
+				"WHERE length(pkgId) = 128") == 1,
+		     "pkgid cut short");
+	sqlite3_close (db);
+
+	repoxml_remove_dbs ();
+} END_TEST
+
 START_TEST (test_low_repo_set_search_no_repos)
 {
 	int i = 0;
 	LowPackageIter *iter;
 
-	/* Should this be part of low_repo_set's interface? */
-	LowRepoSet *repo_set = malloc (sizeof (LowRepoSet));
-	repo_set->repos = g_hash_table_new (NULL, NULL);
+	LowRepoSet *repo_set = low_repo_set_new ();
 
 	iter = low_repo_set_list_all (repo_set);
 	while (iter = low_package_iter_next (iter), iter != NULL) {
@@ -218,9 +785,7 @@ START_TEST (test_low_repo_set_search_single_repo_no_packages)
 	LowRepoSqliteFake *repo;
 	LowPackageIter *iter;
 
-	/* Should this be part of low_repo_set's interface? */
-	LowRepoSet *repo_set = malloc (sizeof (LowRepoSet));
-	repo_set->repos = g_hash_table_new (NULL, NULL);
+	LowRepoSet *repo_set = low_repo_set_new ();
 
 	repo = (LowRepoSqliteFake *) low_repo_sqlite_initialize ("test",
 								 "test repo",
@@ -229,7 +794,7 @@ START_TEST (test_low_repo_set_search_single_repo_no_packages)
 								 true, TRUE);
 	packages[0] = NULL;
 	repo->packages = packages;
-	g_hash_table_insert (repo_set->repos, repo->super.id, repo);
+	low_repo_set_add (repo_set, (LowRepo *) repo);
 
 	iter = low_repo_set_list_all (repo_set);
 	while (iter = low_package_iter_next (iter), iter != NULL) {
@@ -240,11 +805,10 @@ START_TEST (test_low_repo_set_search_single_repo_no_packages)
 	low_repo_set_free (repo_set);
 } END_TEST
 
-static GHashTable *
-initialize_repos (LowPackage **packages)
+static void
+initialize_repos (LowRepoSet *repo_set, LowPackage **packages)
 {
 	LowRepoSqliteFake *repo;
-	GHashTable *repos = g_hash_table_new (NULL, NULL);
 
 	repo = (LowRepoSqliteFake *) low_repo_sqlite_initialize ("test1",
 								 "test repo",
@@ -252,7 +816,7 @@ initialize_repos (LowPackage **packages)
 								 "mirror",
 								 true, TRUE);
 	repo->packages = packages;
-	g_hash_table_insert (repos, repo->super.id, repo);
+	low_repo_set_add (repo_set, (LowRepo *) repo);
 
 	repo = (LowRepoSqliteFake *) low_repo_sqlite_initialize ("test2",
 								 "test repo",
@@ -260,9 +824,7 @@ initialize_repos (LowPackage **packages)
 								 "mirror",
 								 true, TRUE);
 	repo->packages = packages;
-	g_hash_table_insert (repos, repo->super.id, repo);
-
-	return repos;
+	low_repo_set_add (repo_set, (LowRepo *) repo);
 }
 
 START_TEST (test_low_repo_set_search_two_repos_no_packages)
@@ -274,9 +836,8 @@ START_TEST (test_low_repo_set_search_two_repos_no_packages)
 
 	packages[0] = NULL;
 
-	/* Should this be part of low_repo_set's interface? */
-	repo_set = malloc (sizeof (LowRepoSet));
-	repo_set->repos = initialize_repos (packages);
+	repo_set = low_repo_set_new ();
+	initialize_repos (repo_set, packages);
 
 	iter = low_repo_set_list_all (repo_set);
 	while (iter = low_package_iter_next (iter), iter != NULL) {
@@ -295,9 +856,7 @@ START_TEST (test_low_repo_set_search_single_repo_one_package)
 	LowRepoSqliteFake *repo;
 	LowPackageIter *iter;
 
-	/* Should this be part of low_repo_set's interface? */
-	LowRepoSet *repo_set = malloc (sizeof (LowRepoSet));
-	repo_set->repos = g_hash_table_new (NULL, NULL);
+	LowRepoSet *repo_set = low_repo_set_new ();
 
 	repo = (LowRepoSqliteFake *) low_repo_sqlite_initialize ("test",
 								 "test repo",
@@ -307,7 +866,7 @@ START_TEST (test_low_repo_set_search_single_repo_one_package)
 	packages[0] = &package;
 	packages[1] = NULL;
 	repo->packages = packages;
-	g_hash_table_insert (repo_set->repos, repo->super.id, repo);
+	low_repo_set_add (repo_set, (LowRepo *) repo);
 
 	iter = low_repo_set_list_all (repo_set);
 	while (iter = low_package_iter_next (iter), iter != NULL) {
@@ -329,12 +888,36 @@ START_TEST (test_low_repo_set_search_two_repos_two_packages)
 	packages[0] = &package;
 	packages[1] = NULL;
 
-	/* Should this be part of low_repo_set's interface? */
-	repo_set = malloc (sizeof (LowRepoSet));
-	repo_set->repos = initialize_repos (packages);
+	repo_set = low_repo_set_new ();
+	initialize_repos (repo_set, packages);
+
+	iter = low_repo_set_list_all (repo_set);
+	while (iter = low_package_iter_next (iter), iter != NULL) {
+		i++;
+	}
+
+	fail_unless (i == 2, "wrong number of packages found");
+	low_repo_set_free (repo_set);
+} END_TEST
+
+START_TEST (test_low_repo_set_search_two_repos_two_packages_concurrent)
+{
+	int i = 0;
+	LowPackage **packages = malloc (sizeof (LowPackage *) * 2);
+	LowPackage package;
+	LowPackageIter *iter;
+	LowRepoSet *repo_set;
+
+	packages[0] = &package;
+	packages[1] = NULL;
+
+	repo_set = low_repo_set_new ();
+	initialize_repos (repo_set, packages);
+	low_repo_set_set_search_threads (repo_set, 2);
 
 	iter = low_repo_set_list_all (repo_set);
 	while (iter = low_package_iter_next (iter), iter != NULL) {
+		fail_unless (iter->pkg == &package, "unexpected package found");
 		i++;
 	}
 
@@ -342,6 +925,229 @@ START_TEST (test_low_repo_set_search_two_repos_two_packages)
 	low_repo_set_free (repo_set);
 } END_TEST
 
+static LowRepo *
+initialize_repo (LowRepoSet *repo_set, const char *id, int priority,
+		 LowPackage **packages)
+{
+	LowRepoSqliteFake *repo;
+
+	repo = (LowRepoSqliteFake *) low_repo_sqlite_initialize (id,
+								 "test repo",
+								 "test url",
+								 "mirror",
+								 true, TRUE);
+	repo->super.priority = priority;
+	repo->packages = packages;
+	low_repo_set_add (repo_set, (LowRepo *) repo);
+
+	return (LowRepo *) repo;
+}
+
+START_TEST (test_low_repo_set_search_priority_order)
+{
+	LowPackage **packages1 = malloc (sizeof (LowPackage *) * 2);
+	LowPackage **packages2 = malloc (sizeof (LowPackage *) * 2);
+	LowPackage package1;
+	LowPackage package2;
+	LowPackageIter *iter;
+	LowRepoSet *repo_set;
+
+	packages1[0] = &package1;
+	packages1[1] = NULL;
+	packages2[0] = &package2;
+	packages2[1] = NULL;
+
+	repo_set = low_repo_set_new ();
+	initialize_repo (repo_set, "test1", 20, packages1);
+	initialize_repo (repo_set, "test2", 10, packages2);
+
+	iter = low_repo_set_list_all (repo_set);
+	iter = low_package_iter_next (iter);
+	fail_unless (iter->pkg == &package2, "higher priority repo not first");
+	iter = low_package_iter_next (iter);
+	fail_unless (iter->pkg == &package1, "lower priority repo not second");
+	iter = low_package_iter_next (iter);
+	fail_unless (iter == NULL, "too many packages found");
+
+	low_repo_set_free (repo_set);
+} END_TEST
+
+START_TEST (test_low_repo_set_search_first_match)
+{
+	int i = 0;
+	LowPackage **packages1 = malloc (sizeof (LowPackage *) * 2);
+	LowPackage **packages2 = malloc (sizeof (LowPackage *) * 2);
+	LowPackage **packages3 = malloc (sizeof (LowPackage *) * 2);
+	LowPackage package1;
+	LowPackage package2;
+	LowPackage package3;
+	LowPackageIter *iter;
+	LowRepoSet *repo_set;
+	char name[] = "foo";
+
+	package1.name = name;
+	package2.name = name;
+	package3.name = name;
+
+	packages1[0] = &package1;
+	packages1[1] = NULL;
+	packages2[0] = &package2;
+	packages2[1] = NULL;
+	packages3[0] = &package3;
+	packages3[1] = NULL;
+
+	repo_set = low_repo_set_new ();
+	initialize_repo (repo_set, "test1", 10, packages1);
+	initialize_repo (repo_set, "test2", 10, packages2);
+	initialize_repo (repo_set, "test3", 20, packages3);
+	low_repo_set_set_search_mode (repo_set, SEARCH_FIRST_MATCH);
+
+	iter = low_repo_set_list_by_name (repo_set, "foo");
+	while (iter = low_package_iter_next (iter), iter != NULL) {
+		fail_if (iter->pkg == &package3,
+			 "lower priority repo searched");
+		i++;
+	}
+	fail_unless (i == 2, "wrong number of packages found");
+
+	low_repo_set_set_search_mode (repo_set, SEARCH_ALL_REPOS);
+
+	i = 0;
+	iter = low_repo_set_list_by_name (repo_set, "foo");
+	while (iter = low_package_iter_next (iter), iter != NULL) {
+		i++;
+	}
+	fail_unless (i == 3, "wrong number of packages found");
+
+	low_repo_set_free (repo_set);
+} END_TEST
+
+static LowPackageDependency **
+fake_package_get_provides (LowPackage *pkg)
+{
+	return pkg->provides;
+}
+
+static void
+initialize_providing_package (LowPackage *pkg, char *name,
+			      const char **provides)
+{
+	int i;
+
+	for (i = 0; provides[i] != NULL; i++);
+
+	memset (pkg, 0, sizeof (LowPackage));
+	pkg->ref_count = 1;
+	pkg->name = name;
+	pkg->provides = malloc (sizeof (LowPackageDependency *) * (i + 1));
+	for (i = 0; provides[i] != NULL; i++) {
+		pkg->provides[i] =
+			low_package_dependency_new (provides[i],
+						    DEPENDENCY_SENSE_NONE,
+						    NULL);
+	}
+	pkg->provides[i] = NULL;
+	pkg->get_provides = fake_package_get_provides;
+}
+
+/*
+ * Run every dependency through both the batched and the single provides
+ * searches, and make sure they find the same packages in the same order.
+ * Returns how many packages were found in all.
+ */
+static unsigned int
+compare_provides_batch (LowRepoSet *repo_set, LowPackageDependency **deps,
+			unsigned int count)
+{
+	LowPackageIter **batch;
+	unsigned int found = 0;
+	unsigned int i;
+
+	batch = low_repo_set_search_provides_batch (repo_set, deps, count);
+	for (i = 0; i < count; i++) {
+		LowPackageIter *single =
+			low_repo_set_search_provides (repo_set, deps[i]);
+
+		while (batch[i] = low_package_iter_next (batch[i]),
+		       batch[i] != NULL) {
+			single = low_package_iter_next (single);
+			fail_unless (single != NULL,
+				     "batch found more than single search");
+			fail_unless (single->pkg == batch[i]->pkg,
+				     "batch found a different package");
+			found++;
+		}
+		single = low_package_iter_next (single);
+		fail_unless (single == NULL,
+			     "single search found more than batch");
+	}
+	free (batch);
+
+	return found;
+}
+
+START_TEST (test_low_repo_set_search_provides_batch_matches_single)
+{
+	const char *provides1[] = { "foo", NULL };
+	const char *provides2[] = { "bar", NULL };
+	const char *provides3[] = { "foo", "bar", "baz", "qux", NULL };
+	const char *filter3[] = { "foo", "bar", "baz", NULL };
+	const char *names[] = { "foo", "bar", "baz", "qux", "quux" };
+	LowPackage **packages1 = malloc (sizeof (LowPackage *) * 2);
+	LowPackage **packages2 = malloc (sizeof (LowPackage *) * 2);
+	LowPackage **packages3 = malloc (sizeof (LowPackage *) * 2);
+	LowPackageDependency *deps[5];
+	LowPackage package1;
+	LowPackage package2;
+	LowPackage package3;
+	LowFakeRepo *repo;
+	LowRepoSet *repo_set;
+	char name[] = "pkg";
+	unsigned int i;
+
+	initialize_providing_package (&package1, name, provides1);
+	initialize_providing_package (&package2, name, provides2);
+	initialize_providing_package (&package3, name, provides3);
+
+	packages1[0] = &package1;
+	packages1[1] = NULL;
+	packages2[0] = &package2;
+	packages2[1] = NULL;
+	packages3[0] = &package3;
+	packages3[1] = NULL;
+
+	for (i = 0; i < 5; i++) {
+		deps[i] = low_package_dependency_new (names[i],
+						      DEPENDENCY_SENSE_NONE,
+						      NULL);
+	}
+
+	repo_set = low_repo_set_new ();
+	initialize_repo (repo_set, "test1", 10, packages1);
+	initialize_repo (repo_set, "test2", 10, packages2);
+	repo = (LowFakeRepo *) initialize_repo (repo_set, "test3", 20,
+						packages3);
+
+	/* test3's filter is missing qux, so neither search asks it */
+	repo->provides_filter = filter3;
+
+	/* foo from test1, bar from test2, baz from test3 */
+	low_repo_set_set_search_mode (repo_set, SEARCH_FIRST_MATCH);
+	fail_unless (compare_provides_batch (repo_set, deps, 5) == 3,
+		     "wrong number of packages found in first match mode");
+
+	/* test3's foo and bar too */
+	low_repo_set_set_search_mode (repo_set, SEARCH_ALL_REPOS);
+	fail_unless (compare_provides_batch (repo_set, deps, 5) == 5,
+		     "wrong number of packages found in all repos");
+
+	low_repo_set_set_search_threads (repo_set, 2);
+	fail_unless (compare_provides_batch (repo_set, deps, 5) == 5,
+		     "wrong number of packages found concurrently");
+
+	low_repo_set_free (repo_set);
+} END_TEST
+
 static Suite *
 low_suite (void)
 {
@@ -372,6 +1178,41 @@ low_suite (void)
 	tc = tcase_create ("low-util");
 	tcase_add_test (tc, test_low_util_word_wrap_no_wrap_needed);
 	tcase_add_test (tc, test_low_util_word_wrap_wrap_one_line_to_two);
+	tcase_add_test (tc, test_low_util_parse_duration);
+	tcase_add_test (tc, test_low_util_file_stamp_replaced_in_same_second);
+	suite_add_tcase (s, tc);
+
+	tc = tcase_create ("low-bloom");
+	tcase_add_test (tc, test_low_bloom_might_contain);
+	tcase_add_test (tc, test_low_bloom_write_and_load);
+	tcase_add_test (tc, test_low_bloom_load_rejects_bad_header);
+	suite_add_tcase (s, tc);
+
+	tc = tcase_create ("low-decompress");
+	tcase_add_test (tc, test_low_decompressor_bz2_in_pieces);
+	tcase_add_test (tc, test_low_decompress_strip_extension);
+	suite_add_tcase (s, tc);
+
+	tc = tcase_create ("low-chunks");
+	tcase_add_test (tc, test_low_chunk_index_missing_changed_chunks);
+	suite_add_tcase (s, tc);
+
+	tc = tcase_create ("low-mirror-list");
+	tcase_add_test (tc, test_low_mirror_list_stats_prefer_fast_mirror);
+	suite_add_tcase (s, tc);
+
+	tc = tcase_create ("low-repomd-parser");
+	tcase_add_test (tc, test_low_repomd_parse_checksums);
+	suite_add_tcase (s, tc);
+
+	tc = tcase_create ("low-repoxml-parser");
+	tcase_add_test (tc, test_low_repoxml_parse_dependencies_and_files);
+	tcase_add_test (tc, test_low_repoxml_parse_filelists_in_another_order);
+	tcase_add_test (tc, test_low_repoxml_parse_empty_file_and_long_pkgid);
+	suite_add_tcase (s, tc);
+
+	tc = tcase_create ("low-newest");
+	tcase_add_test (tc, test_low_newest_write_and_load);
 	suite_add_tcase (s, tc);
 
 	tc = tcase_create ("low-repo-set");
@@ -380,6 +1221,12 @@ low_suite (void)
 	tcase_add_test (tc, test_low_repo_set_search_two_repos_no_packages);
 	tcase_add_test (tc, test_low_repo_set_search_single_repo_one_package);
 	tcase_add_test (tc, test_low_repo_set_search_two_repos_two_packages);
+	tcase_add_test (tc,
+			test_low_repo_set_search_two_repos_two_packages_concurrent);
+	tcase_add_test (tc, test_low_repo_set_search_priority_order);
+	tcase_add_test (tc, test_low_repo_set_search_first_match);
+	tcase_add_test (tc,
+			test_low_repo_set_search_provides_batch_matches_single);
 	suite_add_tcase (s, tc);
 
 	return s;
@@ -0,0 +1,302 @@
+/*
+ *  Low: a yum-like package manager
+ *
+ *  Copyright (C) 2008 - 2010 James Bowes <jbowes@repl.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301  USA
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include <check.h>
+#include <glib.h>
+
+#include "low-package.h"
+#include "low-repo-sqlite.h"
+#include "low-repoxml-parser.h"
+
+/*
+ * The real sqlite repo, run against a cache of its own (LOCAL_CACHE is set
+ * for this program), as check_low stands in a fake one.
+ */
+
+static const char *repo_ids[] = { "one", "two" };
+#define REPO_COUNT (sizeof (repo_ids) / sizeof (repo_ids[0]))
+
+static int fetch_calls[REPO_COUNT];
+
+static int
+repo_index (LowRepo *repo)
+{
+	unsigned int i;
+
+	for (i = 0; i < REPO_COUNT; i++) {
+		if (!strcmp (repo->id, repo_ids[i])) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Counts the fetches; the filelists db is already in the cache */
+static bool
+fake_fetch_filelists (LowRepo *repo, LowRepomdData *data,
+		      LowRepomdData *chunks G_GNUC_UNUSED)
+{
+	char *local_db = g_strdup_printf (LOCAL_CACHE "/%s/%s", repo->id,
+					  strrchr (data->location, '/') + 1);
+	bool found;
+
+	fetch_calls[repo_index (repo)]++;
+
+	/* Listed compressed, but imported uncompressed */
+	local_db[strlen (local_db) - strlen (".bz2")] = '\0';
+	found = access (local_db, R_OK) == 0;
+	free (local_db);
+
+	return found;
+}
+
+static void
+write_string (const char *filename, const char *contents)
+{
+	FILE *file = fopen (filename, "w");
+
+	fprintf (file, "%s", contents);
+	fclose (file);
+}
+
+static void
+make_repo (const char *id)
+{
+	char *dir = g_strdup_printf (LOCAL_CACHE "/%s", id);
+	char *primary = g_strdup_printf ("%s/primary.xml", dir);
+	char *filelists = g_strdup_printf ("%s/filelists.xml", dir);
+	char *repomd = g_strdup_printf ("%s/repomd.xml", dir);
+
+	mkdir (LOCAL_CACHE, 0755);
+	mkdir (dir, 0755);
+
+	write_string (primary,
+		      "<metadata packages=\"1\">"
+		      "<package type=\"rpm\"><name>foo</name>"
+		      "<arch>noarch</arch>"
+		      "<version epoch=\"0\" ver=\"1.0\" rel=\"1\"/>"
+		      "<checksum type=\"sha256\" pkgid=\"YES\">"
+		      "abcd</checksum>"
+		      "<format><rpm:provides>"
+		      "<rpm:entry name=\"foo\"/>"
+		      "</rpm:provides>"
+		      "<file>/usr/bin/foo</file>"
+		      "</format></package></metadata>");
+	write_string (filelists,
+		      "<filelists packages=\"1\">"
+		      "<package pkgid=\"abcd\" name=\"foo\" arch=\"noarch\">"
+		      "<file>/usr/bin/foo</file>"
+		      "<file>/usr/share/foo/a</file>"
+		      "</package></filelists>");
+	low_repoxml_parse (primary, filelists);
+	unlink (primary);
+	unlink (filelists);
+
+	/* Only the dbs are listed, so filelists go through the fetch */
+	write_string (repomd,
+		      "<repomd><data type=\"primary_db\">"
+		      "<location href=\"repodata/primary.sqlite.bz2\"/>"
+		      "</data><data type=\"filelists_db\">"
+		      "<location href=\"repodata/filelists.sqlite.bz2\"/>"
+		      "</data></repomd>");
+
+	free (repomd);
+	free (filelists);
+	free (primary);
+	free (dir);
+}
+
+static void
+remove_repo (const char *id)
+{
+	const char *files[] = { "repomd.xml", "primary.sqlite",
+				"filelists.sqlite", NULL };
+	char *dir = g_strdup_printf (LOCAL_CACHE "/%s", id);
+	int i;
+
+	for (i = 0; files[i] != NULL; i++) {
+		char *file = g_strdup_printf ("%s/%s", dir, files[i]);
+
+		unlink (file);
+		free (file);
+	}
+
+	rmdir (dir);
+	rmdir (LOCAL_CACHE);
+	free (dir);
+}
+
+static void
+setup_repos (LowRepo **repos)
+{
+	unsigned int i;
+
+	low_repo_sqlite_set_filelists_fetch (fake_fetch_filelists);
+
+	for (i = 0; i < REPO_COUNT; i++) {
+		make_repo (repo_ids[i]);
+		repos[i] = low_repo_sqlite_initialize (repo_ids[i],
+						       repo_ids[i], NULL,
+						       NULL, true, true);
+		fail_if (repos[i] == NULL, "unable to open repo");
+		fetch_calls[i] = 0;
+	}
+}
+
+static void
+teardown_repos (LowRepo **repos)
+{
+	unsigned int i;
+
+	for (i = 0; i < REPO_COUNT; i++) {
+		low_repo_sqlite_shutdown (repos[i]);
+		remove_repo (repo_ids[i]);
+	}
+
+	low_repo_sqlite_set_filelists_fetch (NULL);
+}
+
+static int
+count_packages (LowPackageIter *iter)
+{
+	int count = 0;
+
+	while (iter = low_package_iter_next (iter), iter != NULL) {
+		low_package_unref (iter->pkg);
+		count++;
+	}
+
+	return count;
+}
+
+static LowPackage *
+first_package (LowRepo *repo)
+{
+	LowPackageIter *iter = low_repo_sqlite_list_by_name (repo, "foo");
+	LowPackage *pkg;
+
+	iter = low_package_iter_next (iter);
+	fail_if (iter == NULL, "package not found");
+	pkg = iter->pkg;
+	low_package_iter_free (iter);
+
+	return pkg;
+}
+
+START_TEST (test_low_repo_sqlite_primary_searches_do_not_fetch_filelists)
+{
+	LowRepo *repos[REPO_COUNT];
+	LowPackageDependency *dep;
+	LowPackage *pkg;
+	unsigned int i;
+
+	setup_repos (repos);
+	dep = low_package_dependency_new ("foo", DEPENDENCY_SENSE_NONE, NULL);
+
+	for (i = 0; i < REPO_COUNT; i++) {
+		fail_unless (count_packages
+			     (low_repo_sqlite_search_provides (repos[i], dep))
+			     == 1, "provides not found");
+		fail_unless (count_packages
+			     (low_repo_sqlite_search_files (repos[i],
+							    "/usr/bin/foo"))
+			     == 1, "primary file not found");
+
+		pkg = first_package (repos[i]);
+		fail_unless (low_package_has_file (pkg, "/usr/bin/foo"),
+			     "primary file not in package");
+		low_package_unref (pkg);
+
+		fail_unless (fetch_calls[i] == 0, "filelists fetched");
+	}
+
+	low_package_dependency_free (dep);
+	teardown_repos (repos);
+} END_TEST
+
+START_TEST (test_low_repo_sqlite_filelists_fetched_once_per_repo)
+{
+	LowRepo *repos[REPO_COUNT];
+	LowPackage *pkg;
+	unsigned int i;
+
+	setup_repos (repos);
+
+	for (i = 0; i < REPO_COUNT; i++) {
+		fail_unless (count_packages
+			     (low_repo_sqlite_search_files (repos[i],
+							    "/usr/share/foo/a"))
+			     == 1, "filelists file not found");
+		fail_unless (count_packages
+			     (low_repo_sqlite_search_files (repos[i],
+							    "/usr/share/foo/b"))
+			     == 0, "missing file found");
+
+		pkg = first_package (repos[i]);
+		fail_unless (low_package_has_file (pkg, "/usr/share/foo/a"),
+			     "filelists file not in package");
+		low_package_unref (pkg);
+	}
+
+	for (i = 0; i < REPO_COUNT; i++) {
+		fail_unless (fetch_calls[i] == 1,
+			     "filelists fetched %d times", fetch_calls[i]);
+	}
+
+	teardown_repos (repos);
+} END_TEST
+
+static Suite *
+low_repo_sqlite_suite (void)
+{
+	Suite *s = suite_create ("low-repo-sqlite");
+
+	TCase *tc = tcase_create ("filelists");
+	tcase_add_test (tc,
+			test_low_repo_sqlite_primary_searches_do_not_fetch_filelists);
+	tcase_add_test (tc, test_low_repo_sqlite_filelists_fetched_once_per_repo);
+	suite_add_tcase (s, tc);
+
+	return s;
+}
+
+int
+main (void)
+{
+	int nf;
+	Suite *s = low_repo_sqlite_suite ();
+	SRunner *sr = srunner_create (s);
+	srunner_set_log (sr, "check_repo_sqlite.log");
+	srunner_run_all (sr, CK_NORMAL);
+	nf = srunner_ntests_failed (sr);
+	srunner_free (sr);
+	return (nf == 0) ? 0 : 1;
+}
+
+/* vim: set ts=8 sw=8 noet: */
@@ -65,6 +65,14 @@ low_config_get_bool (LowConfig *config G_GNUC_UNUSED,
 	return true;
 }
 
+int
+low_config_get_int (LowConfig *config G_GNUC_UNUSED,
+		    const char *group G_GNUC_UNUSED,
+		    const char *key G_GNUC_UNUSED)
+{
+	return 0;
+}
+
 void
 low_config_free (LowConfig *config)
 {
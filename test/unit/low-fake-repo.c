@@ -38,9 +38,12 @@ low_fake_repo_initialize (const char *id, const char *name, bool enabled)
 	repo->super.id = strdup (id);
 	repo->super.name = strdup (name);
 	repo->super.enabled = enabled;
+	repo->super.priority = LOW_REPO_DEFAULT_PRIORITY;
+	repo->super.cost = LOW_REPO_DEFAULT_COST;
 
 	/* Set this yourself */
 	repo->packages = NULL;
+	repo->provides_filter = NULL;
 
 	return (LowRepo *) repo;
 }
@@ -151,6 +154,30 @@ low_fake_repo_search_provides_filter_fn (LowPackage *pkg, gpointer data)
 	return false;
 }
 
+/**
+ * With a provides_filter set, only the names on it might be provided, as
+ * a repo's Bloom filter would say. Searches skip any other name, even one
+ * a package has.
+ */
+bool
+low_fake_repo_might_provide (LowRepo *repo, const char *name)
+{
+	LowFakeRepo *repo_fake = (LowFakeRepo *) repo;
+	int i;
+
+	if (repo_fake->provides_filter == NULL) {
+		return true;
+	}
+
+	for (i = 0; repo_fake->provides_filter[i] != NULL; i++) {
+		if (!strcmp (repo_fake->provides_filter[i], name)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 LowPackageIter *
 low_fake_repo_search_provides (LowRepo *repo,
 			       const LowPackageDependency *provides)
@@ -170,6 +197,32 @@ low_fake_repo_search_provides (LowRepo *repo,
 	return (LowPackageIter *) iter;
 }
 
+GList **
+low_fake_repo_search_provides_batch (LowRepo *repo,
+				     LowPackageDependency **provides,
+				     unsigned int count)
+{
+	GList **found = malloc (sizeof (GList *) * count);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		LowPackageIter *iter;
+
+		/* The sqlite repo checks its filter before querying, too */
+		found[i] = NULL;
+		if (!low_fake_repo_might_provide (repo, provides[i]->name)) {
+			continue;
+		}
+
+		iter = low_fake_repo_search_provides (repo, provides[i]);
+		while (iter = low_package_iter_next (iter), iter != NULL) {
+			found[i] = g_list_append (found[i], iter->pkg);
+		}
+	}
+
+	return found;
+}
+
 static bool
 low_fake_repo_search_requires_filter_fn (LowPackage *pkg, gpointer data)
 {
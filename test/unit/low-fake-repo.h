@@ -29,6 +29,7 @@
 typedef struct _LowFakeRepo {
 	LowRepo super;
 	LowPackage **packages;
+	const char **provides_filter; /**< Stands in for a Bloom filter */
 } LowFakeRepo;
 LowRepo *		low_fake_repo_initialize 	(const char *id,
 							 const char *name,
@@ -39,8 +40,13 @@ LowPackageIter *	low_fake_repo_list_all 	(LowRepo *repo);
 LowPackageIter *	low_fake_repo_list_by_name 	(LowRepo *repo,
 							 const char *name);
 
+bool			low_fake_repo_might_provide 	(LowRepo *repo,
+							 const char *name);
 LowPackageIter *	low_fake_repo_search_provides 	(LowRepo *repo,
 							 const LowPackageDependency *provides);
+GList **		low_fake_repo_search_provides_batch (LowRepo *repo,
+							     LowPackageDependency **provides,
+							     unsigned int count);
 LowPackageIter * 	low_fake_repo_search_requires  (LowRepo *repo,
 							const LowPackageDependency *requires);
 LowPackageIter * 	low_fake_repo_search_conflicts (LowRepo *repo,
@@ -123,6 +129,41 @@ char **			low_fake_repo_get_files 	(LowRepo *repo,
 				    bool enabled, \
 				    bool bind_dbs G_GNUC_UNUSED) { \
 		return low_fake_repo_initialize (name, id, enabled); \
+	} \
+	\
+	GList ** \
+	low_repo_sqlite_search_provides_batch (LowRepo *repo, \
+					       LowPackageDependency **provides, \
+					       unsigned int count) { \
+		return low_fake_repo_search_provides_batch (repo, provides, \
+							    count); \
+	} \
+	\
+	bool \
+	low_repo_sqlite_might_provide (LowRepo *repo, const char *name) { \
+		return low_fake_repo_might_provide (repo, name); \
+	} \
+	\
+	bool \
+	low_repo_sqlite_might_contain_file (LowRepo *repo G_GNUC_UNUSED, \
+					    const char *file G_GNUC_UNUSED) { \
+		return true; \
+	} \
+	\
+	void \
+	low_repo_sqlite_build_newest (LowRepo **repos G_GNUC_UNUSED, \
+				      unsigned int count G_GNUC_UNUSED, \
+				      uint32_t set_signature G_GNUC_UNUSED) { \
+	} \
+	\
+	bool \
+	low_repo_sqlite_load_newest (LowRepo *repo G_GNUC_UNUSED, \
+				     uint32_t set_signature G_GNUC_UNUSED) { \
+		return false; \
+	} \
+	\
+	void \
+	low_repo_sqlite_unload_newest (LowRepo *repo G_GNUC_UNUSED) { \
 	}
 
 #define FAKE_RPMDB \